@@ -0,0 +1,79 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Consecutive stats samples that have to agree before an estimate counts
+// as stable, and how far apart they may be, relative to the lowest.
+#define BANDWIDTH_STABLE_SAMPLES 3
+#define BANDWIDTH_STABLE_SPREAD 0.15
+
+struct BandwidthHistoryConfig {
+  // State file; empty disables the history.
+  std::string path;
+  // Share of the recorded estimate a new session starts at. The network may
+  // have got worse since, and overshooting costs loss and a keyframe.
+  double discount = 0.8;
+  // Older records are ignored.
+  int64_t max_age_s = 7 * 24 * 3600;
+};
+
+// Picks the stable estimate out of a session's periodic
+// availableOutgoingBitrate samples.
+class StableBandwidthFilter {
+public:
+  // Returns the lowest of the last BANDWIDTH_STABLE_SAMPLES samples once
+  // they agree, 0 otherwise.
+  uint32_t OnSample(double available_bps);
+
+private:
+  double samples[BANDWIDTH_STABLE_SAMPLES] = {};
+  size_t count = 0;
+};
+
+// Remembers the last stable send-side bandwidth estimate per WHIP endpoint
+// and network interface, so that the next session to the same place can
+// start near it instead of ramping up from WebRTC's default. Shared by every
+// session of the process; all methods are thread safe.
+class BandwidthHistory {
+public:
+  explicit BandwidthHistory(const BandwidthHistoryConfig &config);
+
+  // Looks up the interface the route to |endpoint|'s host goes through for
+  // StartBitrate(). Resolves the host, so it may block for as long as DNS
+  // takes; call it while bringing up, not on the signaling thread.
+  void ResolveEgress(const std::string &endpoint);
+  // Start bitrate for a new session to |endpoint|: the discounted estimate
+  // recorded for it on the interface routing to its host. If that is not
+  // known yet, the lowest estimate on any interface that is up. 0 if there
+  // is none. Does not block on the network.
+  uint32_t StartBitrate(const std::string &endpoint);
+  // Records a stable estimate measured with the selected candidate pair's
+  // local address |local_address|, which also becomes the endpoint's egress
+  // interface for later sessions. The file is rewritten only when the
+  // estimate moved noticeably.
+  void Record(const std::string &endpoint, const std::string &local_address,
+              uint32_t bitrate_bps);
+
+private:
+  struct Entry {
+    std::string endpoint;
+    std::string interface_name;
+    uint32_t bitrate_bps;
+    int64_t time_s;
+  };
+
+  void Load();
+  bool Store();
+
+  BandwidthHistoryConfig config;
+  std::mutex mutex;
+  bool loaded = false;
+  std::vector<Entry> entries;
+  // Egress interface per endpoint, from ResolveEgress() or the last
+  // session's candidate pair.
+  std::map<std::string, std::string> egress;
+};
@@ -0,0 +1,42 @@
+#pragma once
+#include "api/scoped_refptr.h"
+#include "rtc_base/rtc_certificate.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+struct CertificateCacheConfig {
+  // PEM file holding the private key followed by the certificate. Empty
+  // keeps the certificate in memory only, shared by the process's
+  // PeerConnections.
+  std::string path;
+  // Lifetime of generated certificates. WebRTC caps it at a year.
+  int64_t lifetime_days = 30;
+  // Certificates expiring within this window are replaced, so a session
+  // never starts with one that expires under it.
+  int64_t renew_days = 2;
+};
+
+// Hands out one ECDSA DTLS certificate to every PeerConnection instead of
+// letting each generate its own, and keeps it on disk across restarts.
+// Receivers only check the certificate against the fingerprint in the
+// SDP, so reusing it is safe.
+class CertificateCache {
+public:
+  explicit CertificateCache(const CertificateCacheConfig &config);
+
+  // Returns the cached certificate, loading or generating it first if
+  // there is none or it is due for renewal. Null if generation failed, in
+  // which case WebRTC generates its own. Safe to call from any thread;
+  // concurrent callers wait for the first.
+  rtc::scoped_refptr<rtc::RTCCertificate> Get();
+
+private:
+  rtc::scoped_refptr<rtc::RTCCertificate> Load();
+  bool Store(const rtc::RTCCertificate &certificate);
+  bool IsFresh(const rtc::RTCCertificate &certificate) const;
+
+  CertificateCacheConfig config;
+  std::mutex mutex;
+  rtc::scoped_refptr<rtc::RTCCertificate> certificate;
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include "bandwidth_history.h"
+#include "certificate_cache.h"
+#include "encoder/encoder_config.h"
+#include "hot_path.h"
+#include "logging.h"
+#include "thread_policy.h"
+#include "whip.h"
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct ParsedArgs {
+  std::map<std::string, std::string> named;
+  std::vector<std::string> positional;
+};
+
+ParsedArgs parse_args(int argc, char **argv);
+
+// One published camera. Cameras sharing a WHIP endpoint are sent as extra
+// tracks on the same PeerConnection.
+struct CameraConfig {
+  // A V4L2 node, its number, or a virtual source (see virtual_source.h).
+  std::string video_device;
+  std::string whip_endpoint;
+  CaptureTrackConfig capture_config;
+};
+
+class WadiConfig {
+public:
+  std::string whip_endpoint;
+  std::string video_device;
+  CaptureTrackConfig capture_config;
+  // Filled from [camera] sections of -config; otherwise a single camera is
+  // built from the flags above.
+  std::vector<CameraConfig> cameras;
+  WHIPClientConfig http_config;
+  std::optional<std::string> stun_server;
+  bool trickle_ice = true;
+  int trickle_coalesce_ms = 20;
+  int ice_restart_delay_ms = 2000;
+  int ice_candidate_pool_size = 1;
+  CertificateCacheConfig certificate_cache;
+  BandwidthHistoryConfig bandwidth_history;
+  // Port of the local Prometheus listener; 0 disables it.
+  uint16_t metrics_port = 0;
+  int stats_interval_ms = 5000;
+  bool trace_latency = false;
+  HardwareEncoderConfig encoder;
+  MemoryConfig memory;
+  // Set with -network-thread, -capture-thread etc.; see ThreadRole.
+  ThreadPolicy thread_policies[THREAD_ROLE_COUNT];
+  LogLevel log_level = LOG_LEVEL_INFO;
+  LogLevel webrtc_log_level = LOG_LEVEL_WARN;
+
+  WadiConfig();
+
+  static WadiConfig FromArgs(int argc, char **argv);
+  // Reads "key = value" lines. Keys before the first [camera] section take
+  // the same names as the command line flags; each [camera] section starts
+  // from those values and may override device, endpoint, w, h, r, c,
+  // buffers and max-bitrate.
+  bool LoadFile(const std::string &path);
+  // Cameras to publish, with device paths normalized to /dev/videoN.
+  std::vector<CameraConfig> Cameras() const;
+
+private:
+  bool Apply(const std::string &key, const std::string &value);
+  bool ApplyThreadPolicy(const std::string &key, const std::string &value);
+};
@@ -0,0 +1,84 @@
+#pragma once
+#include "api/scoped_refptr.h"
+#include "api/video/video_frame_buffer.h"
+#include <cstdint>
+#include <vector>
+
+#define DMABUF_MAX_PLANES 2
+
+// A picture in DMABUF memory, described the way a multi-planar V4L2 output
+// plane takes it. Planes of one contiguous buffer share a fd and differ in
+// offset; as in V4L2, |bytesused| includes the offset.
+struct DmaBufFrame {
+  uint32_t num_planes;
+  int fd[DMABUF_MAX_PLANES];
+  uint32_t offset[DMABUF_MAX_PLANES];
+  uint32_t bytesused[DMABUF_MAX_PLANES];
+  int64_t timestamp_us;
+  // Per-frame encoder metadata was set for this slot (V4L2 reserved2).
+  bool input_metadata;
+};
+
+// The encoder input plane a DmaBufInputQueue feeds, e.g. an NvVideoEncoder
+// output plane in V4L2_MEMORY_DMABUF mode. tools/dmabuf_input_check
+// replaces it with a fake that returns slots in queue order.
+class DmaBufPlane {
+public:
+  virtual ~DmaBufPlane() = default;
+  // Both return 0 on success.
+  virtual int Queue(uint32_t slot, const DmaBufFrame &frame) = 0;
+  // Waits for the encoder to finish reading a queued buffer and returns its
+  // slot.
+  virtual int Dequeue(uint32_t *slot) = 0;
+};
+
+// Tracks which frame each encoder input slot holds. A frame queued by fd
+// stays referenced until the encoder hands its slot back; for camera
+// buffers that is what keeps V4LDevice from requeueing the memory to the
+// driver while the encoder still reads it.
+//
+// V4L2 has no explicit fences: a camera buffer has been written once it is
+// dequeued from the camera, and an input buffer has been read once it is
+// dequeued from the encoder, so those two events bracket the time a frame
+// is held. Memory written by the CPU has to be synced for the device before
+// Submit().
+//
+// Slots go free -> acquired -> queued -> free. Not thread safe; everything
+// runs on the encoder queue.
+class DmaBufInputQueue {
+public:
+  // At most |max_queued| of the |num_slots| slots are queued at once, which
+  // bounds how many camera buffers the encoder can hold back from capture.
+  DmaBufInputQueue(DmaBufPlane *plane, uint32_t num_slots,
+                   uint32_t max_queued);
+
+  // Returns a free slot, first waiting for the encoder to return one if
+  // |max_queued| are in use, or -1 if the plane failed.
+  int AcquireSlot();
+  // Queues |frame| in |slot|, which came from AcquireSlot(), and keeps
+  // |owner| alive until the encoder returns it. On failure the slot is free
+  // again and |owner| is released.
+  bool Submit(int slot, const DmaBufFrame &frame,
+              rtc::scoped_refptr<webrtc::VideoFrameBuffer> owner);
+  // Gives back a slot from AcquireSlot() that was not submitted.
+  void Cancel(int slot);
+  // Drops every reference once the plane has been stopped; STREAMOFF
+  // returns all buffers without dequeuing them.
+  void ReleaseAll();
+
+  uint32_t queued() const { return num_queued; }
+
+private:
+  bool Reclaim();
+
+  enum class SlotState { kFree, kAcquired, kQueued };
+  struct Slot {
+    SlotState state = SlotState::kFree;
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> owner;
+  };
+
+  DmaBufPlane *plane;
+  std::vector<Slot> slots;
+  uint32_t max_queued;
+  uint32_t num_queued;
+};
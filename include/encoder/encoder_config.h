@@ -0,0 +1,11 @@
+#pragma once
+#include "encoder/key_frame_limiter.h"
+
+// Settings for the hardware encoder; software encoders ignore them.
+struct HardwareEncoderConfig {
+  KeyFrameConfig key_frames;
+  // Queue NV12 camera buffers into the encoder as DMABUFs instead of
+  // copying them. Frames the encoder cannot import are copied into DMABUFs
+  // it allocates itself.
+  bool dmabuf_input = false;
+};
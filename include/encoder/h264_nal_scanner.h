@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#define H264_MAX_NAL_UNITS 64
+
+enum H264NalType : uint8_t {
+  kH264NalSlice = 1,
+  kH264NalIdr = 5,
+  kH264NalSei = 6,
+  kH264NalSps = 7,
+  kH264NalPps = 8,
+  kH264NalAud = 9,
+};
+
+struct H264NalUnit {
+  // Offset of the first byte of the start code.
+  size_t start_offset;
+  // Offset of the NAL header, i.e. the first byte after the start code.
+  size_t payload_offset;
+  // Size of the NAL unit without start code and trailing zero bytes.
+  size_t payload_size;
+  uint8_t type;
+};
+
+// Returns a pointer to the first byte of the next 00 00 01 start code in
+// [begin, end), or end if there is none. Uses SSE2/NEON to skip 16 bytes at a
+// time over runs without a zero pair.
+const uint8_t *H264FindStartCode(const uint8_t *begin, const uint8_t *end);
+
+// Splits an Annex-B byte stream into NAL units. Writes at most max_units
+// entries and returns the number of NAL units found, which may be larger
+// than max_units if the caller's array was too small.
+size_t H264ScanNalUnits(const uint8_t *data, size_t size, H264NalUnit *units,
+                        size_t max_units);
@@ -0,0 +1,93 @@
+#pragma once
+#include "api/video_codecs/sdp_video_format.h"
+#include "api/video_codecs/video_codec.h"
+#include "api/video_codecs/video_encoder.h"
+#include "api/video_codecs/video_encoder_factory.h"
+#include "encoder/h264_nal_scanner.h"
+#include "modules/include/module_common_types.h"
+#include "modules/video_coding/include/video_codec_interface.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class V4LFrameBuffer;
+
+// Sends H.264 access units captured by cameras with a compressed output
+// format as they are: NAL units are located and described in the
+// fragmentation header, nothing is decoded or re-encoded. Frames in any
+// other format go to |fallback|, which is initialized on first use.
+class H264PassthroughEncoder : public webrtc::VideoEncoder,
+                               public webrtc::EncodedImageCallback {
+public:
+  H264PassthroughEncoder(std::unique_ptr<webrtc::VideoEncoder> fallback,
+                         webrtc::H264PacketizationMode packetization_mode);
+  ~H264PassthroughEncoder() override;
+
+  int32_t InitEncode(const webrtc::VideoCodec *codec_settings,
+                     int32_t number_of_cores, size_t max_payload_size) override;
+  int32_t RegisterEncodeCompleteCallback(
+      webrtc::EncodedImageCallback *callback) override;
+  int32_t Release() override;
+  int32_t
+  Encode(const webrtc::VideoFrame &frame,
+         const std::vector<webrtc::VideoFrameType> *frame_types) override;
+  int32_t SetRateAllocation(const webrtc::VideoBitrateAllocation &allocation,
+                            uint32_t framerate) override;
+  void OnPacketLossRateUpdate(float packet_loss_rate) override;
+  void OnRttUpdate(int64_t rtt_ms) override;
+  EncoderInfo GetEncoderInfo() const override;
+
+  // Output of |fallback|, passed on to the registered callback.
+  Result OnEncodedImage(
+      const webrtc::EncodedImage &image,
+      const webrtc::CodecSpecificInfo *codec_specific_info,
+      const webrtc::RTPFragmentationHeader *fragmentation) override;
+  void OnDroppedFrame(DropReason reason) override;
+
+private:
+  int32_t EncodePassthrough(const webrtc::VideoFrame &frame,
+                            const V4LFrameBuffer &buffer, bool key_frame);
+  int32_t InitFallback();
+  void RequestKeyFrame(const V4LFrameBuffer &buffer, bool force);
+
+  std::unique_ptr<webrtc::VideoEncoder> fallback;
+  bool fallback_initialized;
+  webrtc::VideoCodec codec_settings;
+  int32_t number_of_cores;
+  size_t max_payload_size;
+  webrtc::VideoBitrateAllocation allocation;
+  uint32_t framerate;
+  // Also read on the fallback's output thread, if it has one.
+  std::atomic<webrtc::EncodedImageCallback *> callback;
+
+  // Delta frames are dropped until the first IDR after InitEncode.
+  bool waiting_for_key_frame;
+  int64_t last_key_frame_request_us;
+  // Parameter sets seen last, prepended to IDR frames that lack them.
+  std::vector<uint8_t> sps;
+  std::vector<uint8_t> pps;
+  std::vector<uint8_t> key_frame_buffer;
+  H264NalUnit nal_units[H264_MAX_NAL_UNITS];
+  webrtc::RTPFragmentationHeader frag_header;
+  webrtc::CodecSpecificInfo codec_specific;
+  webrtc::EncodedImage image;
+};
+
+// Wraps |factory| so that its H.264 encoders pass compressed camera frames
+// through. H.264 is advertised even if |factory| cannot encode it.
+class H264PassthroughEncoderFactory : public webrtc::VideoEncoderFactory {
+public:
+  explicit H264PassthroughEncoderFactory(
+      std::unique_ptr<webrtc::VideoEncoderFactory> factory);
+
+  std::vector<webrtc::SdpVideoFormat> GetSupportedFormats() const override;
+  CodecInfo
+  QueryVideoEncoder(const webrtc::SdpVideoFormat &format) const override;
+  std::unique_ptr<webrtc::VideoEncoder>
+  CreateVideoEncoder(const webrtc::SdpVideoFormat &format) override;
+
+private:
+  bool BaseSupports(const webrtc::SdpVideoFormat &format) const;
+
+  std::unique_ptr<webrtc::VideoEncoderFactory> factory;
+};
@@ -6,13 +6,33 @@
 #include "api/video_codecs/video_codec.h"
 #include "api/video_codecs/video_encoder.h"
 #include "api/video_codecs/video_encoder_factory.h"
+#include "encoder/dmabuf_input.h"
+#include "encoder/encoder_config.h"
+#include "encoder/h264_nal_scanner.h"
+#include "encoder/key_frame_limiter.h"
+#include "encoder/rate_controller.h"
 #include "encoder/video_encode.h"
+#include "modules/include/module_common_types.h"
+#include "modules/video_coding/include/video_codec_interface.h"
+#include <atomic>
 #include <memory>
+#include <mutex>
+
+#define JETSON_MAX_PENDING_FRAMES 16
+#define JETSON_NUM_OUTPUT_BUFFERS 10
+// Camera buffers the encoder may hold in DMABUF mode. The capture ring is
+// only V4L_DEFAULT_NUM_BUFFERS deep and the driver needs one to write to.
+#define JETSON_DMABUF_MAX_QUEUED 2
+// How long Release() waits for the capture plane thread to exit.
+#define JETSON_DQ_STOP_TIMEOUT_MS 1000
 
 using EncoderInfo = webrtc::VideoEncoder::EncoderInfo;
 
 class JetsonEncoderFactory : public webrtc::VideoEncoderFactory {
 public:
+  explicit JetsonEncoderFactory(const HardwareEncoderConfig &config)
+      : config(config) {}
+
   std::vector<webrtc::SdpVideoFormat> GetSupportedFormats() const override;
 
   // Returns information about how this format will be encoded. The specified
@@ -25,14 +45,28 @@ public:
   std::unique_ptr<webrtc::VideoEncoder>
   CreateVideoEncoder(const webrtc::SdpVideoFormat &format) override;
 
+private:
+  HardwareEncoderConfig config;
+};
+
+// Per-frame metadata kept between Encode() and the capture plane callback.
+struct PendingFrame {
+  int64_t timestamp_us;
+  uint32_t rtp_timestamp;
+  int64_t ntp_time_ms;
+  int64_t render_time_ms;
+  webrtc::VideoRotation rotation;
+  absl::optional<webrtc::ColorSpace> color_space;
+  // Monotonic time Encode() queued the frame, for the encode time metric.
+  int64_t encode_start_us;
 };
 
 class JetsonEncoder : public webrtc::VideoEncoder {
 public:
   context_t ctx;
-  webrtc::EncodedImageCallback *callback;
-//  JetsonEncoder();
-//  ~JetsonEncoder() {}
+  webrtc::EncodedImageCallback *callback = nullptr;
+  explicit JetsonEncoder(const HardwareEncoderConfig &config);
+  ~JetsonEncoder() override;
 
   /**
    * Abort on error.
@@ -49,6 +83,11 @@ public:
                                           NvBuffer *buffer,
                                           NvBuffer *shared_buffer, void *arg);
 
+  // Splits the bitstream in |buffer| into NAL units and hands it to the
+  // registered callback. The encoded image points straight into the capture
+  // plane buffer, which is only requeued once the callback returns.
+  void DeliverEncodedFrame(const struct v4l2_buffer *buf, NvBuffer *buffer);
+
   // Initialize the encoder with the information from the codecSettings
   //
   // Input:
@@ -75,7 +114,8 @@ public:
   int32_t RegisterEncodeCompleteCallback(
       webrtc::EncodedImageCallback *callback) override;
 
-  // Free encoder memory.
+  // Stops the capture plane thread and deletes the hardware encoder. Safe
+  // to call repeatedly; InitEncode() calls it first.
   // Return value                : WEBRTC_VIDEO_CODEC_OK if OK, < 0 otherwise.
   int32_t Release() override;
 
@@ -85,6 +125,9 @@ public:
   // Input:
   //          - frame             : Image to be encoded
   //          - frame_types       : Frame type to be generated by the encoder.
+  //                                A keyframe request forces an IDR (or a
+  //                                GDR) on this frame, rate-limited by
+  //                                |key_frame_limiter|.
   //
   // Return value                 : WEBRTC_VIDEO_CODEC_OK if OK
   //                                <0 - Errors:
@@ -101,37 +144,112 @@ public:
   //         const webrtc::CodecSpecificInfo *codec_specific_info,
   //         const std::vector<webrtc::VideoFrameType> *frame_types) override;
 
-  // Inform the encoder about the new target bit rate.
+  // Inform the encoder about the new target bit rate. Applied to the running
+  // encoder through |rate_controller|.
   //
   // Input:
-  //          - bitrate         : New target bit rate
+  //          - bitrate         : New target bit rate, in kbps
   //          - framerate       : The target frame rate
   //
   // Return value                : WEBRTC_VIDEO_CODEC_OK if OK, < 0 otherwise.
-  int32_t SetRates(uint32_t bitrate, uint32_t framerate) override { return 0; };
+  int32_t SetRates(uint32_t bitrate, uint32_t framerate) override;
 
-  // Default fallback: Just use the sum of bitrates as the single target rate.
-  // TODO(sprang): Remove this default implementation when we remove SetRates().
+  // Single stream only; the allocation is applied as its sum.
   int32_t SetRateAllocation(const webrtc::VideoBitrateAllocation &allocation,
-                            uint32_t framerate) override {
-    return 0;
-  };
+                            uint32_t framerate) override;
 
   // Inform the encoder when the packet loss rate changes.
   //
   // Input:   - packet_loss_rate  : The packet loss rate (0.0 to 1.0).
-  void OnPacketLossRateUpdate(float packet_loss_rate) override {};
+  void OnPacketLossRateUpdate(float packet_loss_rate) override;
 
   // Inform the encoder when the round trip time changes.
   //
   // Input:   - rtt_ms            : The new RTT, in milliseconds.
-  void OnRttUpdate(int64_t rtt_ms) override {};
+  void OnRttUpdate(int64_t rtt_ms) override;
 
   // Returns meta-data about the encoder, such as implementation name.
   // The output of this method may change during runtime. For instance if a
   // hardware encoder fails, it may fall back to doing software encoding using
   // an implementation with different characteristics.
   EncoderInfo GetEncoderInfo() const override;
+
+private:
+  // Writes |frame| as NV12 to the given planes, reading NV12, YUYV and UYVY
+  // camera buffers without an I420 intermediate.
+  bool CopyToNv12(const webrtc::VideoFrame &frame, uint8_t *y, int y_stride,
+                  uint8_t *uv, int uv_stride);
+  // Fills the NV12 output plane buffer from |frame| in MMAP mode.
+  bool CopyToOutputBuffer(const webrtc::VideoFrame &frame, NvBuffer *buffer);
+
+  // DMABUF mode: allocates one NvBufSurface per output plane slot for
+  // frames that have to be copied, and sets the plane up to take fds.
+  int InitDmaBufInput();
+  void ReleaseDmaBufInput();
+  int32_t EncodeDmaBuf(const webrtc::VideoFrame &frame, bool key_frame);
+  // Copies |frame| into an output plane buffer of the encoder's own.
+  int32_t EncodeMmap(const webrtc::VideoFrame &frame, bool key_frame);
+  // Describes |frame| as the camera's own DMABUF if the encoder can read it
+  // in place: NV12 at the encode size with the encoder's pitch.
+  bool DescribeCameraBuffer(const webrtc::VideoFrame &frame,
+                            DmaBufFrame *input);
+  // Copies |frame| into the surface of |slot| and describes that instead.
+  bool CopyToSurface(const webrtc::VideoFrame &frame, int slot,
+                     DmaBufFrame *input);
+  // Sets the key frame request and hands |input| in |slot| to the encoder.
+  // Returns false, with the slot free again, if the encoder did not take
+  // it.
+  bool SubmitDmaBuf(const webrtc::VideoFrame &frame, bool key_frame, int slot,
+                    DmaBufFrame *input,
+                    rtc::scoped_refptr<webrtc::VideoFrameBuffer> owner);
+  bool PushPendingFrame(const webrtc::VideoFrame &frame);
+  bool PopPendingFrame(int64_t timestamp_us, PendingFrame *frame);
+  // Takes back the newest pending frame if it is |timestamp_us|, for a
+  // frame that never reached the encoder.
+  void DropPendingFrame(int64_t timestamp_us);
+  // Makes the frame queued next in output plane buffer |index| a keyframe.
+  // Sets |tag_buffer| when the buffer has to carry V4L2 input metadata.
+  bool ForceKeyFrame(uint32_t index, bool *tag_buffer);
+
+  // Guards the pending frame ring and |callback| against the DQ thread.
+  std::mutex frames_mutex;
+  PendingFrame pending_frames[JETSON_MAX_PENDING_FRAMES];
+  size_t pending_head = 0;
+  size_t pending_count = 0;
+
+  KeyFrameConfig key_frame_config;
+  KeyFrameLimiter key_frame_limiter;
+  v4l2_enc_gdr_params gdr_params;
+
+  bool dmabuf_input;
+  std::unique_ptr<DmaBufPlane> dmabuf_plane;
+  std::unique_ptr<DmaBufInputQueue> dmabuf_queue;
+  NvBufSurface *surfaces[JETSON_NUM_OUTPUT_BUFFERS] = {};
+  uint32_t surface_pitch = 0;
+  // Set once the encoder refuses a camera DMABUF; every later frame is
+  // copied.
+  bool zero_copy_failed = false;
+
+  // Created in InitEncode once the encoder runs.
+  std::unique_ptr<RateControlTarget> rate_target;
+  std::unique_ptr<RateController> rate_controller;
+
+  // Set on the capture plane DQ thread's first callback.
+  bool dq_thread_configured = false;
+  // Set by Release() while it tears the capture plane thread down.
+  std::atomic<bool> stopping{false};
+
+  // Only touched from the capture plane DQ thread; sized once in InitEncode
+  // so that delivering a frame never allocates.
+  webrtc::RTPFragmentationHeader frag_header;
+  webrtc::CodecSpecificInfo codec_specific;
+  H264NalUnit nal_units[H264_MAX_NAL_UNITS];
 };
 
-std::unique_ptr<webrtc::VideoEncoderFactory> CreateJetsonEncoderFactory();
+std::unique_ptr<webrtc::VideoEncoderFactory>
+CreateJetsonEncoderFactory(const HardwareEncoderConfig &config);
+
+// Opens the encoder device once so that the driver and firmware are loaded
+// before WebRTC creates the first JetsonEncoder. Blocks for as long as that
+// takes; may run on any thread.
+void WarmUpJetsonEncoder();
@@ -0,0 +1,31 @@
+#pragma once
+#include <cstdint>
+
+// How a hardware encoder answers keyframe requests (PLI/FIR) from receivers.
+struct KeyFrameConfig {
+  // Requests arriving within this long of the last forced keyframe are
+  // merged into a single one at the end of the window, so a burst of PLIs
+  // from many viewers costs one keyframe rather than one each.
+  int64_t min_interval_ms = 1000;
+  // Refresh the picture over this many frames with gradual decoder refresh
+  // instead of a full IDR; 0 for an IDR. GDR keeps the bitrate flat but only
+  // repairs receivers that are already decoding: a new viewer still waits
+  // for the next periodic IDR.
+  uint32_t gdr_frames = 0;
+};
+
+// Rate-limits forced keyframes. Called once per encoded frame on the
+// encoder queue.
+class KeyFrameLimiter {
+public:
+  explicit KeyFrameLimiter(int64_t min_interval_ms);
+
+  // Records whether the frame about to be encoded came with a keyframe
+  // request and returns true if it should be encoded as one.
+  bool ShouldForce(bool requested, int64_t now_us);
+
+private:
+  int64_t min_interval_us;
+  int64_t last_forced_us;
+  bool pending;
+};
@@ -0,0 +1,71 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Where a RateController applies its decisions, e.g. a running
+// NvVideoEncoder. tools/rate_controller_check implements it with a fake
+// that records every call.
+class RateControlTarget {
+public:
+  virtual ~RateControlTarget() = default;
+  // Both return 0 on success, like the NvVideoEncoder setters.
+  virtual int SetBitrate(uint32_t bitrate_bps) = 0;
+  virtual int SetFrameRate(uint32_t fps) = 0;
+};
+
+struct RateControllerConfig {
+  uint32_t min_bitrate_bps = 100 * 1000;
+  // 0 for no limit beyond what WebRTC asks for.
+  uint32_t max_bitrate_bps = 0;
+  // Changes smaller than this fraction of the applied rate are skipped;
+  // every change is an ioctl and restarts the encoder's rate estimate.
+  double min_change = 0.05;
+  // Increases are held back for this long after any change, or twice the
+  // RTT if that is longer, so that the effect of the last change is seen
+  // before adding more. Decreases always apply at once.
+  int64_t min_increase_interval_ms = 500;
+};
+
+// Turns WebRTC's target rate, packet loss and RTT into bitrate and frame
+// rate changes on a hardware encoder. The target from the bandwidth
+// estimator is scaled down further while loss is high, since a hardware
+// encoder has no resilience tools of its own and every lost packet costs a
+// keyframe request.
+//
+// SetTarget(), OnPacketLoss() and OnRtt() are called on the encoder queue;
+// OnFrameEncoded() may run on another thread.
+class RateController {
+public:
+  RateController(RateControlTarget *target, const RateControllerConfig &config,
+                 uint32_t start_bitrate_bps, uint32_t fps);
+
+  void SetTarget(uint32_t bitrate_bps, uint32_t fps, int64_t now_us);
+  // |loss| is the fraction of packets lost, 0 to 1.
+  void OnPacketLoss(float loss, int64_t now_us);
+  void OnRtt(int64_t rtt_ms);
+  // Reports an encoded frame whose Encode() call started at
+  // |encode_start_us|. The first one queued after a bitrate change closes
+  // that change's latency measurement.
+  void OnFrameEncoded(int64_t encode_start_us, int64_t now_us);
+
+  uint32_t applied_bitrate_bps() const { return applied_bitrate; }
+  uint32_t applied_fps() const { return applied_framerate; }
+  // Share of the target that loss currently allows, 0.5 to 1.
+  double loss_factor() const;
+
+private:
+  void Apply(int64_t now_us);
+
+  RateControlTarget *target;
+  RateControllerConfig config;
+  uint32_t target_bitrate;
+  uint32_t target_framerate;
+  uint32_t applied_bitrate;
+  uint32_t applied_framerate;
+  float loss;
+  int64_t rtt_ms;
+  int64_t last_change_us;
+  // Time of the last applied bitrate change until a frame encoded after it
+  // comes out, 0 otherwise.
+  std::atomic<int64_t> pending_change_us;
+};
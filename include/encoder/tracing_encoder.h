@@ -0,0 +1,68 @@
+#pragma once
+#include "api/video_codecs/sdp_video_format.h"
+#include "api/video_codecs/video_encoder.h"
+#include "api/video_codecs/video_encoder_factory.h"
+#include <atomic>
+#include <memory>
+
+// Wraps another encoder and stamps the encode stages of every frame into
+// GlobalLatencyTracer() while it is enabled. Works with any encoder, so the
+// pipeline can be traced with the software encoder on a machine without a
+// Jetson. Every encoder wadi creates is wrapped, so this is also where the
+// encoder thread policy is applied and the first frame sent is marked in
+// GlobalStartupTimeline().
+class TracingVideoEncoder : public webrtc::VideoEncoder,
+                            public webrtc::EncodedImageCallback {
+public:
+  explicit TracingVideoEncoder(std::unique_ptr<webrtc::VideoEncoder> encoder);
+
+  int32_t InitEncode(const webrtc::VideoCodec *codec_settings,
+                     int32_t number_of_cores, size_t max_payload_size) override;
+  int32_t RegisterEncodeCompleteCallback(
+      webrtc::EncodedImageCallback *callback) override;
+  int32_t Release() override;
+  int32_t
+  Encode(const webrtc::VideoFrame &frame,
+         const std::vector<webrtc::VideoFrameType> *frame_types) override;
+  int32_t SetRates(uint32_t bitrate, uint32_t framerate) override;
+  int32_t SetRateAllocation(const webrtc::VideoBitrateAllocation &allocation,
+                            uint32_t framerate) override;
+  void OnPacketLossRateUpdate(float packet_loss_rate) override;
+  void OnRttUpdate(int64_t rtt_ms) override;
+  EncoderInfo GetEncoderInfo() const override;
+
+  Result OnEncodedImage(
+      const webrtc::EncodedImage &image,
+      const webrtc::CodecSpecificInfo *codec_specific_info,
+      const webrtc::RTPFragmentationHeader *fragmentation) override;
+  void OnDroppedFrame(DropReason reason) override;
+
+private:
+  // Encoders only report the RTP timestamp of their output, so the capture
+  // time is looked up from the frames recently passed to Encode().
+  static const size_t kNumFrames = 32;
+  struct FrameTimes {
+    std::atomic<uint32_t> rtp_timestamp{0};
+    std::atomic<int64_t> capture_time_us{0};
+  };
+
+  std::unique_ptr<webrtc::VideoEncoder> encoder;
+  // Also read on the encoder's output thread, if it has one.
+  std::atomic<webrtc::EncodedImageCallback *> callback;
+  FrameTimes frames[kNumFrames];
+};
+
+class TracingVideoEncoderFactory : public webrtc::VideoEncoderFactory {
+public:
+  explicit TracingVideoEncoderFactory(
+      std::unique_ptr<webrtc::VideoEncoderFactory> factory);
+
+  std::vector<webrtc::SdpVideoFormat> GetSupportedFormats() const override;
+  CodecInfo
+  QueryVideoEncoder(const webrtc::SdpVideoFormat &format) const override;
+  std::unique_ptr<webrtc::VideoEncoder>
+  CreateVideoEncoder(const webrtc::SdpVideoFormat &format) override;
+
+private:
+  std::unique_ptr<webrtc::VideoEncoderFactory> factory;
+};
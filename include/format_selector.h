@@ -0,0 +1,47 @@
+#pragma once
+#include "v4l.h"
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// What happens to frames after capture, which decides what each capture
+// format costs.
+struct FormatSelectorOptions {
+  // The encoder reads NV12 and packed YUYV/UYVY frames as they are (Jetson);
+  // otherwise everything is converted to I420 first.
+  bool native_yuv_input = false;
+  // Consider H.264 cameras for passthrough. Off by default: the camera's
+  // rate control then replaces WebRTC's.
+  bool allow_h264 = false;
+};
+
+struct CaptureFormat {
+  uint32_t pixelformat;
+  uint32_t width;
+  uint32_t height;
+  uint32_t fps;
+  // Estimated bytes touched per second between the driver and the encoder
+  // input, including MJPEG decode and scaling down to the target.
+  double cost;
+};
+
+// Estimated bytes touched per captured pixel to turn |pixelformat| into
+// encoder input, or a negative value if the pipeline cannot use it.
+double capture_pixel_cost(uint32_t pixelformat,
+                          const FormatSelectorOptions &options);
+
+// Picks the format, frame size and rate that deliver |width|x|height| at
+// |fps| for the least pipeline work. Sizes at the target's aspect ratio and
+// at least as large as it are preferred, then rates of at least |fps|;
+// among those the cheapest wins. Larger sizes are scaled down by the
+// encoder. Falls back to the closest smaller or slower mode when nothing
+// reaches the target.
+std::optional<CaptureFormat>
+select_capture_format(const std::vector<V4LFormat> &formats, uint32_t width,
+                      uint32_t height, uint32_t fps,
+                      const FormatSelectorOptions &options);
+
+// Whether |formats| lists |pixelformat| at |width|x|height|.
+bool supports_capture_format(const std::vector<V4LFormat> &formats,
+                             uint32_t pixelformat, uint32_t width,
+                             uint32_t height);
@@ -0,0 +1,64 @@
+#pragma once
+#include "common_video/include/i420_buffer_pool.h"
+#include <cstddef>
+#include <cstdint>
+
+// Frames a thread may work on before its allocations on the frame path are
+// counted, so that pools and scratch buffers can grow to their working size
+// first. Every outermost HotPathScope on a thread is one frame.
+#define HOT_PATH_WARMUP_FRAMES 300
+// Buffers preallocated per pool and frame size.
+#define HOT_PATH_WARM_BUFFERS 6
+
+// Memory behaviour for deterministic latency. Set once at startup.
+struct MemoryConfig {
+  // Lock wadi's memory into RAM and keep freed heap memory mapped, so that
+  // the frame path never page faults once it has warmed up.
+  bool lock = false;
+  // Ask for transparent hugepages on preallocated frame buffers.
+  bool hugepages = false;
+};
+
+// Applies |config| to the process; call before other threads start.
+// Returns false, leaving memory unlocked, if mlockall fails.
+bool configure_memory(const MemoryConfig &config);
+bool memory_preallocation_enabled();
+
+// Fills |pool| with HOT_PATH_WARM_BUFFERS buffers of |width| x |height|
+// and touches every page. Sources call it at bring-up for the size they
+// expect to deliver, and again whenever that size changes.
+void warm_buffer_pool(webrtc::I420BufferPool *pool, int width, int height);
+
+// Marks the calling thread as working on a frame between capture and
+// encoder output. Once the thread has been through HOT_PATH_WARMUP_FRAMES
+// scopes, in_hot_path() is true inside them.
+class HotPathScope {
+public:
+  HotPathScope();
+  ~HotPathScope();
+  HotPathScope(const HotPathScope &) = delete;
+  HotPathScope &operator=(const HotPathScope &) = delete;
+
+private:
+  bool previous;
+};
+
+// Suspends counting around calls into libwebrtc made from a HotPathScope,
+// e.g. delivering a frame to the sinks or an encoded image to the
+// transport; their allocations are not wadi's to remove.
+class HotPathPause {
+public:
+  HotPathPause();
+  ~HotPathPause();
+  HotPathPause(const HotPathPause &) = delete;
+  HotPathPause &operator=(const HotPathPause &) = delete;
+
+private:
+  bool previous;
+};
+
+// Whether the calling thread is in a warmed-up HotPathScope and not in a
+// HotPathPause. wadi does not replace operator new; tools/hot_path_check
+// does, and fails if it sees allocations while this is true. C libraries
+// calling malloc directly, like libjpeg, are not seen.
+bool in_hot_path();
@@ -0,0 +1,51 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+
+struct HttpServerRequest {
+  std::string method;
+  std::string path;
+  // Header names are lowercased.
+  std::map<std::string, std::string> headers;
+  std::string body;
+};
+
+struct HttpServerResponse {
+  int status = 200;
+  std::string content_type = "text/plain";
+  std::map<std::string, std::string> headers;
+  std::string body;
+};
+
+// Minimal HTTP/1.1 listener serving one connection at a time on its own
+// thread. Every response closes the connection. Meant for local endpoints
+// such as /metrics, not for exposure to untrusted networks.
+class HttpServer {
+public:
+  using Handler =
+      std::function<void(const HttpServerRequest &, HttpServerResponse &)>;
+
+  HttpServer(std::string address, uint16_t port, Handler handler);
+  ~HttpServer();
+  bool Start();
+  void Stop();
+  // The bound port, useful when constructed with port 0.
+  uint16_t port() const { return bound_port; }
+
+private:
+  void _serve_loop();
+  void _serve_connection(int client);
+
+  std::string address;
+  uint16_t requested_port;
+  uint16_t bound_port;
+  Handler handler;
+  int listen_fd;
+  int wake_fd;
+  std::atomic<bool> running;
+  std::thread serve_thread;
+};
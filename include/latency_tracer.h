@@ -0,0 +1,86 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Log-linear histogram with 16 sub-buckets per power of two, giving about 6%
+// relative precision from 1 us up to 2^27 us. Recording is a handful of
+// relaxed atomic adds, so any thread may record without locking.
+class LatencyHistogram {
+public:
+  static const int kSubBucketBits = 4;
+  static const int kMaxExponent = 26;
+  static const int kNumBuckets = (kMaxExponent - 2) << kSubBucketBits;
+
+  void Record(int64_t value_us);
+  void Reset();
+  uint64_t count() const { return total_count.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return total_sum.load(std::memory_order_relaxed); }
+  int64_t max() const { return max_value.load(std::memory_order_relaxed); }
+  // Upper bound of the bucket holding the given quantile, in microseconds.
+  int64_t Percentile(double quantile) const;
+
+private:
+  static int BucketIndex(uint64_t value);
+  static int64_t BucketUpperBound(int index);
+
+  std::atomic<uint64_t> buckets[kNumBuckets] = {};
+  std::atomic<uint64_t> total_count{0};
+  std::atomic<uint64_t> total_sum{0};
+  std::atomic<int64_t> max_value{0};
+};
+
+// Points a frame passes on its way from the camera to the RTP packetizer.
+// Each stage records the time since the previous stage seen for that frame,
+// or since the capture timestamp for the first one.
+enum LatencyStage {
+  kLatencyStageDequeue,    // V4L2 DQBUF, relative to the driver timestamp
+  kLatencyStageBroadcast,  // CapturerTrackSource::OnFrame
+  kLatencyStageEncodeStart, // VideoEncoder::Encode entry
+  kLatencyStageEncodeDone, // encoder output callback
+  kLatencyStagePacketized, // OnEncodedImage returned, packets are queued
+  kLatencyStageTotal,      // capture timestamp to kLatencyStagePacketized
+  kLatencyStageCount,
+};
+
+const char *latency_stage_name(LatencyStage stage);
+
+// Correlates stamps by the frame's capture timestamp (VideoFrame
+// timestamp_us, rtc::TimeMicros() clock) so it works with any frame source.
+// Disabled by default; a disabled tracer costs one relaxed load per stamp.
+class LatencyTracer {
+public:
+  void SetEnabled(bool enabled) {
+    this->enabled.store(enabled, std::memory_order_relaxed);
+  }
+  bool is_enabled() const {
+    return this->enabled.load(std::memory_order_relaxed);
+  }
+
+  void Stamp(LatencyStage stage, int64_t capture_time_us);
+  void Stamp(LatencyStage stage, int64_t capture_time_us, int64_t now_us);
+  void Reset();
+
+  const LatencyHistogram &histogram(LatencyStage stage) const {
+    return this->histograms[stage];
+  }
+  // Human readable per-stage table, one line per stage.
+  std::string Dump() const;
+  // Per-stage summaries in the Prometheus text format.
+  std::string RenderPrometheus() const;
+
+private:
+  // Enough slots for every frame that can be in flight at once; frames that
+  // map to a reused slot only skew their own sample.
+  static const size_t kNumSlots = 256;
+  struct FrameSlot {
+    std::atomic<int64_t> capture_time_us{0};
+    std::atomic<int64_t> last_stamp_us{0};
+  };
+
+  std::atomic<bool> enabled{false};
+  FrameSlot slots[kNumSlots];
+  LatencyHistogram histograms[kLatencyStageCount];
+};
+
+LatencyTracer &GlobalLatencyTracer();
@@ -1,16 +1,65 @@
 #pragma once
-#include <stdarg.h>
-#include <stdio.h>
-#include <time.h>
+#include <atomic>
+#include <cstdint>
 
-inline void tlog(const char *fmt, ...) {
-  char msg[50];
-  time_t now = time(NULL);
-  strftime(msg, sizeof msg, "%Y-%m-%d %T", localtime(&now));
-  printf("[%s] ", msg);
-  va_list args;
-  va_start(args, fmt);
-  vprintf(fmt, args);
-  va_end(args);
-  printf("\n");
-}
+enum LogLevel {
+  LOG_LEVEL_DEBUG = 0,
+  LOG_LEVEL_INFO = 1,
+  LOG_LEVEL_WARN = 2,
+  LOG_LEVEL_ERROR = 3,
+  LOG_LEVEL_NONE = 4,
+};
+
+// Calls below this level are compiled out entirely.
+#ifndef WADI_LOG_MIN_LEVEL
+#define WADI_LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Formats the message into the calling thread's ring buffer; a background
+// thread timestamps, orders and writes the lines to stdout. Never allocates
+// after the thread's first message and never blocks on I/O. Messages are
+// dropped, and the drop counted, if the ring is full.
+void log_write(LogLevel level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+// Runtime threshold applied on top of WADI_LOG_MIN_LEVEL.
+void log_set_level(LogLevel level);
+bool log_parse_level(const char *name, LogLevel *level);
+// Writes everything logged so far before returning.
+void log_flush();
+// Routes RTC_LOG output at or above |level| through log_write instead of
+// libwebrtc's own stderr logging.
+void log_install_webrtc_sink(LogLevel level);
+// Returns true if the call site may log now. |suppressed| receives the
+// number of messages skipped since the last one that was let through.
+bool log_rate_limit(std::atomic<int64_t> *last_us, std::atomic<uint32_t> *count,
+                    int64_t interval_ms, uint32_t *suppressed);
+
+#define WADI_LOG(level, ...)                                                   \
+  do {                                                                         \
+    if ((level) >= WADI_LOG_MIN_LEVEL) {                                       \
+      log_write((level), __VA_ARGS__);                                         \
+    }                                                                          \
+  } while (0)
+
+#define tlog(...) WADI_LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define tlog_debug(...) WADI_LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define tlog_warn(...) WADI_LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define tlog_error(...) WADI_LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Logs at most once per |interval_ms| from this call site.
+#define tlog_every_ms(interval_ms, level, ...)                                 \
+  do {                                                                         \
+    if ((level) >= WADI_LOG_MIN_LEVEL) {                                       \
+      static std::atomic<int64_t> log_site_last_us{INT64_MIN};                 \
+      static std::atomic<uint32_t> log_site_count{0};                          \
+      uint32_t log_site_suppressed;                                            \
+      if (log_rate_limit(&log_site_last_us, &log_site_count, (interval_ms),    \
+                         &log_site_suppressed)) {                              \
+        log_write((level), __VA_ARGS__);                                       \
+        if (log_site_suppressed > 0) {                                         \
+          log_write((level), "(%u similar messages suppressed)",               \
+                    log_site_suppressed);                                      \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
@@ -0,0 +1,66 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Counters updated from the capture, encode and signaling paths. Updates are
+// relaxed atomic adds, so they never allocate or block the frame path.
+struct PipelineCounters {
+  std::atomic<uint64_t> frames_captured{0};
+  std::atomic<uint64_t> frames_discarded{0};
+  std::atomic<uint64_t> frames_adapted_out{0};
+  std::atomic<uint64_t> frames_encoded{0};
+  std::atomic<uint64_t> encode_time_us{0};
+  std::atomic<uint64_t> rate_changes{0};
+  std::atomic<uint64_t> rate_change_latency_us{0};
+  std::atomic<uint64_t> keyframes_forced{0};
+  std::atomic<uint64_t> keyframe_requests_coalesced{0};
+  std::atomic<uint64_t> frames_decoded{0};
+  std::atomic<uint64_t> decode_time_us{0};
+  std::atomic<int64_t> capture_queue_depth{0};
+  std::atomic<int64_t> encoder_queue_depth{0};
+  std::atomic<uint64_t> http_requests{0};
+  std::atomic<uint64_t> http_failures{0};
+  std::atomic<uint64_t> http_latency_us{0};
+  std::atomic<uint64_t> ice_restarts{0};
+};
+
+// Values copied out of the most recent RTCStatsReport of a session.
+struct ConnectionStats {
+  uint64_t bytes_sent = 0;
+  uint64_t packets_sent = 0;
+  uint64_t frames_encoded = 0;
+  uint64_t frames_sent = 0;
+  uint64_t huge_frames_sent = 0;
+  uint64_t nack_count = 0;
+  uint64_t pli_count = 0;
+  uint64_t fir_count = 0;
+  uint64_t qp_sum = 0;
+  double target_bitrate = 0;
+  double available_outgoing_bitrate = 0;
+  double round_trip_time = 0;
+  double frames_per_second = 0;
+  uint32_t frame_width = 0;
+  uint32_t frame_height = 0;
+  // Local IP of the selected candidate pair; not exported.
+  std::string local_address;
+};
+
+class Metrics {
+public:
+  PipelineCounters counters;
+
+  void SetConnectionStats(const std::string &session,
+                          const ConnectionStats &stats);
+  void RemoveConnectionStats(const std::string &session);
+  // Renders every metric in the Prometheus text exposition format.
+  std::string RenderPrometheus();
+
+private:
+  std::mutex connections_mutex;
+  std::map<std::string, ConnectionStats> connections;
+};
+
+Metrics &GlobalMetrics();
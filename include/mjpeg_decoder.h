@@ -0,0 +1,116 @@
+#pragma once
+#include "api/scoped_refptr.h"
+#include "api/video/i420_buffer.h"
+#include "api/video/video_frame.h"
+#include "common_video/include/i420_buffer_pool.h"
+#include "rtc_base/ref_count.h"
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct JpegDecompressorState;
+
+// Decodes baseline JPEG (as sent by UVC cameras in MJPEG mode) straight into
+// I420 with libjpeg-turbo's raw data interface: no color conversion and, for
+// 4:2:0 sources, no intermediate copy. 4:2:2 and 4:4:4 chroma is decoded
+// into scratch planes and box-filtered down. Not thread safe; the decoder
+// state and scratch memory are reused from frame to frame.
+class JpegDecompressor {
+public:
+  JpegDecompressor();
+  ~JpegDecompressor();
+
+  // Parses the frame headers; width() and height() are valid afterwards.
+  // |data| must stay valid until DecodeTo() returns.
+  bool ReadHeader(const uint8_t *data, size_t size);
+  // Decodes the frame whose header was read last into |out|, which must be
+  // width() x height().
+  bool DecodeTo(webrtc::I420Buffer *out);
+  int width() const;
+  int height() const;
+
+private:
+  std::unique_ptr<JpegDecompressorState> state;
+};
+
+// Decodes MJPEG frames on a small pool of worker threads. Consecutive frames
+// decode in parallel but are delivered in submission order, on whichever
+// worker completes the oldest outstanding frame.
+class MjpegDecoder {
+public:
+  using FrameCallback = std::function<void(const webrtc::VideoFrame &)>;
+
+  struct Frame {
+    const uint8_t *data;
+    size_t size;
+    int64_t timestamp_us;
+    // Keeps |data| alive until the frame is decoded, e.g. a V4LFrameBuffer
+    // holding the capture buffer away from the driver.
+    rtc::scoped_refptr<rtc::RefCountInterface> owner;
+    // Region to keep and size to scale it to, as chosen by the source's
+    // VideoAdapter. A zero |width| delivers the frame as decoded.
+    int crop_x = 0;
+    int crop_y = 0;
+    int crop_width = 0;
+    int crop_height = 0;
+    int width = 0;
+    int height = 0;
+  };
+
+  // |on_frame| is called for every frame that decodes; frames that fail to
+  // decode are reported through |on_dropped| instead, in order as well.
+  MjpegDecoder(size_t num_threads, FrameCallback on_frame,
+               std::function<void()> on_dropped);
+  ~MjpegDecoder();
+
+  // Queues a frame for decoding. Returns false, dropping the frame, when
+  // every worker is busy and one frame is already waiting.
+  bool Decode(Frame frame);
+  // Blocks until every queued frame has been delivered.
+  void Flush();
+  // Fills the output pool for frames delivered at |width| x |height|, so
+  // that the first ones do not allocate. Workers do the same whenever the
+  // size changes.
+  void Preallocate(int width, int height);
+
+  static size_t DefaultThreadCount();
+
+private:
+  struct Job {
+    Frame frame;
+    rtc::scoped_refptr<webrtc::I420Buffer> output;
+    bool done = false;
+  };
+
+  void Run();
+  // |mutex| must be held.
+  void ResizePool(int width, int height);
+
+  FrameCallback on_frame;
+  std::function<void()> on_dropped;
+  size_t max_in_flight;
+  std::mutex mutex;
+  std::condition_variable work_available;
+  std::condition_variable job_done;
+  // Oldest first; |todo| holds the jobs no worker has started yet. Both
+  // hold at most |max_in_flight| jobs and are reserved to that, so queueing
+  // a frame does not allocate.
+  std::vector<std::shared_ptr<Job>> in_flight;
+  std::vector<std::shared_ptr<Job>> todo;
+  // Delivered jobs, reused for later frames.
+  std::vector<std::shared_ptr<Job>> spare_jobs;
+  bool stopping;
+  // Output buffers are recycled once every sink releases them. Guarded by
+  // |mutex| since workers allocate as soon as they know the frame size.
+  webrtc::I420BufferPool pool;
+  int pool_width = 0;
+  int pool_height = 0;
+  // Held while draining |in_flight| so two workers cannot interleave their
+  // deliveries.
+  std::mutex deliver_mutex;
+  std::vector<std::thread> workers;
+};
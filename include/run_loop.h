@@ -0,0 +1,24 @@
+#pragma once
+#include <atomic>
+#include <csignal>
+#include <functional>
+
+// Parks the main thread until SIGINT/SIGTERM is delivered or Quit() is
+// called from any thread. SIGUSR1 runs on_dump on the main thread and keeps
+// the loop running. The signals are blocked in the constructor, so it
+// has to run before other threads are started for them to inherit the mask.
+class RunLoop {
+public:
+  RunLoop();
+  ~RunLoop();
+  // Returns the exit status passed to Quit(), or EXIT_SUCCESS on a signal.
+  int Run();
+  void Quit(int status);
+  std::function<void()> on_dump;
+
+private:
+  sigset_t signals;
+  int signal_fd;
+  int quit_fd;
+  std::atomic<int> exit_status;
+};
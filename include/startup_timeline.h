@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// What happened between exec and the first media frame, for tuning
+// bring-up. Phases may overlap: capture devices open while the
+// PeerConnectionFactory is being created.
+//
+// Times are kept on the rtc::TimeMicros() clock and reported relative to
+// the start time the kernel recorded for the process, so the dynamic loader
+// and static initializers are included. That start time only has clock
+// tick (usually 10 ms) resolution.
+class StartupTimeline {
+public:
+  StartupTimeline();
+
+  // Records a phase that ran from |start_us| to |end_us|.
+  void AddPhase(const std::string &name, int64_t start_us, int64_t end_us);
+  // Records a point in time. Only the first mark of a name is kept, so with
+  // several sessions it is the first one to get there.
+  void Mark(const std::string &name);
+  // Marks the first encoded frame handed to the RTP sender and logs the
+  // timeline. Later calls cost a relaxed load.
+  void OnFirstFrameSent();
+
+  // One line per phase and mark, in order of their start.
+  std::string Describe() const;
+
+private:
+  struct Event {
+    std::string name;
+    int64_t start_us;
+    int64_t end_us;
+  };
+
+  int64_t exec_us;
+  mutable std::mutex mutex;
+  std::vector<Event> events;
+  std::atomic<bool> first_frame_sent{false};
+};
+
+StartupTimeline &GlobalStartupTimeline();
+
+// Records the lifetime of the scope as a phase of GlobalStartupTimeline().
+class StartupPhase {
+public:
+  explicit StartupPhase(const char *name);
+  ~StartupPhase();
+
+private:
+  const char *name;
+  int64_t start_us;
+};
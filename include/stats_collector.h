@@ -0,0 +1,45 @@
+#pragma once
+#include "api/peer_connection_interface.h"
+#include "api/stats/rtc_stats_collector_callback.h"
+#include "metrics.h"
+#include "rtc_base/async_invoker.h"
+#include "rtc_base/thread.h"
+#include <functional>
+#include <string>
+
+// Polls PeerConnection::GetStats on |thread| every |interval_ms| and
+// publishes the interesting values to GlobalMetrics() under |label|.
+class StatsCollector : public webrtc::RTCStatsCollectorCallback {
+public:
+  static rtc::scoped_refptr<StatsCollector>
+  Create(std::string label,
+         rtc::scoped_refptr<webrtc::PeerConnectionInterface> pc,
+         rtc::Thread *thread, int interval_ms);
+
+  void Start();
+  void Stop();
+  // Called on |thread| with every delivered report; set before Start().
+  std::function<void(const ConnectionStats &)> on_stats;
+  // The last values delivered, only valid on |thread|.
+  const ConnectionStats &last_stats() const { return stats; }
+
+  void OnStatsDelivered(
+      const rtc::scoped_refptr<const webrtc::RTCStatsReport> &report) override;
+
+protected:
+  StatsCollector(std::string label,
+                 rtc::scoped_refptr<webrtc::PeerConnectionInterface> pc,
+                 rtc::Thread *thread, int interval_ms);
+  ~StatsCollector() override;
+
+private:
+  void Poll();
+
+  std::string label;
+  rtc::scoped_refptr<webrtc::PeerConnectionInterface> pc;
+  rtc::Thread *thread;
+  int interval_ms;
+  bool running;
+  ConnectionStats stats;
+  rtc::AsyncInvoker invoker;
+};
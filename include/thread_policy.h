@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Threads wadi starts or drives itself, each with its own policy.
+enum class ThreadRole {
+  kNetwork,
+  kWorker,
+  kSignaling,
+  // V4L2 and virtual capture threads.
+  kCapture,
+  // WebRTC's encoder queue (applied when an H.264 encoder is initialized)
+  // and the Jetson capture plane thread.
+  kEncoder,
+};
+#define THREAD_ROLE_COUNT 5
+
+const char *thread_role_name(ThreadRole role);
+
+// Where and how a thread is scheduled. The default leaves the thread as
+// the kernel placed it.
+struct ThreadPolicy {
+  // CPUs the thread may run on; empty for all of them.
+  std::vector<int> cpus;
+  // SCHED_FIFO priority, 1 to 99, or 0 for the normal scheduler. Needs
+  // CAP_SYS_NICE or an RLIMIT_RTPRIO grant.
+  int fifo_priority = 0;
+  // Nice level under the normal scheduler, -20 to 19.
+  int nice = 0;
+
+  bool is_default() const {
+    return cpus.empty() && fifo_priority == 0 && nice == 0;
+  }
+};
+
+// Parses a comma separated list of CPUs and CPU ranges, optionally
+// followed by "fifo=N" or "nice=N", e.g. "2-3,fifo=20" or "0,nice=-5".
+bool parse_thread_policy(const std::string &value, ThreadPolicy *policy);
+std::string describe_thread_policy(const ThreadPolicy &policy);
+
+// Installs the policy apply_thread_policy() uses for |role|. Call before
+// the threads start.
+void set_thread_policy(ThreadRole role, const ThreadPolicy &policy);
+// Applies the policy for |role| to the calling thread. Failures, usually
+// missing privileges for SCHED_FIFO, are logged and leave the thread as
+// it was.
+bool apply_thread_policy(ThreadRole role);
+// Logs the policy of every role; called once at startup.
+void log_thread_policies();
@@ -1,9 +1,55 @@
+#pragma once
+#include <atomic>
+#include <functional>
 #include <linux/videodev2.h>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+
+#define V4L_DEFAULT_NUM_BUFFERS 4
 
 std::string fourcc_to_string(uint32_t pixelformat);
+
+// A frame size supported by a format and the frame intervals available at
+// it. Discrete sizes have min == max and a step of 0.
+struct V4LFrameSize {
+  uint32_t min_width, max_width, step_width;
+  uint32_t min_height, max_height, step_height;
+  // Seconds per frame. Stepwise and continuous ranges keep both ends only.
+  std::vector<v4l2_fract> intervals;
+
+  bool contains(uint32_t width, uint32_t height) const;
+  // Highest frame rate available, 0 if the driver reports no intervals.
+  double max_fps() const;
+};
+
+struct V4LFormat {
+  uint32_t pixelformat;
+  // V4L2_FMT_FLAG_* from VIDIOC_ENUM_FMT.
+  uint32_t flags;
+  std::string description;
+  std::vector<V4LFrameSize> sizes;
+};
+
+struct V4LBuffer {
+  void *start = nullptr;
+  size_t length = 0;
+  // Set while the buffer is dequeued and referenced outside of the driver.
+  bool outstanding = false;
+  // The same memory exported with VIDIOC_EXPBUF, so that hardware encoders
+  // can read it without a copy; -1 if the driver cannot export.
+  int dmabuf_fd = -1;
+};
+
 class V4LDevice {
 public:
+  // Invoked on the capture thread for every dequeued buffer. The buffer is
+  // handed back to the driver with requeue() once the consumer is done with
+  // it, so the callback must not block.
+  using FrameCallback = std::function<void(const v4l2_buffer &)>;
+
   explicit V4LDevice(std::string);
   ~V4LDevice();
   v4l2_capability cap;
@@ -12,12 +58,63 @@ public:
   bool can_capture();
   bool can_stream();
   bool sync_format();
+  bool sync_framerate();
+  // Formats, frame sizes and intervals the driver supports. Enumerated on
+  // first use, or loaded from the cache in ~/.cache/wadi when this camera
+  // was probed before on the same port and driver version.
+  const std::vector<V4LFormat> &formats();
+
+  bool start_streaming(uint32_t num_buffers, FrameCallback callback);
+  void stop_streaming();
+  bool is_streaming() const { return streaming; }
+  // Returns a dequeued buffer to the driver. Safe to call from any thread and
+  // after stop_streaming(), in which case the buffer is only marked free.
+  void requeue(uint32_t index);
+  const V4LBuffer &buffer(uint32_t index) const { return buffers[index]; }
+  uint32_t num_buffers() const { return buffers.size(); }
+  // Asks a compressed-format camera for an IDR frame. Tries the V4L2 force
+  // key frame control, then the UVC H.264 extension unit, and finally
+  // restarts the stream, which makes UVC cameras start over with an IDR.
+  // Safe to call from any thread.
+  bool request_key_frame();
 
 private:
   int _open();
   int _list_formats();
+  std::string _cache_path() const;
+  bool _load_cached_formats();
+  void _store_cached_formats() const;
   int _fill_format();
   int _fill_cap();
+  int _request_buffers(uint32_t count);
+  void _release_buffers();
+  void _unmap_buffers();
+  int _queue_buffer(uint32_t index);
+  void _capture_loop();
+  void _restart_stream();
+  int _find_h264_xu_unit();
   std::string sysfs_path;
+  std::vector<V4LFormat> supported_formats;
+  bool formats_listed;
   int fd;
+  int wake_fd;
+  std::vector<V4LBuffer> buffers;
+  std::mutex buffers_mutex;
+  // Guarded by buffers_mutex; true between STREAMON and STREAMOFF.
+  bool queue_active;
+  std::atomic<bool> streaming;
+  std::thread capture_thread;
+  FrameCallback on_frame;
+  // Set by request_key_frame(); the capture thread restarts the stream.
+  std::atomic<bool> restart_requested;
+  // Which request_key_frame() strategy works, probed on the first call.
+  enum KeyFrameMethod {
+    kKeyFrameUnknown,
+    kKeyFrameControl,
+    kKeyFrameUvcXu,
+    kKeyFrameRestream,
+  };
+  std::mutex key_frame_mutex;
+  KeyFrameMethod key_frame_method;
+  int h264_xu_unit;
 };
@@ -0,0 +1,72 @@
+#pragma once
+#include "api/video/i420_buffer.h"
+#include "api/video/video_frame_buffer.h"
+#include "common_video/libyuv/include/webrtc_libyuv.h"
+#include "v4l.h"
+#include <memory>
+#include <mutex>
+#include <string>
+
+webrtc::VideoType fourcc_to_videotype(std::string fourcc);
+
+// Wraps a dequeued V4L2 mmap buffer without copying it. The buffer is handed
+// back to the driver when the last reference to the frame is dropped, so
+// consumers that hold on to frames reduce the depth of the capture ring.
+//
+// Frames keep the camera's layout (see fourcc()). Encoders that can read it
+// use the accessors below; everything else calls ToI420(), which converts
+// on first use and hands out the same I420 copy afterwards.
+class V4LFrameBuffer : public webrtc::VideoFrameBuffer {
+public:
+  V4LFrameBuffer(std::shared_ptr<V4LDevice> device, const v4l2_buffer &buf);
+  ~V4LFrameBuffer() override;
+
+  // One is created for every captured frame; freed ones are kept on a free
+  // list rather than returned to the heap, up to the number reserved.
+  static void *operator new(size_t size);
+  static void operator delete(void *p, size_t size);
+  // A device starting to stream reserves one block per capture buffer,
+  // allocated up front, and releases them again when it stops, so the free
+  // list follows the rings currently streaming.
+  static void ReserveBlocks(size_t count);
+  static void ReleaseBlocks(size_t count);
+
+  Type type() const override { return Type::kNative; }
+  int width() const override { return width_; }
+  int height() const override { return height_; }
+  rtc::scoped_refptr<webrtc::I420BufferInterface> ToI420() override;
+  // Converts the |crop_width|x|crop_height| region at |crop_x|,|crop_y| into
+  // |out|, scaled to its size. Planar I420 is cropped and scaled in one
+  // pass; other formats are converted at the crop size, into |scratch| when
+  // a scale has to follow.
+  bool CropAndScaleTo(int crop_x, int crop_y, int crop_width, int crop_height,
+                      webrtc::I420Buffer *out,
+                      rtc::scoped_refptr<webrtc::I420Buffer> *scratch);
+
+  uint32_t fourcc() const { return fourcc_; }
+  uint32_t stride() const { return stride_; }
+  uint32_t index() const { return index_; }
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+  // Interleaved UV plane of NV12/NV21 frames, |stride()| bytes per row.
+  const uint8_t *chroma_data() const { return data_ + stride_ * height_; }
+  // The capture buffer as a DMABUF, or -1. Owned by the device; valid for
+  // as long as this frame is referenced.
+  int dmabuf_fd() const { return dmabuf_fd_; }
+  const std::shared_ptr<V4LDevice> &device() const { return device_; }
+  // True for compressed formats that ToI420() cannot decode.
+  bool is_compressed() const { return fourcc_ == V4L2_PIX_FMT_H264; }
+
+private:
+  std::shared_ptr<V4LDevice> device_;
+  const uint8_t *data_;
+  size_t size_;
+  uint32_t index_;
+  int dmabuf_fd_;
+  uint32_t fourcc_;
+  uint32_t stride_;
+  int width_;
+  int height_;
+  std::mutex i420_mutex_;
+  rtc::scoped_refptr<webrtc::I420BufferInterface> i420_;
+};
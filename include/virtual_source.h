@@ -0,0 +1,85 @@
+#pragma once
+#include "api/scoped_refptr.h"
+#include "api/video/i420_buffer.h"
+#include "common_video/include/i420_buffer_pool.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+// Device paths naming a virtual capture device rather than a V4L2 node:
+//
+//   synthetic[:moving|noise|static|motion]   generated test pattern
+//   file:<clip.y4m|clip.yuv>[,fast]          looping Y4M or raw I420 file
+//
+// Files play at their own frame rate (Y4M) or the configured one (raw),
+// or as fast as the pipeline takes frames with ",fast".
+bool is_virtual_device(const std::string &device_path);
+
+// Produces the pictures of a virtual device, one call per frame.
+class VirtualFrameSource {
+public:
+  virtual ~VirtualFrameSource() = default;
+
+  // Writes the next picture into |frame|, which is width() x height().
+  virtual bool FillFrame(webrtc::I420Buffer *frame) = 0;
+  virtual int width() const = 0;
+  virtual int height() const = 0;
+  // Frame rate the content was recorded at, 0 when it has none.
+  virtual double native_fps() const { return 0; }
+};
+
+// Generated patterns, from cheapest to most expensive to encode.
+enum class SyntheticPattern {
+  // The same picture every frame.
+  kStatic,
+  // A slowly scrolling gradient with a bouncing box, like a fixed camera.
+  kMoving,
+  // Fast full-frame panning over detailed texture.
+  kHighMotion,
+  // Fresh random noise every frame; nothing is predictable.
+  kNoise,
+};
+
+std::unique_ptr<VirtualFrameSource>
+create_synthetic_source(SyntheticPattern pattern, int width, int height);
+// Opens a Y4M file (4:2:0 only), or a raw I420 file of |width| x |height|
+// when the name does not end in .y4m. Returns null if it cannot be read.
+std::unique_ptr<VirtualFrameSource>
+create_file_source(const std::string &path, int width, int height);
+
+// Plays a VirtualFrameSource on its own thread in place of a camera. Frames
+// come from a small buffer pool; when every buffer is still held downstream
+// a paced capturer drops the frame, as a camera would, while an unpaced one
+// waits for a buffer to come back.
+class VirtualCapturer {
+public:
+  using FrameCallback = std::function<void(
+      rtc::scoped_refptr<webrtc::I420Buffer> frame, int64_t timestamp_us)>;
+
+  // Throws std::runtime_error if |device_path| is malformed or the file
+  // cannot be opened. |fps| paces sources without a rate of their own.
+  VirtualCapturer(const std::string &device_path, int width, int height,
+                  uint32_t fps);
+  ~VirtualCapturer();
+
+  int width() const { return source->width(); }
+  int height() const { return source->height(); }
+  // 0 when frames are produced as fast as they are consumed.
+  double fps() const { return frame_rate; }
+
+  bool Start(FrameCallback callback);
+  void Stop();
+
+private:
+  void Run();
+
+  std::unique_ptr<VirtualFrameSource> source;
+  double frame_rate;
+  webrtc::I420BufferPool pool;
+  std::atomic<bool> running;
+  std::thread thread;
+  FrameCallback on_frame;
+};
@@ -1,15 +1,26 @@
+#pragma once
 #include "api/peer_connection_interface.h"
 #include "api/scoped_refptr.h"
+#include "bandwidth_history.h"
 #include "logging.h"
+#include "rtc_base/async_invoker.h"
+#include "rtc_base/event.h"
+#include "whip_client.h"
+#include "whip_runtime.h"
 #include <functional>
+#include <map>
 #include <optional>
 #include <string>
+#include <vector>
 
 struct CaptureTrackConfig {
   uint32_t width;
   uint32_t height;
   uint32_t fps;
   char fourcc[4];
+  uint32_t num_buffers;
+  // Encoder bitrate cap for this track; 0 leaves it to the session default.
+  uint32_t max_bitrate_kbps;
 };
 
 class DummySetSessionDescriptionObserver
@@ -50,28 +61,106 @@ public:
   }
 };
 
+class CallbackCreateSessionDescriptionObserver
+    : public webrtc::CreateSessionDescriptionObserver {
+
+public:
+  using SuccessCallback =
+      std::function<void(webrtc::SessionDescriptionInterface *)>;
+  using FailureCallback = std::function<void(const std::string &)>;
+
+  static CallbackCreateSessionDescriptionObserver *
+  Create(const SuccessCallback &on_success,
+         const FailureCallback &on_failure) {
+    return new rtc::RefCountedObject<CallbackCreateSessionDescriptionObserver>(
+        on_success, on_failure);
+  }
+
+  SuccessCallback _on_success;
+  FailureCallback _on_failure;
+  CallbackCreateSessionDescriptionObserver(const SuccessCallback &on_success,
+                                           const FailureCallback &on_failure)
+      : _on_success(on_success), _on_failure(on_failure) {}
+
+  void OnSuccess(webrtc::SessionDescriptionInterface *desc) override {
+    _on_success(desc);
+  }
+
+  void OnFailure(webrtc::RTCError error) override {
+    _on_failure(error.message());
+  }
+};
+
+class CapturerTrackSource;
+class StatsCollector;
+
 class WHIPSession : public webrtc::PeerConnectionObserver,
                     public webrtc::CreateSessionDescriptionObserver {
 public:
-  explicit WHIPSession(std::string url);
-  ~WHIPSession() {};
+  // |runtime| must outlive the session.
+  WHIPSession(std::string url, WHIPRuntime *runtime);
+  ~WHIPSession();
   rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> factory;
   rtc::scoped_refptr<webrtc::PeerConnectionInterface> pc;
   std::string sdp;
   std::optional<std::vector<std::string>> allowed_codecs = std::nullopt;
   std::optional<uint> max_framerate = std::nullopt;
   std::optional<uint> max_bitrate = std::nullopt;
+  WHIPClientConfig http_config;
+  std::vector<std::string> ice_servers = {"stun:stun.l.google.com:19302"};
+  // Send locally gathered candidates to the WHIP resource with PATCH.
+  bool trickle_ice = true;
+  // Candidates gathered within this window share a single PATCH.
+  int trickle_coalesce_ms = 20;
+  // How long ICE may stay disconnected before it is restarted.
+  int ice_restart_delay_ms = 2000;
+  // Consecutive restarts without reconnecting before the session gives up.
+  int max_ice_restarts = 5;
+  // How often GetStats is polled into GlobalMetrics(); 0 disables polling.
+  int stats_interval_ms = 5000;
+  // ICE sessions gathered as soon as the PeerConnection exists, before any
+  // track or offer, so the offer finds its candidates ready.
+  int ice_candidate_pool_size = 1;
+  // DTLS certificate for the PeerConnection; WebRTC generates one if unset.
+  rtc::scoped_refptr<rtc::RTCCertificate> certificate;
+  // Seeds the start bitrate and records stable estimates, if set. Must
+  // outlive the session.
+  BandwidthHistory *bandwidth_history = nullptr;
 
   void Initialize();
-  void AddCaptureDevice(uint8_t, std::optional<CaptureTrackConfig>);
+  // Opens and starts a capture device without a session, so that it can be
+  // brought up while the PeerConnectionFactory is created. Throws if the
+  // device cannot be opened.
+  static rtc::scoped_refptr<webrtc::VideoTrackSourceInterface>
+  OpenCaptureDevice(const std::string &device_path,
+                    const std::optional<CaptureTrackConfig> &config);
+  // Adds one more video track to the PeerConnection. Throws if the device
+  // cannot be opened.
+  void AddCaptureDevice(const std::string &device_path,
+                        std::optional<CaptureTrackConfig>);
+  // Same with a device returned by OpenCaptureDevice().
+  void AddCaptureSource(
+      const std::string &device_path,
+      const std::optional<CaptureTrackConfig> &config,
+      rtc::scoped_refptr<webrtc::VideoTrackSourceInterface> source);
   bool CreateConnection(bool);
   void CreateOffer();
-  void WaitForOffer();
+  // Blocks until the offer was POSTed and answered, or the exchange failed.
+  // Returns true if the answer was applied.
+  bool WaitForOffer(int timeout_ms);
+  // Stops capture, deletes the WHIP resource and closes the connection.
+  void Close();
   static std::string SDPForceCodecs(std::string sdp,
                                     std::vector<std::string> allowed_codecs);
-  std::unique_ptr<rtc::Thread> signaling_thread;
+  WHIPRuntime *runtime;
+  rtc::Thread *signaling_thread;
 
   std::string url;
+  // Absolute URL of the WHIP resource, taken from the POST's Location header.
+  std::string resource_url;
+  // Invoked from the signaling thread when the session cannot continue.
+  std::function<void(const std::string &)> on_failure;
+
   void
   OnAddTrack(rtc::scoped_refptr<webrtc::RtpReceiverInterface> receiver,
              const std::vector<rtc::scoped_refptr<webrtc::MediaStreamInterface>>
@@ -81,18 +170,73 @@ public:
   void OnIceCandidate(const webrtc::IceCandidateInterface *candidate) override;
 
   void OnSignalingChange(
-      webrtc::PeerConnectionInterface::SignalingState new_state) override {}
+      webrtc::PeerConnectionInterface::SignalingState) override {}
   void OnDataChannel(
-      rtc::scoped_refptr<webrtc::DataChannelInterface> channel) override {}
+      rtc::scoped_refptr<webrtc::DataChannelInterface>) override {}
   void OnRenegotiationNeeded() override {}
   void OnIceConnectionChange(
-      webrtc::PeerConnectionInterface::IceConnectionState new_state) override {}
+      webrtc::PeerConnectionInterface::IceConnectionState new_state) override;
   void OnIceGatheringChange(
-      webrtc::PeerConnectionInterface::IceGatheringState new_state) override {}
-  void OnIceConnectionReceivingChange(bool receiving) override {}
+      webrtc::PeerConnectionInterface::IceGatheringState new_state) override;
+  void OnIceConnectionReceivingChange(bool) override {}
+  void OnConnectionChange(
+      webrtc::PeerConnectionInterface::PeerConnectionState new_state) override;
 
   // CreateSessionDescriptionObserver implementation
   void OnSuccess(webrtc::SessionDescriptionInterface *desc) override;
   void OnFailure(webrtc::RTCError error) override;
   void OnFailure(const std::string &error) override;
+
+private:
+  void SeedBitrate();
+  void SendOffer(const std::string &offer);
+  void OnAnswer(const WHIPResponse &response);
+  void Fail(const std::string &reason);
+  void ScheduleTrickle();
+  void SendTrickle();
+  void OnTrickleResponse(const WHIPResponse &response);
+  std::string BuildSdpFragment(bool include_end_of_candidates);
+  void ParseLocalIceParameters(const std::string &offer);
+  void RestartIce();
+  void OnRestartOffer(webrtc::SessionDescriptionInterface *desc);
+  void OnRestartAnswer(const WHIPResponse &response);
+  void FinishIceRestart();
+  // Retries RestartIce() after |ice_restart_delay_ms| unless ICE recovered.
+  void ScheduleIceRestart();
+  static std::string
+  SDPReplaceIceParameters(const std::string &sdp, const std::string &fragment);
+  std::string ResolveLocation(const std::string &location) const;
+
+  std::unique_ptr<WHIPClient> client;
+  struct VideoTrack {
+    rtc::scoped_refptr<CapturerTrackSource> source;
+    rtc::scoped_refptr<webrtc::RtpSenderInterface> sender;
+    uint32_t max_bitrate_kbps;
+  };
+  std::vector<VideoTrack> video_tracks;
+  rtc::scoped_refptr<StatsCollector> stats_collector;
+  // Signaling thread only.
+  StableBandwidthFilter bandwidth_filter;
+  rtc::Event offer_answered;
+  bool answer_applied = false;
+
+  // Trickle ICE state, only touched on the signaling thread.
+  rtc::AsyncInvoker invoker;
+  std::string etag;
+  std::string ice_ufrag;
+  std::string ice_pwd;
+  // m= line and candidates not yet sent, keyed by mid.
+  std::map<std::string, std::string> media_lines;
+  std::map<std::string, std::vector<std::string>> pending_candidates;
+  bool offer_posted = false;
+  bool gathering_complete = false;
+  bool end_of_candidates_sent = false;
+  bool trickle_scheduled = false;
+  bool trickle_in_flight = false;
+
+  // ICE restart state, only touched on the signaling thread.
+  webrtc::PeerConnectionInterface::IceConnectionState ice_state =
+      webrtc::PeerConnectionInterface::kIceConnectionNew;
+  bool restart_in_flight = false;
+  int ice_restarts = 0;
 };
@@ -0,0 +1,55 @@
+#pragma once
+#include "HTTPRequest/Request.hpp"
+#include "rtc_base/thread.h"
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+struct WHIPClientConfig {
+  std::chrono::milliseconds connect_timeout{2000};
+  std::chrono::milliseconds read_timeout{5000};
+};
+
+struct WHIPResponse {
+  // HTTP status code, or 0 if the request did not complete.
+  int status = 0;
+  std::string error;
+  std::string body;
+  http::HeaderFields headers;
+  // Time from dispatch on the I/O thread until the response was parsed.
+  std::chrono::microseconds latency{0};
+
+  bool ok() const { return status / 100 == 2; }
+  // Header names are lowercased by the HTTP parser.
+  std::string header(const std::string &name) const;
+};
+
+// Runs blocking HTTP exchanges on a dedicated I/O thread so that a slow WHIP
+// server never stalls the thread that issued the request. Completion
+// callbacks are posted back to |callback_thread|.
+class WHIPClient {
+public:
+  using Callback = std::function<void(const WHIPResponse &)>;
+
+  WHIPClient(rtc::Thread *callback_thread, WHIPClientConfig config);
+  ~WHIPClient();
+
+  void Send(const std::string &method, const std::string &url,
+            const std::string &body, const http::HeaderFields &headers,
+            Callback callback);
+  // Blocks the calling thread until the exchange completes. Only meant for
+  // teardown, where there is nothing left to stall.
+  WHIPResponse SendSync(const std::string &method, const std::string &url,
+                        const std::string &body = "",
+                        const http::HeaderFields &headers = {});
+
+private:
+  WHIPResponse Perform(const std::string &method, const std::string &url,
+                       const std::string &body,
+                       const http::HeaderFields &headers) const;
+
+  rtc::Thread *callback_thread;
+  std::unique_ptr<rtc::Thread> io_thread;
+  WHIPClientConfig config;
+};
@@ -0,0 +1,39 @@
+#pragma once
+#include "api/peer_connection_interface.h"
+#include "api/scoped_refptr.h"
+#include "encoder/encoder_config.h"
+#include "rtc_base/thread.h"
+#include <memory>
+
+// Threads and PeerConnectionFactory shared by every WHIPSession in the
+// process, so publishing more cameras adds PeerConnections and encoders but
+// no further network, worker or signaling threads.
+class WHIPRuntime {
+public:
+  // Returns nullptr if the factory could not be created. Video encoders
+  // are wrapped in TracingVideoEncoder, which traces frames while
+  // GlobalLatencyTracer() is enabled.
+  static std::shared_ptr<WHIPRuntime>
+  Create(const HardwareEncoderConfig &encoder);
+  ~WHIPRuntime();
+  // Loads the hardware encoder ahead of the first session, see
+  // WarmUpJetsonEncoder(). Does nothing without one.
+  static void WarmUpEncoder();
+
+  rtc::Thread *signaling_thread() const { return signaling.get(); }
+  rtc::Thread *worker_thread() const { return worker.get(); }
+  rtc::Thread *network_thread() const { return network.get(); }
+  const rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> &
+  factory() const {
+    return pc_factory;
+  }
+
+private:
+  WHIPRuntime();
+
+  std::unique_ptr<rtc::Thread> network;
+  std::unique_ptr<rtc::Thread> worker;
+  std::unique_ptr<rtc::Thread> signaling;
+  // Declared last so it is released before the threads it runs on stop.
+  rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> pc_factory;
+};
@@ -0,0 +1,306 @@
+#include "bandwidth_history.h"
+#include "logging.h"
+#include "rtc_base/time_utils.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <set>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// A record is rewritten when the estimate moved by more than this, or when
+// it is older than BANDWIDTH_REFRESH_S, so the file sees a few writes per
+// session at most.
+#define BANDWIDTH_REWRITE_CHANGE 0.1
+#define BANDWIDTH_REFRESH_S 3600
+// Interface name of addresses no local interface has, e.g. relayed
+// candidates. Such records apply whatever interfaces are up.
+#define BANDWIDTH_ANY_INTERFACE "-"
+
+uint32_t StableBandwidthFilter::OnSample(double available_bps) {
+  if (available_bps <= 0) {
+    this->count = 0;
+    return 0;
+  }
+  this->samples[this->count % BANDWIDTH_STABLE_SAMPLES] = available_bps;
+  this->count++;
+  if (this->count < BANDWIDTH_STABLE_SAMPLES) {
+    return 0;
+  }
+  double low = *std::min_element(this->samples,
+                                 this->samples + BANDWIDTH_STABLE_SAMPLES);
+  double high = *std::max_element(this->samples,
+                                  this->samples + BANDWIDTH_STABLE_SAMPLES);
+  if (high > low * (1 + BANDWIDTH_STABLE_SPREAD)) {
+    return 0;
+  }
+  return static_cast<uint32_t>(low);
+}
+
+// Calls |visit| with the name and address of every interface that is up.
+template <typename Visitor> static void for_each_interface(Visitor visit) {
+  struct ifaddrs *addresses = nullptr;
+  if (getifaddrs(&addresses) != 0) {
+    return;
+  }
+  for (struct ifaddrs *ifa = addresses; ifa != nullptr; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == nullptr || !(ifa->ifa_flags & IFF_UP) ||
+        !(ifa->ifa_flags & IFF_RUNNING) || (ifa->ifa_flags & IFF_LOOPBACK)) {
+      continue;
+    }
+    char address[INET6_ADDRSTRLEN] = "";
+    if (ifa->ifa_addr->sa_family == AF_INET) {
+      inet_ntop(AF_INET,
+                &reinterpret_cast<struct sockaddr_in *>(ifa->ifa_addr)
+                     ->sin_addr,
+                address, sizeof(address));
+    } else if (ifa->ifa_addr->sa_family == AF_INET6) {
+      inet_ntop(AF_INET6,
+                &reinterpret_cast<struct sockaddr_in6 *>(ifa->ifa_addr)
+                     ->sin6_addr,
+                address, sizeof(address));
+    } else {
+      continue;
+    }
+    visit(std::string(ifa->ifa_name), std::string(address));
+  }
+  freeifaddrs(addresses);
+}
+
+static std::string interface_for_address(const std::string &address) {
+  std::string name = BANDWIDTH_ANY_INTERFACE;
+  for_each_interface(
+      [&](const std::string &interface_name, const std::string &local) {
+        if (local == address) {
+          name = interface_name;
+        }
+      });
+  return name;
+}
+
+// Interface the kernel routes traffic to |endpoint|'s host through, or an
+// empty string if the host cannot be resolved. Connecting a UDP socket only
+// looks up the route; nothing is sent.
+static std::string egress_interface(const std::string &endpoint) {
+  size_t scheme = endpoint.find("://");
+  size_t begin = scheme == std::string::npos ? 0 : scheme + 3;
+  size_t end = endpoint.find('/', begin);
+  std::string authority = endpoint.substr(
+      begin, end == std::string::npos ? std::string::npos : end - begin);
+  std::string host;
+  if (!authority.empty() && authority[0] == '[') {
+    host = authority.substr(1, authority.find(']') - 1);
+  } else {
+    host = authority.substr(0, authority.find(':'));
+  }
+  if (host.empty()) {
+    return std::string();
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  struct addrinfo *result = nullptr;
+  if (getaddrinfo(host.c_str(), "9", &hints, &result) != 0) {
+    return std::string();
+  }
+  std::string name;
+  for (struct addrinfo *ai = result; ai != nullptr && name.empty();
+       ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      continue;
+    }
+    struct sockaddr_storage local;
+    socklen_t length = sizeof(local);
+    char address[INET6_ADDRSTRLEN] = "";
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+        getsockname(fd, reinterpret_cast<struct sockaddr *>(&local),
+                    &length) == 0) {
+      if (local.ss_family == AF_INET) {
+        inet_ntop(AF_INET,
+                  &reinterpret_cast<struct sockaddr_in *>(&local)->sin_addr,
+                  address, sizeof(address));
+      } else if (local.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6,
+                  &reinterpret_cast<struct sockaddr_in6 *>(&local)->sin6_addr,
+                  address, sizeof(address));
+      }
+    }
+    close(fd);
+    if (address[0] != '\0') {
+      name = interface_for_address(address);
+    }
+  }
+  freeaddrinfo(result);
+  return name;
+}
+
+BandwidthHistory::BandwidthHistory(const BandwidthHistoryConfig &config)
+    : config(config) {}
+
+void BandwidthHistory::ResolveEgress(const std::string &endpoint) {
+  if (this->config.path.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->egress.count(endpoint) != 0) {
+      return;
+    }
+  }
+  std::string name = egress_interface(endpoint);
+  if (name.empty() || name == BANDWIDTH_ANY_INTERFACE) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(this->mutex);
+  // A session that got as far as recording knows better.
+  this->egress.emplace(endpoint, name);
+}
+
+uint32_t BandwidthHistory::StartBitrate(const std::string &endpoint) {
+  if (this->config.path.empty()) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(this->mutex);
+  // The session will most likely use the interface the route to the
+  // server goes through. Otherwise any interface that is up may be the one,
+  // and the lowest of their estimates is the safe start.
+  std::set<std::string> candidates;
+  auto known = this->egress.find(endpoint);
+  bool exact = known != this->egress.end();
+  if (exact) {
+    candidates.insert(known->second);
+  } else {
+    for_each_interface([&](const std::string &name, const std::string &) {
+      candidates.insert(name);
+    });
+  }
+  candidates.insert(BANDWIDTH_ANY_INTERFACE);
+
+  this->Load();
+  int64_t now_s = rtc::TimeUTCMillis() / 1000;
+  const Entry *best = nullptr;
+  for (const Entry &entry : this->entries) {
+    if (entry.endpoint != endpoint ||
+        candidates.count(entry.interface_name) == 0 ||
+        now_s - entry.time_s > this->config.max_age_s) {
+      continue;
+    }
+    // Each endpoint has one record per interface, so with a known egress
+    // interface this only prefers its own record over a relayed one.
+    if (best == nullptr ||
+        (exact ? entry.interface_name != BANDWIDTH_ANY_INTERFACE
+               : entry.bitrate_bps < best->bitrate_bps)) {
+      best = &entry;
+    }
+  }
+  if (best == nullptr) {
+    return 0;
+  }
+  uint32_t start_bps =
+      static_cast<uint32_t>(best->bitrate_bps * this->config.discount);
+  tlog("Last stable estimate to %s on %s was %u kbps, starting at %u kbps",
+       endpoint.c_str(), best->interface_name.c_str(),
+       best->bitrate_bps / 1000, start_bps / 1000);
+  return start_bps;
+}
+
+void BandwidthHistory::Record(const std::string &endpoint,
+                              const std::string &local_address,
+                              uint32_t bitrate_bps) {
+  if (this->config.path.empty() || bitrate_bps == 0) {
+    return;
+  }
+  std::string interface_name = interface_for_address(local_address);
+  int64_t now_s = rtc::TimeUTCMillis() / 1000;
+
+  std::lock_guard<std::mutex> lock(this->mutex);
+  if (interface_name != BANDWIDTH_ANY_INTERFACE) {
+    this->egress[endpoint] = interface_name;
+  }
+  this->Load();
+  Entry *entry = nullptr;
+  for (Entry &existing : this->entries) {
+    if (existing.endpoint == endpoint &&
+        existing.interface_name == interface_name) {
+      entry = &existing;
+    }
+  }
+  if (entry == nullptr) {
+    this->entries.push_back({endpoint, interface_name, 0, 0});
+    entry = &this->entries.back();
+  } else if (std::fabs(static_cast<double>(bitrate_bps) -
+                       entry->bitrate_bps) <=
+                 BANDWIDTH_REWRITE_CHANGE * entry->bitrate_bps &&
+             now_s - entry->time_s < BANDWIDTH_REFRESH_S) {
+    return;
+  }
+  entry->bitrate_bps = bitrate_bps;
+  entry->time_s = now_s;
+  tlog_debug("Stable estimate to %s on %s: %u kbps", endpoint.c_str(),
+             interface_name.c_str(), bitrate_bps / 1000);
+  this->Store();
+}
+
+void BandwidthHistory::Load() {
+  if (this->loaded) {
+    return;
+  }
+  this->loaded = true;
+  std::ifstream file(this->config.path);
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    Entry entry;
+    if (fields >> entry.endpoint >> entry.interface_name >>
+        entry.bitrate_bps >> entry.time_s) {
+      this->entries.push_back(entry);
+    }
+  }
+}
+
+bool BandwidthHistory::Store() {
+  // Records of endpoints no longer configured age out here.
+  int64_t now_s = rtc::TimeUTCMillis() / 1000;
+  this->entries.erase(
+      std::remove_if(this->entries.begin(), this->entries.end(),
+                     [&](const Entry &entry) {
+                       return now_s - entry.time_s > this->config.max_age_s;
+                     }),
+      this->entries.end());
+  std::ostringstream contents;
+  for (const Entry &entry : this->entries) {
+    contents << entry.endpoint << ' ' << entry.interface_name << ' '
+             << entry.bitrate_bps << ' ' << entry.time_s << '\n';
+  }
+  std::string data = contents.str();
+  // Renamed into place so that a crash never leaves a truncated file.
+  std::string temp_path = this->config.path + ".tmp";
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd < 0) {
+    tlog_every_ms(60000, LOG_LEVEL_WARN, "Cannot write %s: %s",
+                  temp_path.c_str(), strerror(errno));
+    return false;
+  }
+  bool ok = write(fd, data.data(), data.size()) ==
+            static_cast<ssize_t>(data.size());
+  close(fd);
+  if (!ok || rename(temp_path.c_str(), this->config.path.c_str()) != 0) {
+    tlog_every_ms(60000, LOG_LEVEL_WARN, "Failed to store %s: %s",
+                  this->config.path.c_str(), strerror(errno));
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,108 @@
+#include "certificate_cache.h"
+#include "logging.h"
+#include "rtc_base/rtc_certificate_generator.h"
+#include "rtc_base/ssl_identity.h"
+#include "rtc_base/time_utils.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+#define CERTIFICATE_PEM_HEADER "-----BEGIN CERTIFICATE-----"
+
+CertificateCache::CertificateCache(const CertificateCacheConfig &config)
+    : config(config) {}
+
+bool CertificateCache::IsFresh(const rtc::RTCCertificate &certificate) const {
+  uint64_t renew_ms = this->config.renew_days * 24 * 3600 * 1000;
+  return !certificate.HasExpired(rtc::TimeUTCMillis() + renew_ms);
+}
+
+rtc::scoped_refptr<rtc::RTCCertificate> CertificateCache::Get() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  if (this->certificate && this->IsFresh(*this->certificate)) {
+    return this->certificate;
+  }
+  if (!this->certificate && !this->config.path.empty()) {
+    rtc::scoped_refptr<rtc::RTCCertificate> loaded = this->Load();
+    if (loaded && this->IsFresh(*loaded)) {
+      tlog("Loaded DTLS certificate from %s", this->config.path.c_str());
+      this->certificate = loaded;
+      return this->certificate;
+    }
+    if (loaded) {
+      tlog("DTLS certificate in %s is due for renewal",
+           this->config.path.c_str());
+    }
+  }
+
+  int64_t start_us = rtc::TimeMicros();
+  rtc::scoped_refptr<rtc::RTCCertificate> generated =
+      rtc::RTCCertificateGenerator::GenerateCertificate(
+          rtc::KeyParams::ECDSA(),
+          static_cast<uint64_t>(this->config.lifetime_days) * 24 * 3600 *
+              1000);
+  if (!generated) {
+    tlog_error("Failed to generate a DTLS certificate");
+    return this->certificate;
+  }
+  tlog("Generated DTLS certificate in %ld ms",
+       (long)((rtc::TimeMicros() - start_us) / 1000));
+  this->certificate = generated;
+  if (!this->config.path.empty()) {
+    this->Store(*generated);
+  }
+  return this->certificate;
+}
+
+rtc::scoped_refptr<rtc::RTCCertificate> CertificateCache::Load() {
+  std::ifstream file(this->config.path);
+  if (!file) {
+    return nullptr;
+  }
+  std::stringstream contents;
+  contents << file.rdbuf();
+  std::string pem = contents.str();
+  size_t split = pem.find(CERTIFICATE_PEM_HEADER);
+  if (split == std::string::npos) {
+    tlog_warn("No certificate in %s", this->config.path.c_str());
+    return nullptr;
+  }
+  rtc::scoped_refptr<rtc::RTCCertificate> certificate =
+      rtc::RTCCertificate::FromPEM(
+          rtc::RTCCertificatePEM(pem.substr(0, split), pem.substr(split)));
+  if (!certificate) {
+    tlog_warn("Failed to parse DTLS certificate from %s",
+              this->config.path.c_str());
+  }
+  return certificate;
+}
+
+bool CertificateCache::Store(const rtc::RTCCertificate &certificate) {
+  rtc::RTCCertificatePEM pem = certificate.ToPEM();
+  std::string contents = pem.private_key() + pem.certificate();
+  // Written beside the old file and renamed over it, so a crash never
+  // leaves a half-written key behind. Only the owner may read the key.
+  std::string temp_path = this->config.path + ".tmp";
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0600);
+  if (fd < 0) {
+    tlog_warn("Cannot write %s: %s", temp_path.c_str(), strerror(errno));
+    return false;
+  }
+  bool ok = write(fd, contents.data(), contents.size()) ==
+                static_cast<ssize_t>(contents.size()) &&
+            fsync(fd) == 0;
+  close(fd);
+  if (!ok || rename(temp_path.c_str(), this->config.path.c_str()) != 0) {
+    tlog_warn("Failed to store DTLS certificate in %s: %s",
+              this->config.path.c_str(), strerror(errno));
+    unlink(temp_path.c_str());
+    return false;
+  }
+  tlog("Stored DTLS certificate in %s", this->config.path.c_str());
+  return true;
+}
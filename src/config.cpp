@@ -0,0 +1,251 @@
+#include "config.h"
+#include "v4l.h"
+#include "virtual_source.h"
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#define BASE_VIDEO_PATH "/dev/video"
+
+// Flags that need no value. They only take the next argument if it is
+// "true" or "false", so "-no-trickle http://host/whip" keeps the endpoint.
+static const char *const boolean_flags[] = {
+    "no-trickle", "trace-latency", "lock-memory", "hugepages", "dmabuf",
+};
+
+static bool is_boolean_flag(const std::string &key) {
+  for (const char *flag : boolean_flags) {
+    if (key == flag) {
+      return true;
+    }
+  }
+  return false;
+}
+
+ParsedArgs parse_args(int argc, char **argv) {
+  ParsedArgs args;
+  std::optional<std::string> key;
+  for (int i = 1; i < argc; i += 1) {
+    std::string token(argv[i]);
+    if (key.has_value() && is_boolean_flag(key.value()) &&
+        token != "true" && token != "false") {
+      args.named[key.value()] = "true";
+      key = std::nullopt;
+    }
+    if (key.has_value()) {
+      args.named[key.value()] = token[0] == '-' ? "true" : token;
+    }
+    if (token[0] == '-') {
+      key = token.substr(1);
+      continue;
+    }
+    if (!key.has_value()) {
+      args.positional.push_back(token);
+    }
+    key = std::nullopt;
+  }
+  if (key.has_value()) {
+    args.named[key.value()] = "true";
+  }
+  return args;
+}
+
+static std::string trim(const std::string &value) {
+  size_t begin = value.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  size_t end = value.find_last_not_of(" \t\r");
+  return value.substr(begin, end - begin + 1);
+}
+
+// Options that describe a single camera, shared by the flags and the
+// [camera] sections of the config file.
+static bool apply_camera_option(CameraConfig &camera, const std::string &key,
+                                const std::string &value) {
+  if (key == "d" || key == "device") {
+    camera.video_device = value;
+  } else if (key == "endpoint") {
+    camera.whip_endpoint = value;
+  } else if (key == "w") {
+    camera.capture_config.width = atoi(value.c_str());
+  } else if (key == "h") {
+    camera.capture_config.height = atoi(value.c_str());
+  } else if (key == "r") {
+    camera.capture_config.fps = atoi(value.c_str());
+  } else if (key == "buffers") {
+    camera.capture_config.num_buffers = atoi(value.c_str());
+  } else if (key == "max-bitrate") {
+    camera.capture_config.max_bitrate_kbps = atoi(value.c_str());
+  } else if (key == "c") {
+    std::string fourcc = value;
+    for (size_t i = 0; i < fourcc.length(); i++) {
+      fourcc[i] = std::toupper(fourcc[i]);
+    }
+    memcpy(camera.capture_config.fourcc, fourcc.c_str(),
+           fourcc.length() > 4 ? 4 : fourcc.length());
+  } else {
+    return false;
+  }
+  return true;
+}
+
+WadiConfig::WadiConfig() {
+  this->whip_endpoint = "http://localhost:8889/wadi/whip";
+  this->video_device = "0";
+  this->capture_config.width = 1280;
+  this->capture_config.height = 720;
+  // Let select_capture_format() pick the cheapest format the camera has.
+  memcpy(this->capture_config.fourcc, "AUTO", 4);
+  this->capture_config.fps = 30;
+  this->capture_config.num_buffers = V4L_DEFAULT_NUM_BUFFERS;
+  this->capture_config.max_bitrate_kbps = 0;
+}
+
+bool WadiConfig::Apply(const std::string &key, const std::string &value) {
+  CameraConfig defaults = {this->video_device, this->whip_endpoint,
+                           this->capture_config};
+  if (apply_camera_option(defaults, key, value)) {
+    this->video_device = defaults.video_device;
+    this->whip_endpoint = defaults.whip_endpoint;
+    this->capture_config = defaults.capture_config;
+  } else if (key == "connect-timeout") {
+    this->http_config.connect_timeout =
+        std::chrono::milliseconds(atoi(value.c_str()));
+  } else if (key == "read-timeout") {
+    this->http_config.read_timeout =
+        std::chrono::milliseconds(atoi(value.c_str()));
+  } else if (key == "stun") {
+    this->stun_server = value;
+  } else if (key == "no-trickle") {
+    this->trickle_ice = value == "false";
+  } else if (key == "trickle-delay") {
+    this->trickle_coalesce_ms = atoi(value.c_str());
+  } else if (key == "ice-restart-delay") {
+    this->ice_restart_delay_ms = atoi(value.c_str());
+  } else if (key == "ice-pool") {
+    this->ice_candidate_pool_size = atoi(value.c_str());
+  } else if (key == "cert-cache") {
+    this->certificate_cache.path = value;
+  } else if (key == "cert-lifetime") {
+    this->certificate_cache.lifetime_days = atoi(value.c_str());
+  } else if (key == "bwe-history") {
+    this->bandwidth_history.path = value;
+  } else if (key == "bwe-discount") {
+    this->bandwidth_history.discount = atof(value.c_str());
+  } else if (key == "metrics-port") {
+    this->metrics_port = atoi(value.c_str());
+  } else if (key == "stats-interval") {
+    this->stats_interval_ms = atoi(value.c_str());
+  } else if (key == "trace-latency") {
+    this->trace_latency = value != "false";
+  } else if (key == "keyframe-interval") {
+    this->encoder.key_frames.min_interval_ms = atoi(value.c_str());
+  } else if (key == "gdr-frames") {
+    this->encoder.key_frames.gdr_frames = atoi(value.c_str());
+  } else if (key == "lock-memory") {
+    this->memory.lock = value != "false";
+  } else if (key == "hugepages") {
+    this->memory.hugepages = value != "false";
+  } else if (key == "dmabuf") {
+    this->encoder.dmabuf_input = value != "false";
+  } else if (key == "log-level") {
+    if (!log_parse_level(value.c_str(), &this->log_level)) {
+      tlog_warn("Unknown log level %s", value.c_str());
+    }
+  } else if (key == "webrtc-log-level") {
+    if (!log_parse_level(value.c_str(), &this->webrtc_log_level)) {
+      tlog_warn("Unknown log level %s", value.c_str());
+    }
+  } else {
+    return this->ApplyThreadPolicy(key, value);
+  }
+  return true;
+}
+
+bool WadiConfig::ApplyThreadPolicy(const std::string &key,
+                                   const std::string &value) {
+  for (int i = 0; i < THREAD_ROLE_COUNT; i++) {
+    const char *role = thread_role_name(static_cast<ThreadRole>(i));
+    if (key != std::string(role) + "-thread") {
+      continue;
+    }
+    if (!parse_thread_policy(value, &this->thread_policies[i])) {
+      tlog_warn("Invalid %s thread policy %s", role, value.c_str());
+    }
+    return true;
+  }
+  return false;
+}
+
+bool WadiConfig::LoadFile(const std::string &path) {
+  std::ifstream file(path);
+  if (!file) {
+    tlog_error("Failed to open config file %s", path.c_str());
+    return false;
+  }
+  CameraConfig *camera = nullptr;
+  std::string line;
+  int line_number = 0;
+  while (std::getline(file, line)) {
+    line_number++;
+    line = trim(line.substr(0, line.find('#')));
+    if (line.empty()) {
+      continue;
+    }
+    if (line == "[camera]") {
+      this->cameras.push_back(
+          {this->video_device, this->whip_endpoint, this->capture_config});
+      camera = &this->cameras.back();
+      continue;
+    }
+    size_t equals = line.find('=');
+    if (equals == std::string::npos) {
+      tlog_error("%s:%d: expected key = value", path.c_str(), line_number);
+      return false;
+    }
+    std::string key = trim(line.substr(0, equals));
+    std::string value = trim(line.substr(equals + 1));
+    bool known = camera != nullptr ? apply_camera_option(*camera, key, value)
+                                   : this->Apply(key, value);
+    if (!known) {
+      tlog_warn("%s:%d: unknown option %s", path.c_str(), line_number,
+                key.c_str());
+    }
+  }
+  return true;
+}
+
+WadiConfig WadiConfig::FromArgs(int argc, char **argv) {
+  ParsedArgs args = parse_args(argc, argv);
+  WadiConfig config;
+  auto file = args.named.find("config");
+  if (file != args.named.end() && !config.LoadFile(file->second)) {
+    exit(EXIT_FAILURE);
+  }
+  if (args.positional.size() > 0) {
+    config.whip_endpoint = args.positional[0];
+  }
+  for (const auto &arg : args.named) {
+    if (arg.first != "config" && !config.Apply(arg.first, arg.second)) {
+      tlog_warn("Unknown flag -%s", arg.first.c_str());
+    }
+  }
+  return config;
+}
+
+std::vector<CameraConfig> WadiConfig::Cameras() const {
+  std::vector<CameraConfig> cameras = this->cameras;
+  if (cameras.empty()) {
+    cameras.push_back(
+        {this->video_device, this->whip_endpoint, this->capture_config});
+  }
+  for (CameraConfig &camera : cameras) {
+    if (camera.video_device.find('/') == std::string::npos &&
+        !is_virtual_device(camera.video_device)) {
+      camera.video_device = BASE_VIDEO_PATH + camera.video_device;
+    }
+  }
+  return cameras;
+}
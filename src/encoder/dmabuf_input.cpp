@@ -0,0 +1,75 @@
+#include "encoder/dmabuf_input.h"
+#include "logging.h"
+#include <algorithm>
+
+DmaBufInputQueue::DmaBufInputQueue(DmaBufPlane *plane, uint32_t num_slots,
+                                   uint32_t max_queued)
+    : plane(plane), slots(num_slots),
+      max_queued(std::max(1u, std::min(max_queued, num_slots))),
+      num_queued(0) {}
+
+bool DmaBufInputQueue::Reclaim() {
+  uint32_t index;
+  if (this->plane->Dequeue(&index) != 0) {
+    return false;
+  }
+  if (index >= this->slots.size() ||
+      this->slots[index].state != SlotState::kQueued) {
+    tlog_error("Encoder returned input slot %u, which was not queued", index);
+    return false;
+  }
+  Slot &slot = this->slots[index];
+  slot.state = SlotState::kFree;
+  slot.owner = nullptr;
+  this->num_queued--;
+  return true;
+}
+
+int DmaBufInputQueue::AcquireSlot() {
+  while (this->num_queued >= this->max_queued) {
+    if (!this->Reclaim()) {
+      return -1;
+    }
+  }
+  for (size_t i = 0; i < this->slots.size(); i++) {
+    if (this->slots[i].state == SlotState::kFree) {
+      this->slots[i].state = SlotState::kAcquired;
+      return i;
+    }
+  }
+  // Only reachable if a caller holds acquired slots without submitting.
+  tlog_error("No free encoder input slot");
+  return -1;
+}
+
+bool DmaBufInputQueue::Submit(
+    int index, const DmaBufFrame &frame,
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> owner) {
+  Slot &slot = this->slots[index];
+  if (slot.state != SlotState::kAcquired) {
+    tlog_error("Input slot %d submitted without being acquired", index);
+    return false;
+  }
+  if (this->plane->Queue(index, frame) != 0) {
+    slot.state = SlotState::kFree;
+    return false;
+  }
+  slot.state = SlotState::kQueued;
+  slot.owner = std::move(owner);
+  this->num_queued++;
+  return true;
+}
+
+void DmaBufInputQueue::Cancel(int index) {
+  if (this->slots[index].state == SlotState::kAcquired) {
+    this->slots[index].state = SlotState::kFree;
+  }
+}
+
+void DmaBufInputQueue::ReleaseAll() {
+  for (Slot &slot : this->slots) {
+    slot.state = SlotState::kFree;
+    slot.owner = nullptr;
+  }
+  this->num_queued = 0;
+}
@@ -0,0 +1,75 @@
+#include "encoder/h264_nal_scanner.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+const uint8_t *H264FindStartCode(const uint8_t *begin, const uint8_t *end) {
+  const uint8_t *p = begin;
+  while (end - p >= 3) {
+#if defined(__SSE2__)
+    // Need p[0..16] for the pair compare and p[17] for the scalar check.
+    if (end - p >= 18) {
+      const __m128i zero = _mm_setzero_si128();
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1));
+      int mask = _mm_movemask_epi8(
+          _mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)));
+      if (mask == 0) {
+        p += 16;
+        continue;
+      }
+      p += __builtin_ctz(mask);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    if (end - p >= 18) {
+      uint8x16_t a = vld1q_u8(p);
+      uint8x16_t b = vld1q_u8(p + 1);
+      uint8x16_t pairs = vandq_u8(vceqzq_u8(a), vceqzq_u8(b));
+      if (vmaxvq_u8(pairs) == 0) {
+        p += 16;
+        continue;
+      }
+    }
+#endif
+    if (p[2] > 1) {
+      p += 3;
+    } else if (p[2] == 1 && p[1] == 0 && p[0] == 0) {
+      return p;
+    } else {
+      p++;
+    }
+  }
+  return end;
+}
+
+size_t H264ScanNalUnits(const uint8_t *data, size_t size, H264NalUnit *units,
+                        size_t max_units) {
+  const uint8_t *end = data + size;
+  const uint8_t *start = H264FindStartCode(data, end);
+  size_t count = 0;
+  while (start != end) {
+    const uint8_t *payload = start + 3;
+    const uint8_t *next = H264FindStartCode(payload, end);
+    // Zero bytes before the next start code are either its leading zero_byte
+    // or trailing_zero_8bits of this NAL unit; neither belongs to the payload.
+    const uint8_t *payload_end = next;
+    while (payload_end > payload && payload_end[-1] == 0) {
+      payload_end--;
+    }
+    if (payload_end > payload) {
+      if (count < max_units) {
+        H264NalUnit &unit = units[count];
+        const bool long_start_code = start > data && start[-1] == 0;
+        unit.start_offset = (long_start_code ? start - 1 : start) - data;
+        unit.payload_offset = payload - data;
+        unit.payload_size = payload_end - payload;
+        unit.type = payload[0] & 0x1F;
+      }
+      count++;
+    }
+    start = next;
+  }
+  return count;
+}
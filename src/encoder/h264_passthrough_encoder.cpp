@@ -0,0 +1,383 @@
+#include "encoder/h264_passthrough_encoder.h"
+#include "api/video/video_frame_type.h"
+#include "hot_path.h"
+#include "logging.h"
+#include "media/base/media_constants.h"
+#include "modules/video_coding/include/video_error_codes.h"
+#include "rtc_base/time_utils.h"
+#include "v4l_frame_buffer.h"
+#include <algorithm>
+#include <cstring>
+
+// Restreaming costs a few frames, so repeated PLIs are coalesced.
+#define PASSTHROUGH_KEY_FRAME_INTERVAL_MS 1000
+
+static const uint8_t start_code[] = {0, 0, 0, 1};
+
+H264PassthroughEncoder::H264PassthroughEncoder(
+    std::unique_ptr<webrtc::VideoEncoder> fallback,
+    webrtc::H264PacketizationMode packetization_mode)
+    : fallback(std::move(fallback)), fallback_initialized(false),
+      number_of_cores(1), max_payload_size(0), framerate(0), callback(nullptr),
+      waiting_for_key_frame(true), last_key_frame_request_us(0) {
+  frag_header.VerifyAndAllocateFragmentationHeader(H264_MAX_NAL_UNITS);
+  memset(&codec_specific.codecSpecific, 0,
+         sizeof(codec_specific.codecSpecific));
+  codec_specific.codecType = webrtc::kVideoCodecH264;
+  codec_specific.codecSpecific.H264.packetization_mode =
+      packetization_mode;
+}
+
+H264PassthroughEncoder::~H264PassthroughEncoder() { this->Release(); }
+
+int32_t
+H264PassthroughEncoder::InitEncode(const webrtc::VideoCodec *codec_settings,
+                                   int32_t number_of_cores,
+                                   size_t max_payload_size) {
+  this->codec_settings = *codec_settings;
+  this->number_of_cores = number_of_cores;
+  this->max_payload_size = max_payload_size;
+  this->waiting_for_key_frame = true;
+  this->last_key_frame_request_us = rtc::TimeMicros();
+  if (this->fallback_initialized) {
+    return this->fallback->InitEncode(codec_settings, number_of_cores,
+                                      max_payload_size);
+  }
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+int32_t H264PassthroughEncoder::InitFallback() {
+  if (this->fallback_initialized) {
+    return WEBRTC_VIDEO_CODEC_OK;
+  }
+  if (!this->fallback) {
+    tlog_every_ms(5000, LOG_LEVEL_ERROR,
+                  "No H264 encoder available for raw frames");
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  int32_t ret = this->fallback->InitEncode(
+      &this->codec_settings, this->number_of_cores, this->max_payload_size);
+  if (ret != WEBRTC_VIDEO_CODEC_OK) {
+    return ret;
+  }
+  this->fallback->RegisterEncodeCompleteCallback(this);
+  if (this->framerate != 0) {
+    this->fallback->SetRateAllocation(this->allocation, this->framerate);
+  }
+  this->fallback_initialized = true;
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+int32_t H264PassthroughEncoder::RegisterEncodeCompleteCallback(
+    webrtc::EncodedImageCallback *callback) {
+  // The fallback stops calling OnEncodedImage() before the callback goes
+  // away, and only starts once it is set.
+  int32_t ret = WEBRTC_VIDEO_CODEC_OK;
+  if (callback == nullptr && this->fallback_initialized) {
+    ret = this->fallback->RegisterEncodeCompleteCallback(nullptr);
+  }
+  this->callback = callback;
+  if (callback != nullptr && this->fallback_initialized) {
+    ret = this->fallback->RegisterEncodeCompleteCallback(this);
+  }
+  return ret;
+}
+
+int32_t H264PassthroughEncoder::Release() {
+  if (!this->fallback_initialized) {
+    return WEBRTC_VIDEO_CODEC_OK;
+  }
+  this->fallback_initialized = false;
+  return this->fallback->Release();
+}
+
+int32_t H264PassthroughEncoder::Encode(
+    const webrtc::VideoFrame &frame,
+    const std::vector<webrtc::VideoFrameType> *frame_types) {
+  // V4LFrameBuffer is the only native buffer type in wadi.
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer =
+      frame.video_frame_buffer();
+  if (buffer->type() == webrtc::VideoFrameBuffer::Type::kNative &&
+      static_cast<V4LFrameBuffer *>(buffer.get())->is_compressed()) {
+    bool key_frame =
+        frame_types != nullptr &&
+        std::find(frame_types->begin(), frame_types->end(),
+                  webrtc::VideoFrameType::kVideoFrameKey) != frame_types->end();
+    return this->EncodePassthrough(
+        frame, *static_cast<V4LFrameBuffer *>(buffer.get()), key_frame);
+  }
+  int32_t ret = this->InitFallback();
+  if (ret != WEBRTC_VIDEO_CODEC_OK) {
+    return ret;
+  }
+  return this->fallback->Encode(frame, frame_types);
+}
+
+void H264PassthroughEncoder::RequestKeyFrame(const V4LFrameBuffer &buffer,
+                                             bool force) {
+  int64_t now = rtc::TimeMicros();
+  if (!force && now - this->last_key_frame_request_us <
+                    PASSTHROUGH_KEY_FRAME_INTERVAL_MS *
+                        rtc::kNumMicrosecsPerMillisec) {
+    return;
+  }
+  this->last_key_frame_request_us = now;
+  if (!buffer.device()->request_key_frame()) {
+    tlog_every_ms(5000, LOG_LEVEL_WARN, "Camera key frame request failed");
+  }
+}
+
+int32_t H264PassthroughEncoder::EncodePassthrough(
+    const webrtc::VideoFrame &frame, const V4LFrameBuffer &buffer,
+    bool key_frame) {
+  HotPathScope hot_path;
+  webrtc::EncodedImageCallback *callback = this->callback;
+  if (callback == nullptr) {
+    return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
+  }
+  const uint8_t *data = buffer.data();
+  size_t size = buffer.size();
+  size_t nal_count =
+      H264ScanNalUnits(data, size, this->nal_units, H264_MAX_NAL_UNITS);
+  if (nal_count == 0 || nal_count > H264_MAX_NAL_UNITS) {
+    tlog_every_ms(5000, LOG_LEVEL_WARN,
+                  "Dropping camera frame with %zu NAL units", nal_count);
+    return WEBRTC_VIDEO_CODEC_OK;
+  }
+  // Without FU-A the packetizer has to fit every NAL unit in one packet,
+  // and camera slices rarely do. Say so rather than have it drop them.
+  if (this->codec_specific.codecSpecific.H264.packetization_mode ==
+      webrtc::H264PacketizationMode::SingleNalUnit) {
+    for (size_t i = 0; i < nal_count; i++) {
+      if (this->nal_units[i].payload_size > this->max_payload_size) {
+        tlog_every_ms(5000, LOG_LEVEL_ERROR,
+                      "Camera NAL unit of %zu bytes does not fit "
+                      "packetization-mode=0, dropping frame",
+                      this->nal_units[i].payload_size);
+        callback->OnDroppedFrame(
+            webrtc::EncodedImageCallback::DropReason::kDroppedByEncoder);
+        return WEBRTC_VIDEO_CODEC_OK;
+      }
+    }
+  }
+
+  bool idr = false;
+  bool has_sps = false;
+  bool has_pps = false;
+  for (size_t i = 0; i < nal_count; i++) {
+    const H264NalUnit &nal = this->nal_units[i];
+    const uint8_t *payload = data + nal.payload_offset;
+    if (nal.type == kH264NalIdr) {
+      idr = true;
+    } else if (nal.type == kH264NalSps) {
+      has_sps = true;
+      this->sps.assign(payload, payload + nal.payload_size);
+    } else if (nal.type == kH264NalPps) {
+      has_pps = true;
+      this->pps.assign(payload, payload + nal.payload_size);
+    }
+  }
+
+  if (!idr) {
+    if (key_frame || this->waiting_for_key_frame) {
+      // A forced key frame bypasses the interval; the initial wait does
+      // not, since cameras usually start with an IDR anyway.
+      this->RequestKeyFrame(buffer, key_frame && !this->waiting_for_key_frame);
+    }
+    if (this->waiting_for_key_frame) {
+      callback->OnDroppedFrame(
+          webrtc::EncodedImageCallback::DropReason::kDroppedByEncoder);
+      return WEBRTC_VIDEO_CODEC_OK;
+    }
+  }
+  this->waiting_for_key_frame = false;
+
+  if (idr && (!has_sps || !has_pps) && !this->sps.empty() &&
+      !this->pps.empty()) {
+    // Receivers can only start decoding at an IDR that carries the parameter
+    // sets, so splice in the last ones the camera sent.
+    this->key_frame_buffer.clear();
+    this->key_frame_buffer.insert(this->key_frame_buffer.end(), start_code,
+                                  start_code + sizeof(start_code));
+    this->key_frame_buffer.insert(this->key_frame_buffer.end(),
+                                  this->sps.begin(), this->sps.end());
+    this->key_frame_buffer.insert(this->key_frame_buffer.end(), start_code,
+                                  start_code + sizeof(start_code));
+    this->key_frame_buffer.insert(this->key_frame_buffer.end(),
+                                  this->pps.begin(), this->pps.end());
+    this->key_frame_buffer.insert(this->key_frame_buffer.end(), data,
+                                  data + size);
+    data = this->key_frame_buffer.data();
+    size = this->key_frame_buffer.size();
+    nal_count =
+        H264ScanNalUnits(data, size, this->nal_units, H264_MAX_NAL_UNITS);
+    if (nal_count > H264_MAX_NAL_UNITS) {
+      // Without this IDR the frames after it cannot be decoded; wait for
+      // the next one.
+      tlog_every_ms(5000, LOG_LEVEL_WARN,
+                    "Dropping key frame with %zu NAL units", nal_count);
+      this->waiting_for_key_frame = true;
+      this->RequestKeyFrame(buffer, true);
+      callback->OnDroppedFrame(
+          webrtc::EncodedImageCallback::DropReason::kDroppedByEncoder);
+      return WEBRTC_VIDEO_CODEC_OK;
+    }
+  }
+
+  for (size_t i = 0; i < nal_count; i++) {
+    const H264NalUnit &nal = this->nal_units[i];
+    this->frag_header.fragmentationOffset[i] = nal.payload_offset;
+    this->frag_header.fragmentationLength[i] = nal.payload_size;
+  }
+  this->frag_header.fragmentationVectorSize = nal_count;
+
+  // The image aliases the capture buffer, which the frame keeps alive until
+  // Encode() returns; the send stream copies it while packetizing.
+  this->image.set_buffer(const_cast<uint8_t *>(data), size);
+  this->image.set_size(size);
+  this->image._encodedWidth = buffer.width();
+  this->image._encodedHeight = buffer.height();
+  this->image._completeFrame = true;
+  this->image.SetTimestamp(frame.timestamp());
+  this->image.ntp_time_ms_ = frame.ntp_time_ms();
+  this->image.capture_time_ms_ = frame.render_time_ms();
+  this->image.rotation_ = frame.rotation();
+  this->image.SetColorSpace(frame.color_space());
+  this->image.qp_ = -1;
+  this->image._frameType = idr ? webrtc::VideoFrameType::kVideoFrameKey
+                               : webrtc::VideoFrameType::kVideoFrameDelta;
+  this->codec_specific.codecSpecific.H264.idr_frame = idr;
+
+  HotPathPause transport;
+  webrtc::EncodedImageCallback::Result result = callback->OnEncodedImage(
+      this->image, &this->codec_specific, &this->frag_header);
+  if (result.error != webrtc::EncodedImageCallback::Result::OK) {
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+webrtc::EncodedImageCallback::Result H264PassthroughEncoder::OnEncodedImage(
+    const webrtc::EncodedImage &image,
+    const webrtc::CodecSpecificInfo *codec_specific_info,
+    const webrtc::RTPFragmentationHeader *fragmentation) {
+  webrtc::EncodedImageCallback *callback = this->callback;
+  if (callback == nullptr) {
+    return Result(Result::ERROR_SEND_FAILED);
+  }
+  return callback->OnEncodedImage(image, codec_specific_info, fragmentation);
+}
+
+void H264PassthroughEncoder::OnDroppedFrame(DropReason reason) {
+  webrtc::EncodedImageCallback *callback = this->callback;
+  if (callback != nullptr) {
+    callback->OnDroppedFrame(reason);
+  }
+}
+
+int32_t H264PassthroughEncoder::SetRateAllocation(
+    const webrtc::VideoBitrateAllocation &allocation, uint32_t framerate) {
+  // The camera's own rate control applies to passthrough frames.
+  this->allocation = allocation;
+  this->framerate = framerate;
+  if (this->fallback_initialized) {
+    return this->fallback->SetRateAllocation(allocation, framerate);
+  }
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+void H264PassthroughEncoder::OnPacketLossRateUpdate(float packet_loss_rate) {
+  if (this->fallback_initialized) {
+    this->fallback->OnPacketLossRateUpdate(packet_loss_rate);
+  }
+}
+
+void H264PassthroughEncoder::OnRttUpdate(int64_t rtt_ms) {
+  if (this->fallback_initialized) {
+    this->fallback->OnRttUpdate(rtt_ms);
+  }
+}
+
+webrtc::VideoEncoder::EncoderInfo
+H264PassthroughEncoder::GetEncoderInfo() const {
+  if (this->fallback_initialized) {
+    EncoderInfo info(this->fallback->GetEncoderInfo());
+    // Native frames must reach Encode() unconverted to be passed through.
+    info.supports_native_handle = true;
+    return info;
+  }
+  // Scaling stays off: there is no QP to scale on and the camera sets the
+  // resolution.
+  EncoderInfo info;
+  info.implementation_name = "H264Passthrough";
+  info.is_hardware_accelerated = true;
+  info.has_internal_source = false;
+  info.supports_native_handle = true;
+  return info;
+}
+
+H264PassthroughEncoderFactory::H264PassthroughEncoderFactory(
+    std::unique_ptr<webrtc::VideoEncoderFactory> factory)
+    : factory(std::move(factory)) {}
+
+bool H264PassthroughEncoderFactory::BaseSupports(
+    const webrtc::SdpVideoFormat &format) const {
+  for (const webrtc::SdpVideoFormat &supported :
+       this->factory->GetSupportedFormats()) {
+    if (supported == format) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<webrtc::SdpVideoFormat>
+H264PassthroughEncoderFactory::GetSupportedFormats() const {
+  std::vector<webrtc::SdpVideoFormat> formats =
+      this->factory->GetSupportedFormats();
+  for (const webrtc::SdpVideoFormat &format : formats) {
+    if (format.name == cricket::kH264CodecName) {
+      return formats;
+    }
+  }
+  // Constrained baseline 3.1, the profile every WebRTC receiver accepts.
+  // Only packetization-mode=1: camera IDR slices are larger than a packet
+  // and need FU-A fragmentation.
+  formats.push_back(webrtc::SdpVideoFormat(
+      cricket::kH264CodecName,
+      {{cricket::kH264FmtpProfileLevelId, "42e01f"},
+       {cricket::kH264FmtpLevelAsymmetryAllowed, "1"},
+       {cricket::kH264FmtpPacketizationMode, "1"}}));
+  return formats;
+}
+
+webrtc::VideoEncoderFactory::CodecInfo
+H264PassthroughEncoderFactory::QueryVideoEncoder(
+    const webrtc::SdpVideoFormat &format) const {
+  if (format.name == cricket::kH264CodecName && !this->BaseSupports(format)) {
+    CodecInfo info;
+    info.is_hardware_accelerated = true;
+    info.has_internal_source = false;
+    return info;
+  }
+  return this->factory->QueryVideoEncoder(format);
+}
+
+std::unique_ptr<webrtc::VideoEncoder>
+H264PassthroughEncoderFactory::CreateVideoEncoder(
+    const webrtc::SdpVideoFormat &format) {
+  if (format.name != cricket::kH264CodecName) {
+    return this->factory->CreateVideoEncoder(format);
+  }
+  std::unique_ptr<webrtc::VideoEncoder> fallback;
+  if (this->BaseSupports(format)) {
+    fallback = this->factory->CreateVideoEncoder(format);
+  }
+  auto mode = format.parameters.find(cricket::kH264FmtpPacketizationMode);
+  webrtc::H264PacketizationMode packetization_mode =
+      mode != format.parameters.end() && mode->second == "1"
+          ? webrtc::H264PacketizationMode::NonInterleaved
+          : webrtc::H264PacketizationMode::SingleNalUnit;
+  return std::unique_ptr<webrtc::VideoEncoder>(
+      new H264PassthroughEncoder(std::move(fallback), packetization_mode));
+}
@@ -6,22 +6,120 @@
 #include "api/video/video_frame_buffer.h"
 #include "common_types.h"
 #include "common_video/libyuv/include/webrtc_libyuv.h"
+#include "libyuv/convert_from.h"
+#include "libyuv/planar_functions.h"
 #include "modules/video_coding/codecs/h264/include/h264.h"
+#include "hot_path.h"
 #include "logging.h"
+#include "metrics.h"
 #include "modules/include/module_common_types.h"
+#include "modules/video_coding/include/video_error_codes.h"
+#include "rtc_base/time_utils.h"
+#include "thread_policy.h"
+#include "v4l_frame_buffer.h"
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
-#include <iomanip>
-#include <ios>
 #include <linux/v4l2-controls.h>
 #include <linux/videodev2.h>
 #include <memory>
-#include <ostream>
-#include <sstream>
 #ifndef MAX_PLANES
 #define MAX_PLANES 4
 #endif
 
+// Opened by WarmUpJetsonEncoder() and closed once the first real encoder
+// exists, so the driver is not unloaded in between.
+static std::mutex warm_encoder_mutex;
+static NvVideoEncoder *warm_encoder = nullptr;
+
+void WarmUpJetsonEncoder() {
+  NvVideoEncoder *encoder = NvVideoEncoder::createVideoEncoder("warmup");
+  if (encoder == nullptr) {
+    tlog_warn("Failed to open the encoder ahead of time");
+    return;
+  }
+  std::lock_guard<std::mutex> lock(warm_encoder_mutex);
+  std::swap(encoder, warm_encoder);
+  delete encoder;
+}
+
+static void release_warm_encoder() {
+  NvVideoEncoder *encoder;
+  {
+    std::lock_guard<std::mutex> lock(warm_encoder_mutex);
+    encoder = warm_encoder;
+    warm_encoder = nullptr;
+  }
+  delete encoder;
+}
+
+// Applies rate changes to the running NvVideoEncoder.
+class NvEncoderRateTarget : public RateControlTarget {
+public:
+  explicit NvEncoderRateTarget(NvVideoEncoder *enc) : enc(enc) {}
+  int SetBitrate(uint32_t bitrate_bps) override {
+    return enc->setBitrate(bitrate_bps);
+  }
+  int SetFrameRate(uint32_t fps) override { return enc->setFrameRate(fps, 1); }
+
+private:
+  NvVideoEncoder *enc;
+};
+
+// The output plane in V4L2_MEMORY_DMABUF mode, fed by DmaBufInputQueue.
+class NvDmaBufPlane : public DmaBufPlane {
+public:
+  explicit NvDmaBufPlane(NvVideoEncoder *enc) : enc(enc) {}
+
+  int Queue(uint32_t slot, const DmaBufFrame &frame) override {
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[MAX_PLANES];
+    memset(&buf, 0, sizeof(buf));
+    memset(planes, 0, sizeof(planes));
+    buf.index = slot;
+    buf.m.planes = planes;
+    for (uint32_t i = 0; i < frame.num_planes; i++) {
+      planes[i].m.fd = frame.fd[i];
+      planes[i].data_offset = frame.offset[i];
+      planes[i].bytesused = frame.bytesused[i];
+    }
+    buf.flags |= V4L2_BUF_FLAG_TIMESTAMP_COPY;
+    buf.timestamp.tv_sec = frame.timestamp_us / rtc::kNumMicrosecsPerSec;
+    buf.timestamp.tv_usec = frame.timestamp_us % rtc::kNumMicrosecsPerSec;
+    if (frame.input_metadata) {
+      buf.reserved2 = slot;
+    }
+    return enc->output_plane.qBuffer(buf, NULL) < 0 ? -1 : 0;
+  }
+
+  int Dequeue(uint32_t *slot) override {
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[MAX_PLANES];
+    NvBuffer *buffer;
+    memset(&buf, 0, sizeof(buf));
+    memset(planes, 0, sizeof(planes));
+    buf.m.planes = planes;
+    if (enc->output_plane.dqBuffer(buf, &buffer, NULL, 10) < 0) {
+      return -1;
+    }
+    *slot = buf.index;
+    return 0;
+  }
+
+private:
+  NvVideoEncoder *enc;
+};
+
+JetsonEncoder::JetsonEncoder(const HardwareEncoderConfig &config)
+    : key_frame_config(config.key_frames),
+      key_frame_limiter(config.key_frames.min_interval_ms),
+      dmabuf_input(config.dmabuf_input) {
+  memset(&ctx, 0, sizeof(ctx));
+  memset(&gdr_params, 0, sizeof(gdr_params));
+}
+
+JetsonEncoder::~JetsonEncoder() { this->Release(); }
+
 void JetsonEncoder::SetDefaults() {
   memset(&ctx, 0, sizeof(context_t));
 
@@ -110,16 +208,32 @@ void JetsonEncoder::SetDefaults() {
 int32_t JetsonEncoder::InitEncode(const webrtc::VideoCodec *codec_settings,
                                   int32_t number_of_cores,
                                   size_t max_payload_size) {
+  // WebRTC reinitializes on every resolution change; the previous encoder
+  // has to be gone before |ctx| is reset.
+  this->Release();
   this->SetDefaults();
   ctx.encoder_pixfmt = V4L2_PIX_FMT_H264;
   ctx.encode_width = ctx.width = codec_settings->width;
   ctx.encode_height = ctx.height = codec_settings->height;
   ctx.enc = NvVideoEncoder::createVideoEncoder("enc0");
   assert(ctx.enc != nullptr);
+  release_warm_encoder();
   ctx.level = V4L2_MPEG_VIDEO_H264_LEVEL_5_1;
-  ctx.output_memory_type = V4L2_MEMORY_MMAP;
+  ctx.output_memory_type = dmabuf_input ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
   ctx.capture_memory_type = V4L2_MEMORY_MMAP;
-  ctx.raw_pixfmt = V4L2_PIX_FMT_YUV420M;
+  // NV12 is the encoder's native input; NV12 and YUYV cameras and I420
+  // frames all get there in a single pass, see CopyToOutputBuffer().
+  ctx.raw_pixfmt = V4L2_PIX_FMT_NV12M;
+  ctx.is_semiplanar = true;
+  ctx.copy_timestamp = true;
+  ctx.insert_sps_pps_at_idr = true;
+  // Start where WebRTC's bandwidth estimate starts; SetRates() follows it.
+  if (codec_settings->startBitrate > 0) {
+    ctx.bitrate = codec_settings->startBitrate * 1000;
+  }
+  if (codec_settings->maxFramerate > 0) {
+    ctx.fps_n = codec_settings->maxFramerate;
+  }
 
   int ret = ctx.enc->setCapturePlaneFormat(ctx.encoder_pixfmt, ctx.width,
                                            ctx.height, 2 * 1024 * 1024);
@@ -138,6 +252,10 @@ int32_t JetsonEncoder::InitEncode(const webrtc::VideoCodec *codec_settings,
   ret = ctx.enc->setLevel(ctx.level);
   assert(ret == 0);
 
+  // Every IDR has to be decodable on its own by a receiver that joins late.
+  ret = ctx.enc->setInsertSpsPpsAtIdrEnabled(ctx.insert_sps_pps_at_idr);
+  assert(ret == 0);
+
 //  ret = ctx.enc->setRateControl(ctx.rate_control);
 //  assert(ret == 0);
 
@@ -157,15 +275,27 @@ int32_t JetsonEncoder::InitEncode(const webrtc::VideoCodec *codec_settings,
   ret = ctx.enc->setMaxPerfMode(1);
   assert(ret == 0);
 
-  ret = ctx.enc->output_plane.setupPlane(V4L2_MEMORY_MMAP, 10, true, false);
+  if (dmabuf_input) {
+    ret = this->InitDmaBufInput();
+  } else {
+    ret = ctx.enc->output_plane.setupPlane(
+        V4L2_MEMORY_MMAP, JETSON_NUM_OUTPUT_BUFFERS, true, false);
+  }
   assert(ret == 0);
 
   ret = ctx.enc->capture_plane.setupPlane(V4L2_MEMORY_MMAP,
                                           ctx.num_output_buffers, true, false);
   assert(ret == 0);
 
-  // NOTE: Probably not the best way to do this.
+  // One image per capture plane buffer; each one aliases the buffer's
+  // bitstream while it is being delivered.
   ctx.encoded_images = new webrtc::EncodedImage[ctx.num_output_buffers];
+  frag_header.VerifyAndAllocateFragmentationHeader(H264_MAX_NAL_UNITS);
+  memset(&codec_specific.codecSpecific, 0, sizeof(codec_specific.codecSpecific));
+  codec_specific.codecType = webrtc::kVideoCodecH264;
+  codec_specific.codecSpecific.H264.packetization_mode =
+      webrtc::H264PacketizationMode::NonInterleaved;
+  pending_head = pending_count = 0;
 
   ret = ctx.enc->subscribeEvent(V4L2_EVENT_EOS, 0, 0);
   assert(ret == 0);
@@ -176,9 +306,18 @@ int32_t JetsonEncoder::InitEncode(const webrtc::VideoCodec *codec_settings,
   ret = ctx.enc->capture_plane.setStreamStatus(true);
   assert(ret == 0);
 
+  RateControllerConfig rate_config;
+  if (codec_settings->minBitrate > 0) {
+    rate_config.min_bitrate_bps = codec_settings->minBitrate * 1000;
+  }
+  rate_config.max_bitrate_bps = codec_settings->maxBitrate * 1000;
+  rate_target.reset(new NvEncoderRateTarget(ctx.enc));
+  rate_controller.reset(new RateController(rate_target.get(), rate_config,
+                                           ctx.bitrate, ctx.fps_n));
+
   ctx.enc->capture_plane.setDQThreadCallback(
       &JetsonEncoder::EncoderCapturePlaneCallback);
-  ctx.enc->capture_plane.startDQThread(&ctx);
+  ctx.enc->capture_plane.startDQThread(this);
 
   /* Enqueue all the empty capture plane buffers. */
   for (uint32_t i = 0; i < ctx.enc->capture_plane.getNumBuffers(); i++) {
@@ -204,13 +343,18 @@ bool JetsonEncoder::EncoderCapturePlaneCallback(struct v4l2_buffer *buf,
                                                 NvBuffer *buffer,
                                                 NvBuffer *shared_buffer,
                                                 void *arg) {
-  context_t *ctx = (context_t *)arg;
+  JetsonEncoder *encoder = (JetsonEncoder *)arg;
+  context_t *ctx = &encoder->ctx;
   NvVideoEncoder *enc = ctx->enc;
-  pthread_setname_np(pthread_self(), "EncCapPlane");
-  uint32_t frame_num = ctx->enc->capture_plane.getTotalDequeuedBuffers() - 1;
-  static uint32_t num_encoded_frames = 1;
-  struct v4l2_event ev;
-  int ret = 0;
+  // Release() turned streaming off to wake this thread up.
+  if (encoder->stopping.load(std::memory_order_acquire)) {
+    return false;
+  }
+  if (!encoder->dq_thread_configured) {
+    pthread_setname_np(pthread_self(), "EncCapPlane");
+    apply_thread_policy(ThreadRole::kEncoder);
+    encoder->dq_thread_configured = true;
+  }
 
   if (buf == NULL) {
     tlog("Error while dequeing buffer from output plane");
@@ -225,28 +369,7 @@ bool JetsonEncoder::EncoderCapturePlaneCallback(struct v4l2_buffer *buf,
     return false;
   }
 
-  size_t required_capacity = webrtc::CalcBufferSize(
-      webrtc::VideoType::kI420, ctx->encode_width, ctx->encode_height);
-  size_t fragments_count = 0;
-  uint32_t buffer_index = buf->index;
-  webrtc::EncodedImage *image = &ctx->encoded_images[buffer_index];
-  if (image->capacity() < required_capacity) {
-    image->Allocate(required_capacity);
-  }
-  webrtc::RTPFragmentationHeader frag_header;
-  const uint8_t start_code[4] = {0x00, 0x00, 0x00, 0x01};
-  std::stringstream ss;
-  ss << std::endl << "frame_" << num_encoded_frames << ".h264" << std::endl;
-  for (size_t i = 0; i < buffer->planes[0].bytesused; i++) {
-    ss << std::hex << std::setw(2) << std::setfill('0')
-       << (int)buffer->planes[0].data[i];
-  }
-  ss << std::endl << std::endl;
-  tlog(ss.str().c_str());
-
-  // TODO: Fill rtp fragmentation header
-
-  num_encoded_frames++;
+  encoder->DeliverEncodedFrame(buf, buffer);
 
   /* encoder qbuffer for capture plane */
   if (enc->capture_plane.qBuffer(*buf, NULL) < 0) {
@@ -258,18 +381,231 @@ bool JetsonEncoder::EncoderCapturePlaneCallback(struct v4l2_buffer *buf,
   return true;
 }
 
+void JetsonEncoder::DeliverEncodedFrame(const struct v4l2_buffer *buf,
+                                        NvBuffer *buffer) {
+  HotPathScope hot_path;
+  int64_t timestamp_us =
+      buf->timestamp.tv_sec * rtc::kNumMicrosecsPerSec + buf->timestamp.tv_usec;
+  PendingFrame frame;
+  if (!this->PopPendingFrame(timestamp_us, &frame)) {
+    tlog("Encoded frame without a matching input frame");
+    return;
+  }
+  int64_t now_us = rtc::TimeMicros();
+  PipelineCounters &counters = GlobalMetrics().counters;
+  counters.frames_encoded.fetch_add(1, std::memory_order_relaxed);
+  counters.encode_time_us.fetch_add(now_us - frame.encode_start_us,
+                                    std::memory_order_relaxed);
+  this->rate_controller->OnFrameEncoded(frame.encode_start_us, now_us);
+
+  const uint8_t *data = buffer->planes[0].data;
+  size_t size = buffer->planes[0].bytesused;
+  size_t nal_count =
+      H264ScanNalUnits(data, size, this->nal_units, H264_MAX_NAL_UNITS);
+  if (nal_count == 0 || nal_count > H264_MAX_NAL_UNITS) {
+    tlog_warn("Dropping encoded frame with %zu NAL units", nal_count);
+    return;
+  }
+
+  bool idr = false;
+  for (size_t i = 0; i < nal_count; i++) {
+    this->frag_header.fragmentationOffset[i] = this->nal_units[i].payload_offset;
+    this->frag_header.fragmentationLength[i] = this->nal_units[i].payload_size;
+    idr |= this->nal_units[i].type == kH264NalIdr;
+  }
+  // The arrays were sized for H264_MAX_NAL_UNITS in InitEncode. Resize()
+  // would reallocate them whenever the NAL count changes, so only shrink the
+  // visible size here.
+  this->frag_header.fragmentationVectorSize = nal_count;
+
+  webrtc::EncodedImage &image = ctx.encoded_images[buf->index];
+  image.set_buffer(buffer->planes[0].data, buffer->planes[0].length);
+  image.set_size(size);
+  image._encodedWidth = ctx.encode_width;
+  image._encodedHeight = ctx.encode_height;
+  image._completeFrame = true;
+  image.SetTimestamp(frame.rtp_timestamp);
+  image.ntp_time_ms_ = frame.ntp_time_ms;
+  image.capture_time_ms_ = frame.render_time_ms;
+  image.rotation_ = frame.rotation;
+  image.SetColorSpace(frame.color_space);
+  image.qp_ = -1;
+
+  v4l2_ctrl_videoenc_outputbuf_metadata enc_metadata;
+  if (ctx.enc->getMetadata(buf->index, enc_metadata) == 0) {
+    image.qp_ = enc_metadata.AvgQP;
+    idr |= enc_metadata.KeyFrame;
+  }
+  image._frameType = idr ? webrtc::VideoFrameType::kVideoFrameKey
+                         : webrtc::VideoFrameType::kVideoFrameDelta;
+  this->codec_specific.codecSpecific.H264.idr_frame = idr;
+
+  // Delivered outside the lock, so that Encode() can record frames while
+  // the transport packetizes this one.
+  webrtc::EncodedImageCallback *callback;
+  {
+    std::lock_guard<std::mutex> lock(this->frames_mutex);
+    callback = this->callback;
+  }
+  if (callback == nullptr) {
+    return;
+  }
+  HotPathPause transport;
+  webrtc::EncodedImageCallback::Result result = callback->OnEncodedImage(
+      image, &this->codec_specific, &this->frag_header);
+  if (result.error != webrtc::EncodedImageCallback::Result::OK) {
+    tlog_error("Failed to deliver encoded frame");
+  }
+}
+
+bool JetsonEncoder::PushPendingFrame(const webrtc::VideoFrame &frame) {
+  std::lock_guard<std::mutex> lock(this->frames_mutex);
+  if (this->pending_count == JETSON_MAX_PENDING_FRAMES) {
+    return false;
+  }
+  PendingFrame &pending =
+      this->pending_frames[(this->pending_head + this->pending_count) %
+                           JETSON_MAX_PENDING_FRAMES];
+  pending.timestamp_us = frame.timestamp_us();
+  pending.rtp_timestamp = frame.timestamp();
+  pending.ntp_time_ms = frame.ntp_time_ms();
+  pending.render_time_ms = frame.render_time_ms();
+  pending.rotation = frame.rotation();
+  pending.color_space = frame.color_space();
+  pending.encode_start_us = rtc::TimeMicros();
+  this->pending_count++;
+  GlobalMetrics().counters.encoder_queue_depth.store(
+      this->pending_count, std::memory_order_relaxed);
+  return true;
+}
+
+bool JetsonEncoder::PopPendingFrame(int64_t timestamp_us, PendingFrame *frame) {
+  std::lock_guard<std::mutex> lock(this->frames_mutex);
+  // The encoder emits frames in input order but may skip some, so discard
+  // entries older than the one that came out.
+  while (this->pending_count > 0) {
+    PendingFrame &pending = this->pending_frames[this->pending_head];
+    this->pending_head = (this->pending_head + 1) % JETSON_MAX_PENDING_FRAMES;
+    this->pending_count--;
+    GlobalMetrics().counters.encoder_queue_depth.store(
+        this->pending_count, std::memory_order_relaxed);
+    if (pending.timestamp_us == timestamp_us) {
+      *frame = pending;
+      return true;
+    }
+  }
+  return false;
+}
+
+void JetsonEncoder::DropPendingFrame(int64_t timestamp_us) {
+  std::lock_guard<std::mutex> lock(this->frames_mutex);
+  if (this->pending_count == 0) {
+    return;
+  }
+  size_t newest = (this->pending_head + this->pending_count - 1) %
+                  JETSON_MAX_PENDING_FRAMES;
+  if (this->pending_frames[newest].timestamp_us != timestamp_us) {
+    return;
+  }
+  this->pending_count--;
+  GlobalMetrics().counters.encoder_queue_depth.store(
+      this->pending_count, std::memory_order_relaxed);
+}
 
 int32_t JetsonEncoder::RegisterEncodeCompleteCallback(
     webrtc::EncodedImageCallback *callback) {
+  std::lock_guard<std::mutex> lock(this->frames_mutex);
   this->callback = callback;
   return 0;
 }
 
+bool JetsonEncoder::CopyToOutputBuffer(const webrtc::VideoFrame &frame,
+                                       NvBuffer *buffer) {
+  NvBuffer::NvBufferPlane &y = buffer->planes[0];
+  NvBuffer::NvBufferPlane &uv = buffer->planes[1];
+  y.bytesused = y.fmt.stride * y.fmt.height;
+  uv.bytesused = uv.fmt.stride * uv.fmt.height;
+  return this->CopyToNv12(frame, y.data, y.fmt.stride, uv.data,
+                          uv.fmt.stride);
+}
+
+bool JetsonEncoder::CopyToNv12(const webrtc::VideoFrame &frame, uint8_t *y,
+                               int y_stride, uint8_t *uv, int uv_stride) {
+  int width = ctx.encode_width;
+  int height = ctx.encode_height;
+
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> input =
+      frame.video_frame_buffer();
+  // V4LFrameBuffer is the only native buffer type in wadi. Camera layouts
+  // the encoder can take are copied or repacked directly; the rest goes
+  // through the frame's (cached) I420 conversion.
+  if (input->type() == webrtc::VideoFrameBuffer::Type::kNative) {
+    const V4LFrameBuffer *native =
+        static_cast<const V4LFrameBuffer *>(input.get());
+    switch (native->fourcc()) {
+    case V4L2_PIX_FMT_NV12:
+      libyuv::CopyPlane(native->data(), native->stride(), y, y_stride, width,
+                        height);
+      libyuv::CopyPlane(native->chroma_data(), native->stride(), uv,
+                        uv_stride, (width + 1) / 2 * 2, (height + 1) / 2);
+      return true;
+    case V4L2_PIX_FMT_YUYV:
+      return libyuv::YUY2ToNV12(native->data(), native->stride(), y,
+                                y_stride, uv, uv_stride, width, height) == 0;
+    case V4L2_PIX_FMT_UYVY:
+      return libyuv::UYVYToNV12(native->data(), native->stride(), y,
+                                y_stride, uv, uv_stride, width, height) == 0;
+    default:
+      break;
+    }
+  }
+  rtc::scoped_refptr<webrtc::I420BufferInterface> i420 = input->ToI420();
+  if (!i420) {
+    return false;
+  }
+  return libyuv::I420ToNV12(i420->DataY(), i420->StrideY(), i420->DataU(),
+                            i420->StrideU(), i420->DataV(), i420->StrideV(),
+                            y, y_stride, uv, uv_stride, width, height) == 0;
+}
+
 int32_t
 JetsonEncoder::Encode(const webrtc::VideoFrame &frame,
                       const std::vector<webrtc::VideoFrameType> *frame_types) {
-  tlog("Encoding frame");
+  HotPathScope hot_path;
+  tlog_debug("Encoding frame");
+
+  if (frame.width() != static_cast<int>(ctx.encode_width) ||
+      frame.height() != static_cast<int>(ctx.encode_height)) {
+    tlog_every_ms(5000, LOG_LEVEL_ERROR, "Frame is %dx%d, encoder is %ux%u",
+                  frame.width(), frame.height(), ctx.encode_width,
+                  ctx.encode_height);
+    return WEBRTC_VIDEO_CODEC_ERR_PARAMETER;
+  }
+
+  // The timestamp is copied to the matching capture plane buffer and used to
+  // find this frame's metadata again in DeliverEncodedFrame. Recorded before
+  // the frame reaches the encoder, and taken back if it never does.
+  if (!this->PushPendingFrame(frame)) {
+    tlog_every_ms(5000, LOG_LEVEL_WARN,
+                  "Too many frames pending in the encoder, dropping frame");
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  bool key_frame_requested =
+      frame_types != nullptr &&
+      std::find(frame_types->begin(), frame_types->end(),
+                webrtc::VideoFrameType::kVideoFrameKey) != frame_types->end();
+  bool key_frame = this->key_frame_limiter.ShouldForce(key_frame_requested,
+                                                       rtc::TimeMicros());
+  int32_t ret = dmabuf_queue ? this->EncodeDmaBuf(frame, key_frame)
+                             : this->EncodeMmap(frame, key_frame);
+  if (ret != WEBRTC_VIDEO_CODEC_OK) {
+    this->DropPendingFrame(frame.timestamp_us());
+  }
+  return ret;
+}
 
+int32_t JetsonEncoder::EncodeMmap(const webrtc::VideoFrame &frame,
+                                  bool key_frame) {
   // Send help
   struct v4l2_buffer v4l2_buf;
   struct v4l2_plane planes[MAX_PLANES];
@@ -286,15 +622,12 @@ JetsonEncoder::Encode(const webrtc::VideoFrame &frame,
     return -1;
   }
 
-  rtc::scoped_refptr<const webrtc::I420BufferInterface> frame_buffer =
-      frame.video_frame_buffer()->ToI420();
-
-  memcpy(buffer->planes[0].data, const_cast<uint8_t *>(frame_buffer->DataY()),
-         buffer->planes[0].bytesused);
-  memcpy(buffer->planes[1].data, const_cast<uint8_t *>(frame_buffer->DataU()),
-         buffer->planes[1].bytesused);
-  memcpy(buffer->planes[2].data, const_cast<uint8_t *>(frame_buffer->DataV()),
-         buffer->planes[2].bytesused);
+  if (!this->CopyToOutputBuffer(frame, buffer)) {
+    // The buffer has to go back to the encoder either way; it still holds
+    // an earlier picture.
+    tlog_every_ms(5000, LOG_LEVEL_ERROR,
+                  "Failed to copy frame into the encoder");
+  }
 
   for (uint32_t j = 0; j < buffer->n_planes; j++) {
     NvBufSurface *nvbuf_surf = 0;
@@ -311,15 +644,17 @@ JetsonEncoder::Encode(const webrtc::VideoFrame &frame,
     }
   }
 
-  uint32_t index = v4l2_buf.index;
-  ctx.encoded_images[index]._encodedWidth = ctx.encode_width;
-  ctx.encoded_images[index]._encodedHeight = ctx.encode_height;
-  ctx.encoded_images[index].SetTimestamp(frame.timestamp());
-  ctx.encoded_images[index].ntp_time_ms_ = frame.ntp_time_ms();
-  ctx.encoded_images[index].capture_time_ms_ = frame.render_time_ms();
-  ctx.encoded_images[index].rotation_ = frame.rotation();
-  ctx.encoded_images[index].SetColorSpace(frame.color_space());
-  ctx.encoded_images[index].SetTimestamp(frame.timestamp());
+  v4l2_buf.flags |= V4L2_BUF_FLAG_TIMESTAMP_COPY;
+  v4l2_buf.timestamp.tv_sec = frame.timestamp_us() / rtc::kNumMicrosecsPerSec;
+  v4l2_buf.timestamp.tv_usec = frame.timestamp_us() % rtc::kNumMicrosecsPerSec;
+
+  bool tag_buffer = false;
+  if (key_frame && !this->ForceKeyFrame(v4l2_buf.index, &tag_buffer)) {
+    tlog_every_ms(5000, LOG_LEVEL_WARN, "Failed to force a keyframe");
+  }
+  if (tag_buffer) {
+    v4l2_buf.reserved2 = v4l2_buf.index;
+  }
 
   ret = ctx.enc->output_plane.qBuffer(v4l2_buf, NULL);
   if (ret < 0) {
@@ -331,19 +666,234 @@ JetsonEncoder::Encode(const webrtc::VideoFrame &frame,
   return 0;
 }
 
+bool JetsonEncoder::ForceKeyFrame(uint32_t index, bool *tag_buffer) {
+  if (this->key_frame_config.gdr_frames == 0) {
+    // Applies to the next buffer queued on the output plane.
+    return ctx.enc->forceIDR() == 0;
+  }
+  // GDR is per-frame input metadata, tied to the buffer through reserved2
+  // as in the MMAPI samples. The parameters must outlive the qBuffer call.
+  v4l2_ctrl_videoenc_input_metadata meta;
+  memset(&meta, 0, sizeof(meta));
+  this->gdr_params.nGDRFrames = this->key_frame_config.gdr_frames;
+  meta.flag = V4L2_ENC_INPUT_GDR_PARAM_FLAG;
+  meta.VideoEncGDRParams = &this->gdr_params;
+  if (ctx.enc->SetInputMetaParams(index, meta) < 0) {
+    return false;
+  }
+  *tag_buffer = true;
+  return true;
+}
+
+int JetsonEncoder::InitDmaBufInput() {
+  NvBufSurfaceCreateParams params;
+  memset(&params, 0, sizeof(params));
+  params.width = ctx.encode_width;
+  params.height = ctx.encode_height;
+  params.colorFormat = NVBUF_COLOR_FORMAT_NV12;
+  params.layout = NVBUF_LAYOUT_PITCH;
+  params.memType = NVBUF_MEM_SURFACE_ARRAY;
+  for (uint32_t i = 0; i < JETSON_NUM_OUTPUT_BUFFERS; i++) {
+    if (NvBufSurfaceCreate(&surfaces[i], 1, &params) < 0 ||
+        NvBufSurfaceMap(surfaces[i], 0, -1, NVBUF_MAP_READ_WRITE) < 0) {
+      tlog_error("Failed to allocate encoder input surface %u", i);
+      return -1;
+    }
+    ctx.output_plane_fd[i] = surfaces[i]->surfaceList[0].bufferDesc;
+  }
+  surface_pitch = surfaces[0]->surfaceList[0].planeParams.pitch[0];
+
+  int ret = ctx.enc->output_plane.setupPlane(
+      V4L2_MEMORY_DMABUF, JETSON_NUM_OUTPUT_BUFFERS, false, false);
+  if (ret < 0) {
+    return ret;
+  }
+  dmabuf_plane.reset(new NvDmaBufPlane(ctx.enc));
+  dmabuf_queue.reset(new DmaBufInputQueue(dmabuf_plane.get(),
+                                          JETSON_NUM_OUTPUT_BUFFERS,
+                                          JETSON_DMABUF_MAX_QUEUED));
+  zero_copy_failed = false;
+  return 0;
+}
+
+void JetsonEncoder::ReleaseDmaBufInput() {
+  if (dmabuf_queue) {
+    // STREAMOFF hands every queued buffer back, so the frames they hold can
+    // go back to the camera.
+    ctx.enc->output_plane.setStreamStatus(false);
+    dmabuf_queue->ReleaseAll();
+    dmabuf_queue.reset();
+    dmabuf_plane.reset();
+  }
+  for (NvBufSurface *&surface : surfaces) {
+    if (surface != nullptr) {
+      NvBufSurfaceUnMap(surface, 0, -1);
+      NvBufSurfaceDestroy(surface);
+      surface = nullptr;
+    }
+  }
+}
+
+bool JetsonEncoder::DescribeCameraBuffer(const webrtc::VideoFrame &frame,
+                                         DmaBufFrame *input) {
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer =
+      frame.video_frame_buffer();
+  if (buffer->type() != webrtc::VideoFrameBuffer::Type::kNative) {
+    return false;
+  }
+  const V4LFrameBuffer *native =
+      static_cast<const V4LFrameBuffer *>(buffer.get());
+  if (native->fourcc() != V4L2_PIX_FMT_NV12 || native->dmabuf_fd() < 0 ||
+      native->stride() != surface_pitch) {
+    return false;
+  }
+  uint32_t luma_size = native->stride() * ctx.encode_height;
+  input->num_planes = 2;
+  input->fd[0] = input->fd[1] = native->dmabuf_fd();
+  input->offset[0] = 0;
+  input->bytesused[0] = luma_size;
+  input->offset[1] = luma_size;
+  input->bytesused[1] =
+      luma_size + native->stride() * ((ctx.encode_height + 1) / 2);
+  return true;
+}
+
+bool JetsonEncoder::CopyToSurface(const webrtc::VideoFrame &frame, int slot,
+                                  DmaBufFrame *input) {
+  NvBufSurfaceParams &surface = surfaces[slot]->surfaceList[0];
+  NvBufSurfacePlaneParams &planes = surface.planeParams;
+  if (!this->CopyToNv12(
+          frame, static_cast<uint8_t *>(surface.mappedAddr.addr[0]),
+          planes.pitch[0], static_cast<uint8_t *>(surface.mappedAddr.addr[1]),
+          planes.pitch[1])) {
+    return false;
+  }
+  if (NvBufSurfaceSyncForDevice(surfaces[slot], 0, -1) < 0) {
+    tlog("Error while NvBufSurfaceSyncForDevice at output plane");
+    return false;
+  }
+  // The surface describes its own plane layout to the encoder.
+  input->num_planes = 2;
+  for (uint32_t i = 0; i < 2; i++) {
+    input->fd[i] = surface.bufferDesc;
+    input->offset[i] = 0;
+    input->bytesused[i] = planes.pitch[i] * planes.height[i];
+  }
+  return true;
+}
+
+bool JetsonEncoder::SubmitDmaBuf(
+    const webrtc::VideoFrame &frame, bool key_frame, int slot,
+    DmaBufFrame *input, rtc::scoped_refptr<webrtc::VideoFrameBuffer> owner) {
+  input->timestamp_us = frame.timestamp_us();
+  if (key_frame && !this->ForceKeyFrame(slot, &input->input_metadata)) {
+    tlog_every_ms(5000, LOG_LEVEL_WARN, "Failed to force a keyframe");
+  }
+  if (!dmabuf_queue->Submit(slot, *input, std::move(owner))) {
+    return false;
+  }
+  ctx.input_frames_queued_count++;
+  return true;
+}
+
+int32_t JetsonEncoder::EncodeDmaBuf(const webrtc::VideoFrame &frame,
+                                    bool key_frame) {
+  int slot = dmabuf_queue->AcquireSlot();
+  if (slot < 0) {
+    tlog("Error while DQing buffer at output plane");
+    return -1;
+  }
+  DmaBufFrame input;
+  memset(&input, 0, sizeof(input));
+  if (!zero_copy_failed && this->DescribeCameraBuffer(frame, &input)) {
+    // The frame buffer keeps the camera buffer from being requeued until
+    // the encoder has read it.
+    if (this->SubmitDmaBuf(frame, key_frame, slot, &input,
+                           frame.video_frame_buffer())) {
+      return 0;
+    }
+    // Typically a camera buffer that is not an NvBufSurface. The failed
+    // submit freed the slot; copy this frame and every later one.
+    tlog_warn("Encoder does not take the camera's DMABUF, copying frames");
+    zero_copy_failed = true;
+    slot = dmabuf_queue->AcquireSlot();
+    if (slot < 0) {
+      tlog("Error while DQing buffer at output plane");
+      return -1;
+    }
+    memset(&input, 0, sizeof(input));
+  }
+  if (!this->CopyToSurface(frame, slot, &input)) {
+    tlog_every_ms(5000, LOG_LEVEL_ERROR,
+                  "Failed to copy frame into the encoder");
+    dmabuf_queue->Cancel(slot);
+    return -1;
+  }
+  if (!this->SubmitDmaBuf(frame, key_frame, slot, &input, nullptr)) {
+    tlog("Error while queueing buffer at output plane");
+    return -1;
+  }
+  return 0;
+}
+
+int32_t JetsonEncoder::SetRates(uint32_t bitrate, uint32_t framerate) {
+  if (!rate_controller) {
+    return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
+  }
+  rate_controller->SetTarget(bitrate * 1000, framerate, rtc::TimeMicros());
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+int32_t JetsonEncoder::SetRateAllocation(
+    const webrtc::VideoBitrateAllocation &allocation, uint32_t framerate) {
+  if (!rate_controller) {
+    return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
+  }
+  rate_controller->SetTarget(allocation.get_sum_bps(), framerate,
+                             rtc::TimeMicros());
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+void JetsonEncoder::OnPacketLossRateUpdate(float packet_loss_rate) {
+  if (rate_controller) {
+    rate_controller->OnPacketLoss(packet_loss_rate, rtc::TimeMicros());
+  }
+}
+
+void JetsonEncoder::OnRttUpdate(int64_t rtt_ms) {
+  if (rate_controller) {
+    rate_controller->OnRtt(rtt_ms);
+  }
+}
+
 int32_t JetsonEncoder::Release() {
-  bool error = false;
-  if (ctx.enc && ctx.enc->isInError()) {
+  if (ctx.enc == nullptr) {
+    return 0;
+  }
+  bool error = ctx.got_error;
+  if (ctx.enc->isInError()) {
     tlog("Error in encoder");
     error = true;
   }
-  if (ctx.got_error) {
+  // The DQ thread blocks in DQBUF; STREAMOFF on the capture plane wakes it
+  // with an error, which the callback answers by stopping.
+  stopping.store(true, std::memory_order_release);
+  ctx.enc->capture_plane.setStreamStatus(false);
+  if (ctx.enc->capture_plane.waitForDQThread(JETSON_DQ_STOP_TIMEOUT_MS) != 0) {
+    tlog_error("Encoder capture plane thread did not stop");
     error = true;
   }
-  if (ctx.encoded_images != nullptr) {
-    delete[] ctx.encoded_images;
-  }
-  // TODO: Clean up encoder
+  this->ReleaseDmaBufInput();
+  ctx.enc->output_plane.setStreamStatus(false);
+  // The rate target points at the encoder.
+  rate_controller.reset();
+  rate_target.reset();
+  delete ctx.enc;
+  ctx.enc = nullptr;
+  delete[] ctx.encoded_images;
+  ctx.encoded_images = nullptr;
+  dq_thread_configured = false;
+  stopping.store(false, std::memory_order_relaxed);
   return error ? -1 : 0;
 }
 
@@ -366,15 +916,20 @@ webrtc::VideoEncoderFactory::CodecInfo JetsonEncoderFactory::QueryVideoEncoder(
 
 std::unique_ptr<webrtc::VideoEncoder>
 JetsonEncoderFactory::CreateVideoEncoder(const webrtc::SdpVideoFormat &format) {
-  return absl::make_unique<JetsonEncoder>();
+  return absl::make_unique<JetsonEncoder>(config);
 }
 
-std::unique_ptr<webrtc::VideoEncoderFactory> CreateJetsonEncoderFactory() {
-  return absl::make_unique<JetsonEncoderFactory>();
+std::unique_ptr<webrtc::VideoEncoderFactory>
+CreateJetsonEncoderFactory(const HardwareEncoderConfig &config) {
+  return absl::make_unique<JetsonEncoderFactory>(config);
 }
 
 EncoderInfo JetsonEncoder::GetEncoderInfo() const{
 	EncoderInfo info;
+	info.implementation_name = "Jetson";
+	info.is_hardware_accelerated = true;
+	// Camera frames are read in their own layout by CopyToOutputBuffer().
+	info.supports_native_handle = true;
 	return info;
 }
 
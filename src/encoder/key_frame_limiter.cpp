@@ -0,0 +1,29 @@
+#include "encoder/key_frame_limiter.h"
+#include "metrics.h"
+
+KeyFrameLimiter::KeyFrameLimiter(int64_t min_interval_ms)
+    : min_interval_us(min_interval_ms * 1000), last_forced_us(0),
+      pending(false) {}
+
+bool KeyFrameLimiter::ShouldForce(bool requested, int64_t now_us) {
+  PipelineCounters &counters = GlobalMetrics().counters;
+  if (requested) {
+    if (this->pending) {
+      counters.keyframe_requests_coalesced.fetch_add(
+          1, std::memory_order_relaxed);
+    }
+    this->pending = true;
+  }
+  if (!this->pending) {
+    return false;
+  }
+  // The first request is always answered at once.
+  if (this->last_forced_us != 0 &&
+      now_us - this->last_forced_us < this->min_interval_us) {
+    return false;
+  }
+  this->pending = false;
+  this->last_forced_us = now_us;
+  counters.keyframes_forced.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
@@ -0,0 +1,98 @@
+#include "encoder/rate_controller.h"
+#include "logging.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+
+// Loss below this is normal on the Internet and left to the estimator.
+#define RATE_LOSS_THRESHOLD 0.02
+// Fraction of the target dropped per unit of loss above the threshold.
+#define RATE_LOSS_SLOPE 2.5
+#define RATE_MIN_LOSS_FACTOR 0.5
+
+RateController::RateController(RateControlTarget *target,
+                               const RateControllerConfig &config,
+                               uint32_t start_bitrate_bps, uint32_t fps)
+    : target(target), config(config), target_bitrate(start_bitrate_bps),
+      target_framerate(fps), applied_bitrate(start_bitrate_bps),
+      applied_framerate(fps), loss(0), rtt_ms(0), last_change_us(0),
+      pending_change_us(0) {}
+
+double RateController::loss_factor() const {
+  if (this->loss <= RATE_LOSS_THRESHOLD) {
+    return 1.0;
+  }
+  return std::max(RATE_MIN_LOSS_FACTOR,
+                  1.0 - (this->loss - RATE_LOSS_THRESHOLD) * RATE_LOSS_SLOPE);
+}
+
+void RateController::SetTarget(uint32_t bitrate_bps, uint32_t fps,
+                               int64_t now_us) {
+  this->target_bitrate = bitrate_bps;
+  if (fps > 0) {
+    this->target_framerate = fps;
+  }
+  this->Apply(now_us);
+}
+
+void RateController::OnPacketLoss(float loss, int64_t now_us) {
+  this->loss = std::min(std::max(loss, 0.0f), 1.0f);
+  this->Apply(now_us);
+}
+
+void RateController::OnRtt(int64_t rtt_ms) { this->rtt_ms = rtt_ms; }
+
+void RateController::Apply(int64_t now_us) {
+  // Zero means the stream is paused; the encoder keeps its last rate and
+  // simply gets no frames.
+  if (this->target_bitrate == 0) {
+    return;
+  }
+  double wanted = this->target_bitrate * this->loss_factor();
+  wanted = std::max(wanted, static_cast<double>(this->config.min_bitrate_bps));
+  if (this->config.max_bitrate_bps > 0) {
+    wanted = std::min(wanted, static_cast<double>(this->config.max_bitrate_bps));
+  }
+  uint32_t bitrate = static_cast<uint32_t>(std::lround(wanted));
+
+  double change = std::fabs(wanted - this->applied_bitrate);
+  bool increase = bitrate > this->applied_bitrate;
+  int64_t hold_us =
+      std::max(this->config.min_increase_interval_ms, 2 * this->rtt_ms) *
+      1000;
+  if (change >= this->config.min_change * this->applied_bitrate &&
+      (!increase || now_us - this->last_change_us >= hold_us)) {
+    if (this->target->SetBitrate(bitrate) == 0) {
+      tlog_debug("Encoder bitrate %u -> %u bps (loss %.1f%%, rtt %ld ms)",
+                 this->applied_bitrate, bitrate, this->loss * 100,
+                 (long)this->rtt_ms);
+      this->applied_bitrate = bitrate;
+      this->last_change_us = now_us;
+      this->pending_change_us.store(now_us, std::memory_order_relaxed);
+    } else {
+      tlog_every_ms(5000, LOG_LEVEL_WARN, "Failed to set encoder bitrate %u",
+                    bitrate);
+    }
+  }
+
+  if (this->target_framerate != this->applied_framerate) {
+    if (this->target->SetFrameRate(this->target_framerate) == 0) {
+      this->applied_framerate = this->target_framerate;
+    } else {
+      tlog_every_ms(5000, LOG_LEVEL_WARN, "Failed to set encoder rate %u fps",
+                    this->target_framerate);
+    }
+  }
+}
+
+void RateController::OnFrameEncoded(int64_t encode_start_us, int64_t now_us) {
+  int64_t change_us = this->pending_change_us.load(std::memory_order_relaxed);
+  if (change_us == 0 || encode_start_us < change_us ||
+      !this->pending_change_us.compare_exchange_strong(change_us, 0)) {
+    return;
+  }
+  PipelineCounters &counters = GlobalMetrics().counters;
+  counters.rate_changes.fetch_add(1, std::memory_order_relaxed);
+  counters.rate_change_latency_us.fetch_add(now_us - change_us,
+                                            std::memory_order_relaxed);
+}
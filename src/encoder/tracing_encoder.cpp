@@ -0,0 +1,137 @@
+#include "encoder/tracing_encoder.h"
+#include "latency_tracer.h"
+#include "startup_timeline.h"
+#include "thread_policy.h"
+
+TracingVideoEncoder::TracingVideoEncoder(
+    std::unique_ptr<webrtc::VideoEncoder> encoder)
+    : encoder(std::move(encoder)), callback(nullptr) {}
+
+int32_t
+TracingVideoEncoder::InitEncode(const webrtc::VideoCodec *codec_settings,
+                                int32_t number_of_cores,
+                                size_t max_payload_size) {
+  // Runs on WebRTC's encoder queue, which every Encode() call shares,
+  // whatever the codec and encoder.
+  apply_thread_policy(ThreadRole::kEncoder);
+  return this->encoder->InitEncode(codec_settings, number_of_cores,
+                                   max_payload_size);
+}
+
+int32_t TracingVideoEncoder::RegisterEncodeCompleteCallback(
+    webrtc::EncodedImageCallback *callback) {
+  // As in H264PassthroughEncoder, the wrapped encoder is unregistered
+  // before the callback goes away.
+  if (callback == nullptr) {
+    int32_t ret = this->encoder->RegisterEncodeCompleteCallback(nullptr);
+    this->callback = nullptr;
+    return ret;
+  }
+  this->callback = callback;
+  return this->encoder->RegisterEncodeCompleteCallback(this);
+}
+
+int32_t TracingVideoEncoder::Release() { return this->encoder->Release(); }
+
+int32_t TracingVideoEncoder::Encode(
+    const webrtc::VideoFrame &frame,
+    const std::vector<webrtc::VideoFrameType> *frame_types) {
+  LatencyTracer &tracer = GlobalLatencyTracer();
+  if (tracer.is_enabled()) {
+    FrameTimes &times = this->frames[frame.timestamp() % kNumFrames];
+    times.rtp_timestamp.store(frame.timestamp(), std::memory_order_relaxed);
+    times.capture_time_us.store(frame.timestamp_us(),
+                                std::memory_order_release);
+    tracer.Stamp(kLatencyStageEncodeStart, frame.timestamp_us());
+  }
+  return this->encoder->Encode(frame, frame_types);
+}
+
+int32_t TracingVideoEncoder::SetRates(uint32_t bitrate, uint32_t framerate) {
+  return this->encoder->SetRates(bitrate, framerate);
+}
+
+int32_t TracingVideoEncoder::SetRateAllocation(
+    const webrtc::VideoBitrateAllocation &allocation, uint32_t framerate) {
+  return this->encoder->SetRateAllocation(allocation, framerate);
+}
+
+void TracingVideoEncoder::OnPacketLossRateUpdate(float packet_loss_rate) {
+  this->encoder->OnPacketLossRateUpdate(packet_loss_rate);
+}
+
+void TracingVideoEncoder::OnRttUpdate(int64_t rtt_ms) {
+  this->encoder->OnRttUpdate(rtt_ms);
+}
+
+webrtc::VideoEncoder::EncoderInfo
+TracingVideoEncoder::GetEncoderInfo() const {
+  return this->encoder->GetEncoderInfo();
+}
+
+webrtc::EncodedImageCallback::Result TracingVideoEncoder::OnEncodedImage(
+    const webrtc::EncodedImage &image,
+    const webrtc::CodecSpecificInfo *codec_specific_info,
+    const webrtc::RTPFragmentationHeader *fragmentation) {
+  webrtc::EncodedImageCallback *callback = this->callback;
+  if (callback == nullptr) {
+    return Result(Result::ERROR_SEND_FAILED);
+  }
+  LatencyTracer &tracer = GlobalLatencyTracer();
+  int64_t capture_time_us = 0;
+  bool traced = false;
+  if (tracer.is_enabled()) {
+    FrameTimes &times = this->frames[image.Timestamp() % kNumFrames];
+    capture_time_us = times.capture_time_us.load(std::memory_order_acquire);
+    traced = times.rtp_timestamp.load(std::memory_order_relaxed) ==
+             image.Timestamp();
+  }
+  if (traced) {
+    tracer.Stamp(kLatencyStageEncodeDone, capture_time_us);
+  }
+  // The send stream packetizes the image and hands the packets to the pacer
+  // before OnEncodedImage returns.
+  Result result =
+      callback->OnEncodedImage(image, codec_specific_info, fragmentation);
+  if (traced) {
+    tracer.Stamp(kLatencyStagePacketized, capture_time_us);
+  }
+  if (result.error == Result::OK) {
+    GlobalStartupTimeline().OnFirstFrameSent();
+  }
+  return result;
+}
+
+void TracingVideoEncoder::OnDroppedFrame(DropReason reason) {
+  webrtc::EncodedImageCallback *callback = this->callback;
+  if (callback != nullptr) {
+    callback->OnDroppedFrame(reason);
+  }
+}
+
+TracingVideoEncoderFactory::TracingVideoEncoderFactory(
+    std::unique_ptr<webrtc::VideoEncoderFactory> factory)
+    : factory(std::move(factory)) {}
+
+std::vector<webrtc::SdpVideoFormat>
+TracingVideoEncoderFactory::GetSupportedFormats() const {
+  return this->factory->GetSupportedFormats();
+}
+
+webrtc::VideoEncoderFactory::CodecInfo
+TracingVideoEncoderFactory::QueryVideoEncoder(
+    const webrtc::SdpVideoFormat &format) const {
+  return this->factory->QueryVideoEncoder(format);
+}
+
+std::unique_ptr<webrtc::VideoEncoder>
+TracingVideoEncoderFactory::CreateVideoEncoder(
+    const webrtc::SdpVideoFormat &format) {
+  std::unique_ptr<webrtc::VideoEncoder> encoder =
+      this->factory->CreateVideoEncoder(format);
+  if (!encoder) {
+    return nullptr;
+  }
+  return std::unique_ptr<webrtc::VideoEncoder>(
+      new TracingVideoEncoder(std::move(encoder)));
+}
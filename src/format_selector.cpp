@@ -0,0 +1,175 @@
+#include "format_selector.h"
+#include <algorithm>
+#include <cmath>
+
+// Scaling reads every captured pixel once and writes the target; counted
+// per captured pixel, 4:2:0 both ways.
+#define SCALE_PIXEL_COST 2.0
+
+double capture_pixel_cost(uint32_t pixelformat,
+                          const FormatSelectorOptions &options) {
+  // Bytes the driver writes per pixel, read back by the conversion below,
+  // plus what the conversion writes.
+  switch (pixelformat) {
+  case V4L2_PIX_FMT_H264:
+    // Passed through untouched; a rough 0.05 bytes per pixel of bitstream.
+    return options.allow_h264 ? 0.05 : -1;
+  case V4L2_PIX_FMT_MJPEG:
+  case V4L2_PIX_FMT_JPEG:
+    // Entropy decoding and IDCT dominate; about 6 bytes worth of memory
+    // traffic per pixel, plus the I420 to NV12 pass of a Jetson encoder.
+    return 6.0 + (options.native_yuv_input ? 3.0 : 0);
+  case V4L2_PIX_FMT_NV12:
+  case V4L2_PIX_FMT_YUV420:
+  case V4L2_PIX_FMT_NV21:
+  case V4L2_PIX_FMT_YVU420:
+    // One 4:2:0 copy or plane shuffle, unless the encoder takes NV12 as
+    // captured.
+    if (pixelformat == V4L2_PIX_FMT_NV12 && options.native_yuv_input) {
+      return 1.5;
+    }
+    return 1.5 + 3.0;
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_UYVY:
+    // 4:2:2 capture is a third more to transfer; repacking is one pass,
+    // folded into the encoder's input copy when it reads them natively.
+    return 2.0 + (options.native_yuv_input ? 0 : 3.5);
+  case V4L2_PIX_FMT_RGB24:
+  case V4L2_PIX_FMT_BGR24:
+  case V4L2_PIX_FMT_RGB565:
+  case V4L2_PIX_FMT_ABGR32:
+  case V4L2_PIX_FMT_XBGR32:
+  case V4L2_PIX_FMT_ARGB32:
+  case V4L2_PIX_FMT_XRGB32:
+    // Color conversion on top of the larger transfer.
+    return 4.0 + 6.0;
+  default:
+    return -1;
+  }
+}
+
+// Frame rate to request at |size|: the lowest one reaching |fps|, else the
+// highest available. 0 when the driver does not report intervals.
+static uint32_t pick_fps(const V4LFrameSize &size, uint32_t fps) {
+  double best = 0;
+  double fastest = 0;
+  for (const v4l2_fract &interval : size.intervals) {
+    if (interval.numerator == 0) {
+      continue;
+    }
+    double rate = static_cast<double>(interval.denominator) /
+                  interval.numerator;
+    fastest = std::max(fastest, rate);
+    if (rate + 0.5 >= fps && (best == 0 || rate < best)) {
+      best = rate;
+    }
+  }
+  return static_cast<uint32_t>(std::lround(best != 0 ? best : fastest));
+}
+
+// The frame size of |size| closest to the target from above, or its largest
+// one if the target does not fit.
+static void pick_size(const V4LFrameSize &size, uint32_t width,
+                      uint32_t height, uint32_t *out_width,
+                      uint32_t *out_height) {
+  if (size.min_width == size.max_width && size.min_height == size.max_height) {
+    *out_width = size.max_width;
+    *out_height = size.max_height;
+    return;
+  }
+  auto snap = [](uint32_t target, uint32_t min, uint32_t max, uint32_t step) {
+    uint32_t value = std::max(target, min);
+    if (step > 1) {
+      value = min + (value - min + step - 1) / step * step;
+    }
+    return std::min(value, max);
+  };
+  *out_width = snap(width, size.min_width, size.max_width, size.step_width);
+  *out_height =
+      snap(height, size.min_height, size.max_height, size.step_height);
+}
+
+namespace {
+struct Candidate {
+  CaptureFormat format;
+  // Lower is better: misses the size, misses the rate, other aspect ratio.
+  int tier;
+};
+} // namespace
+
+static bool better(const Candidate &a, const Candidate &b) {
+  if (a.tier != b.tier) {
+    return a.tier < b.tier;
+  }
+  const CaptureFormat &x = a.format;
+  const CaptureFormat &y = b.format;
+  // Short of the target, get as close to it as possible first.
+  if (a.tier >= 4 && x.width * x.height != y.width * y.height) {
+    return x.width * x.height > y.width * y.height;
+  }
+  if ((a.tier & 2) != 0 && x.fps != y.fps) {
+    return x.fps > y.fps;
+  }
+  return x.cost < y.cost;
+}
+
+std::optional<CaptureFormat>
+select_capture_format(const std::vector<V4LFormat> &formats, uint32_t width,
+                      uint32_t height, uint32_t fps,
+                      const FormatSelectorOptions &options) {
+  std::optional<Candidate> best;
+  for (const V4LFormat &format : formats) {
+    double pixel_cost = capture_pixel_cost(format.pixelformat, options);
+    if (pixel_cost < 0 || (format.flags & V4L2_FMT_FLAG_EMULATED) != 0) {
+      // Emulated formats are converted by libv4l in the capture thread,
+      // which costs more than doing it ourselves.
+      continue;
+    }
+    for (const V4LFrameSize &size : format.sizes) {
+      Candidate candidate;
+      CaptureFormat &capture = candidate.format;
+      capture.pixelformat = format.pixelformat;
+      pick_size(size, width, height, &capture.width, &capture.height);
+      capture.fps = pick_fps(size, fps);
+
+      bool fits = capture.width >= width && capture.height >= height;
+      bool fast = capture.fps == 0 || capture.fps >= fps;
+      double cross_a = static_cast<double>(capture.width) * height;
+      double cross_b = static_cast<double>(capture.height) * width;
+      bool same_aspect = std::fabs(cross_a - cross_b) <= 0.01 * cross_a;
+      candidate.tier = (fits ? 0 : 4) + (fast ? 0 : 2) + (same_aspect ? 0 : 1);
+
+      double pixels = static_cast<double>(capture.width) * capture.height;
+      double cost = pixel_cost;
+      if (capture.width > width || capture.height > height) {
+        cost += SCALE_PIXEL_COST;
+      }
+      uint32_t rate = capture.fps != 0 ? std::min(capture.fps, fps) : fps;
+      capture.cost = cost * pixels * rate;
+
+      if (!best.has_value() || better(candidate, best.value())) {
+        best = candidate;
+      }
+    }
+  }
+  if (!best.has_value()) {
+    return std::nullopt;
+  }
+  return best->format;
+}
+
+bool supports_capture_format(const std::vector<V4LFormat> &formats,
+                             uint32_t pixelformat, uint32_t width,
+                             uint32_t height) {
+  for (const V4LFormat &format : formats) {
+    if (format.pixelformat != pixelformat) {
+      continue;
+    }
+    for (const V4LFrameSize &size : format.sizes) {
+      if (size.contains(width, height)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,104 @@
+#include "hot_path.h"
+#include "logging.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+#ifndef MCL_ONFAULT
+#define MCL_ONFAULT 4
+#endif
+
+static MemoryConfig memory_config;
+// Whether the calling thread is inside a warmed-up HotPathScope. Plain
+// thread_local data needs no constructor, so an operator new replacement
+// can read it at any time.
+static thread_local bool hot_path_counting = false;
+// HotPathScope nesting and the frames the thread has warmed up with.
+static thread_local int hot_path_depth = 0;
+static thread_local int hot_path_frames = 0;
+
+bool configure_memory(const MemoryConfig &config) {
+  memory_config = config;
+  if (!config.lock) {
+    return true;
+  }
+  // Frame-sized blocks would otherwise be mmapped and unmapped on every
+  // allocation, and freed heap returned to the kernel, so each reuse would
+  // fault again.
+  mallopt(M_MMAP_MAX, 0);
+  mallopt(M_TRIM_THRESHOLD, -1);
+  // MCL_ONFAULT locks pages as they are touched instead of populating every
+  // mapping up front, which would commit the full stack of every thread.
+  // Pools are prefaulted explicitly in warm_buffer_pool().
+  if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) != 0) {
+    tlog_warn("Failed to lock memory: %s; raise RLIMIT_MEMLOCK or grant "
+              "CAP_IPC_LOCK",
+              strerror(errno));
+    return false;
+  }
+  tlog("Memory locked%s",
+       config.hugepages ? ", hugepages for frame pools" : "");
+  return true;
+}
+
+bool memory_preallocation_enabled() { return memory_config.lock; }
+
+// Only whole hugepages inside the block can be backed by one.
+static void advise_hugepages(void *data, size_t size) {
+  uintptr_t start = reinterpret_cast<uintptr_t>(data);
+  uintptr_t mask = ~static_cast<uintptr_t>(HUGEPAGE_SIZE - 1);
+  uintptr_t first = (start + HUGEPAGE_SIZE - 1) & mask;
+  uintptr_t last = (start + size) & mask;
+  if (last > first) {
+    madvise(reinterpret_cast<void *>(first), last - first, MADV_HUGEPAGE);
+  }
+}
+
+void warm_buffer_pool(webrtc::I420BufferPool *pool, int width, int height) {
+  std::vector<rtc::scoped_refptr<webrtc::I420Buffer>> held;
+  held.reserve(HOT_PATH_WARM_BUFFERS);
+  for (int i = 0; i < HOT_PATH_WARM_BUFFERS; i++) {
+    rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+        pool->CreateBuffer(width, height);
+    if (!buffer) {
+      break;
+    }
+    // The planes are one allocation starting at the Y plane.
+    size_t size = buffer->StrideY() * height +
+                  (buffer->StrideU() + buffer->StrideV()) * ((height + 1) / 2);
+    uint8_t *data = buffer->MutableDataY();
+    if (memory_config.hugepages) {
+      advise_hugepages(data, size);
+    }
+    memset(data, 0, size);
+    held.push_back(buffer);
+  }
+  tlog_debug("Preallocated %zu %dx%d frame buffers", held.size(), width,
+             height);
+}
+
+HotPathScope::HotPathScope() : previous(hot_path_counting) {
+  hot_path_counting = hot_path_frames >= HOT_PATH_WARMUP_FRAMES;
+  if (hot_path_depth++ == 0 && !hot_path_counting) {
+    hot_path_frames++;
+  }
+}
+
+HotPathScope::~HotPathScope() {
+  hot_path_depth--;
+  hot_path_counting = previous;
+}
+
+HotPathPause::HotPathPause() : previous(hot_path_counting) {
+  hot_path_counting = false;
+}
+
+HotPathPause::~HotPathPause() { hot_path_counting = previous; }
+
+bool in_hot_path() { return hot_path_counting; }
@@ -0,0 +1,233 @@
+#include "http_server.h"
+#include "logging.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define HTTP_SERVER_MAX_REQUEST 65536
+#define HTTP_SERVER_IO_TIMEOUT_S 2
+
+static const char *status_text(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 201:
+    return "Created";
+  case 204:
+    return "No Content";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 413:
+    return "Payload Too Large";
+  default:
+    return status < 500 ? "Error" : "Internal Server Error";
+  }
+}
+
+static bool write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+HttpServer::HttpServer(std::string address, uint16_t port, Handler handler)
+    : address(std::move(address)), requested_port(port), bound_port(0),
+      handler(std::move(handler)), listen_fd(-1), wake_fd(-1),
+      running(false) {}
+
+HttpServer::~HttpServer() { Stop(); }
+
+bool HttpServer::Start() {
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(requested_port);
+  if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+    tlog("Invalid listen address %s", address.c_str());
+    return false;
+  }
+
+  listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    tlog_error("Failed to create listening socket: %s", strerror(errno));
+    return false;
+  }
+  int reuse = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, 8) < 0) {
+    tlog_error("Failed to listen on %s:%u: %s", address.c_str(),
+               requested_port, strerror(errno));
+    close(listen_fd);
+    listen_fd = -1;
+    return false;
+  }
+  socklen_t len = sizeof(addr);
+  getsockname(listen_fd, (sockaddr *)&addr, &len);
+  bound_port = ntohs(addr.sin_port);
+
+  wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (wake_fd < 0) {
+    tlog_error("Failed to create wake eventfd: %s", strerror(errno));
+    close(listen_fd);
+    listen_fd = -1;
+    return false;
+  }
+
+  running = true;
+  serve_thread = std::thread(&HttpServer::_serve_loop, this);
+  tlog("HTTP server listening on %s:%u", address.c_str(), bound_port);
+  return true;
+}
+
+void HttpServer::Stop() {
+  if (!running.exchange(false)) {
+    return;
+  }
+  uint64_t value = 1;
+  if (write(wake_fd, &value, sizeof(value)) < 0) {
+    tlog_error("Failed to wake HTTP server thread");
+  }
+  if (serve_thread.joinable()) {
+    serve_thread.join();
+  }
+  close(listen_fd);
+  close(wake_fd);
+  listen_fd = wake_fd = -1;
+}
+
+void HttpServer::_serve_loop() {
+  pthread_setname_np(pthread_self(), "HttpServer");
+  pollfd fds[2];
+  fds[0].fd = listen_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = wake_fd;
+  fds[1].events = POLLIN;
+  while (running) {
+    fds[0].revents = fds[1].revents = 0;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      tlog("HTTP server poll failed: %s", strerror(errno));
+      return;
+    }
+    if (fds[1].revents & POLLIN) {
+      return;
+    }
+    if (fds[0].revents & POLLIN) {
+      int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (client < 0) {
+        continue;
+      }
+      _serve_connection(client);
+      close(client);
+    }
+  }
+}
+
+void HttpServer::_serve_connection(int client) {
+  timeval timeout = {HTTP_SERVER_IO_TIMEOUT_S, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  HttpServerResponse response;
+  HttpServerRequest request;
+  std::string data;
+  size_t header_end = std::string::npos;
+  size_t content_length = 0;
+  char chunk[4096];
+  while (true) {
+    if (header_end == std::string::npos) {
+      header_end = data.find("\r\n\r\n");
+      if (header_end != std::string::npos) {
+        std::string head = data.substr(0, header_end);
+        size_t line_end = head.find("\r\n");
+        std::string request_line = head.substr(0, line_end);
+        size_t sp1 = request_line.find(' ');
+        size_t sp2 = request_line.find(' ', sp1 + 1);
+        if (sp1 == std::string::npos || sp2 == std::string::npos) {
+          response.status = 400;
+          break;
+        }
+        request.method = request_line.substr(0, sp1);
+        request.path = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+        size_t pos = line_end;
+        while (pos != std::string::npos && pos < head.size()) {
+          size_t next = head.find("\r\n", pos + 2);
+          std::string line = head.substr(pos + 2, next == std::string::npos
+                                                       ? std::string::npos
+                                                       : next - pos - 2);
+          size_t colon = line.find(':');
+          if (colon != std::string::npos) {
+            std::string name = line.substr(0, colon);
+            for (auto &c : name) {
+              c = tolower(c);
+            }
+            size_t value = line.find_first_not_of(' ', colon + 1);
+            request.headers[name] =
+                value == std::string::npos ? "" : line.substr(value);
+          }
+          pos = next;
+        }
+        auto length = request.headers.find("content-length");
+        if (length != request.headers.end()) {
+          content_length = strtoul(length->second.c_str(), NULL, 10);
+        }
+        if (header_end + 4 + content_length > HTTP_SERVER_MAX_REQUEST) {
+          response.status = 413;
+          break;
+        }
+      }
+    }
+    if (header_end != std::string::npos &&
+        data.size() >= header_end + 4 + content_length) {
+      request.body = data.substr(header_end + 4, content_length);
+      handler(request, response);
+      break;
+    }
+    if (data.size() > HTTP_SERVER_MAX_REQUEST) {
+      response.status = 413;
+      break;
+    }
+    ssize_t received = recv(client, chunk, sizeof(chunk), 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return;
+    }
+    data.append(chunk, received);
+  }
+
+  std::string out = "HTTP/1.1 " + std::to_string(response.status) + " " +
+                    status_text(response.status) + "\r\n";
+  out += "Content-Type: " + response.content_type + "\r\n";
+  out += "Content-Length: " + std::to_string(response.body.size()) + "\r\n";
+  for (const auto &header : response.headers) {
+    out += header.first + ": " + header.second + "\r\n";
+  }
+  out += "Connection: close\r\n\r\n";
+  out += response.body;
+  write_all(client, out.data(), out.size());
+}
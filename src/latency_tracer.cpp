@@ -0,0 +1,177 @@
+#include "latency_tracer.h"
+#include "rtc_base/time_utils.h"
+#include <cstdio>
+#include <sstream>
+
+static const double kQuantiles[] = {0.5, 0.9, 0.99};
+
+int LatencyHistogram::BucketIndex(uint64_t value) {
+  const uint64_t sub_buckets = 1 << kSubBucketBits;
+  if (value < sub_buckets) {
+    return value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  if (exponent > kMaxExponent) {
+    return kNumBuckets - 1;
+  }
+  int shift = exponent - kSubBucketBits;
+  return ((exponent - kSubBucketBits + 1) << kSubBucketBits) +
+         ((value >> shift) & (sub_buckets - 1));
+}
+
+int64_t LatencyHistogram::BucketUpperBound(int index) {
+  const int sub_buckets = 1 << kSubBucketBits;
+  if (index < sub_buckets) {
+    return index;
+  }
+  int shift = (index >> kSubBucketBits) - 1;
+  int64_t lower = (int64_t)(sub_buckets + (index & (sub_buckets - 1))) << shift;
+  return lower + ((int64_t)1 << shift) - 1;
+}
+
+void LatencyHistogram::Record(int64_t value_us) {
+  if (value_us < 0) {
+    value_us = 0;
+  }
+  buckets[BucketIndex(value_us)].fetch_add(1, std::memory_order_relaxed);
+  total_count.fetch_add(1, std::memory_order_relaxed);
+  total_sum.fetch_add(value_us, std::memory_order_relaxed);
+  int64_t current = max_value.load(std::memory_order_relaxed);
+  while (value_us > current &&
+         !max_value.compare_exchange_weak(current, value_us,
+                                          std::memory_order_relaxed)) {
+  }
+}
+
+void LatencyHistogram::Reset() {
+  for (auto &bucket : buckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  total_count.store(0, std::memory_order_relaxed);
+  total_sum.store(0, std::memory_order_relaxed);
+  max_value.store(0, std::memory_order_relaxed);
+}
+
+int64_t LatencyHistogram::Percentile(double quantile) const {
+  // Concurrent records may make the bucket sum differ from total_count, so
+  // the rank is computed against the buckets themselves.
+  uint64_t counts[kNumBuckets];
+  uint64_t total = 0;
+  for (int i = 0; i < kNumBuckets; i++) {
+    counts[i] = buckets[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t rank = quantile * total;
+  if (rank >= total) {
+    rank = total - 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < kNumBuckets; i++) {
+    seen += counts[i];
+    if (seen > rank) {
+      int64_t bound = BucketUpperBound(i);
+      return bound < max() ? bound : max();
+    }
+  }
+  return max();
+}
+
+const char *latency_stage_name(LatencyStage stage) {
+  switch (stage) {
+  case kLatencyStageDequeue:
+    return "dequeue";
+  case kLatencyStageBroadcast:
+    return "broadcast";
+  case kLatencyStageEncodeStart:
+    return "encode_queue";
+  case kLatencyStageEncodeDone:
+    return "encode";
+  case kLatencyStagePacketized:
+    return "packetize";
+  case kLatencyStageTotal:
+    return "total";
+  default:
+    return "unknown";
+  }
+}
+
+LatencyTracer &GlobalLatencyTracer() {
+  static LatencyTracer tracer;
+  return tracer;
+}
+
+void LatencyTracer::Stamp(LatencyStage stage, int64_t capture_time_us) {
+  if (!this->is_enabled()) {
+    return;
+  }
+  this->Stamp(stage, capture_time_us, rtc::TimeMicros());
+}
+
+void LatencyTracer::Stamp(LatencyStage stage, int64_t capture_time_us,
+                          int64_t now_us) {
+  if (!this->is_enabled()) {
+    return;
+  }
+  // Fibonacci hashing spreads timestamps that share their low bits.
+  size_t index = ((uint64_t)capture_time_us * 0x9E3779B97F4A7C15ull) >> 56;
+  FrameSlot &slot = this->slots[index % kNumSlots];
+  int64_t previous;
+  if (slot.capture_time_us.load(std::memory_order_acquire) == capture_time_us) {
+    previous = slot.last_stamp_us.load(std::memory_order_relaxed);
+  } else {
+    previous = capture_time_us;
+    slot.capture_time_us.store(capture_time_us, std::memory_order_release);
+  }
+  slot.last_stamp_us.store(now_us, std::memory_order_relaxed);
+  this->histograms[stage].Record(now_us - previous);
+  if (stage == kLatencyStagePacketized) {
+    this->histograms[kLatencyStageTotal].Record(now_us - capture_time_us);
+  }
+}
+
+void LatencyTracer::Reset() {
+  for (auto &histogram : this->histograms) {
+    histogram.Reset();
+  }
+}
+
+std::string LatencyTracer::Dump() const {
+  std::ostringstream out;
+  char line[160];
+  snprintf(line, sizeof(line), "%-13s %10s %9s %9s %9s %9s %9s", "stage",
+           "frames", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+  out << line;
+  for (int i = 0; i < kLatencyStageCount; i++) {
+    const LatencyHistogram &h = this->histograms[i];
+    uint64_t count = h.count();
+    snprintf(line, sizeof(line), "\n%-13s %10llu %9.2f %9.2f %9.2f %9.2f %9.2f",
+             latency_stage_name((LatencyStage)i), (unsigned long long)count,
+             count ? h.sum() / 1e3 / count : 0.0, h.Percentile(0.5) / 1e3,
+             h.Percentile(0.9) / 1e3, h.Percentile(0.99) / 1e3, h.max() / 1e3);
+    out << line;
+  }
+  return out.str();
+}
+
+std::string LatencyTracer::RenderPrometheus() const {
+  std::ostringstream out;
+  out.precision(12);
+  const char *name = "wadi_frame_latency_seconds";
+  out << "# HELP " << name
+      << " Time frames spend in each pipeline stage.\n";
+  out << "# TYPE " << name << " summary\n";
+  for (int i = 0; i < kLatencyStageCount; i++) {
+    const LatencyHistogram &h = this->histograms[i];
+    const char *stage = latency_stage_name((LatencyStage)i);
+    for (double quantile : kQuantiles) {
+      out << name << "{stage=\"" << stage << "\",quantile=\"" << quantile
+          << "\"} " << h.Percentile(quantile) / 1e6 << "\n";
+    }
+    out << name << "_sum{stage=\"" << stage << "\"} " << h.sum() / 1e6 << "\n";
+    out << name << "_count{stage=\"" << stage << "\"} " << h.count() << "\n";
+  }
+  return out.str();
+}
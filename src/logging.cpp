@@ -0,0 +1,368 @@
+#include "logging.h"
+#include "rtc_base/logging.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define LOG_RING_SIZE 256
+#define LOG_MESSAGE_SIZE 240
+#define LOG_FLUSH_INTERVAL_MS 20
+
+struct LogEntry {
+  int64_t time_us;
+  LogLevel level;
+  char text[LOG_MESSAGE_SIZE];
+};
+
+// Single producer (the owning thread), single consumer (the flusher).
+struct LogRing {
+  LogEntry entries[LOG_RING_SIZE];
+  std::atomic<uint64_t> head{0};
+  std::atomic<uint64_t> tail{0};
+  std::atomic<uint64_t> dropped{0};
+  // Set when the owning thread exits; the flusher frees the ring once empty.
+  std::atomic<bool> retired{false};
+  char thread_name[16];
+};
+
+static int64_t monotonic_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static const char level_tags[] = {'D', 'I', 'W', 'E'};
+
+class Logger {
+public:
+  static Logger &Get();
+
+  void Write(LogLevel level, const char *fmt, va_list args);
+  void Flush();
+  void Shutdown();
+  std::atomic<int> min_level{LOG_LEVEL_INFO};
+
+private:
+  Logger();
+  LogRing *LocalRing();
+  void FlushLoop();
+  // Writes out every queued entry; serialized by drain_mutex.
+  void Drain();
+  void WriteLine(std::string &out, int64_t time_us, LogLevel level,
+                 const char *thread, const char *text);
+  void Wake();
+
+  std::mutex rings_mutex;
+  std::vector<LogRing *> rings;
+  std::mutex drain_mutex;
+  std::string out;
+  std::atomic<bool> running;
+  int wake_fd;
+  std::thread flusher;
+  // Wall clock at startup, advanced by the monotonic clock so timestamps
+  // never jump backwards.
+  int64_t wall_base_us;
+  int64_t mono_base_us;
+  // Formatted date of the second cached_second refers to.
+  int64_t cached_second;
+  char cached_date[32];
+};
+
+struct LocalRingHandle {
+  LogRing *ring = nullptr;
+  ~LocalRingHandle() {
+    if (ring != nullptr) {
+      ring->retired.store(true, std::memory_order_release);
+      ring = nullptr;
+    }
+  }
+};
+static thread_local LocalRingHandle local_ring;
+
+Logger &Logger::Get() {
+  // Never destroyed: threads may log while static destructors run.
+  static Logger *logger = [] {
+    Logger *logger = new Logger();
+    atexit([] { Logger::Get().Shutdown(); });
+    return logger;
+  }();
+  return *logger;
+}
+
+Logger::Logger() : running(true), cached_second(-1) {
+  timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  wall_base_us = wall.tv_sec * 1000000LL + wall.tv_nsec / 1000;
+  mono_base_us = monotonic_us();
+  out.reserve(LOG_RING_SIZE * (LOG_MESSAGE_SIZE + 64));
+  wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  flusher = std::thread(&Logger::FlushLoop, this);
+}
+
+LogRing *Logger::LocalRing() {
+  if (local_ring.ring != nullptr) {
+    return local_ring.ring;
+  }
+  LogRing *ring = new LogRing();
+  if (pthread_getname_np(pthread_self(), ring->thread_name,
+                         sizeof(ring->thread_name)) != 0) {
+    snprintf(ring->thread_name, sizeof(ring->thread_name), "%ld",
+             (long)syscall(SYS_gettid));
+  }
+  {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    rings.push_back(ring);
+  }
+  local_ring.ring = ring;
+  return ring;
+}
+
+void Logger::Write(LogLevel level, const char *fmt, va_list args) {
+  if (level < min_level.load(std::memory_order_relaxed)) {
+    return;
+  }
+  if (!running.load(std::memory_order_acquire)) {
+    // The flusher is gone; write synchronously.
+    char text[LOG_MESSAGE_SIZE];
+    vsnprintf(text, sizeof(text), fmt, args);
+    std::lock_guard<std::mutex> lock(drain_mutex);
+    out.clear();
+    WriteLine(out, monotonic_us(), level, "", text);
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+    return;
+  }
+  LogRing *ring = LocalRing();
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  uint64_t used = head - ring->tail.load(std::memory_order_acquire);
+  if (used >= LOG_RING_SIZE) {
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  LogEntry &entry = ring->entries[head % LOG_RING_SIZE];
+  entry.time_us = monotonic_us();
+  entry.level = level;
+  vsnprintf(entry.text, sizeof(entry.text), fmt, args);
+  ring->head.store(head + 1, std::memory_order_release);
+  if (level >= LOG_LEVEL_ERROR || used + 1 == LOG_RING_SIZE / 2) {
+    Wake();
+  }
+}
+
+void Logger::Wake() {
+  uint64_t value = 1;
+  if (write(wake_fd, &value, sizeof(value)) < 0) {
+    // The flusher still runs on its interval.
+  }
+}
+
+void Logger::WriteLine(std::string &out, int64_t time_us, LogLevel level,
+                       const char *thread, const char *text) {
+  int64_t wall_us = wall_base_us + (time_us - mono_base_us);
+  int64_t second = wall_us / 1000000;
+  if (second != cached_second) {
+    time_t t = second;
+    tm local;
+    localtime_r(&t, &local);
+    strftime(cached_date, sizeof(cached_date), "%Y-%m-%d %T", &local);
+    cached_second = second;
+  }
+  char prefix[80];
+  snprintf(prefix, sizeof(prefix), "[%s.%03d] %c [%s] ", cached_date,
+           (int)(wall_us % 1000000 / 1000), level_tags[level], thread);
+  out += prefix;
+  out += text;
+  out += '\n';
+}
+
+void Logger::Drain() {
+  struct Pending {
+    int64_t time_us;
+    LogRing *ring;
+    uint64_t index;
+  };
+  std::lock_guard<std::mutex> drain_lock(drain_mutex);
+  std::vector<LogRing *> snapshot;
+  {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    snapshot = rings;
+  }
+  // Merge the rings by timestamp so lines from different threads come out in
+  // the order they were logged.
+  std::vector<Pending> pending;
+  std::vector<uint64_t> heads(snapshot.size());
+  for (size_t i = 0; i < snapshot.size(); i++) {
+    LogRing *ring = snapshot[i];
+    heads[i] = ring->head.load(std::memory_order_acquire);
+    for (uint64_t j = ring->tail.load(std::memory_order_relaxed); j < heads[i];
+         j++) {
+      pending.push_back({ring->entries[j % LOG_RING_SIZE].time_us, ring, j});
+    }
+  }
+  std::stable_sort(pending.begin(), pending.end(),
+                   [](const Pending &a, const Pending &b) {
+                     return a.time_us < b.time_us;
+                   });
+  out.clear();
+  for (const Pending &p : pending) {
+    const LogEntry &entry = p.ring->entries[p.index % LOG_RING_SIZE];
+    WriteLine(out, entry.time_us, entry.level, p.ring->thread_name,
+              entry.text);
+  }
+  for (size_t i = 0; i < snapshot.size(); i++) {
+    LogRing *ring = snapshot[i];
+    ring->tail.store(heads[i], std::memory_order_release);
+    uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+      char text[64];
+      snprintf(text, sizeof(text), "%llu log messages dropped",
+               (unsigned long long)dropped);
+      WriteLine(out, monotonic_us(), LOG_LEVEL_WARN, ring->thread_name, text);
+    }
+  }
+  if (!out.empty()) {
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+  }
+
+  std::lock_guard<std::mutex> lock(rings_mutex);
+  for (auto it = rings.begin(); it != rings.end();) {
+    LogRing *ring = *it;
+    if (ring->retired.load(std::memory_order_acquire) &&
+        ring->head.load(std::memory_order_acquire) ==
+            ring->tail.load(std::memory_order_relaxed)) {
+      delete ring;
+      it = rings.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void Logger::FlushLoop() {
+  pthread_setname_np(pthread_self(), "LogFlusher");
+  pollfd fd = {wake_fd, POLLIN, 0};
+  while (running.load(std::memory_order_acquire)) {
+    if (poll(&fd, 1, LOG_FLUSH_INTERVAL_MS) > 0) {
+      uint64_t value;
+      if (read(wake_fd, &value, sizeof(value)) < 0) {
+        // Already drained by a concurrent wake.
+      }
+    }
+    Drain();
+  }
+}
+
+void Logger::Flush() {
+  if (running.load(std::memory_order_acquire)) {
+    Drain();
+  }
+}
+
+void Logger::Shutdown() {
+  if (!running.exchange(false)) {
+    return;
+  }
+  Wake();
+  if (flusher.joinable()) {
+    flusher.join();
+  }
+  Drain();
+}
+
+void log_write(LogLevel level, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  Logger::Get().Write(level, fmt, args);
+  va_end(args);
+}
+
+void log_set_level(LogLevel level) {
+  Logger::Get().min_level.store(level, std::memory_order_relaxed);
+}
+
+bool log_parse_level(const char *name, LogLevel *level) {
+  static const char *names[] = {"debug", "info", "warn", "error", "none"};
+  for (int i = 0; i <= LOG_LEVEL_NONE; i++) {
+    if (strcasecmp(name, names[i]) == 0) {
+      *level = (LogLevel)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void log_flush() { Logger::Get().Flush(); }
+
+bool log_rate_limit(std::atomic<int64_t> *last_us,
+                    std::atomic<uint32_t> *count, int64_t interval_ms,
+                    uint32_t *suppressed) {
+  int64_t now = monotonic_us();
+  int64_t last = last_us->load(std::memory_order_relaxed);
+  if ((last == INT64_MIN || now - last >= interval_ms * 1000) &&
+      last_us->compare_exchange_strong(last, now,
+                                       std::memory_order_relaxed)) {
+    *suppressed = count->exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+  count->fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+class WebRTCLogSink : public rtc::LogSink {
+public:
+  void OnLogMessage(const std::string &message,
+                    rtc::LoggingSeverity severity) override {
+    LogLevel level;
+    switch (severity) {
+    case rtc::LS_VERBOSE:
+      level = LOG_LEVEL_DEBUG;
+      break;
+    case rtc::LS_INFO:
+      level = LOG_LEVEL_INFO;
+      break;
+    case rtc::LS_WARNING:
+      level = LOG_LEVEL_WARN;
+      break;
+    default:
+      level = LOG_LEVEL_ERROR;
+      break;
+    }
+    size_t size = message.size();
+    while (size > 0 && message[size - 1] == '\n') {
+      size--;
+    }
+    log_write(level, "webrtc: %.*s", (int)size, message.data());
+  }
+
+  void OnLogMessage(const std::string &message) override {
+    this->OnLogMessage(message, rtc::LS_INFO);
+  }
+};
+
+void log_install_webrtc_sink(LogLevel level) {
+  static WebRTCLogSink sink;
+  static const rtc::LoggingSeverity severities[] = {
+      rtc::LS_VERBOSE, rtc::LS_INFO, rtc::LS_WARNING, rtc::LS_ERROR,
+      rtc::LS_NONE};
+  rtc::LogMessage::LogToDebug(rtc::LS_NONE);
+  rtc::LogMessage::SetLogToStderr(false);
+  rtc::LogMessage::RemoveLogToStream(&sink);
+  if (level != LOG_LEVEL_NONE) {
+    rtc::LogMessage::AddLogToStream(&sink, severities[level]);
+  }
+}
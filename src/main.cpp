@@ -1,113 +1,223 @@
+#include "bandwidth_history.h"
+#include "certificate_cache.h"
+#include "config.h"
+#include "hot_path.h"
+#include "http_server.h"
+#include "latency_tracer.h"
 #include "logging.h"
+#include "metrics.h"
 #include "rtc_base/ssl_adapter.h"
-#include "v4l.h"
+#include "rtc_base/time_utils.h"
+#include "run_loop.h"
+#include "startup_timeline.h"
+#include "thread_policy.h"
 #include "whip.h"
-#include <cctype>
-#include <cstring>
-#include <fcntl.h>
-#include <linux/videodev2.h>
-#include <sys/ioctl.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
-#define BASE_VIDEO_PATH "/dev/video"
+#include "whip_runtime.h"
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
 
-struct ParsedArgs {
-  std::map<std::string, std::string> named;
-  std::vector<std::string> positional;
-};
-
-ParsedArgs parse_args(int argc, char **argv) {
-  ParsedArgs args;
-  std::optional<std::string> key;
-  for (int i = 1; i < argc; i += 1) {
-    std::string token(argv[i]);
-    if (key.has_value()) {
-      args.named[key.value()] = token[0] == '-' ? "true" : token;
-    }
-    if (token[0] == '-') {
-      key = token.substr(1);
-      continue;
-    }
-    if (!key.has_value()) {
-      args.positional.push_back(token);
+static rtc::scoped_refptr<WHIPSession>
+create_session(const WadiConfig &config, const std::string &endpoint,
+               const std::shared_ptr<WHIPRuntime> &runtime,
+               const rtc::scoped_refptr<rtc::RTCCertificate> &certificate,
+               BandwidthHistory &bandwidth_history, RunLoop &loop) {
+  rtc::scoped_refptr<WHIPSession> session(
+      new rtc::RefCountedObject<WHIPSession>(endpoint, runtime.get()));
+  session->http_config = config.http_config;
+  session->trickle_ice = config.trickle_ice;
+  session->trickle_coalesce_ms = config.trickle_coalesce_ms;
+  session->ice_restart_delay_ms = config.ice_restart_delay_ms;
+  session->stats_interval_ms = config.stats_interval_ms;
+  session->ice_candidate_pool_size = config.ice_candidate_pool_size;
+  session->certificate = certificate;
+  session->bandwidth_history = &bandwidth_history;
+  if (config.stun_server.has_value()) {
+    session->ice_servers.clear();
+    if (config.stun_server.value() != "none") {
+      session->ice_servers.push_back(config.stun_server.value());
     }
-    key = std::nullopt;
   }
-  return args;
+  // A failed session takes the whole process down so that the supervisor
+  // restarts every camera from a clean state.
+  session->on_failure = [&loop](const std::string &) {
+    loop.Quit(EXIT_FAILURE);
+  };
+  tlog("Requesting connection to whip server %s", endpoint.c_str());
+  StartupPhase phase("peer connection");
+  session->Initialize();
+  if (!session->CreateConnection(true)) {
+    tlog_error("Failed to create connection to %s", endpoint.c_str());
+    return nullptr;
+  }
+  return session;
 }
 
-class WadiConfig {
-public:
-  std::string whip_endpoint;
-  std::string video_device;
-  CaptureTrackConfig capture_config;
+int main(int argc, char **argv) {
+  // Must come first so that every thread inherits the blocked signal mask.
+  RunLoop loop;
+  rtc::InitializeSSL();
+  WadiConfig config = WadiConfig::FromArgs(argc, argv);
+  log_set_level(config.log_level);
+  log_install_webrtc_sink(config.webrtc_log_level);
+  configure_memory(config.memory);
+  for (int i = 0; i < THREAD_ROLE_COUNT; i++) {
+    set_thread_policy(static_cast<ThreadRole>(i), config.thread_policies[i]);
+  }
+  log_thread_policies();
+  if (config.trace_latency) {
+    GlobalLatencyTracer().SetEnabled(true);
+    loop.on_dump = []() {
+      tlog("Frame latency:\n%s", GlobalLatencyTracer().Dump().c_str());
+    };
+  }
+  std::unique_ptr<HttpServer> metrics_server;
+  if (config.metrics_port != 0) {
+    metrics_server.reset(new HttpServer(
+        "127.0.0.1", config.metrics_port,
+        [](const HttpServerRequest &request, HttpServerResponse &response) {
+          if (request.path != "/metrics") {
+            response.status = 404;
+            return;
+          }
+          if (request.method != "GET") {
+            response.status = 405;
+            return;
+          }
+          response.content_type = "text/plain; version=0.0.4";
+          response.body = GlobalMetrics().RenderPrometheus();
+        }));
+    if (!metrics_server->Start()) {
+      metrics_server.reset();
+    }
+  }
 
-  WadiConfig(std::string whip_endpoint, std::string video_device,
-             CaptureTrackConfig capture_config) {
-    this->whip_endpoint = whip_endpoint;
-    this->video_device = video_device;
-    this->capture_config = capture_config;
+  // Opening a camera and loading the encoder take a few hundred ms of
+  // ioctls and firmware loading each, so they run on their own threads
+  // while the factory and PeerConnections are created. The PeerConnections
+  // start gathering candidates right away, see ice_candidate_pool_size.
+  std::vector<CameraConfig> cameras = config.Cameras();
+  std::vector<rtc::scoped_refptr<webrtc::VideoTrackSourceInterface>> sources(
+      cameras.size());
+  std::vector<std::string> open_errors(cameras.size());
+  std::vector<std::thread> bring_up;
+  for (size_t i = 0; i < cameras.size(); i++) {
+    bring_up.emplace_back([&cameras, &sources, &open_errors, i]() {
+      int64_t start_us = rtc::TimeMicros();
+      try {
+        sources[i] = WHIPSession::OpenCaptureDevice(
+            cameras[i].video_device, cameras[i].capture_config);
+      } catch (const std::exception &e) {
+        open_errors[i] = e.what();
+      }
+      GlobalStartupTimeline().AddPhase("open " + cameras[i].video_device,
+                                       start_us, rtc::TimeMicros());
+    });
   }
+  bring_up.emplace_back([]() {
+    StartupPhase phase("encoder warm-up");
+    WHIPRuntime::WarmUpEncoder();
+  });
+  // Resolving the WHIP hosts for their egress interface may wait on DNS,
+  // which session setup should not.
+  BandwidthHistory bandwidth_history(config.bandwidth_history);
+  bring_up.emplace_back([&cameras, &bandwidth_history]() {
+    StartupPhase phase("egress lookup");
+    for (const CameraConfig &camera : cameras) {
+      bandwidth_history.ResolveEgress(camera.whip_endpoint);
+    }
+  });
+  // Loaded from disk, or generated once for every session of the process.
+  CertificateCache certificates(config.certificate_cache);
+  rtc::scoped_refptr<rtc::RTCCertificate> certificate;
+  std::thread certificate_thread([&certificates, &certificate]() {
+    StartupPhase phase("certificate");
+    certificate = certificates.Get();
+  });
 
-  WadiConfig() {
-    this->whip_endpoint = "http://localhost:8889/wadi/whip";
-    this->video_device = "0";
-    this->capture_config.width = 1280;
-    this->capture_config.height = 720;
-    mempcpy(this->capture_config.fourcc, "I420",
-            4); // this->capture_config.fourcc
-    this->capture_config.fps = 30;
+  // Outlives every session, see WHIPSession::WHIPSession.
+  std::shared_ptr<WHIPRuntime> runtime;
+  {
+    StartupPhase phase("factory");
+    runtime = WHIPRuntime::Create(config.encoder);
+  }
+  // Every PeerConnection is created with the certificate.
+  {
+    StartupPhase phase("wait for certificate");
+    certificate_thread.join();
   }
 
-  static WadiConfig FromArgs(int argc, char **argv) {
-    ParsedArgs args = parse_args(argc, argv);
-    WadiConfig config;
-    if (args.positional.size() > 0) {
-      config.whip_endpoint = args.positional[0];
-    }
-    if (args.named.find("d") != args.named.end()) {
-      config.video_device = args.named["d"];
+  // One session per distinct endpoint; cameras sharing an endpoint become
+  // extra tracks on that session's PeerConnection.
+  std::vector<rtc::scoped_refptr<WHIPSession>> sessions;
+  std::vector<rtc::scoped_refptr<WHIPSession>> camera_sessions;
+  int status = runtime ? EXIT_SUCCESS : EXIT_FAILURE;
+  for (size_t i = 0; i < cameras.size() && status == EXIT_SUCCESS; i++) {
+    rtc::scoped_refptr<WHIPSession> session;
+    for (auto &existing : sessions) {
+      if (existing->url == cameras[i].whip_endpoint) {
+        session = existing;
+      }
     }
-    if (args.named.find("w") != args.named.end()) {
-      config.capture_config.width = atoi(args.named["w"].c_str());
+    if (!session) {
+      session = create_session(config, cameras[i].whip_endpoint, runtime,
+                               certificate, bandwidth_history, loop);
+      if (!session) {
+        status = EXIT_FAILURE;
+        break;
+      }
+      sessions.push_back(session);
     }
-    if (args.named.find("h") != args.named.end()) {
-      config.capture_config.height = atoi(args.named["h"].c_str());
+    camera_sessions.push_back(session);
+  }
+
+  {
+    StartupPhase phase("wait for bring-up");
+    for (std::thread &thread : bring_up) {
+      thread.join();
     }
-    if (args.named.find("r") != args.named.end()) {
-      config.capture_config.fps = atoi(args.named["r"].c_str());
+  }
+  for (size_t i = 0; i < camera_sessions.size() && status == EXIT_SUCCESS;
+       i++) {
+    if (!sources[i]) {
+      tlog_error("Failed to add capture device: %s", open_errors[i].c_str());
+      status = EXIT_FAILURE;
+      break;
     }
-    if (args.named.find("c") != args.named.end()) {
-      for (int i = 0; i < args.named["c"].length(); i++) {
-        args.named["c"][i] = std::toupper(args.named["c"][i]);
-      }
-      mempcpy(config.capture_config.fourcc, args.named["c"].c_str(),
-              args.named["c"].length() > 4 ? 4 : args.named["c"].length());
+    try {
+      camera_sessions[i]->AddCaptureSource(cameras[i].video_device,
+                                           cameras[i].capture_config,
+                                           sources[i]);
+    } catch (const std::exception &e) {
+      tlog_error("Failed to add capture device: %s", e.what());
+      status = EXIT_FAILURE;
     }
-    return config;
   }
-};
+  // Devices that did not make it into a session stop here.
+  sources.clear();
+  camera_sessions.clear();
 
-int main(int argc, char **argv) {
-  rtc::InitializeSSL();
-  WadiConfig config = WadiConfig::FromArgs(argc, argv);
-  rtc::scoped_refptr<WHIPSession> session(
-      new rtc::RefCountedObject<WHIPSession>(config.whip_endpoint));
-  tlog("Requesting connection to whip server %s", config.whip_endpoint.c_str());
-  //"http://159.54.131.60:8889/wadi/whip"));
-  session->Initialize();
-  if (session->CreateConnection(true)) {
-    tlog("Connection created successfully");
+  if (status == EXIT_SUCCESS) {
+    tlog("Publishing %zu session(s)", sessions.size());
+    for (auto &session : sessions) {
+      session->CreateOffer();
+    }
+    status = loop.Run();
+    if (loop.on_dump) {
+      loop.on_dump();
+    }
   }
-  if (config.video_device.find(BASE_VIDEO_PATH) == 0) {
-    config.video_device = config.video_device.substr(strlen(BASE_VIDEO_PATH));
+  if (metrics_server) {
+    metrics_server->Stop();
   }
-  session->AddCaptureDevice(atoi(config.video_device.c_str()),
-                            config.capture_config);
-  session->CreateOffer();
-  while (1)
-    ;
-
-  return 0;
+  for (auto &session : sessions) {
+    session->Close();
+  }
+  sessions.clear();
+  runtime.reset();
+  rtc::CleanupSSL();
+  tlog("Exiting with status %d", status);
+  log_flush();
+  return status;
 }
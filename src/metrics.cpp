@@ -0,0 +1,164 @@
+#include "metrics.h"
+#include "latency_tracer.h"
+#include <sstream>
+
+Metrics &GlobalMetrics() {
+  static Metrics metrics;
+  return metrics;
+}
+
+void Metrics::SetConnectionStats(const std::string &session,
+                                 const ConnectionStats &stats) {
+  std::lock_guard<std::mutex> lock(connections_mutex);
+  connections[session] = stats;
+}
+
+void Metrics::RemoveConnectionStats(const std::string &session) {
+  std::lock_guard<std::mutex> lock(connections_mutex);
+  connections.erase(session);
+}
+
+static void WriteMetric(std::ostringstream &out, const char *name,
+                        const char *type, const char *help, double value) {
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " " << type << "\n";
+  out << name << " " << value << "\n";
+}
+
+// Label values are quoted; backslash, quote and newline are escaped as the
+// text exposition format requires.
+static void WriteLabelValue(std::ostringstream &out, const std::string &value) {
+  out << '"';
+  for (char ch : value) {
+    if (ch == '\\') {
+      out << "\\\\";
+    } else if (ch == '"') {
+      out << "\\\"";
+    } else if (ch == '\n') {
+      out << "\\n";
+    } else {
+      out << ch;
+    }
+  }
+  out << '"';
+}
+
+template <typename Getter>
+static void WriteSessionMetric(std::ostringstream &out, const char *name,
+                               const char *type, const char *help,
+                               const std::map<std::string, ConnectionStats> &c,
+                               Getter getter) {
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " " << type << "\n";
+  for (const auto &connection : c) {
+    out << name << "{session=";
+    WriteLabelValue(out, connection.first);
+    out << "} " << getter(connection.second) << "\n";
+  }
+}
+
+std::string Metrics::RenderPrometheus() {
+  std::ostringstream out;
+  out.precision(12);
+  const PipelineCounters &c = counters;
+  WriteMetric(out, "wadi_frames_captured_total", "counter",
+              "Frames dequeued from capture sources.", c.frames_captured);
+  WriteMetric(out, "wadi_frames_discarded_total", "counter",
+              "Frames dropped before reaching the encoder.",
+              c.frames_discarded);
+  WriteMetric(out, "wadi_frames_adapted_out_total", "counter",
+              "Frames the source skipped to meet the requested frame rate.",
+              c.frames_adapted_out);
+  WriteMetric(out, "wadi_frames_encoded_total", "counter",
+              "Frames delivered by wadi-owned encoders.", c.frames_encoded);
+  WriteMetric(out, "wadi_encode_time_seconds_total", "counter",
+              "Time between encoder input and output.",
+              c.encode_time_us / 1e6);
+  WriteMetric(out, "wadi_encoder_rate_changes_total", "counter",
+              "Bitrate changes applied to hardware encoders.", c.rate_changes);
+  WriteMetric(out, "wadi_encoder_rate_change_seconds_total", "counter",
+              "Time from each bitrate change to the first frame encoded "
+              "after it.",
+              c.rate_change_latency_us / 1e6);
+  WriteMetric(out, "wadi_encoder_keyframes_forced_total", "counter",
+              "Keyframes hardware encoders produced on request.",
+              c.keyframes_forced);
+  WriteMetric(out, "wadi_encoder_keyframe_requests_coalesced_total",
+              "counter",
+              "Keyframe requests merged into another forced keyframe.",
+              c.keyframe_requests_coalesced);
+  WriteMetric(out, "wadi_frames_decoded_total", "counter",
+              "MJPEG frames decoded to I420.", c.frames_decoded);
+  WriteMetric(out, "wadi_decode_time_seconds_total", "counter",
+              "Time spent decoding MJPEG frames.", c.decode_time_us / 1e6);
+  WriteMetric(out, "wadi_capture_queue_depth", "gauge",
+              "Capture buffers currently held outside the driver.",
+              c.capture_queue_depth);
+  WriteMetric(out, "wadi_encoder_queue_depth", "gauge",
+              "Frames queued in wadi-owned encoders.", c.encoder_queue_depth);
+  WriteMetric(out, "wadi_http_requests_total", "counter",
+              "WHIP HTTP requests issued.", c.http_requests);
+  WriteMetric(out, "wadi_http_failures_total", "counter",
+              "WHIP HTTP requests without a 2xx answer.", c.http_failures);
+  WriteMetric(out, "wadi_http_request_duration_seconds_total", "counter",
+              "Time spent in WHIP HTTP requests.", c.http_latency_us / 1e6);
+  WriteMetric(out, "wadi_ice_restarts_total", "counter",
+              "ICE restarts performed.", c.ice_restarts);
+
+  if (GlobalLatencyTracer().is_enabled()) {
+    out << GlobalLatencyTracer().RenderPrometheus();
+  }
+
+  std::lock_guard<std::mutex> lock(connections_mutex);
+  WriteSessionMetric(out, "wadi_rtp_bytes_sent_total", "counter",
+                     "RTP payload bytes sent.", connections,
+                     [](const ConnectionStats &s) { return s.bytes_sent; });
+  WriteSessionMetric(out, "wadi_rtp_packets_sent_total", "counter",
+                     "RTP packets sent.", connections,
+                     [](const ConnectionStats &s) { return s.packets_sent; });
+  WriteSessionMetric(
+      out, "wadi_rtp_frames_encoded_total", "counter",
+      "Frames encoded according to WebRTC.", connections,
+      [](const ConnectionStats &s) { return s.frames_encoded; });
+  WriteSessionMetric(out, "wadi_rtp_frames_sent_total", "counter",
+                     "Frames sent.", connections,
+                     [](const ConnectionStats &s) { return s.frames_sent; });
+  WriteSessionMetric(
+      out, "wadi_rtp_huge_frames_sent_total", "counter",
+      "Frames at least 2.5 times the average frame size.", connections,
+      [](const ConnectionStats &s) { return s.huge_frames_sent; });
+  WriteSessionMetric(out, "wadi_rtp_nack_total", "counter",
+                     "NACKs received.", connections,
+                     [](const ConnectionStats &s) { return s.nack_count; });
+  WriteSessionMetric(out, "wadi_rtp_pli_total", "counter", "PLIs received.",
+                     connections,
+                     [](const ConnectionStats &s) { return s.pli_count; });
+  WriteSessionMetric(out, "wadi_rtp_fir_total", "counter", "FIRs received.",
+                     connections,
+                     [](const ConnectionStats &s) { return s.fir_count; });
+  WriteSessionMetric(out, "wadi_rtp_qp_sum_total", "counter",
+                     "Sum of QP over encoded frames.", connections,
+                     [](const ConnectionStats &s) { return s.qp_sum; });
+  WriteSessionMetric(
+      out, "wadi_target_bitrate_bps", "gauge", "Encoder target bitrate.",
+      connections, [](const ConnectionStats &s) { return s.target_bitrate; });
+  WriteSessionMetric(out, "wadi_available_outgoing_bitrate_bps", "gauge",
+                     "Bandwidth estimate of the selected candidate pair.",
+                     connections, [](const ConnectionStats &s) {
+                       return s.available_outgoing_bitrate;
+                     });
+  WriteSessionMetric(
+      out, "wadi_round_trip_time_seconds", "gauge",
+      "Current RTT of the selected candidate pair.", connections,
+      [](const ConnectionStats &s) { return s.round_trip_time; });
+  WriteSessionMetric(
+      out, "wadi_frames_per_second", "gauge", "Sent frame rate.", connections,
+      [](const ConnectionStats &s) { return s.frames_per_second; });
+  WriteSessionMetric(out, "wadi_frame_width", "gauge", "Sent frame width.",
+                     connections,
+                     [](const ConnectionStats &s) { return s.frame_width; });
+  WriteSessionMetric(out, "wadi_frame_height", "gauge", "Sent frame height.",
+                     connections,
+                     [](const ConnectionStats &s) { return s.frame_height; });
+  return out.str();
+}
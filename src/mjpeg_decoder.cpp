@@ -0,0 +1,412 @@
+#include "mjpeg_decoder.h"
+#include "libyuv/planar_functions.h"
+#include "libyuv/scale.h"
+#include "hot_path.h"
+#include "logging.h"
+#include "metrics.h"
+#include "rtc_base/time_utils.h"
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+
+#include "third_party/libjpeg_turbo/jpeglib.h"
+
+// Output buffers that may be held by sinks and encoders at once before the
+// decoder starts dropping frames.
+#define MJPEG_MAX_POOLED_BUFFERS 30
+
+struct JpegErrorManager {
+  jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+  char message[JMSG_LENGTH_MAX];
+};
+
+struct JpegDecompressorState {
+  jpeg_decompress_struct cinfo;
+  JpegErrorManager error;
+  jpeg_source_mgr source;
+  bool header_read = false;
+  // Per component: whether rows are decoded into the output plane directly,
+  // and the plane to decode into otherwise.
+  bool direct[3];
+  std::vector<uint8_t> scratch[3];
+  // Target of the rows an iMCU row extends past the bottom of the image.
+  std::vector<uint8_t> sink;
+  std::vector<JSAMPROW> rows[3];
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+  JpegErrorManager *error = reinterpret_cast<JpegErrorManager *>(cinfo->err);
+  cinfo->err->format_message(cinfo, error->message);
+  longjmp(error->setjmp_buffer, 1);
+}
+
+static void jpeg_output_message(j_common_ptr cinfo) {
+  // Only warnings get here, typically corrupt data in a frame that still
+  // decodes.
+  char message[JMSG_LENGTH_MAX];
+  cinfo->err->format_message(cinfo, message);
+  tlog_every_ms(5000, LOG_LEVEL_DEBUG, "MJPEG: %s", message);
+}
+
+// The vendored libjpeg-turbo is built without jpeg_mem_src(), so frames are
+// fed through a minimal source manager over the capture buffer.
+static void jpeg_init_source(j_decompress_ptr) {}
+
+static boolean jpeg_fill_input_buffer(j_decompress_ptr cinfo) {
+  // Truncated frame: end it with an EOI marker so the rows decoded so far are
+  // kept, as jdatasrc.c does.
+  static const JOCTET eoi[] = {0xFF, JPEG_EOI};
+  cinfo->src->next_input_byte = eoi;
+  cinfo->src->bytes_in_buffer = sizeof(eoi);
+  return TRUE;
+}
+
+static void jpeg_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
+  if (num_bytes <= 0) {
+    return;
+  }
+  if (static_cast<size_t>(num_bytes) > cinfo->src->bytes_in_buffer) {
+    jpeg_fill_input_buffer(cinfo);
+    return;
+  }
+  cinfo->src->next_input_byte += num_bytes;
+  cinfo->src->bytes_in_buffer -= num_bytes;
+}
+
+static void jpeg_term_source(j_decompress_ptr) {}
+
+JpegDecompressor::JpegDecompressor() : state(new JpegDecompressorState()) {
+  JpegDecompressorState *s = this->state.get();
+  s->cinfo.err = jpeg_std_error(&s->error.pub);
+  s->error.pub.error_exit = jpeg_error_exit;
+  s->error.pub.output_message = jpeg_output_message;
+  jpeg_create_decompress(&s->cinfo);
+  s->source.init_source = jpeg_init_source;
+  s->source.fill_input_buffer = jpeg_fill_input_buffer;
+  s->source.skip_input_data = jpeg_skip_input_data;
+  s->source.resync_to_restart = jpeg_resync_to_restart;
+  s->source.term_source = jpeg_term_source;
+  s->cinfo.src = &s->source;
+}
+
+JpegDecompressor::~JpegDecompressor() {
+  jpeg_destroy_decompress(&this->state->cinfo);
+}
+
+int JpegDecompressor::width() const { return this->state->cinfo.image_width; }
+
+int JpegDecompressor::height() const {
+  return this->state->cinfo.image_height;
+}
+
+bool JpegDecompressor::ReadHeader(const uint8_t *data, size_t size) {
+  JpegDecompressorState *s = this->state.get();
+  s->header_read = false;
+  if (setjmp(s->error.setjmp_buffer)) {
+    jpeg_abort_decompress(&s->cinfo);
+    tlog_every_ms(5000, LOG_LEVEL_WARN, "Failed to read MJPEG header: %s",
+                  s->error.message);
+    return false;
+  }
+  jpeg_abort_decompress(&s->cinfo);
+  s->source.next_input_byte = data;
+  s->source.bytes_in_buffer = size;
+  if (jpeg_read_header(&s->cinfo, TRUE) != JPEG_HEADER_OK) {
+    return false;
+  }
+
+  jpeg_decompress_struct &cinfo = s->cinfo;
+  bool supported =
+      (cinfo.num_components == 3 && cinfo.jpeg_color_space == JCS_YCbCr) ||
+      (cinfo.num_components == 1 && cinfo.jpeg_color_space == JCS_GRAYSCALE);
+  for (int c = 1; supported && c < cinfo.num_components; c++) {
+    supported = cinfo.comp_info[c].h_samp_factor == 1 &&
+                cinfo.comp_info[c].v_samp_factor == 1;
+  }
+  if (supported && (cinfo.comp_info[0].h_samp_factor > 2 ||
+                    cinfo.comp_info[0].v_samp_factor > 2)) {
+    supported = false;
+  }
+  if (!supported) {
+    tlog_every_ms(5000, LOG_LEVEL_WARN,
+                  "Unsupported MJPEG frame: %d components, %dx%d sampling",
+                  cinfo.num_components, cinfo.comp_info[0].h_samp_factor,
+                  cinfo.comp_info[0].v_samp_factor);
+    jpeg_abort_decompress(&cinfo);
+    return false;
+  }
+  s->header_read = true;
+  return true;
+}
+
+bool JpegDecompressor::DecodeTo(webrtc::I420Buffer *out) {
+  JpegDecompressorState *s = this->state.get();
+  jpeg_decompress_struct &cinfo = s->cinfo;
+  if (!s->header_read || out->width() != static_cast<int>(cinfo.image_width) ||
+      out->height() != static_cast<int>(cinfo.image_height)) {
+    return false;
+  }
+  s->header_read = false;
+  if (setjmp(s->error.setjmp_buffer)) {
+    jpeg_abort_decompress(&cinfo);
+    tlog_every_ms(5000, LOG_LEVEL_WARN, "Failed to decode MJPEG frame: %s",
+                  s->error.message);
+    return false;
+  }
+
+  cinfo.raw_data_out = TRUE;
+  cinfo.out_color_space = cinfo.jpeg_color_space;
+  cinfo.do_fancy_upsampling = FALSE;
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_decompress(&cinfo);
+
+  uint8_t *planes[3] = {out->MutableDataY(), out->MutableDataU(),
+                        out->MutableDataV()};
+  int strides[3] = {out->StrideY(), out->StrideU(), out->StrideV()};
+  int widths[3] = {out->width(), out->ChromaWidth(), out->ChromaWidth()};
+  int heights[3] = {out->height(), out->ChromaHeight(), out->ChromaHeight()};
+  int max_lines = cinfo.max_v_samp_factor * DCTSIZE;
+  int imcu_rows = (cinfo.output_height + max_lines - 1) / max_lines;
+
+  size_t sink_width = 0;
+  for (int c = 0; c < cinfo.num_components; c++) {
+    const jpeg_component_info &comp = cinfo.comp_info[c];
+    int padded_width = comp.width_in_blocks * DCTSIZE;
+    s->direct[c] = static_cast<int>(comp.downsampled_width) == widths[c] &&
+                   static_cast<int>(comp.downsampled_height) == heights[c] &&
+                   padded_width <= strides[c];
+    if (!s->direct[c]) {
+      s->scratch[c].resize(static_cast<size_t>(padded_width) * imcu_rows *
+                           comp.v_samp_factor * DCTSIZE);
+    }
+    s->rows[c].resize(comp.v_samp_factor * DCTSIZE);
+    sink_width = std::max(sink_width, static_cast<size_t>(padded_width));
+  }
+  s->sink.resize(sink_width);
+
+  JSAMPARRAY image[3];
+  while (cinfo.output_scanline < cinfo.output_height) {
+    int imcu_row = cinfo.output_scanline / max_lines;
+    for (int c = 0; c < cinfo.num_components; c++) {
+      const jpeg_component_info &comp = cinfo.comp_info[c];
+      int padded_width = comp.width_in_blocks * DCTSIZE;
+      int rows = comp.v_samp_factor * DCTSIZE;
+      for (int r = 0; r < rows; r++) {
+        int y = imcu_row * rows + r;
+        if (!s->direct[c]) {
+          s->rows[c][r] = s->scratch[c].data() +
+                          static_cast<size_t>(y) * padded_width;
+        } else if (y < heights[c]) {
+          s->rows[c][r] = planes[c] + static_cast<size_t>(y) * strides[c];
+        } else {
+          s->rows[c][r] = s->sink.data();
+        }
+      }
+      image[c] = s->rows[c].data();
+    }
+    if (jpeg_read_raw_data(&cinfo, image, max_lines) == 0) {
+      jpeg_abort_decompress(&cinfo);
+      return false;
+    }
+  }
+
+  // comp_info is freed with the image, so resample before finishing.
+  for (int c = 0; c < cinfo.num_components; c++) {
+    if (s->direct[c]) {
+      continue;
+    }
+    const jpeg_component_info &comp = cinfo.comp_info[c];
+    libyuv::ScalePlane(s->scratch[c].data(), comp.width_in_blocks * DCTSIZE,
+                       comp.downsampled_width, comp.downsampled_height,
+                       planes[c], strides[c], widths[c], heights[c],
+                       libyuv::kFilterBox);
+  }
+  if (cinfo.num_components == 1) {
+    libyuv::SetPlane(planes[1], strides[1], widths[1], heights[1], 128);
+    libyuv::SetPlane(planes[2], strides[2], widths[2], heights[2], 128);
+  }
+  jpeg_finish_decompress(&cinfo);
+  return true;
+}
+
+MjpegDecoder::MjpegDecoder(size_t num_threads, FrameCallback on_frame,
+                           std::function<void()> on_dropped)
+    : on_frame(std::move(on_frame)), on_dropped(std::move(on_dropped)),
+      max_in_flight(num_threads + 1), stopping(false),
+      pool(/*zero_initialize=*/false, MJPEG_MAX_POOLED_BUFFERS) {
+  this->in_flight.reserve(this->max_in_flight);
+  this->todo.reserve(this->max_in_flight);
+  this->spare_jobs.reserve(this->max_in_flight);
+  for (size_t i = 0; i < this->max_in_flight; i++) {
+    this->spare_jobs.push_back(std::make_shared<Job>());
+  }
+  for (size_t i = 0; i < num_threads; i++) {
+    this->workers.emplace_back(&MjpegDecoder::Run, this);
+  }
+}
+
+MjpegDecoder::~MjpegDecoder() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+  }
+  this->work_available.notify_all();
+  for (std::thread &worker : this->workers) {
+    worker.join();
+  }
+}
+
+size_t MjpegDecoder::DefaultThreadCount() {
+  size_t cores = std::thread::hardware_concurrency();
+  return std::max<size_t>(2, std::min<size_t>(4, cores / 2));
+}
+
+bool MjpegDecoder::Decode(Frame frame) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  if (this->in_flight.size() >= this->max_in_flight) {
+    return false;
+  }
+  // Jobs still being delivered are not spare yet; only then is another
+  // one allocated.
+  std::shared_ptr<Job> job;
+  if (this->spare_jobs.empty()) {
+    job = std::make_shared<Job>();
+  } else {
+    job = std::move(this->spare_jobs.back());
+    this->spare_jobs.pop_back();
+  }
+  job->frame = std::move(frame);
+  this->in_flight.push_back(job);
+  this->todo.push_back(std::move(job));
+  this->work_available.notify_one();
+  return true;
+}
+
+void MjpegDecoder::Flush() {
+  {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->job_done.wait(lock, [this]() { return this->in_flight.empty(); });
+  }
+  // Jobs leave |in_flight| before they are delivered, under deliver_mutex.
+  std::lock_guard<std::mutex> deliver(this->deliver_mutex);
+}
+
+void MjpegDecoder::Preallocate(int width, int height) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->ResizePool(width, height);
+}
+
+void MjpegDecoder::ResizePool(int width, int height) {
+  if (width != this->pool_width || height != this->pool_height) {
+    warm_buffer_pool(&this->pool, width, height);
+    this->pool_width = width;
+    this->pool_height = height;
+  }
+}
+
+void MjpegDecoder::Run() {
+  pthread_setname_np(pthread_self(), "MjpegDecoder");
+  JpegDecompressor decompressor;
+  // Full-size decode target for frames that are cropped or scaled after.
+  rtc::scoped_refptr<webrtc::I420Buffer> scratch;
+  std::vector<std::shared_ptr<Job>> ready;
+  ready.reserve(this->max_in_flight);
+  for (;;) {
+    std::shared_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->work_available.wait(
+          lock, [this]() { return this->stopping || !this->todo.empty(); });
+      if (this->todo.empty()) {
+        return;
+      }
+      job = std::move(this->todo.front());
+      this->todo.erase(this->todo.begin());
+    }
+
+    HotPathScope hot_path;
+    // The job belongs to this worker until it is marked done.
+    int64_t start_us = rtc::TimeMicros();
+    const Frame &frame = job->frame;
+    if (decompressor.ReadHeader(frame.data, frame.size)) {
+      int width = decompressor.width();
+      int height = decompressor.height();
+      bool adapt = frame.width != 0 &&
+                   frame.crop_x + frame.crop_width <= width &&
+                   frame.crop_y + frame.crop_height <= height &&
+                   (frame.width != width || frame.height != height);
+      {
+        int output_width = adapt ? frame.width : width;
+        int output_height = adapt ? frame.height : height;
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->ResizePool(output_width, output_height);
+        job->output = this->pool.CreateBuffer(output_width, output_height);
+      }
+      if (!job->output) {
+        tlog_every_ms(5000, LOG_LEVEL_WARN,
+                      "MJPEG output buffers exhausted, dropping frame");
+      } else if (!adapt) {
+        if (!decompressor.DecodeTo(job->output.get())) {
+          job->output = nullptr;
+        }
+      } else {
+        if (!scratch || scratch->width() != width ||
+            scratch->height() != height) {
+          scratch = webrtc::I420Buffer::Create(width, height);
+        }
+        if (decompressor.DecodeTo(scratch.get())) {
+          job->output->CropAndScaleFrom(*scratch, frame.crop_x & ~1,
+                                        frame.crop_y & ~1, frame.crop_width,
+                                        frame.crop_height);
+        } else {
+          job->output = nullptr;
+        }
+      }
+    }
+    // Hand the capture buffer back to the driver as early as possible.
+    job->frame.owner = nullptr;
+    if (job->output) {
+      PipelineCounters &counters = GlobalMetrics().counters;
+      counters.frames_decoded.fetch_add(1, std::memory_order_relaxed);
+      counters.decode_time_us.fetch_add(rtc::TimeMicros() - start_us,
+                                        std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> deliver(this->deliver_mutex);
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      job->done = true;
+      size_t count = 0;
+      while (count < this->in_flight.size() && this->in_flight[count]->done) {
+        ready.push_back(std::move(this->in_flight[count]));
+        count++;
+      }
+      this->in_flight.erase(this->in_flight.begin(),
+                            this->in_flight.begin() + count);
+    }
+    for (std::shared_ptr<Job> &done : ready) {
+      if (done->output) {
+        this->on_frame(webrtc::VideoFrame::Builder()
+                           .set_video_frame_buffer(done->output)
+                           .set_timestamp_us(done->frame.timestamp_us)
+                           .set_rotation(webrtc::kVideoRotation_0)
+                           .build());
+      } else {
+        this->on_dropped();
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      for (std::shared_ptr<Job> &done : ready) {
+        done->output = nullptr;
+        done->done = false;
+        this->spare_jobs.push_back(std::move(done));
+      }
+    }
+    ready.clear();
+    this->job_done.notify_all();
+  }
+}
@@ -0,0 +1,74 @@
+#include "run_loop.h"
+#include "logging.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+RunLoop::RunLoop() : signal_fd(-1), quit_fd(-1), exit_status(EXIT_SUCCESS) {
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+    throw std::runtime_error("Failed to block termination signals");
+  }
+  signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+  quit_fd = eventfd(0, EFD_CLOEXEC);
+  if (signal_fd < 0 || quit_fd < 0) {
+    throw std::runtime_error("Failed to create run loop descriptors");
+  }
+}
+
+RunLoop::~RunLoop() {
+  close(signal_fd);
+  close(quit_fd);
+}
+
+int RunLoop::Run() {
+  pollfd fds[2];
+  fds[0].fd = signal_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = quit_fd;
+  fds[1].events = POLLIN;
+  while (true) {
+    fds[0].revents = fds[1].revents = 0;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      tlog("Run loop poll failed: %s", strerror(errno));
+      return EXIT_FAILURE;
+    }
+    if (fds[0].revents & POLLIN) {
+      signalfd_siginfo info;
+      if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+        continue;
+      }
+      if (info.ssi_signo == SIGUSR1) {
+        if (this->on_dump) {
+          this->on_dump();
+        }
+        continue;
+      }
+      tlog("Received %s, shutting down", strsignal(info.ssi_signo));
+      return EXIT_SUCCESS;
+    }
+    if (fds[1].revents & POLLIN) {
+      return exit_status;
+    }
+  }
+}
+
+void RunLoop::Quit(int status) {
+  exit_status = status;
+  uint64_t value = 1;
+  if (write(quit_fd, &value, sizeof(value)) < 0) {
+    tlog_error("Failed to wake run loop");
+  }
+}
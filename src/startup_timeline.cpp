@@ -0,0 +1,115 @@
+#include "startup_timeline.h"
+#include "logging.h"
+#include "rtc_base/time_utils.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <time.h>
+#include <unistd.h>
+
+// Time the process was started, on the rtc::TimeMicros() clock, or -1 if
+// /proc cannot tell.
+static int64_t process_start_us() {
+  FILE *file = fopen("/proc/self/stat", "r");
+  if (file == nullptr) {
+    return -1;
+  }
+  char line[1024];
+  bool ok = fgets(line, sizeof(line), file) != nullptr;
+  fclose(file);
+  // The command name may contain spaces; fields are counted from after it.
+  char *fields = ok ? strrchr(line, ')') : nullptr;
+  unsigned long long start_ticks = 0;
+  if (fields == nullptr ||
+      sscanf(fields + 1,
+             " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d"
+             " %*d %*d %*d %*d %llu",
+             &start_ticks) != 1) {
+    return -1;
+  }
+  long ticks_per_second = sysconf(_SC_CLK_TCK);
+  struct timespec boot;
+  if (ticks_per_second <= 0 || clock_gettime(CLOCK_BOOTTIME, &boot) != 0) {
+    return -1;
+  }
+  int64_t boot_us = boot.tv_sec * rtc::kNumMicrosecsPerSec +
+                    boot.tv_nsec / rtc::kNumNanosecsPerMicrosec;
+  int64_t start_us = static_cast<int64_t>(start_ticks) *
+                     rtc::kNumMicrosecsPerSec / ticks_per_second;
+  return rtc::TimeMicros() - (boot_us - start_us);
+}
+
+StartupTimeline &GlobalStartupTimeline() {
+  static StartupTimeline timeline;
+  return timeline;
+}
+
+StartupTimeline::StartupTimeline() {
+  this->exec_us = process_start_us();
+  int64_t now_us = rtc::TimeMicros();
+  if (this->exec_us < 0 || this->exec_us > now_us) {
+    this->exec_us = now_us;
+  }
+  this->events.reserve(32);
+}
+
+void StartupTimeline::AddPhase(const std::string &name, int64_t start_us,
+                               int64_t end_us) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->events.push_back({name, start_us, end_us});
+}
+
+void StartupTimeline::Mark(const std::string &name) {
+  int64_t now_us = rtc::TimeMicros();
+  std::lock_guard<std::mutex> lock(this->mutex);
+  for (const Event &event : this->events) {
+    if (event.name == name) {
+      return;
+    }
+  }
+  this->events.push_back({name, now_us, now_us});
+}
+
+void StartupTimeline::OnFirstFrameSent() {
+  if (this->first_frame_sent.load(std::memory_order_relaxed) ||
+      this->first_frame_sent.exchange(true)) {
+    return;
+  }
+  this->Mark("first frame sent");
+  tlog("Startup timeline (ms since exec):\n%s", this->Describe().c_str());
+}
+
+std::string StartupTimeline::Describe() const {
+  std::vector<Event> events;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    events = this->events;
+  }
+  std::stable_sort(events.begin(), events.end(),
+                   [](const Event &a, const Event &b) {
+                     return a.start_us < b.start_us;
+                   });
+  std::string out;
+  char line[128];
+  for (const Event &event : events) {
+    double start_ms = (event.start_us - this->exec_us) / 1000.0;
+    if (event.end_us == event.start_us) {
+      snprintf(line, sizeof(line), "  %-24s %8.1f\n", event.name.c_str(),
+               start_ms);
+    } else {
+      double end_ms = (event.end_us - this->exec_us) / 1000.0;
+      snprintf(line, sizeof(line), "  %-24s %8.1f .. %8.1f  (%.1f)\n",
+               event.name.c_str(), start_ms, end_ms, end_ms - start_ms);
+    }
+    out += line;
+  }
+  return out;
+}
+
+StartupPhase::StartupPhase(const char *name)
+    : name(name), start_us(rtc::TimeMicros()) {}
+
+StartupPhase::~StartupPhase() {
+  GlobalStartupTimeline().AddPhase(this->name, this->start_us,
+                                   rtc::TimeMicros());
+}
@@ -0,0 +1,116 @@
+#include "stats_collector.h"
+#include "api/stats/rtcstats_objects.h"
+#include "logging.h"
+#include "rtc_base/location.h"
+
+// Undefined members read as zero.
+template <typename T>
+static T StatValue(const webrtc::RTCStatsMember<T> &member) {
+  return member.is_defined() ? *member : T();
+}
+
+rtc::scoped_refptr<StatsCollector>
+StatsCollector::Create(std::string label,
+                       rtc::scoped_refptr<webrtc::PeerConnectionInterface> pc,
+                       rtc::Thread *thread, int interval_ms) {
+  return new rtc::RefCountedObject<StatsCollector>(
+      std::move(label), std::move(pc), thread, interval_ms);
+}
+
+StatsCollector::StatsCollector(
+    std::string label, rtc::scoped_refptr<webrtc::PeerConnectionInterface> pc,
+    rtc::Thread *thread, int interval_ms)
+    : label(std::move(label)), pc(std::move(pc)), thread(thread),
+      interval_ms(interval_ms), running(false) {}
+
+StatsCollector::~StatsCollector() {
+  GlobalMetrics().RemoveConnectionStats(this->label);
+}
+
+void StatsCollector::Start() {
+  this->thread->PostTask(RTC_FROM_HERE, [this]() {
+    if (this->running) {
+      return;
+    }
+    this->running = true;
+    this->Poll();
+  });
+}
+
+void StatsCollector::Stop() {
+  this->thread->Invoke<void>(RTC_FROM_HERE, [this]() {
+    this->running = false;
+    this->invoker.Clear();
+  });
+}
+
+void StatsCollector::Poll() {
+  if (!this->running) {
+    return;
+  }
+  this->pc->GetStats(this);
+  this->invoker.AsyncInvokeDelayed<void>(
+      RTC_FROM_HERE, this->thread, [this]() { this->Poll(); },
+      this->interval_ms);
+}
+
+void StatsCollector::OnStatsDelivered(
+    const rtc::scoped_refptr<const webrtc::RTCStatsReport> &report) {
+  ConnectionStats stats;
+  for (const webrtc::RTCOutboundRTPStreamStats *rtp :
+       report->GetStatsOfType<webrtc::RTCOutboundRTPStreamStats>()) {
+    if (!rtp->kind.is_defined() || *rtp->kind != "video") {
+      continue;
+    }
+    stats.bytes_sent += StatValue(rtp->bytes_sent);
+    stats.packets_sent += StatValue(rtp->packets_sent);
+    stats.frames_encoded += StatValue(rtp->frames_encoded);
+    stats.nack_count += StatValue(rtp->nack_count);
+    stats.pli_count += StatValue(rtp->pli_count);
+    stats.fir_count += StatValue(rtp->fir_count);
+    stats.qp_sum += StatValue(rtp->qp_sum);
+    stats.target_bitrate += StatValue(rtp->target_bitrate);
+  }
+  for (const webrtc::RTCMediaStreamTrackStats *track :
+       report->GetStatsOfType<webrtc::RTCMediaStreamTrackStats>()) {
+    if (!track->kind.is_defined() || *track->kind != "video" ||
+        (!track->remote_source.is_defined() || *track->remote_source)) {
+      continue;
+    }
+    stats.frames_sent += StatValue(track->frames_sent);
+    stats.huge_frames_sent += StatValue(track->huge_frames_sent);
+    stats.frames_per_second = StatValue(track->frames_per_second);
+    stats.frame_width = StatValue(track->frame_width);
+    stats.frame_height = StatValue(track->frame_height);
+  }
+  for (const webrtc::RTCTransportStats *transport :
+       report->GetStatsOfType<webrtc::RTCTransportStats>()) {
+    if (!transport->selected_candidate_pair_id.is_defined()) {
+      continue;
+    }
+    const webrtc::RTCStats *pair =
+        report->Get(*transport->selected_candidate_pair_id);
+    if (pair == nullptr) {
+      continue;
+    }
+    const auto &candidate_pair =
+        pair->cast_to<webrtc::RTCIceCandidatePairStats>();
+    stats.available_outgoing_bitrate =
+        StatValue(candidate_pair.available_outgoing_bitrate);
+    stats.round_trip_time =
+        StatValue(candidate_pair.current_round_trip_time);
+    const webrtc::RTCStats *local =
+        candidate_pair.local_candidate_id.is_defined()
+            ? report->Get(*candidate_pair.local_candidate_id)
+            : nullptr;
+    if (local != nullptr) {
+      stats.local_address =
+          StatValue(local->cast_to<webrtc::RTCLocalIceCandidateStats>().ip);
+    }
+  }
+  this->stats = stats;
+  GlobalMetrics().SetConnectionStats(this->label, stats);
+  if (this->on_stats) {
+    this->on_stats(stats);
+  }
+}
@@ -0,0 +1,162 @@
+#include "thread_policy.h"
+#include "logging.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static std::mutex policies_mutex;
+static ThreadPolicy policies[THREAD_ROLE_COUNT];
+
+const char *thread_role_name(ThreadRole role) {
+  switch (role) {
+  case ThreadRole::kNetwork:
+    return "network";
+  case ThreadRole::kWorker:
+    return "worker";
+  case ThreadRole::kSignaling:
+    return "signaling";
+  case ThreadRole::kCapture:
+    return "capture";
+  case ThreadRole::kEncoder:
+    return "encoder";
+  }
+  return "unknown";
+}
+
+static bool parse_int(const std::string &text, int *value) {
+  if (text.empty()) {
+    return false;
+  }
+  char *end;
+  long parsed = strtol(text.c_str(), &end, 10);
+  if (*end != '\0') {
+    return false;
+  }
+  *value = parsed;
+  return true;
+}
+
+bool parse_thread_policy(const std::string &value, ThreadPolicy *policy) {
+  ThreadPolicy parsed;
+  std::stringstream stream(value);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (item.compare(0, 5, "fifo=") == 0) {
+      if (!parse_int(item.substr(5), &parsed.fifo_priority) ||
+          parsed.fifo_priority < 1 || parsed.fifo_priority > 99) {
+        return false;
+      }
+      continue;
+    }
+    if (item.compare(0, 5, "nice=") == 0) {
+      if (!parse_int(item.substr(5), &parsed.nice) || parsed.nice < -20 ||
+          parsed.nice > 19) {
+        return false;
+      }
+      continue;
+    }
+    size_t dash = item.find('-');
+    int first, last;
+    if (dash == std::string::npos) {
+      if (!parse_int(item, &first)) {
+        return false;
+      }
+      last = first;
+    } else if (!parse_int(item.substr(0, dash), &first) ||
+               !parse_int(item.substr(dash + 1), &last)) {
+      return false;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      parsed.cpus.push_back(cpu);
+    }
+  }
+  *policy = parsed;
+  return true;
+}
+
+std::string describe_thread_policy(const ThreadPolicy &policy) {
+  std::ostringstream out;
+  if (policy.cpus.empty()) {
+    out << "any cpu";
+  } else {
+    out << "cpus ";
+    for (size_t i = 0; i < policy.cpus.size(); i++) {
+      out << (i > 0 ? "," : "") << policy.cpus[i];
+    }
+  }
+  if (policy.fifo_priority > 0) {
+    out << ", SCHED_FIFO " << policy.fifo_priority;
+  } else if (policy.nice != 0) {
+    out << ", nice " << policy.nice;
+  }
+  return out.str();
+}
+
+void set_thread_policy(ThreadRole role, const ThreadPolicy &policy) {
+  std::lock_guard<std::mutex> lock(policies_mutex);
+  policies[static_cast<int>(role)] = policy;
+}
+
+bool apply_thread_policy(ThreadRole role) {
+  ThreadPolicy policy;
+  {
+    std::lock_guard<std::mutex> lock(policies_mutex);
+    policy = policies[static_cast<int>(role)];
+  }
+  if (policy.is_default()) {
+    return true;
+  }
+  const char *name = thread_role_name(role);
+  bool ok = true;
+  if (!policy.cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : policy.cpus) {
+      CPU_SET(cpu, &set);
+    }
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+      tlog_warn("Failed to pin %s thread: %s", name, strerror(err));
+      ok = false;
+    }
+  }
+  if (policy.fifo_priority > 0) {
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = policy.fifo_priority;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0) {
+      tlog_warn("Failed to make %s thread SCHED_FIFO %d: %s", name,
+                policy.fifo_priority, strerror(err));
+      ok = false;
+    }
+  } else if (policy.nice != 0) {
+    // Nice values are per thread on Linux, addressed by tid.
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), policy.nice) != 0) {
+      tlog_warn("Failed to set %s thread nice %d: %s", name, policy.nice,
+                strerror(errno));
+      ok = false;
+    }
+  }
+  tlog_debug("Applied %s thread policy: %s", name,
+             describe_thread_policy(policy).c_str());
+  return ok;
+}
+
+void log_thread_policies() {
+  std::lock_guard<std::mutex> lock(policies_mutex);
+  for (int i = 0; i < THREAD_ROLE_COUNT; i++) {
+    tlog("Thread policy %s: %s", thread_role_name(static_cast<ThreadRole>(i)),
+         describe_thread_policy(policies[i]).c_str());
+  }
+}
@@ -1,15 +1,49 @@
 #include "v4l.h"
 #include "logging.h"
+#include "thread_policy.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
 #include <cstring>
 #include <fcntl.h>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <linux/usb/ch9.h>
+#include <linux/usb/video.h>
+#include <linux/uvcvideo.h>
 #include <linux/videodev2.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdexcept>
 #include <string>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#define V4L_POLL_TIMEOUT_MS 1000
+
+// UVC 1.5 H.264 payload extension unit and its picture type control.
+static const uint8_t uvc_h264_xu_guid[16] = {0x41, 0x76, 0x9e, 0xa2, 0x04, 0xde,
+                                             0xe3, 0x47, 0x8b, 0x2b, 0xf4, 0x34,
+                                             0x1a, 0xff, 0x00, 0x3b};
+#define UVCX_PICTURE_TYPE_CONTROL 0x09
+#define UVCX_PICTURE_TYPE_IDR 0x0001
+
+static int xioctl(int fd, unsigned long request, void *arg) {
+  int ret;
+  do {
+    ret = ioctl(fd, request, arg);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
 std::string fourcc_to_string(uint32_t pixelformat) {
   char str[4];
   str[0] = (pixelformat >> 0) & 0xFF;
@@ -19,7 +53,31 @@ std::string fourcc_to_string(uint32_t pixelformat) {
   return std::string(str, 4);
 }
 
-V4LDevice::V4LDevice(std::string path) : sysfs_path(path) {
+bool V4LFrameSize::contains(uint32_t width, uint32_t height) const {
+  if (width < min_width || width > max_width || height < min_height ||
+      height > max_height) {
+    return false;
+  }
+  return (step_width == 0 || (width - min_width) % step_width == 0) &&
+         (step_height == 0 || (height - min_height) % step_height == 0);
+}
+
+double V4LFrameSize::max_fps() const {
+  double fps = 0;
+  for (const v4l2_fract &interval : intervals) {
+    if (interval.numerator != 0) {
+      fps = std::max(fps, static_cast<double>(interval.denominator) /
+                              interval.numerator);
+    }
+  }
+  return fps;
+}
+
+V4LDevice::V4LDevice(std::string path)
+    : framerate(0), sysfs_path(path), formats_listed(false), fd(-1),
+      wake_fd(-1),
+      queue_active(false), streaming(false), restart_requested(false),
+      key_frame_method(kKeyFrameUnknown), h264_xu_unit(-1) {
   if (this->_open() < 0) {
     throw std::runtime_error("Failed to open video capture device");
   }
@@ -38,7 +96,11 @@ V4LDevice::V4LDevice(std::string path) : sysfs_path(path) {
   }
   tlog("Can stream video");
 }
-V4LDevice::~V4LDevice() { close(fd); }
+V4LDevice::~V4LDevice() {
+  this->stop_streaming();
+  this->_release_buffers();
+  close(fd);
+}
 
 bool V4LDevice::can_capture() {
   return cap.capabilities & V4L2_CAP_VIDEO_CAPTURE ||
@@ -49,9 +111,9 @@ bool V4LDevice::can_stream() { return cap.capabilities & V4L2_CAP_STREAMING; }
 int V4LDevice::_open() {
   tlog("Attempting to open video capture device");
   std::string device = this->sysfs_path;
-  fd = open(device.c_str(), O_RDWR);
+  fd = open(device.c_str(), O_RDWR | O_NONBLOCK);
   if (fd < 0) {
-    tlog("Failed to open video capture device");
+    tlog_error("Failed to open video capture device");
     return -1;
   }
   tlog("Successfully opened video capture device");
@@ -61,9 +123,9 @@ int V4LDevice::_open() {
 
 bool V4LDevice::sync_format() {
   v4l2_format desired_format = fmt;
-  int ret = ioctl(fd, VIDIOC_S_FMT, &fmt);
+  int ret = xioctl(fd, VIDIOC_S_FMT, &fmt);
   if (ret < 0) {
-    tlog("Failed to set video format");
+    tlog_error("Failed to set video format");
     return false;
   }
   this->_fill_format();
@@ -72,11 +134,224 @@ bool V4LDevice::sync_format() {
          fmt.fmt.pix.pixelformat == desired_format.fmt.pix.pixelformat;
 }
 
+bool V4LDevice::sync_framerate() {
+  if (this->framerate == 0) {
+    return true;
+  }
+  v4l2_streamparm parm;
+  memset(&parm, 0, sizeof(parm));
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(fd, VIDIOC_G_PARM, &parm) < 0 ||
+      !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+    tlog("Device does not support setting the frame rate");
+    return false;
+  }
+  parm.parm.capture.timeperframe.numerator = 1;
+  parm.parm.capture.timeperframe.denominator = this->framerate;
+  if (xioctl(fd, VIDIOC_S_PARM, &parm) < 0) {
+    tlog_error("Failed to set frame rate");
+    return false;
+  }
+  const v4l2_fract &tpf = parm.parm.capture.timeperframe;
+  tlog("Frame rate: %d/%d", tpf.denominator, tpf.numerator);
+  return tpf.numerator != 0 && tpf.denominator / tpf.numerator == framerate;
+}
+
+const std::vector<V4LFormat> &V4LDevice::formats() {
+  if (!formats_listed) {
+    formats_listed = true;
+    if (!this->_load_cached_formats() && this->_list_formats() == 0) {
+      this->_store_cached_formats();
+    }
+  }
+  return supported_formats;
+}
+
+static std::vector<v4l2_fract> list_frame_intervals(int fd, uint32_t fourcc,
+                                                    uint32_t width,
+                                                    uint32_t height) {
+  std::vector<v4l2_fract> intervals;
+  v4l2_frmivalenum ival;
+  memset(&ival, 0, sizeof(ival));
+  ival.pixel_format = fourcc;
+  ival.width = width;
+  ival.height = height;
+  for (; xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ival.index++) {
+    if (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+      intervals.push_back(ival.discrete);
+      continue;
+    }
+    intervals.push_back(ival.stepwise.min);
+    intervals.push_back(ival.stepwise.max);
+    break;
+  }
+  return intervals;
+}
+
+int V4LDevice::_list_formats() {
+  supported_formats.clear();
+  v4l2_fmtdesc desc;
+  memset(&desc, 0, sizeof(desc));
+  desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  for (; xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++) {
+    V4LFormat format;
+    format.pixelformat = desc.pixelformat;
+    format.flags = desc.flags;
+    format.description = reinterpret_cast<const char *>(desc.description);
+
+    v4l2_frmsizeenum size;
+    memset(&size, 0, sizeof(size));
+    size.pixel_format = desc.pixelformat;
+    for (; xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++) {
+      V4LFrameSize frame_size;
+      if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+        frame_size.min_width = frame_size.max_width = size.discrete.width;
+        frame_size.min_height = frame_size.max_height = size.discrete.height;
+        frame_size.step_width = frame_size.step_height = 0;
+      } else {
+        frame_size.min_width = size.stepwise.min_width;
+        frame_size.max_width = size.stepwise.max_width;
+        frame_size.step_width = size.stepwise.step_width;
+        frame_size.min_height = size.stepwise.min_height;
+        frame_size.max_height = size.stepwise.max_height;
+        frame_size.step_height = size.stepwise.step_height;
+      }
+      // Ranges are probed at their largest size, the most constrained one.
+      frame_size.intervals =
+          list_frame_intervals(fd, desc.pixelformat, frame_size.max_width,
+                               frame_size.max_height);
+      format.sizes.push_back(frame_size);
+      if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+        break;
+      }
+    }
+    tlog("Format %s (%s): %zu frame sizes",
+         fourcc_to_string(format.pixelformat).c_str(),
+         format.description.c_str(), format.sizes.size());
+    for (const V4LFrameSize &frame_size : format.sizes) {
+      tlog_debug("  %ux%u-%ux%u up to %.1f fps", frame_size.min_width,
+                 frame_size.min_height, frame_size.max_width,
+                 frame_size.max_height, frame_size.max_fps());
+    }
+    supported_formats.push_back(std::move(format));
+  }
+  if (errno != EINVAL) {
+    tlog_error("Failed to enumerate formats: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// The cache is keyed by what identifies the camera model and the port it is
+// plugged into, so a different camera on /dev/videoN is probed again.
+std::string V4LDevice::_cache_path() const {
+  std::string dir;
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (xdg != nullptr && xdg[0] != '\0') {
+    dir = xdg;
+  } else if (home != nullptr && home[0] != '\0') {
+    dir = std::string(home) + "/.cache";
+  } else {
+    return "";
+  }
+  std::string key = std::string(reinterpret_cast<const char *>(cap.driver)) +
+                    "-" + reinterpret_cast<const char *>(cap.card) + "-" +
+                    reinterpret_cast<const char *>(cap.bus_info) + "-" +
+                    std::to_string(cap.version);
+  for (char &c : key) {
+    if (!isalnum(static_cast<unsigned char>(c)) && c != '-') {
+      c = '_';
+    }
+  }
+  return dir + "/wadi/v4l-" + key;
+}
+
+#define V4L_FORMAT_CACHE_VERSION "wadi-v4l-formats 1"
+
+bool V4LDevice::_load_cached_formats() {
+  std::string path = this->_cache_path();
+  std::ifstream in(path);
+  std::string line;
+  if (path.empty() || !in || !std::getline(in, line) ||
+      line != V4L_FORMAT_CACHE_VERSION) {
+    return false;
+  }
+  std::vector<V4LFormat> formats;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string kind;
+    fields >> kind;
+    if (kind == "format") {
+      V4LFormat format;
+      fields >> std::hex >> format.pixelformat >> format.flags >> std::dec;
+      std::getline(fields >> std::ws, format.description);
+      formats.push_back(std::move(format));
+    } else if (kind == "size" && !formats.empty()) {
+      V4LFrameSize size;
+      fields >> size.min_width >> size.max_width >> size.step_width >>
+          size.min_height >> size.max_height >> size.step_height;
+      v4l2_fract interval;
+      char slash;
+      while (fields >> interval.numerator >> slash >> interval.denominator) {
+        size.intervals.push_back(interval);
+      }
+      formats.back().sizes.push_back(std::move(size));
+    } else {
+      tlog_warn("Ignoring corrupt format cache %s", path.c_str());
+      return false;
+    }
+  }
+  tlog("Loaded %zu formats from %s", formats.size(), path.c_str());
+  supported_formats = std::move(formats);
+  return true;
+}
+
+void V4LDevice::_store_cached_formats() const {
+  std::string path = this->_cache_path();
+  if (path.empty()) {
+    return;
+  }
+  // Create the directories one by one; existing ones are fine.
+  for (size_t slash = path.find('/', 1); slash != std::string::npos;
+       slash = path.find('/', slash + 1)) {
+    mkdir(path.substr(0, slash).c_str(), 0755);
+  }
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream out(tmp_path);
+    out << V4L_FORMAT_CACHE_VERSION << "\n";
+    for (const V4LFormat &format : supported_formats) {
+      out << "format " << std::hex << format.pixelformat << " "
+          << format.flags << std::dec << " " << format.description << "\n";
+      for (const V4LFrameSize &size : format.sizes) {
+        out << "size " << size.min_width << " " << size.max_width << " "
+            << size.step_width << " " << size.min_height << " "
+            << size.max_height << " " << size.step_height;
+        for (const v4l2_fract &interval : size.intervals) {
+          out << " " << interval.numerator << "/" << interval.denominator;
+        }
+        out << "\n";
+      }
+    }
+    if (!out) {
+      tlog_warn("Failed to write format cache %s", tmp_path.c_str());
+      unlink(tmp_path.c_str());
+      return;
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+    tlog_warn("Failed to write format cache %s: %s", path.c_str(),
+              strerror(errno));
+    unlink(tmp_path.c_str());
+  }
+}
+
 int V4LDevice::_fill_cap() {
   tlog("Getting video capabilities");
-  int ret = ioctl(fd, VIDIOC_QUERYCAP, &cap);
+  int ret = xioctl(fd, VIDIOC_QUERYCAP, &cap);
   if (ret < 0) {
-    tlog("Failed to get video capabilities");
+    tlog_error("Failed to get video capabilities");
     return -1;
   }
   tlog("Driver: %s", cap.driver);
@@ -87,9 +362,9 @@ int V4LDevice::_fill_cap() {
 
 int V4LDevice::_fill_format() {
   fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  int ret = ioctl(fd, VIDIOC_G_FMT, &fmt);
+  int ret = xioctl(fd, VIDIOC_G_FMT, &fmt);
   if (ret < 0) {
-    tlog("Failed to get video format");
+    tlog_error("Failed to get video format");
     return 1;
   }
   std::string format = fourcc_to_string(fmt.fmt.pix.pixelformat);
@@ -98,3 +373,360 @@ int V4LDevice::_fill_format() {
   tlog("Height: %d", fmt.fmt.pix.height);
   return 0;
 }
+
+int V4LDevice::_request_buffers(uint32_t count) {
+  v4l2_requestbuffers req;
+  memset(&req, 0, sizeof(req));
+  req.count = count;
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = V4L2_MEMORY_MMAP;
+  if (xioctl(fd, VIDIOC_REQBUFS, &req) < 0) {
+    tlog_error("Failed to request %d capture buffers: %s", count,
+               strerror(errno));
+    return -1;
+  }
+  if (req.count < 2) {
+    tlog("Insufficient capture buffer memory");
+    return -1;
+  }
+  if (req.count != count) {
+    tlog("Driver granted %d of %d capture buffers", req.count, count);
+  }
+
+  std::lock_guard<std::mutex> lock(buffers_mutex);
+  buffers.resize(req.count);
+  for (uint32_t i = 0; i < req.count; i++) {
+    v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    if (xioctl(fd, VIDIOC_QUERYBUF, &buf) < 0) {
+      tlog_error("Failed to query capture buffer %d", i);
+      return -1;
+    }
+    buffers[i].length = buf.length;
+    buffers[i].outstanding = false;
+    buffers[i].start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, buf.m.offset);
+    if (buffers[i].start == MAP_FAILED) {
+      tlog_error("Failed to map capture buffer %d", i);
+      buffers[i].start = nullptr;
+      return -1;
+    }
+    v4l2_exportbuffer expbuf;
+    memset(&expbuf, 0, sizeof(expbuf));
+    expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    expbuf.index = i;
+    expbuf.flags = O_RDONLY | O_CLOEXEC;
+    if (xioctl(fd, VIDIOC_EXPBUF, &expbuf) == 0) {
+      buffers[i].dmabuf_fd = expbuf.fd;
+    }
+  }
+  if (!buffers.empty() && buffers[0].dmabuf_fd < 0) {
+    tlog_debug("Capture buffers cannot be exported as DMABUF");
+  }
+  return 0;
+}
+
+void V4LDevice::_release_buffers() {
+  std::lock_guard<std::mutex> lock(buffers_mutex);
+  this->_unmap_buffers();
+}
+
+void V4LDevice::_unmap_buffers() {
+  for (V4LBuffer &buffer : buffers) {
+    if (buffer.start != nullptr) {
+      munmap(buffer.start, buffer.length);
+    }
+    if (buffer.dmabuf_fd >= 0) {
+      close(buffer.dmabuf_fd);
+    }
+  }
+  buffers.clear();
+
+  v4l2_requestbuffers req;
+  memset(&req, 0, sizeof(req));
+  req.count = 0;
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = V4L2_MEMORY_MMAP;
+  xioctl(fd, VIDIOC_REQBUFS, &req);
+}
+
+int V4LDevice::_queue_buffer(uint32_t index) {
+  v4l2_buffer buf;
+  memset(&buf, 0, sizeof(buf));
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = V4L2_MEMORY_MMAP;
+  buf.index = index;
+  if (xioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+    tlog_error("Failed to queue capture buffer %d", index);
+    return -1;
+  }
+  return 0;
+}
+
+bool V4LDevice::start_streaming(uint32_t num_buffers, FrameCallback callback) {
+  if (streaming) {
+    return true;
+  }
+  if (!buffers.empty()) {
+    // The previous ring may still be referenced by frames in flight.
+    tlog("Capture buffers from a previous stream are still mapped");
+    return false;
+  }
+  if (this->_request_buffers(num_buffers) < 0) {
+    this->_release_buffers();
+    return false;
+  }
+  for (uint32_t i = 0; i < buffers.size(); i++) {
+    if (this->_queue_buffer(i) < 0) {
+      this->_release_buffers();
+      return false;
+    }
+  }
+
+  wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd < 0) {
+    tlog_error("Failed to create capture wake event");
+    this->_release_buffers();
+    return false;
+  }
+
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+    tlog_error("Failed to start streaming: %s", strerror(errno));
+    close(wake_fd);
+    wake_fd = -1;
+    this->_release_buffers();
+    return false;
+  }
+  tlog("Streaming with %zu mmap buffers", buffers.size());
+
+  on_frame = std::move(callback);
+  queue_active = true;
+  streaming = true;
+  capture_thread = std::thread(&V4LDevice::_capture_loop, this);
+  return true;
+}
+
+void V4LDevice::stop_streaming() {
+  if (!streaming) {
+    return;
+  }
+  streaming = false;
+  uint64_t wake = 1;
+  if (write(wake_fd, &wake, sizeof(wake)) < 0) {
+    tlog_error("Failed to wake capture thread");
+  }
+  if (capture_thread.joinable()) {
+    if (capture_thread.get_id() == std::this_thread::get_id()) {
+      capture_thread.detach();
+    } else {
+      capture_thread.join();
+    }
+  }
+  close(wake_fd);
+  wake_fd = -1;
+  on_frame = nullptr;
+
+  // STREAMOFF hands every buffer back to userspace. Only unmap the ring once
+  // no frame references it anymore; otherwise the last requeue() does it.
+  std::lock_guard<std::mutex> lock(buffers_mutex);
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(fd, VIDIOC_STREAMOFF, &type) < 0) {
+    tlog_error("Failed to stop streaming");
+  }
+  queue_active = false;
+  for (const V4LBuffer &buffer : buffers) {
+    if (buffer.outstanding) {
+      return;
+    }
+  }
+  this->_unmap_buffers();
+}
+
+void V4LDevice::requeue(uint32_t index) {
+  std::lock_guard<std::mutex> lock(buffers_mutex);
+  if (index >= buffers.size() || !buffers[index].outstanding) {
+    return;
+  }
+  buffers[index].outstanding = false;
+  if (queue_active) {
+    this->_queue_buffer(index);
+    return;
+  }
+  for (const V4LBuffer &buffer : buffers) {
+    if (buffer.outstanding) {
+      return;
+    }
+  }
+  this->_unmap_buffers();
+}
+
+void V4LDevice::_capture_loop() {
+  pthread_setname_np(pthread_self(), "V4LCapture");
+  apply_thread_policy(ThreadRole::kCapture);
+  pollfd fds[2];
+  fds[0].fd = fd;
+  fds[0].events = POLLIN | POLLPRI;
+  fds[1].fd = wake_fd;
+  fds[1].events = POLLIN;
+
+  while (streaming) {
+    fds[0].revents = fds[1].revents = 0;
+    int ret = poll(fds, 2, V4L_POLL_TIMEOUT_MS);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      tlog_error("Failed to poll capture device: %s", strerror(errno));
+      break;
+    }
+    if (ret == 0) {
+      tlog_every_ms(5000, LOG_LEVEL_WARN,
+                    "Timed out waiting for a capture buffer");
+      continue;
+    }
+    if (fds[1].revents & POLLIN) {
+      uint64_t value;
+      if (read(wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        break;
+      }
+      if (!streaming) {
+        break;
+      }
+      if (restart_requested.exchange(false)) {
+        this->_restart_stream();
+      }
+      continue;
+    }
+    if (fds[0].revents & POLLERR) {
+      tlog_error("Capture device reported an error");
+      break;
+    }
+
+    v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(fd, VIDIOC_DQBUF, &buf) < 0) {
+      if (errno == EAGAIN) {
+        continue;
+      }
+      tlog_error("Failed to dequeue capture buffer: %s", strerror(errno));
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> lock(buffers_mutex);
+      buffers[buf.index].outstanding = true;
+    }
+    if (buf.flags & V4L2_BUF_FLAG_ERROR || !on_frame) {
+      this->requeue(buf.index);
+      continue;
+    }
+    on_frame(buf);
+  }
+}
+
+void V4LDevice::_restart_stream() {
+  // Runs on the capture thread so that polling never sees the stream off.
+  std::lock_guard<std::mutex> lock(buffers_mutex);
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(fd, VIDIOC_STREAMOFF, &type) < 0) {
+    tlog_error("Failed to stop streaming: %s", strerror(errno));
+    return;
+  }
+  // STREAMOFF returned every queued buffer; frames still in flight are
+  // queued again by requeue() as usual.
+  for (uint32_t i = 0; i < buffers.size(); i++) {
+    if (!buffers[i].outstanding) {
+      this->_queue_buffer(i);
+    }
+  }
+  if (xioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+    tlog_error("Failed to restart streaming: %s", strerror(errno));
+  }
+}
+
+int V4LDevice::_find_h264_xu_unit() {
+  // The unit id is only known from the USB descriptors, which sysfs exposes
+  // on the parent of the video interface.
+  char resolved[PATH_MAX];
+  if (realpath(sysfs_path.c_str(), resolved) == nullptr) {
+    return -1;
+  }
+  std::string name(resolved);
+  name = name.substr(name.rfind('/') + 1);
+  std::ifstream file("/sys/class/video4linux/" + name +
+                         "/device/../descriptors",
+                     std::ios::binary);
+  if (!file) {
+    return -1;
+  }
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  bool in_video_control = false;
+  for (size_t i = 0; i + 2 <= data.size() && data[i] >= 2;) {
+    size_t length = data[i];
+    if (i + length > data.size()) {
+      break;
+    }
+    uint8_t type = data[i + 1];
+    if (type == USB_DT_INTERFACE && length >= 9) {
+      in_video_control = data[i + 5] == USB_CLASS_VIDEO &&
+                         data[i + 6] == UVC_SC_VIDEOCONTROL;
+    } else if (in_video_control && type == USB_DT_CS_INTERFACE &&
+               length >= 20 && data[i + 2] == UVC_VC_EXTENSION_UNIT &&
+               memcmp(&data[i + 4], uvc_h264_xu_guid, 16) == 0) {
+      return data[i + 3];
+    }
+    i += length;
+  }
+  return -1;
+}
+
+bool V4LDevice::request_key_frame() {
+  std::lock_guard<std::mutex> lock(key_frame_mutex);
+  if (key_frame_method == kKeyFrameUnknown ||
+      key_frame_method == kKeyFrameControl) {
+    v4l2_control control;
+    memset(&control, 0, sizeof(control));
+    control.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+    control.value = 1;
+    if (xioctl(fd, VIDIOC_S_CTRL, &control) == 0) {
+      key_frame_method = kKeyFrameControl;
+      return true;
+    }
+    if (key_frame_method == kKeyFrameControl) {
+      return false;
+    }
+    h264_xu_unit = this->_find_h264_xu_unit();
+    key_frame_method =
+        h264_xu_unit >= 0 ? kKeyFrameUvcXu : kKeyFrameRestream;
+    tlog("Requesting key frames from %s by %s", sysfs_path.c_str(),
+         h264_xu_unit >= 0 ? "UVC H.264 extension unit" : "restreaming");
+  }
+  if (key_frame_method == kKeyFrameUvcXu) {
+    uint16_t picture_type[2] = {0, UVCX_PICTURE_TYPE_IDR};
+    uvc_xu_control_query query;
+    memset(&query, 0, sizeof(query));
+    query.unit = h264_xu_unit;
+    query.selector = UVCX_PICTURE_TYPE_CONTROL;
+    query.query = UVC_SET_CUR;
+    query.size = sizeof(picture_type);
+    query.data = reinterpret_cast<uint8_t *>(picture_type);
+    if (xioctl(fd, UVCIOC_CTRL_QUERY, &query) == 0) {
+      return true;
+    }
+    tlog_warn("UVC key frame request failed, falling back to restreaming: %s",
+              strerror(errno));
+    key_frame_method = kKeyFrameRestream;
+  }
+  if (!streaming) {
+    return false;
+  }
+  restart_requested = true;
+  uint64_t wake = 1;
+  return write(wake_fd, &wake, sizeof(wake)) == sizeof(wake);
+}
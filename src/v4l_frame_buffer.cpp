@@ -0,0 +1,272 @@
+#include "v4l_frame_buffer.h"
+#include "api/video/i420_buffer.h"
+#include "libyuv/convert.h"
+#include "libyuv/scale.h"
+#include "logging.h"
+#include "metrics.h"
+#include "rtc_base/ref_counted_object.h"
+#include <algorithm>
+#include <cassert>
+
+webrtc::VideoType fourcc_to_videotype(std::string fourcc) {
+  assert(fourcc.length() == 4);
+  if (fourcc == "I420" || fourcc == "YU12") {
+    return webrtc::VideoType::kI420;
+  }
+  if (fourcc == "IYUV") {
+    return webrtc::VideoType::kIYUV;
+  }
+  if (fourcc == "RGB24") {
+    return webrtc::VideoType::kRGB24;
+  }
+  if (fourcc == "YUY2" || fourcc == "YUYV") {
+    return webrtc::VideoType::kYUY2;
+  }
+  if (fourcc == "YV12") {
+    return webrtc::VideoType::kYV12;
+  }
+  if (fourcc == "UYVY") {
+    return webrtc::VideoType::kUYVY;
+  }
+  if (fourcc == "NV21") {
+    return webrtc::VideoType::kNV21;
+  }
+  if (fourcc == "NV12") {
+    return webrtc::VideoType::kNV12;
+  }
+  if (fourcc == "BGRA") {
+    return webrtc::VideoType::kBGRA;
+  }
+  if (fourcc == "MJPG" || fourcc == "JPEG") {
+    return webrtc::VideoType::kMJPEG;
+  }
+  return webrtc::VideoType::kUnknown;
+}
+
+namespace {
+struct FreeBlock {
+  FreeBlock *next;
+};
+std::mutex free_blocks_mutex;
+FreeBlock *free_blocks = nullptr;
+size_t free_block_count = 0;
+// Blocks reserved by the devices streaming; the free list holds no more.
+size_t free_block_limit = 0;
+// Every frame is a RefCountedObject<V4LFrameBuffer>, so only that size is
+// recycled; anything else goes to the heap.
+const size_t kFreeBlockSize = sizeof(rtc::RefCountedObject<V4LFrameBuffer>);
+} // namespace
+
+void *V4LFrameBuffer::operator new(size_t size) {
+  if (size == kFreeBlockSize) {
+    std::lock_guard<std::mutex> lock(free_blocks_mutex);
+    if (free_blocks != nullptr) {
+      FreeBlock *block = free_blocks;
+      free_blocks = block->next;
+      free_block_count--;
+      return block;
+    }
+  }
+  return ::operator new(size);
+}
+
+void V4LFrameBuffer::operator delete(void *p, size_t size) {
+  if (size == kFreeBlockSize) {
+    std::lock_guard<std::mutex> lock(free_blocks_mutex);
+    if (free_block_count < free_block_limit) {
+      FreeBlock *block = static_cast<FreeBlock *>(p);
+      block->next = free_blocks;
+      free_blocks = block;
+      free_block_count++;
+      return;
+    }
+  }
+  ::operator delete(p);
+}
+
+void V4LFrameBuffer::ReserveBlocks(size_t count) {
+  std::lock_guard<std::mutex> lock(free_blocks_mutex);
+  free_block_limit += count;
+  while (free_block_count < free_block_limit) {
+    FreeBlock *block =
+        static_cast<FreeBlock *>(::operator new(kFreeBlockSize));
+    block->next = free_blocks;
+    free_blocks = block;
+    free_block_count++;
+  }
+}
+
+void V4LFrameBuffer::ReleaseBlocks(size_t count) {
+  std::lock_guard<std::mutex> lock(free_blocks_mutex);
+  free_block_limit -= std::min(count, free_block_limit);
+  // Frames still in flight are freed to the heap as they are dropped.
+  while (free_block_count > free_block_limit) {
+    FreeBlock *block = free_blocks;
+    free_blocks = block->next;
+    free_block_count--;
+    ::operator delete(block);
+  }
+}
+
+V4LFrameBuffer::V4LFrameBuffer(std::shared_ptr<V4LDevice> device,
+                               const v4l2_buffer &buf)
+    : device_(std::move(device)), index_(buf.index) {
+  const V4LBuffer &mapped = device_->buffer(buf.index);
+  data_ = static_cast<const uint8_t *>(mapped.start);
+  dmabuf_fd_ = mapped.dmabuf_fd;
+  size_ = buf.bytesused;
+  fourcc_ = device_->fmt.fmt.pix.pixelformat;
+  stride_ = device_->fmt.fmt.pix.bytesperline;
+  width_ = device_->fmt.fmt.pix.width;
+  height_ = device_->fmt.fmt.pix.height;
+  GlobalMetrics().counters.capture_queue_depth.fetch_add(
+      1, std::memory_order_relaxed);
+}
+
+V4LFrameBuffer::~V4LFrameBuffer() {
+  GlobalMetrics().counters.capture_queue_depth.fetch_sub(
+      1, std::memory_order_relaxed);
+  device_->requeue(index_);
+}
+
+rtc::scoped_refptr<webrtc::I420BufferInterface> V4LFrameBuffer::ToI420() {
+  // Several encoders may ask for the same frame; convert only once.
+  std::lock_guard<std::mutex> lock(i420_mutex_);
+  if (i420_) {
+    return i420_;
+  }
+  rtc::scoped_refptr<webrtc::I420Buffer> i420 =
+      webrtc::I420Buffer::Create(width_, height_);
+  if (is_compressed()) {
+    // Only the passthrough encoder can consume these; anything else gets a
+    // black frame rather than a null buffer.
+    tlog_every_ms(5000, LOG_LEVEL_ERROR,
+                  "Cannot convert %s frames to I420, is H264 negotiated?",
+                  fourcc_to_string(fourcc_).c_str());
+    webrtc::I420Buffer::SetBlack(i420);
+    i420_ = i420;
+    return i420_;
+  }
+  int ret;
+  switch (fourcc_) {
+  case V4L2_PIX_FMT_YUV420:
+    ret = libyuv::I420Copy(data_, stride_, data_ + stride_ * height_,
+                           stride_ / 2,
+                           data_ + stride_ * height_ +
+                               (stride_ / 2) * ((height_ + 1) / 2),
+                           stride_ / 2, i420->MutableDataY(), i420->StrideY(),
+                           i420->MutableDataU(), i420->StrideU(),
+                           i420->MutableDataV(), i420->StrideV(), width_,
+                           height_);
+    break;
+  case V4L2_PIX_FMT_NV12:
+    ret = libyuv::NV12ToI420(data_, stride_, chroma_data(), stride_,
+                             i420->MutableDataY(), i420->StrideY(),
+                             i420->MutableDataU(), i420->StrideU(),
+                             i420->MutableDataV(), i420->StrideV(), width_,
+                             height_);
+    break;
+  case V4L2_PIX_FMT_YUYV:
+    ret = libyuv::YUY2ToI420(data_, stride_, i420->MutableDataY(),
+                             i420->StrideY(), i420->MutableDataU(),
+                             i420->StrideU(), i420->MutableDataV(),
+                             i420->StrideV(), width_, height_);
+    break;
+  case V4L2_PIX_FMT_UYVY:
+    ret = libyuv::UYVYToI420(data_, stride_, i420->MutableDataY(),
+                             i420->StrideY(), i420->MutableDataU(),
+                             i420->StrideU(), i420->MutableDataV(),
+                             i420->StrideV(), width_, height_);
+    break;
+  default:
+    ret = libyuv::ConvertToI420(
+        data_, size_, i420->MutableDataY(), i420->StrideY(),
+        i420->MutableDataU(), i420->StrideU(), i420->MutableDataV(),
+        i420->StrideV(), 0, 0, width_, height_, width_, height_,
+        libyuv::kRotate0, fourcc_);
+    break;
+  }
+  if (ret < 0) {
+    tlog_error("Failed to convert %s frame to I420",
+               fourcc_to_string(fourcc_).c_str());
+    return nullptr;
+  }
+  i420_ = i420;
+  return i420_;
+}
+
+bool V4LFrameBuffer::CropAndScaleTo(
+    int crop_x, int crop_y, int crop_width, int crop_height,
+    webrtc::I420Buffer *out, rtc::scoped_refptr<webrtc::I420Buffer> *scratch) {
+  if (is_compressed()) {
+    return false;
+  }
+  // Chroma is subsampled; keep the crop on even pixels.
+  crop_x &= ~1;
+  crop_y &= ~1;
+  if (fourcc_ == V4L2_PIX_FMT_YUV420) {
+    int chroma_stride = stride_ / 2;
+    const uint8_t *u = data_ + stride_ * height_;
+    const uint8_t *v = u + chroma_stride * ((height_ + 1) / 2);
+    int chroma_offset = chroma_stride * (crop_y / 2) + crop_x / 2;
+    return libyuv::I420Scale(
+               data_ + stride_ * crop_y + crop_x, stride_, u + chroma_offset,
+               chroma_stride, v + chroma_offset, chroma_stride, crop_width,
+               crop_height, out->MutableDataY(), out->StrideY(),
+               out->MutableDataU(), out->StrideU(), out->MutableDataV(),
+               out->StrideV(), out->width(), out->height(),
+               libyuv::kFilterBox) == 0;
+  }
+
+  // libyuv cannot scale packed or semi-planar frames directly.
+  bool scale = crop_width != out->width() || crop_height != out->height();
+  webrtc::I420Buffer *target = out;
+  if (scale) {
+    if (!*scratch || (*scratch)->width() != crop_width ||
+        (*scratch)->height() != crop_height) {
+      *scratch = webrtc::I420Buffer::Create(crop_width, crop_height);
+    }
+    target = scratch->get();
+  }
+  int ret;
+  switch (fourcc_) {
+  case V4L2_PIX_FMT_NV12:
+    ret = libyuv::NV12ToI420(
+        data_ + stride_ * crop_y + crop_x, stride_,
+        chroma_data() + stride_ * (crop_y / 2) + crop_x, stride_,
+        target->MutableDataY(), target->StrideY(), target->MutableDataU(),
+        target->StrideU(), target->MutableDataV(), target->StrideV(),
+        crop_width, crop_height);
+    break;
+  case V4L2_PIX_FMT_YUYV:
+    ret = libyuv::YUY2ToI420(
+        data_ + stride_ * crop_y + crop_x * 2, stride_,
+        target->MutableDataY(), target->StrideY(), target->MutableDataU(),
+        target->StrideU(), target->MutableDataV(), target->StrideV(),
+        crop_width, crop_height);
+    break;
+  case V4L2_PIX_FMT_UYVY:
+    ret = libyuv::UYVYToI420(
+        data_ + stride_ * crop_y + crop_x * 2, stride_,
+        target->MutableDataY(), target->StrideY(), target->MutableDataU(),
+        target->StrideU(), target->MutableDataV(), target->StrideV(),
+        crop_width, crop_height);
+    break;
+  default:
+    ret = libyuv::ConvertToI420(
+        data_, size_, target->MutableDataY(), target->StrideY(),
+        target->MutableDataU(), target->StrideU(), target->MutableDataV(),
+        target->StrideV(), crop_x, crop_y, width_, height_, crop_width,
+        crop_height, libyuv::kRotate0, fourcc_);
+    break;
+  }
+  if (ret < 0) {
+    tlog_every_ms(5000, LOG_LEVEL_ERROR, "Failed to convert %s frame to I420",
+                  fourcc_to_string(fourcc_).c_str());
+    return false;
+  }
+  if (scale) {
+    out->ScaleFrom(*target);
+  }
+  return true;
+}
@@ -0,0 +1,441 @@
+#include "virtual_source.h"
+#include "hot_path.h"
+#include "libyuv/planar_functions.h"
+#include "logging.h"
+#include "metrics.h"
+#include "rtc_base/time_utils.h"
+#include "thread_policy.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+// Output buffers that may be held downstream at once, about what a camera
+// with a few capture buffers allows.
+#define VIRTUAL_MAX_POOLED_BUFFERS 8
+
+#define SYNTHETIC_PREFIX "synthetic"
+#define FILE_PREFIX "file:"
+
+static bool starts_with(const std::string &s, const char *prefix) {
+  return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+bool is_virtual_device(const std::string &device_path) {
+  return device_path == SYNTHETIC_PREFIX ||
+         starts_with(device_path, SYNTHETIC_PREFIX ":") ||
+         starts_with(device_path, FILE_PREFIX);
+}
+
+namespace {
+
+// Cheap deterministic noise, so runs are comparable.
+class XorShift {
+public:
+  explicit XorShift(uint64_t seed) : state(seed) {}
+  uint64_t Next() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+
+private:
+  uint64_t state;
+};
+
+static void fill_noise(XorShift &rng, uint8_t *data, int stride, int width,
+                       int height) {
+  for (int y = 0; y < height; y++) {
+    uint8_t *row = data + y * stride;
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      uint64_t value = rng.Next();
+      memcpy(row + x, &value, 8);
+    }
+    uint64_t value = rng.Next();
+    memcpy(row + x, &value, width - x);
+  }
+}
+
+class SyntheticSource : public VirtualFrameSource {
+public:
+  SyntheticSource(SyntheticPattern pattern, int width, int height)
+      : pattern(pattern), frame_width(width), frame_height(height), count(0),
+        rng(0x9e3779b97f4a7c15ull) {
+    if (pattern == SyntheticPattern::kHighMotion) {
+      MakeTexture();
+    }
+  }
+
+  bool FillFrame(webrtc::I420Buffer *frame) override {
+    switch (pattern) {
+    case SyntheticPattern::kStatic:
+      DrawGradient(frame, 0);
+      break;
+    case SyntheticPattern::kMoving:
+      DrawGradient(frame, count);
+      DrawBox(frame, count);
+      break;
+    case SyntheticPattern::kHighMotion:
+      DrawPan(frame, count);
+      break;
+    case SyntheticPattern::kNoise:
+      fill_noise(rng, frame->MutableDataY(), frame->StrideY(), frame_width,
+                 frame_height);
+      fill_noise(rng, frame->MutableDataU(), frame->StrideU(),
+                 frame->ChromaWidth(), frame->ChromaHeight());
+      fill_noise(rng, frame->MutableDataV(), frame->StrideV(),
+                 frame->ChromaWidth(), frame->ChromaHeight());
+      break;
+    }
+    count++;
+    return true;
+  }
+
+  int width() const override { return frame_width; }
+  int height() const override { return frame_height; }
+
+private:
+  // Diagonal luma ramp scrolling two pixels per frame over flat chroma
+  // that drifts slowly.
+  void DrawGradient(webrtc::I420Buffer *frame, uint32_t n) {
+    for (int y = 0; y < frame_height; y++) {
+      uint8_t *row = frame->MutableDataY() + y * frame->StrideY();
+      uint8_t value = static_cast<uint8_t>(y + 2 * n);
+      for (int x = 0; x < frame_width; x++) {
+        row[x] = value++;
+      }
+    }
+    libyuv::SetPlane(frame->MutableDataU(), frame->StrideU(),
+                     frame->ChromaWidth(), frame->ChromaHeight(),
+                     static_cast<uint8_t>(96 + (n / 4) % 64));
+    libyuv::SetPlane(frame->MutableDataV(), frame->StrideV(),
+                     frame->ChromaWidth(), frame->ChromaHeight(),
+                     static_cast<uint8_t>(160 - (n / 4) % 64));
+  }
+
+  // A white box an eighth of the frame wide bouncing around the frame.
+  void DrawBox(webrtc::I420Buffer *frame, uint32_t n) {
+    int size = std::max(2, frame_width / 8) & ~1;
+    int range_x = std::max(1, frame_width - size);
+    int range_y = std::max(1, frame_height - size);
+    int x = (n * 6) % (2 * range_x);
+    int y = (n * 4) % (2 * range_y);
+    x = (x < range_x ? x : 2 * range_x - x) & ~1;
+    y = (y < range_y ? y : 2 * range_y - y) & ~1;
+    size = std::min({size, frame_width - x, frame_height - y});
+    libyuv::SetPlane(frame->MutableDataY() + y * frame->StrideY() + x,
+                     frame->StrideY(), size, size, 235);
+    libyuv::SetPlane(frame->MutableDataU() + y / 2 * frame->StrideU() + x / 2,
+                     frame->StrideU(), size / 2, size / 2, 128);
+    libyuv::SetPlane(frame->MutableDataV() + y / 2 * frame->StrideV() + x / 2,
+                     frame->StrideV(), size / 2, size / 2, 128);
+  }
+
+  // Texture twice the frame size: random 8x8 blocks with a fine ramp on
+  // top, so every block has edges and no two look alike.
+  void MakeTexture() {
+    texture_width = frame_width * 2;
+    texture_height = frame_height * 2;
+    texture.resize(static_cast<size_t>(texture_width) * texture_height);
+    int blocks_x = (texture_width + 7) / 8;
+    std::vector<uint8_t> blocks(blocks_x);
+    for (int y = 0; y < texture_height; y++) {
+      if (y % 8 == 0) {
+        for (uint8_t &block : blocks) {
+          block = rng.Next() & 0xff;
+        }
+      }
+      uint8_t *row = texture.data() + static_cast<size_t>(y) * texture_width;
+      for (int x = 0; x < texture_width; x++) {
+        row[x] = blocks[x / 8] / 2 + ((x + y) & 0x7f);
+      }
+    }
+  }
+
+  // Pans across the texture by 13 pixels right and 7 down per frame.
+  void DrawPan(webrtc::I420Buffer *frame, uint32_t n) {
+    int offset_x = ((n * 13) % frame_width) & ~1;
+    int offset_y = ((n * 7) % frame_height) & ~1;
+    const uint8_t *src =
+        texture.data() + static_cast<size_t>(offset_y) * texture_width +
+        offset_x;
+    libyuv::CopyPlane(src, texture_width, frame->MutableDataY(),
+                      frame->StrideY(), frame_width, frame_height);
+    // Chroma from the same texture at half resolution, shifted so U and V
+    // differ.
+    int chroma_width = frame->ChromaWidth();
+    int chroma_height = frame->ChromaHeight();
+    const uint8_t *src_u =
+        texture.data() + static_cast<size_t>(offset_y / 2) * texture_width +
+        offset_x / 2;
+    const uint8_t *src_v = src_u + chroma_height * texture_width;
+    libyuv::CopyPlane(src_u, texture_width, frame->MutableDataU(),
+                      frame->StrideU(), chroma_width, chroma_height);
+    libyuv::CopyPlane(src_v, texture_width, frame->MutableDataV(),
+                      frame->StrideV(), chroma_width, chroma_height);
+  }
+
+  SyntheticPattern pattern;
+  int frame_width;
+  int frame_height;
+  uint32_t count;
+  XorShift rng;
+  std::vector<uint8_t> texture;
+  int texture_width = 0;
+  int texture_height = 0;
+};
+
+// Reads 4:2:0 frames from a Y4M or headerless I420 file, starting over at
+// the end.
+class FileSource : public VirtualFrameSource {
+public:
+  ~FileSource() override {
+    if (file != nullptr) {
+      fclose(file);
+    }
+  }
+
+  bool Open(const std::string &path, int width, int height) {
+    this->path = path;
+    file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+      tlog_error("Failed to open %s: %s", path.c_str(), strerror(errno));
+      return false;
+    }
+    frame_width = width;
+    frame_height = height;
+    y4m = path.size() > 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+    if (y4m && !ReadY4MHeader()) {
+      return false;
+    }
+    data_start = ftell(file);
+    if (frame_width <= 0 || frame_height <= 0) {
+      tlog_error("%s: unknown frame size", path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  bool FillFrame(webrtc::I420Buffer *frame) override {
+    for (int attempt = 0; attempt < 2; attempt++) {
+      if (ReadFrame(frame)) {
+        return true;
+      }
+      // Loop; a file without a single whole frame fails the second time.
+      fseek(file, data_start, SEEK_SET);
+    }
+    tlog_error("%s: no complete frame", path.c_str());
+    return false;
+  }
+
+  int width() const override { return frame_width; }
+  int height() const override { return frame_height; }
+  double native_fps() const override { return fps; }
+
+private:
+  // Parses "YUV4MPEG2 W<w> H<h> F<n>:<d> C<colorspace> ...".
+  bool ReadY4MHeader() {
+    char line[256];
+    if (fgets(line, sizeof(line), file) == nullptr ||
+        strncmp(line, "YUV4MPEG2 ", 10) != 0) {
+      tlog_error("%s: not a Y4M file", path.c_str());
+      return false;
+    }
+    std::istringstream tokens(line + 10);
+    std::string token;
+    while (tokens >> token) {
+      switch (token[0]) {
+      case 'W':
+        frame_width = atoi(token.c_str() + 1);
+        break;
+      case 'H':
+        frame_height = atoi(token.c_str() + 1);
+        break;
+      case 'F': {
+        int num = 0;
+        int den = 0;
+        if (sscanf(token.c_str() + 1, "%d:%d", &num, &den) == 2 && den > 0) {
+          fps = static_cast<double>(num) / den;
+        }
+        break;
+      }
+      case 'C':
+        if (!starts_with(token, "C420")) {
+          tlog_error("%s: only 4:2:0 Y4M is supported, not %s",
+                     path.c_str(), token.c_str() + 1);
+          return false;
+        }
+        break;
+      }
+    }
+    return true;
+  }
+
+  bool ReadPlane(uint8_t *data, int stride, int width, int height) {
+    if (stride == width) {
+      return fread(data, width, height, file) == static_cast<size_t>(height);
+    }
+    for (int y = 0; y < height; y++) {
+      if (fread(data + y * stride, width, 1, file) != 1) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool ReadFrame(webrtc::I420Buffer *frame) {
+    if (y4m) {
+      // "FRAME" and optional parameters up to the newline.
+      char tag[6];
+      if (fread(tag, 1, 5, file) != 5 || memcmp(tag, "FRAME", 5) != 0) {
+        return false;
+      }
+      int c;
+      while ((c = fgetc(file)) != '\n') {
+        if (c == EOF) {
+          return false;
+        }
+      }
+    }
+    return ReadPlane(frame->MutableDataY(), frame->StrideY(), frame_width,
+                     frame_height) &&
+           ReadPlane(frame->MutableDataU(), frame->StrideU(),
+                     frame->ChromaWidth(), frame->ChromaHeight()) &&
+           ReadPlane(frame->MutableDataV(), frame->StrideV(),
+                     frame->ChromaWidth(), frame->ChromaHeight());
+  }
+
+  std::string path;
+  FILE *file = nullptr;
+  bool y4m = false;
+  long data_start = 0;
+  int frame_width = 0;
+  int frame_height = 0;
+  double fps = 0;
+};
+
+} // namespace
+
+std::unique_ptr<VirtualFrameSource>
+create_synthetic_source(SyntheticPattern pattern, int width, int height) {
+  return std::unique_ptr<VirtualFrameSource>(
+      new SyntheticSource(pattern, width & ~1, height & ~1));
+}
+
+std::unique_ptr<VirtualFrameSource>
+create_file_source(const std::string &path, int width, int height) {
+  std::unique_ptr<FileSource> source(new FileSource());
+  if (!source->Open(path, width, height)) {
+    return nullptr;
+  }
+  return source;
+}
+
+VirtualCapturer::VirtualCapturer(const std::string &device_path, int width,
+                                 int height, uint32_t fps)
+    : frame_rate(fps > 0 ? fps : 30),
+      pool(/*zero_initialize=*/false, VIRTUAL_MAX_POOLED_BUFFERS),
+      running(false) {
+  if (starts_with(device_path, FILE_PREFIX)) {
+    std::string path = device_path.substr(strlen(FILE_PREFIX));
+    bool fast = false;
+    size_t comma = path.rfind(',');
+    if (comma != std::string::npos && path.substr(comma + 1) == "fast") {
+      fast = true;
+      path.resize(comma);
+    }
+    source = create_file_source(path, width, height);
+    if (!source) {
+      throw std::runtime_error("Failed to open " + path);
+    }
+    if (fast) {
+      frame_rate = 0;
+    } else if (source->native_fps() > 0) {
+      frame_rate = source->native_fps();
+    }
+    return;
+  }
+
+  std::string name = device_path.size() > strlen(SYNTHETIC_PREFIX)
+                         ? device_path.substr(strlen(SYNTHETIC_PREFIX ":"))
+                         : "moving";
+  SyntheticPattern pattern;
+  if (name == "static") {
+    pattern = SyntheticPattern::kStatic;
+  } else if (name == "moving") {
+    pattern = SyntheticPattern::kMoving;
+  } else if (name == "motion") {
+    pattern = SyntheticPattern::kHighMotion;
+  } else if (name == "noise") {
+    pattern = SyntheticPattern::kNoise;
+  } else {
+    throw std::runtime_error("Unknown synthetic pattern " + name);
+  }
+  if (width < 2 || height < 2) {
+    throw std::runtime_error("Synthetic sources need a frame size");
+  }
+  source = create_synthetic_source(pattern, width, height);
+}
+
+VirtualCapturer::~VirtualCapturer() { this->Stop(); }
+
+bool VirtualCapturer::Start(FrameCallback callback) {
+  if (this->running) {
+    return true;
+  }
+  this->on_frame = std::move(callback);
+  warm_buffer_pool(&this->pool, this->width(), this->height());
+  this->running = true;
+  this->thread = std::thread(&VirtualCapturer::Run, this);
+  return true;
+}
+
+void VirtualCapturer::Stop() {
+  if (!this->running) {
+    return;
+  }
+  this->running = false;
+  this->thread.join();
+}
+
+void VirtualCapturer::Run() {
+  pthread_setname_np(pthread_self(), "VirtualCapture");
+  apply_thread_policy(ThreadRole::kCapture);
+  int64_t interval_us =
+      this->frame_rate > 0
+          ? static_cast<int64_t>(rtc::kNumMicrosecsPerSec / this->frame_rate)
+          : 0;
+  int64_t next_us = rtc::TimeMicros();
+  while (this->running) {
+    if (interval_us > 0) {
+      int64_t wait_us = next_us - rtc::TimeMicros();
+      if (wait_us > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+      }
+      next_us += interval_us;
+    }
+    rtc::scoped_refptr<webrtc::I420Buffer> frame =
+        this->pool.CreateBuffer(this->width(), this->height());
+    if (!frame) {
+      if (interval_us > 0) {
+        GlobalMetrics().counters.frames_discarded.fetch_add(
+            1, std::memory_order_relaxed);
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      continue;
+    }
+    if (!this->source->FillFrame(frame.get())) {
+      tlog_error("Virtual source failed, stopping");
+      return;
+    }
+    this->on_frame(frame, rtc::TimeMicros());
+  }
+}
@@ -1,202 +1,519 @@
 #include "whip.h"
 #include <linux/videodev2.h>
-#ifdef HW_ENCODING_SUPPORT
-#include "encoder/jetson_encoder.h"
-#endif
-#include "HTTPRequest/Request.hpp"
-#include "api/audio_codecs/builtin_audio_decoder_factory.h"
-#include "api/audio_codecs/builtin_audio_encoder_factory.h"
-#include "api/create_peerconnection_factory.h"
 #include "api/jsep.h"
 #include "api/peer_connection_interface.h"
 #include "api/rtc_error.h"
 #include "api/rtp_parameters.h"
-#include "api/video_codecs/builtin_video_decoder_factory.h"
-#include "api/video_codecs/builtin_video_encoder_factory.h"
 #include "common_types.h"
+#include "common_video/include/i420_buffer_pool.h"
+#include "format_selector.h"
+#include "hot_path.h"
+#include "latency_tracer.h"
 #include "logging.h"
-#include "media/base/video_broadcaster.h"
-#include "modules/video_capture/video_capture.h"
-#include "modules/video_capture/video_capture_factory.h"
-#include "pc/video_track_source.h"
+#include "media/base/adapted_video_track_source.h"
+#include "metrics.h"
+#include "mjpeg_decoder.h"
 #include "rtc_base/location.h"
+#include "rtc_base/time_utils.h"
+#include "startup_timeline.h"
+#include "stats_collector.h"
 #include "v4l.h"
+#include "v4l_frame_buffer.h"
+#include "virtual_source.h"
 #include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <sstream>
 #include <stdexcept>
 #include <thread>
 
-webrtc::VideoType fourcc_to_videotype(std::string fourcc) {
-  assert(fourcc.length() == 4);
-  if (fourcc == "I420" || fourcc == "YU12") {
-    return webrtc::VideoType::kI420;
-  }
-  if (fourcc == "IYUV") {
-    return webrtc::VideoType::kIYUV;
-  }
-  if (fourcc == "RGB24") {
-    return webrtc::VideoType::kRGB24;
-  }
-  if (fourcc == "YUY2" || fourcc == "YUYV") {
-    return webrtc::VideoType::kYUY2;
-  }
-  if (fourcc == "YV12") {
-    return webrtc::VideoType::kYV12;
-  }
-  if (fourcc == "UYVY") {
-    return webrtc::VideoType::kUYVY;
-  }
-  if (fourcc == "NV21") {
-    return webrtc::VideoType::kNV21;
-  }
-  if (fourcc == "NV12") {
-    return webrtc::VideoType::kNV12;
-  }
-  if (fourcc == "BGRA") {
-    return webrtc::VideoType::kBGRA;
-  }
-  return webrtc::VideoType::kUnknown;
-}
-
-class CapturerTrackSource : public webrtc::VideoTrackSource,
-                            public rtc::VideoSinkInterface<webrtc::VideoFrame> {
+// Wraps a V4L2 device as a track source. Frames pass through the
+// source's VideoAdapter right after capture: skipped frames are dropped
+// before any decoding or conversion, and downscaled ones are cropped and
+// scaled once instead of at full size further down the pipeline.
+class CapturerTrackSource : public rtc::AdaptedVideoTrackSource {
 public:
   static rtc::scoped_refptr<CapturerTrackSource>
   Create(std::string video_device_path) {
-    std::unique_ptr<V4LDevice> device(new V4LDevice(video_device_path));
+    std::shared_ptr<V4LDevice> device(new V4LDevice(video_device_path));
     tlog("Creating video capturer");
-    rtc::scoped_refptr<webrtc::VideoCaptureModule> capturer =
-        webrtc::VideoCaptureFactory::Create((const char *)device->cap.bus_info);
-    if (!capturer) {
-      tlog("Failed to create video capturer");
+    rtc::scoped_refptr<CapturerTrackSource> source(
+        new rtc::RefCountedObject<CapturerTrackSource>(std::move(device)));
+    if (!source->Start(V4L_DEFAULT_NUM_BUFFERS)) {
+      tlog_error("Failed to start video capturer");
       return nullptr;
     }
     tlog("Created video capturer");
-    return new rtc::RefCountedObject<CapturerTrackSource>(std::move(capturer),
-                                                          std::move(device));
+    return source;
   }
 
   static rtc::scoped_refptr<CapturerTrackSource>
   CreateWithConfig(std::string video_device_path, CaptureTrackConfig config) {
-    std::unique_ptr<V4LDevice> device(new V4LDevice(video_device_path));
+    std::shared_ptr<V4LDevice> device(new V4LDevice(video_device_path));
     tlog("Setting video capturer config %dx%d@%d", config.width, config.height,
          config.fps);
-    device->fmt.fmt.pix.width = config.width;
-    device->fmt.fmt.pix.height = config.height;
-    device->fmt.fmt.pix.pixelformat = v4l2_fourcc(
-        config.fourcc[0], config.fourcc[1], config.fourcc[2], config.fourcc[3]);
-    device->framerate = config.fps;
+    CaptureFormat capture = {
+        v4l2_fourcc(config.fourcc[0], config.fourcc[1], config.fourcc[2],
+                    config.fourcc[3]),
+        config.width, config.height, config.fps, 0};
+    if (capture.pixelformat == v4l2_fourcc('A', 'U', 'T', 'O')) {
+      FormatSelectorOptions options;
+#ifdef HW_ENCODING_SUPPORT
+      options.native_yuv_input = true;
+#endif
+      std::optional<CaptureFormat> selected = select_capture_format(
+          device->formats(), config.width, config.height, config.fps, options);
+      if (selected.has_value()) {
+        capture = selected.value();
+        if (capture.fps == 0) {
+          capture.fps = config.fps;
+        }
+        tlog("Selected %s %ux%u@%u",
+             fourcc_to_string(capture.pixelformat).c_str(), capture.width,
+             capture.height, capture.fps);
+      } else {
+        capture.pixelformat = device->fmt.fmt.pix.pixelformat;
+        tlog_warn("No usable capture format, keeping %s",
+                  fourcc_to_string(capture.pixelformat).c_str());
+      }
+    } else if (!supports_capture_format(device->formats(), capture.pixelformat,
+                                        capture.width, capture.height)) {
+      tlog_warn("Device does not list %s %ux%u",
+                fourcc_to_string(capture.pixelformat).c_str(), capture.width,
+                capture.height);
+    }
+    device->fmt.fmt.pix.width = capture.width;
+    device->fmt.fmt.pix.height = capture.height;
+    device->fmt.fmt.pix.pixelformat = capture.pixelformat;
+    device->framerate = capture.fps;
+    if (!device->sync_format()) {
+      tlog("Device adjusted the requested format to %s %dx%d",
+           fourcc_to_string(device->fmt.fmt.pix.pixelformat).c_str(),
+           device->fmt.fmt.pix.width, device->fmt.fmt.pix.height);
+    }
+    if (!device->sync_framerate()) {
+      tlog("Device did not accept %d fps", capture.fps);
+    }
     tlog("Creating video capturer");
-    rtc::scoped_refptr<webrtc::VideoCaptureModule> capturer =
-        webrtc::VideoCaptureFactory::Create((const char *)device->cap.bus_info);
-    if (!capturer) {
-      tlog("Failed to create video capturer");
+    rtc::scoped_refptr<CapturerTrackSource> source(
+        new rtc::RefCountedObject<CapturerTrackSource>(std::move(device)));
+    // Larger or faster capture modes are brought down to the request here.
+    if (config.width > 0 && config.height > 0) {
+      source->video_adapter()->OnOutputFormatRequest(
+          std::make_pair(config.width, config.height),
+          config.width * config.height,
+          config.fps > 0 ? absl::optional<int>(config.fps) : absl::nullopt);
+    }
+    if (!source->Start(config.num_buffers)) {
+      tlog_error("Failed to start video capturer");
       return nullptr;
     }
     tlog("Created video capturer");
-    return new rtc::RefCountedObject<CapturerTrackSource>(std::move(capturer),
-                                                          std::move(device));
+    return source;
   }
 
-  void OnFrame(const webrtc::VideoFrame &frame) override {
-    // tlog("OnFrame");
+  // Same as CreateWithConfig() for a synthetic or file source, see
+  // virtual_source.h. Throws if |device_path| cannot be opened.
+  static rtc::scoped_refptr<CapturerTrackSource>
+  CreateVirtual(std::string device_path, CaptureTrackConfig config) {
+    std::unique_ptr<VirtualCapturer> capturer(new VirtualCapturer(
+        device_path, config.width, config.height, config.fps));
+    tlog("Creating virtual capturer %s %dx%d", device_path.c_str(),
+         capturer->width(), capturer->height());
+    rtc::scoped_refptr<CapturerTrackSource> source(
+        new rtc::RefCountedObject<CapturerTrackSource>(std::move(capturer)));
+    if (config.width > 0 && config.height > 0) {
+      // Unpaced sources are meant to run flat out; only cap their size.
+      source->video_adapter()->OnOutputFormatRequest(
+          std::make_pair(config.width, config.height),
+          config.width * config.height,
+          config.fps > 0 && source->virtual_->fps() > 0
+              ? absl::optional<int>(config.fps)
+              : absl::nullopt);
+    }
+    if (!source->Start(config.num_buffers)) {
+      tlog_error("Failed to start virtual capturer");
+      return nullptr;
+    }
+    return source;
   }
 
-  void OnDiscardedFrame() override { tlog("OnDiscardedFrame"); }
+  SourceState state() const override { return kLive; }
+  bool remote() const override { return false; }
+  bool is_screencast() const override { return false; }
+  absl::optional<bool> needs_denoising() const override { return false; }
 
 protected:
-  explicit CapturerTrackSource(
-      rtc::scoped_refptr<webrtc::VideoCaptureModule> capturer,
-      std::unique_ptr<V4LDevice> device)
-      : VideoTrackSource(/*remote=*/false), capturer_(std::move(capturer)),
-        device_(std::move(device)) {
-//    assert(this->device_->sync_format());
-    this->capturer_->RegisterCaptureDataCallback(&this->broadcaster_);
-
-    struct webrtc::VideoCaptureCapability capability;
-    capability.width = this->device_->fmt.fmt.pix.width;
-    capability.height = this->device_->fmt.fmt.pix.height;
-    capability.maxFPS = this->device_->framerate;
-    capability.videoType = fourcc_to_videotype(
-        fourcc_to_string(this->device_->fmt.fmt.pix.pixelformat));
-    int res = this->capturer_->StartCapture(capability);
-    if (res < 0) {
-      tlog("Failed to start video capturer");
-      assert(false);
+  explicit CapturerTrackSource(std::shared_ptr<V4LDevice> device)
+      : device_(std::move(device)), scaled_pool_(false, 8),
+        next_sequence_(0) {}
+  explicit CapturerTrackSource(std::unique_ptr<VirtualCapturer> capturer)
+      : virtual_(std::move(capturer)), scaled_pool_(false, 8),
+        next_sequence_(0) {}
+
+  ~CapturerTrackSource() override { this->Stop(); }
+
+public:
+  void Stop() {
+    if (this->virtual_) {
+      this->virtual_->Stop();
+    } else {
+      this->device_->stop_streaming();
+      V4LFrameBuffer::ReleaseBlocks(this->reserved_blocks_);
+      this->reserved_blocks_ = 0;
     }
   }
 
 private:
-  rtc::VideoSourceInterface<webrtc::VideoFrame> *source() override {
-    return &this->broadcaster_;
+  bool Start(uint32_t num_buffers) {
+    if (this->virtual_) {
+      this->Preallocate(this->virtual_->width(), this->virtual_->height());
+      return this->virtual_->Start(
+          [this](rtc::scoped_refptr<webrtc::I420Buffer> frame,
+                 int64_t timestamp_us) {
+            this->OnVirtualFrame(frame, timestamp_us);
+          });
+    }
+    uint32_t fourcc = this->device_->fmt.fmt.pix.pixelformat;
+    if (fourcc == V4L2_PIX_FMT_MJPEG || fourcc == V4L2_PIX_FMT_JPEG) {
+      size_t threads = MjpegDecoder::DefaultThreadCount();
+      tlog("Decoding MJPEG on %zu threads", threads);
+      this->decoder_.reset(new MjpegDecoder(
+          threads,
+          [this](const webrtc::VideoFrame &frame) { this->Deliver(frame); },
+          [this]() { this->OnDiscardedFrame(); }));
+    }
+    if (fourcc != V4L2_PIX_FMT_H264) {
+      this->Preallocate(this->device_->fmt.fmt.pix.width,
+                        this->device_->fmt.fmt.pix.height);
+    }
+    V4LFrameBuffer::ReserveBlocks(num_buffers);
+    this->reserved_blocks_ = num_buffers;
+    if (!this->device_->start_streaming(
+            num_buffers,
+            [this](const v4l2_buffer &buf) { this->OnCapturedBuffer(buf); })) {
+      V4LFrameBuffer::ReleaseBlocks(this->reserved_blocks_);
+      this->reserved_blocks_ = 0;
+      return false;
+    }
+    return true;
+  }
+
+  // Fills the pool frames of the size the adapter will ask for come from,
+  // so that the first frames do not allocate it. Runs before capture
+  // starts; no sink has asked for less yet.
+  void Preallocate(int width, int height) {
+    int crop_width, crop_height, out_width, out_height;
+    if (!this->video_adapter()->AdaptFrameResolution(
+            width, height, 0, &crop_width, &crop_height, &out_width,
+            &out_height)) {
+      return;
+    }
+    if (this->decoder_) {
+      this->decoder_->Preallocate(out_width, out_height);
+    } else if (out_width != width || out_height != height) {
+      this->ResizeScaledPool(out_width, out_height);
+    }
+  }
+
+  void Deliver(const webrtc::VideoFrame &frame) {
+    GlobalLatencyTracer().Stamp(kLatencyStageBroadcast, frame.timestamp_us());
+    HotPathPause webrtc_sinks;
+    this->OnFrame(frame);
   }
-  rtc::scoped_refptr<webrtc::VideoCaptureModule> capturer_;
-  std::unique_ptr<V4LDevice> device_;
-  rtc::VideoBroadcaster broadcaster_;
+
+  void OnDiscardedFrame() {
+    GlobalMetrics().counters.frames_discarded.fetch_add(
+        1, std::memory_order_relaxed);
+  }
+
+  // Runs on the V4L2 capture thread. Frames at the adapted size are passed
+  // on as the wrapped mmap buffer, returned to the driver once every sink
+  // has released it; others are cropped and scaled into pooled buffers.
+  void OnCapturedBuffer(const v4l2_buffer &buf) {
+    HotPathScope hot_path;
+    // Gaps in the driver sequence are frames the driver dropped because no
+    // buffer was queued in time.
+    if (this->next_sequence_ != 0 && buf.sequence > this->next_sequence_) {
+      for (uint32_t i = this->next_sequence_; i < buf.sequence; i++) {
+        this->OnDiscardedFrame();
+      }
+    }
+    this->next_sequence_ = buf.sequence + 1;
+    GlobalMetrics().counters.frames_captured.fetch_add(
+        1, std::memory_order_relaxed);
+    int64_t timestamp_us =
+        (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+                V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+            ? buf.timestamp.tv_sec * rtc::kNumMicrosecsPerSec +
+                  buf.timestamp.tv_usec
+            : rtc::TimeMicros();
+    GlobalLatencyTracer().Stamp(kLatencyStageDequeue, timestamp_us);
+    rtc::scoped_refptr<V4LFrameBuffer> buffer(
+        new rtc::RefCountedObject<V4LFrameBuffer>(this->device_, buf));
+    if (buffer->is_compressed()) {
+      // Skipping or scaling would corrupt the bitstream; the encoder side
+      // handles H.264 cameras.
+      this->Deliver(BuildFrame(buffer, timestamp_us));
+      return;
+    }
+    int width, height, crop_width, crop_height, crop_x, crop_y;
+    if (!this->AdaptFrame(buffer->width(), buffer->height(), timestamp_us,
+                          &width, &height, &crop_width, &crop_height, &crop_x,
+                          &crop_y)) {
+      GlobalMetrics().counters.frames_adapted_out.fetch_add(
+          1, std::memory_order_relaxed);
+      return;
+    }
+    bool adapted = width != buffer->width() || height != buffer->height();
+    if (this->decoder_) {
+      // The decoder holds the capture buffer until the frame is decoded.
+      MjpegDecoder::Frame frame = {buffer->data(), buffer->size(),
+                                   timestamp_us, buffer};
+      if (adapted) {
+        frame.crop_x = crop_x;
+        frame.crop_y = crop_y;
+        frame.crop_width = crop_width;
+        frame.crop_height = crop_height;
+        frame.width = width;
+        frame.height = height;
+      }
+      if (!this->decoder_->Decode(std::move(frame))) {
+        this->OnDiscardedFrame();
+      }
+      return;
+    }
+    if (!adapted) {
+      this->Deliver(BuildFrame(buffer, timestamp_us));
+      return;
+    }
+    rtc::scoped_refptr<webrtc::I420Buffer> scaled =
+        this->CreateScaledBuffer(width, height);
+    if (!scaled || !buffer->CropAndScaleTo(crop_x, crop_y, crop_width,
+                                           crop_height, scaled.get(),
+                                           &this->crop_scratch_)) {
+      this->OnDiscardedFrame();
+      return;
+    }
+    // The capture buffer goes back to the driver here.
+    this->Deliver(BuildFrame(scaled, timestamp_us));
+  }
+
+  // Runs on the virtual capturer's thread; the same steps as a camera
+  // frame in I420.
+  void OnVirtualFrame(rtc::scoped_refptr<webrtc::I420Buffer> frame,
+                      int64_t timestamp_us) {
+    HotPathScope hot_path;
+    GlobalMetrics().counters.frames_captured.fetch_add(
+        1, std::memory_order_relaxed);
+    GlobalLatencyTracer().Stamp(kLatencyStageDequeue, timestamp_us);
+    int width, height, crop_width, crop_height, crop_x, crop_y;
+    if (!this->AdaptFrame(frame->width(), frame->height(), timestamp_us,
+                          &width, &height, &crop_width, &crop_height, &crop_x,
+                          &crop_y)) {
+      GlobalMetrics().counters.frames_adapted_out.fetch_add(
+          1, std::memory_order_relaxed);
+      return;
+    }
+    if (width == frame->width() && height == frame->height()) {
+      this->Deliver(BuildFrame(frame, timestamp_us));
+      return;
+    }
+    rtc::scoped_refptr<webrtc::I420Buffer> scaled =
+        this->CreateScaledBuffer(width, height);
+    if (!scaled) {
+      this->OnDiscardedFrame();
+      return;
+    }
+    scaled->CropAndScaleFrom(*frame, crop_x & ~1, crop_y & ~1, crop_width,
+                             crop_height);
+    this->Deliver(BuildFrame(scaled, timestamp_us));
+  }
+
+  void ResizeScaledPool(int width, int height) {
+    if (width != this->scaled_width_ || height != this->scaled_height_) {
+      // The pool drops buffers of the old size on its own.
+      warm_buffer_pool(&this->scaled_pool_, width, height);
+      this->scaled_width_ = width;
+      this->scaled_height_ = height;
+    }
+  }
+
+  rtc::scoped_refptr<webrtc::I420Buffer> CreateScaledBuffer(int width,
+                                                            int height) {
+    this->ResizeScaledPool(width, height);
+    return this->scaled_pool_.CreateBuffer(width, height);
+  }
+
+  static webrtc::VideoFrame
+  BuildFrame(rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer,
+             int64_t timestamp_us) {
+    return webrtc::VideoFrame::Builder()
+        .set_video_frame_buffer(buffer)
+        .set_timestamp_us(timestamp_us)
+        .set_rotation(webrtc::kVideoRotation_0)
+        .build();
+  }
+
+  // Exactly one of the two is set.
+  std::shared_ptr<V4LDevice> device_;
+  std::unique_ptr<VirtualCapturer> virtual_;
+  // Set for MJPEG cameras; as a member it stops its workers before the base
+  // class drops the sinks.
+  std::unique_ptr<MjpegDecoder> decoder_;
+  // Capture thread only.
+  webrtc::I420BufferPool scaled_pool_;
+  int scaled_width_ = 0;
+  int scaled_height_ = 0;
+  rtc::scoped_refptr<webrtc::I420Buffer> crop_scratch_;
+  // Only touched on the capture thread.
+  uint32_t next_sequence_;
+  // V4LFrameBuffer blocks reserved while the device streams.
+  uint32_t reserved_blocks_ = 0;
 };
 
-WHIPSession::WHIPSession(std::string url) : url(url) {
-  this->signaling_thread = rtc::Thread::CreateWithSocketServer();
-  this->signaling_thread->Start();
+WHIPSession::WHIPSession(std::string url, WHIPRuntime *runtime)
+    : runtime(runtime), url(url),
+      offer_answered(/*manual_reset=*/true, /*initially_signaled=*/false) {
+  this->signaling_thread = this->runtime->signaling_thread();
 }
 
-void WHIPSession::Initialize() {
-  this->factory = webrtc::CreatePeerConnectionFactory(
-      nullptr, nullptr, this->signaling_thread.get(), nullptr,
-      webrtc::CreateBuiltinAudioEncoderFactory(),
-      webrtc::CreateBuiltinAudioDecoderFactory(),
-#ifdef HW_ENCODING_SUPPORT
-      CreateJetsonEncoderFactory(),
-#else
-      webrtc::CreateBuiltinVideoEncoderFactory(),
-#endif
-      webrtc::CreateBuiltinVideoDecoderFactory(), nullptr, nullptr);
+WHIPSession::~WHIPSession() {}
 
-  if (!this->factory) {
-    tlog("Failed to create PeerConnectionFactory");
-    return;
-  }
+void WHIPSession::Initialize() {
+  this->client.reset(
+      new WHIPClient(this->signaling_thread, this->http_config));
+  this->factory = this->runtime->factory();
 }
 
 bool WHIPSession::CreateConnection(bool dtls) {
+  if (!this->factory) {
+    return false;
+  }
   webrtc::PeerConnectionInterface::RTCConfiguration config;
   config.sdp_semantics = webrtc::SdpSemantics::kUnifiedPlan;
   config.enable_dtls_srtp = dtls;
-  webrtc::PeerConnectionInterface::IceServer server;
-  server.uri = "stun:stun.l.google.com:19302";
-  config.servers.push_back(server);
+  config.ice_candidate_pool_size = this->ice_candidate_pool_size;
+  if (this->certificate) {
+    config.certificates.push_back(this->certificate);
+  }
+  for (const std::string &uri : this->ice_servers) {
+    webrtc::PeerConnectionInterface::IceServer server;
+    server.uri = uri;
+    config.servers.push_back(server);
+  }
 
   webrtc::PeerConnectionDependencies pc_dependencies(this);
   this->pc =
       this->factory->CreatePeerConnection(config, std::move(pc_dependencies));
-  return this->pc != nullptr;
+  if (!this->pc) {
+    return false;
+  }
+  if (this->bandwidth_history != nullptr) {
+    this->SeedBitrate();
+  }
+  if (this->stats_interval_ms > 0) {
+    this->stats_collector =
+        StatsCollector::Create(this->url, this->pc,
+                               this->signaling_thread,
+                               this->stats_interval_ms);
+    if (this->bandwidth_history != nullptr) {
+      this->stats_collector->on_stats = [this](const ConnectionStats &stats) {
+        uint32_t stable =
+            this->bandwidth_filter.OnSample(stats.available_outgoing_bitrate);
+        if (stable > 0) {
+          this->bandwidth_history->Record(this->url, stats.local_address,
+                                          stable);
+        }
+      };
+    }
+    this->stats_collector->Start();
+  }
+  return true;
 }
 
-void WHIPSession::AddCaptureDevice(uint8_t device_idx,
-                                   std::optional<CaptureTrackConfig> config) {
-  std::string device_path = "/dev/video" + std::to_string(device_idx);
-  rtc::scoped_refptr<CapturerTrackSource> video_device =
-      config.has_value()
-          ? CapturerTrackSource::CreateWithConfig(device_path, config.value())
-          : CapturerTrackSource::Create(device_path);
+void WHIPSession::SeedBitrate() {
+  uint32_t start_bps = this->bandwidth_history->StartBitrate(this->url);
+  if (start_bps == 0) {
+    return;
+  }
+  // The estimator and, through the bitrate allocator, the encoder's
+  // InitEncode() rate both start here instead of at WebRTC's default.
+  webrtc::BitrateSettings settings;
+  if (this->max_bitrate.has_value()) {
+    start_bps = std::min<uint32_t>(start_bps, this->max_bitrate.value());
+    settings.max_bitrate_bps = this->max_bitrate.value();
+  }
+  settings.start_bitrate_bps = start_bps;
+  webrtc::RTCError error = this->pc->SetBitrate(settings);
+  if (!error.ok()) {
+    tlog_warn("Failed to set start bitrate %u: %s", start_bps,
+              error.message());
+  }
+}
+
+rtc::scoped_refptr<webrtc::VideoTrackSourceInterface>
+WHIPSession::OpenCaptureDevice(
+    const std::string &device_path,
+    const std::optional<CaptureTrackConfig> &config) {
+  rtc::scoped_refptr<CapturerTrackSource> video_device;
+  if (is_virtual_device(device_path)) {
+    // Virtual sources have no mode of their own to fall back to.
+    video_device = CapturerTrackSource::CreateVirtual(
+        device_path,
+        config.value_or(CaptureTrackConfig{1280, 720, 30, {'A', 'U', 'T', 'O'},
+                                           V4L_DEFAULT_NUM_BUFFERS, 0}));
+  } else {
+    video_device =
+        config.has_value()
+            ? CapturerTrackSource::CreateWithConfig(device_path, config.value())
+            : CapturerTrackSource::Create(device_path);
+  }
   if (!video_device)
-    throw std::runtime_error("Failed to create video device");
+    throw std::runtime_error("Failed to create video device " + device_path);
+  return video_device;
+}
 
+void WHIPSession::AddCaptureDevice(const std::string &device_path,
+                                   std::optional<CaptureTrackConfig> config) {
+  this->AddCaptureSource(device_path, config,
+                         WHIPSession::OpenCaptureDevice(device_path, config));
+}
+
+void WHIPSession::AddCaptureSource(
+    const std::string &device_path,
+    const std::optional<CaptureTrackConfig> &config,
+    rtc::scoped_refptr<webrtc::VideoTrackSourceInterface> source) {
+  // Every source comes from OpenCaptureDevice().
+  rtc::scoped_refptr<CapturerTrackSource> video_device(
+      static_cast<CapturerTrackSource *>(source.get()));
+  // Compressed frames can only be passed through, never transcoded.
+  if (config.has_value() && memcmp(config->fourcc, "H264", 4) == 0 &&
+      !this->allowed_codecs.has_value())
+    this->allowed_codecs = std::vector<std::string>{"H264"};
+
+  // Every track of the session belongs to one stream, so the receiver can
+  // tell the cameras of a unit apart by track id.
+  std::string track_id = "video" + std::to_string(this->video_tracks.size());
   rtc::scoped_refptr<webrtc::VideoTrackInterface> video_track_(
-      this->factory->CreateVideoTrack("video_label", video_device));
+      this->factory->CreateVideoTrack(track_id, video_device));
 
   webrtc::RTCErrorOr<rtc::scoped_refptr<webrtc::RtpSenderInterface>>
       result_or_error = this->pc->AddTrack(video_track_, {"stream_id"});
   if (!result_or_error.ok()) {
-    tlog("Failed to add video track: %s", result_or_error.error().message());
+    video_device->Stop();
+    throw std::runtime_error(std::string("Failed to add video track: ") +
+                             result_or_error.error().message());
   }
-  //  sender->SetParameters(params);
+  this->video_tracks.push_back(
+      {video_device, result_or_error.value(),
+       config.has_value() ? config->max_bitrate_kbps : 0});
+  tlog("Added %s as track %s", device_path.c_str(), track_id.c_str());
 }
 
 void WHIPSession::CreateOffer() {
   tlog("Creating Offer: %d", this->pc->signaling_state());
-  tlog("Senders: %d", this->pc->GetSenders().size());
+  tlog("Senders: %zu", this->pc->GetSenders().size());
   this->signaling_thread->PostTask(RTC_FROM_HERE, [this]() {
     auto options = webrtc::PeerConnectionInterface::RTCOfferAnswerOptions();
     options.offer_to_receive_video = false;
@@ -206,21 +523,77 @@ void WHIPSession::CreateOffer() {
   });
 }
 
-void WHIPSession::WaitForOffer() {
-  while (this->sdp.empty()) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+bool WHIPSession::WaitForOffer(int timeout_ms) {
+  if (!this->offer_answered.Wait(timeout_ms)) {
+    return false;
+  }
+  return this->answer_applied;
+}
+
+void WHIPSession::Close() {
+  if (this->stats_collector) {
+    this->stats_collector->Stop();
+    this->stats_collector = nullptr;
+  }
+  for (VideoTrack &track : this->video_tracks) {
+    tlog("Stopping capture");
+    track.source->Stop();
+  }
+  if (!this->resource_url.empty()) {
+    tlog("Deleting WHIP resource %s", this->resource_url.c_str());
+    WHIPResponse response =
+        this->client->SendSync("DELETE", this->resource_url);
+    if (!response.ok() && response.error.empty()) {
+      tlog("WHIP server answered DELETE with %d", response.status);
+    }
+    this->resource_url.clear();
+  }
+  // Drops any exchange still queued on the I/O thread.
+  this->client.reset();
+  if (this->pc) {
+    tlog("Closing peer connection");
+    this->pc->Close();
+    this->pc = nullptr;
+  }
+  this->video_tracks.clear();
+  this->factory = nullptr;
+}
+
+void WHIPSession::Fail(const std::string &reason) {
+  tlog("Session failed: %s", reason.c_str());
+  this->offer_answered.Set();
+  if (this->on_failure) {
+    this->on_failure(reason);
   }
 }
 
+std::string WHIPSession::ResolveLocation(const std::string &location) const {
+  if (location.find("://") != std::string::npos) {
+    return location;
+  }
+  // Relative references resolve against the origin or the endpoint's path.
+  size_t authority = this->url.find("://");
+  size_t path =
+      this->url.find('/', authority == std::string::npos ? 0 : authority + 3);
+  std::string origin = this->url.substr(0, path);
+  if (!location.empty() && location[0] == '/') {
+    return origin + location;
+  }
+  size_t last_slash = this->url.rfind('/');
+  if (path == std::string::npos || last_slash < path) {
+    return origin + "/" + location;
+  }
+  return this->url.substr(0, last_slash + 1) + location;
+}
+
 void WHIPSession::OnAddTrack(
-    rtc::scoped_refptr<webrtc::RtpReceiverInterface> receiver,
-    const std::vector<rtc::scoped_refptr<webrtc::MediaStreamInterface>>
-        &streams) {
+    rtc::scoped_refptr<webrtc::RtpReceiverInterface>,
+    const std::vector<rtc::scoped_refptr<webrtc::MediaStreamInterface>> &) {
   tlog("OnAddTrack");
 }
 
 void WHIPSession::OnRemoveTrack(
-    rtc::scoped_refptr<webrtc::RtpReceiverInterface> receiver) {
+    rtc::scoped_refptr<webrtc::RtpReceiverInterface>) {
   tlog("OnRemoveTrack");
 }
 
@@ -229,6 +602,368 @@ void WHIPSession::OnIceCandidate(
   std::string sdp;
   candidate->ToString(&sdp);
   tlog("OnIceCandidate %s", sdp.c_str());
+  GlobalStartupTimeline().Mark("first candidate");
+  if (!this->trickle_ice) {
+    return;
+  }
+  this->pending_candidates[candidate->sdp_mid()].push_back("a=" + sdp);
+  this->ScheduleTrickle();
+}
+
+void WHIPSession::OnIceGatheringChange(
+    webrtc::PeerConnectionInterface::IceGatheringState new_state) {
+  if (new_state != webrtc::PeerConnectionInterface::kIceGatheringComplete) {
+    return;
+  }
+  tlog("ICE gathering complete");
+  GlobalStartupTimeline().Mark("gathering complete");
+  this->gathering_complete = true;
+  if (!this->offer_posted) {
+    std::string offer;
+    this->pc->local_description()->ToString(&offer);
+    this->SendOffer(offer);
+    return;
+  }
+  this->ScheduleTrickle();
+}
+
+void WHIPSession::ScheduleTrickle() {
+  // Candidates are held until the POST returned the resource URL, and during
+  // an ICE restart until the server acknowledged the new credentials.
+  if (!this->trickle_ice || this->resource_url.empty() ||
+      this->trickle_scheduled || this->trickle_in_flight ||
+      this->restart_in_flight) {
+    return;
+  }
+  this->trickle_scheduled = true;
+  this->invoker.AsyncInvokeDelayed<void>(
+      RTC_FROM_HERE, this->signaling_thread,
+      [this]() {
+        this->trickle_scheduled = false;
+        this->SendTrickle();
+      },
+      this->trickle_coalesce_ms);
+}
+
+void WHIPSession::OnIceConnectionChange(
+    webrtc::PeerConnectionInterface::IceConnectionState new_state) {
+  this->ice_state = new_state;
+  switch (new_state) {
+  case webrtc::PeerConnectionInterface::kIceConnectionConnected:
+  case webrtc::PeerConnectionInterface::kIceConnectionCompleted:
+    if (this->ice_restarts > 0) {
+      tlog("ICE reconnected after %d restart(s)", this->ice_restarts);
+    }
+    GlobalStartupTimeline().Mark("ICE connected");
+    this->ice_restarts = 0;
+    break;
+  case webrtc::PeerConnectionInterface::kIceConnectionDisconnected:
+    // Disconnected often recovers on its own; only restart if it persists.
+    tlog("ICE disconnected");
+    this->invoker.AsyncInvokeDelayed<void>(
+        RTC_FROM_HERE, this->signaling_thread,
+        [this]() {
+          if (this->ice_state ==
+              webrtc::PeerConnectionInterface::kIceConnectionDisconnected) {
+            this->RestartIce();
+          }
+        },
+        this->ice_restart_delay_ms);
+    break;
+  case webrtc::PeerConnectionInterface::kIceConnectionFailed:
+    tlog("ICE failed");
+    this->RestartIce();
+    break;
+  default:
+    break;
+  }
+}
+
+void WHIPSession::OnConnectionChange(
+    webrtc::PeerConnectionInterface::PeerConnectionState new_state) {
+  if (new_state ==
+      webrtc::PeerConnectionInterface::PeerConnectionState::kConnected) {
+    GlobalStartupTimeline().Mark("DTLS connected");
+  }
+}
+
+void WHIPSession::RestartIce() {
+  if (this->restart_in_flight || this->resource_url.empty() || !this->pc) {
+    return;
+  }
+  if (this->ice_restarts >= this->max_ice_restarts) {
+    this->Fail("ICE did not recover after " +
+               std::to_string(this->ice_restarts) + " restarts");
+    return;
+  }
+  this->ice_restarts++;
+  GlobalMetrics().counters.ice_restarts.fetch_add(1,
+                                                  std::memory_order_relaxed);
+  this->restart_in_flight = true;
+  tlog("Restarting ICE (attempt %d)", this->ice_restarts);
+
+  // Only the ICE credentials change; capture, encoder and DTLS stay as they
+  // are, so media resumes as soon as a new candidate pair is selected.
+  auto options = webrtc::PeerConnectionInterface::RTCOfferAnswerOptions();
+  options.offer_to_receive_video = false;
+  options.offer_to_receive_audio = false;
+  options.ice_restart = true;
+  rtc::scoped_refptr<WHIPSession> self(this);
+  this->pc->CreateOffer(
+      CallbackCreateSessionDescriptionObserver::Create(
+          [self](webrtc::SessionDescriptionInterface *desc) {
+            self->OnRestartOffer(desc);
+          },
+          [self](const std::string &error) {
+            tlog_error("Failed to create ICE restart offer: %s", error.c_str());
+            self->restart_in_flight = false;
+            self->ScheduleIceRestart();
+          }),
+      options);
+}
+
+void WHIPSession::OnRestartOffer(webrtc::SessionDescriptionInterface *desc) {
+  std::string offer;
+  desc->ToString(&offer);
+  this->pc->SetLocalDescription(DummySetSessionDescriptionObserver::Create(),
+                                desc);
+  this->ParseLocalIceParameters(offer);
+  // Candidates of the previous generation are useless to the server now.
+  this->pending_candidates.clear();
+  this->gathering_complete = false;
+  this->end_of_candidates_sent = false;
+
+  // RFC 9725 4.4.1: an ICE restart is a PATCH carrying the new credentials
+  // with If-Match: *.
+  rtc::scoped_refptr<WHIPSession> self(this);
+  this->client->Send("PATCH", this->resource_url,
+                     this->BuildSdpFragment(false),
+                     {{"Content-Type", "application/trickle-ice-sdpfrag"},
+                      {"If-Match", "*"}},
+                     [self](const WHIPResponse &response) {
+                       self->OnRestartAnswer(response);
+                     });
+}
+
+void WHIPSession::OnRestartAnswer(const WHIPResponse &response) {
+  if (!response.ok()) {
+    tlog("ICE restart PATCH failed: %s",
+         response.error.empty() ? std::to_string(response.status).c_str()
+                                : response.error.c_str());
+    this->FinishIceRestart();
+    if (response.status / 100 == 4) {
+      this->Fail("WHIP server rejected the ICE restart");
+      return;
+    }
+    // The server may just be unreachable for now; try again later.
+    this->ScheduleIceRestart();
+    return;
+  }
+  std::string etag = response.header("etag");
+  if (!etag.empty()) {
+    this->etag = etag;
+  }
+
+  std::string remote;
+  this->pc->remote_description()->ToString(&remote);
+  remote = WHIPSession::SDPReplaceIceParameters(remote, response.body);
+  webrtc::SdpParseError error;
+  std::unique_ptr<webrtc::SessionDescriptionInterface> answer =
+      webrtc::CreateSessionDescription(webrtc::SdpType::kAnswer, remote,
+                                       &error);
+  if (!answer) {
+    tlog_error("Failed to build ICE restart answer: %s",
+               error.description.c_str());
+    this->FinishIceRestart();
+    this->ScheduleIceRestart();
+    return;
+  }
+  this->pc->SetRemoteDescription(DummySetSessionDescriptionObserver::Create(),
+                                 answer.release());
+  tlog("ICE restart answered");
+  this->FinishIceRestart();
+}
+
+void WHIPSession::ScheduleIceRestart() {
+  // ICE has already failed and reports no further change, so nothing else
+  // would try again. Every attempt counts towards |max_ice_restarts|, after
+  // which RestartIce() fails the session.
+  this->invoker.AsyncInvokeDelayed<void>(
+      RTC_FROM_HERE, this->signaling_thread,
+      [this]() {
+        if (this->ice_state !=
+                webrtc::PeerConnectionInterface::kIceConnectionConnected &&
+            this->ice_state !=
+                webrtc::PeerConnectionInterface::kIceConnectionCompleted) {
+          this->RestartIce();
+        }
+      },
+      this->ice_restart_delay_ms);
+}
+
+void WHIPSession::FinishIceRestart() {
+  this->restart_in_flight = false;
+  // Candidates of the new generation gathered while the PATCH was pending.
+  this->ScheduleTrickle();
+}
+
+std::string WHIPSession::SDPReplaceIceParameters(const std::string &sdp,
+                                                 const std::string &fragment) {
+  std::string ufrag;
+  std::string pwd;
+  std::map<std::string, std::vector<std::string>> candidates;
+  std::vector<std::string> bundle_candidates;
+  std::istringstream ifragstream(fragment);
+  std::string line;
+  std::string mid;
+  while (getline(ifragstream, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.rfind("a=ice-ufrag:", 0) == 0) {
+      ufrag = line.substr(strlen("a=ice-ufrag:"));
+    } else if (line.rfind("a=ice-pwd:", 0) == 0) {
+      pwd = line.substr(strlen("a=ice-pwd:"));
+    } else if (line.rfind("a=mid:", 0) == 0) {
+      mid = line.substr(strlen("a=mid:"));
+    } else if (line.rfind("a=candidate:", 0) == 0) {
+      if (mid.empty()) {
+        bundle_candidates.push_back(line);
+      } else {
+        candidates[mid].push_back(line);
+      }
+    }
+  }
+
+  // Swap the credentials and replace the old candidates of each media
+  // section with the ones from the server's fragment.
+  std::istringstream isdpstream(sdp);
+  std::ostringstream osdpstream;
+  while (getline(isdpstream, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.rfind("a=ice-ufrag:", 0) == 0 && !ufrag.empty()) {
+      line = "a=ice-ufrag:" + ufrag;
+    } else if (line.rfind("a=ice-pwd:", 0) == 0 && !pwd.empty()) {
+      line = "a=ice-pwd:" + pwd;
+    } else if (line.rfind("a=candidate:", 0) == 0 ||
+               line == "a=end-of-candidates") {
+      continue;
+    }
+    osdpstream << line << "\r\n";
+    if (line.rfind("a=mid:", 0) == 0) {
+      const std::vector<std::string> &section =
+          candidates.count(line.substr(strlen("a=mid:")))
+              ? candidates[line.substr(strlen("a=mid:"))]
+              : bundle_candidates;
+      for (const std::string &candidate : section) {
+        osdpstream << candidate << "\r\n";
+      }
+    }
+  }
+  return osdpstream.str();
+}
+
+std::string WHIPSession::BuildSdpFragment(bool include_end_of_candidates) {
+  // RFC 8840 fragment: session-level ICE credentials followed by one media
+  // section per mid carrying only its new candidates.
+  std::ostringstream fragment;
+  fragment << "a=ice-ufrag:" << this->ice_ufrag << "\r\n";
+  fragment << "a=ice-pwd:" << this->ice_pwd << "\r\n";
+  for (const auto &media : this->media_lines) {
+    auto candidates = this->pending_candidates.find(media.first);
+    bool has_candidates = candidates != this->pending_candidates.end() &&
+                          !candidates->second.empty();
+    if (!has_candidates && !include_end_of_candidates) {
+      continue;
+    }
+    fragment << media.second << "\r\n";
+    fragment << "a=mid:" << media.first << "\r\n";
+    if (has_candidates) {
+      for (const std::string &candidate : candidates->second) {
+        fragment << candidate << "\r\n";
+      }
+    }
+    if (include_end_of_candidates) {
+      fragment << "a=end-of-candidates\r\n";
+    }
+  }
+  return fragment.str();
+}
+
+void WHIPSession::SendTrickle() {
+  if (!this->client || this->resource_url.empty()) {
+    return;
+  }
+  size_t count = 0;
+  for (const auto &candidates : this->pending_candidates) {
+    count += candidates.second.size();
+  }
+  bool send_end = this->gathering_complete && !this->end_of_candidates_sent;
+  if (count == 0 && !send_end) {
+    return;
+  }
+
+  std::string fragment = this->BuildSdpFragment(send_end);
+  this->pending_candidates.clear();
+  this->end_of_candidates_sent |= send_end;
+  this->trickle_in_flight = true;
+  tlog("Trickling %zu candidates%s", count,
+       send_end ? " and end-of-candidates" : "");
+
+  http::HeaderFields headers = {
+      {"Content-Type", "application/trickle-ice-sdpfrag"}};
+  if (!this->etag.empty()) {
+    headers.push_back({"If-Match", this->etag});
+  }
+  rtc::scoped_refptr<WHIPSession> self(this);
+  this->client->Send("PATCH", this->resource_url, fragment, headers,
+                     [self](const WHIPResponse &response) {
+                       self->OnTrickleResponse(response);
+                     });
+}
+
+void WHIPSession::OnTrickleResponse(const WHIPResponse &response) {
+  this->trickle_in_flight = false;
+  if (response.status == 405 || response.status == 501) {
+    tlog("WHIP server does not support trickle ICE, disabling it");
+    this->trickle_ice = false;
+    this->pending_candidates.clear();
+    return;
+  }
+  if (!response.ok()) {
+    tlog("Trickle ICE PATCH failed: %s",
+         response.error.empty() ? std::to_string(response.status).c_str()
+                                : response.error.c_str());
+  }
+  // Candidates that arrived while the PATCH was in flight.
+  this->ScheduleTrickle();
+}
+
+void WHIPSession::ParseLocalIceParameters(const std::string &offer) {
+  std::istringstream isdpstream(offer);
+  std::string line;
+  std::string mline;
+  this->media_lines.clear();
+  while (getline(isdpstream, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.rfind("a=ice-ufrag:", 0) == 0) {
+      this->ice_ufrag = line.substr(strlen("a=ice-ufrag:"));
+    } else if (line.rfind("a=ice-pwd:", 0) == 0) {
+      this->ice_pwd = line.substr(strlen("a=ice-pwd:"));
+    } else if (line.rfind("m=", 0) == 0) {
+      // The port of a fragment's media section carries no meaning.
+      auto space = line.find(' ');
+      auto port_end = line.find(' ', space + 1);
+      mline = line.substr(0, space) + " 9" + line.substr(port_end);
+    } else if (line.rfind("a=mid:", 0) == 0 && !mline.empty()) {
+      this->media_lines[line.substr(strlen("a=mid:"))] = mline;
+      mline.clear();
+    }
+  }
 }
 
 std::string
@@ -296,56 +1031,92 @@ WHIPSession::SDPForceCodecs(const std::string sdp,
 }
 
 void WHIPSession::OnSuccess(webrtc::SessionDescriptionInterface *desc) {
+  GlobalStartupTimeline().Mark("offer created");
+  desc->ToString(&sdp);
   this->pc->SetLocalDescription(DummySetSessionDescriptionObserver::Create(),
                                 desc);
-  auto sender = this->pc->GetSenders()[0];
-  webrtc::RtpParameters params = sender->GetParameters();
-  tlog("Encodings %d", params.encodings.size());
-  for (auto &encoding : params.encodings) {
-    if (this->max_bitrate.has_value())
-      encoding.max_bitrate_bps = this->max_bitrate.value();
-    if (this->max_framerate.has_value())
-      encoding.max_framerate = this->max_framerate;
+  for (VideoTrack &track : this->video_tracks) {
+    webrtc::RtpParameters params = track.sender->GetParameters();
+    tlog("Encodings %zu", params.encodings.size());
+    for (auto &encoding : params.encodings) {
+      if (track.max_bitrate_kbps != 0)
+        encoding.max_bitrate_bps = track.max_bitrate_kbps * 1000;
+      else if (this->max_bitrate.has_value())
+        encoding.max_bitrate_bps = this->max_bitrate.value();
+      if (this->max_framerate.has_value())
+        encoding.max_framerate = this->max_framerate;
+    }
+    track.sender->SetParameters(params);
   }
-  sender->SetParameters(params);
 
-  desc->ToString(&sdp);
+  // Without trickle ICE the offer has to carry every candidate, so it is
+  // only sent once gathering completed.
+  if (this->trickle_ice) {
+    this->SendOffer(this->sdp);
+  }
+}
+
+void WHIPSession::SendOffer(const std::string &offer) {
+  this->offer_posted = true;
+  this->sdp = offer;
   if (this->allowed_codecs.has_value())
     this->sdp = WHIPSession::SDPForceCodecs(sdp, this->allowed_codecs.value());
   tlog("SDP: %s", sdp.c_str());
+  this->ParseLocalIceParameters(this->sdp);
+  GlobalStartupTimeline().Mark("offer sent");
 
-  http::Request request(this->url);
-  const auto response =
-      request.send("POST", this->sdp, {{"Content-Type", "application/sdp"}});
+  // The POST runs on the client's I/O thread; the answer comes back to the
+  // signaling thread through OnAnswer.
+  rtc::scoped_refptr<WHIPSession> self(this);
+  this->client->Send("POST", this->url, this->sdp,
+                     {{"Content-Type", "application/sdp"}},
+                     [self](const WHIPResponse &response) {
+                       self->OnAnswer(response);
+                     });
+}
 
-  tlog("SDP Sent");
-  if (!response.status.Ok) {
-    tlog("Failed to send SDP");
+void WHIPSession::OnAnswer(const WHIPResponse &response) {
+  if (!response.error.empty()) {
+    this->Fail("Failed to send SDP: " + response.error);
+    return;
+  }
+  tlog("SDP Sent in %ld ms", (long)(response.latency.count() / 1000));
+  if (!response.ok()) {
+    this->Fail("WHIP server rejected the offer with status " +
+               std::to_string(response.status));
     return;
   }
+  std::string location = response.header("location");
+  if (!location.empty()) {
+    this->resource_url = this->ResolveLocation(location);
+    tlog("WHIP resource: %s", this->resource_url.c_str());
+  }
+  this->etag = response.header("etag");
 
-  std::string response_body{response.body.begin(), response.body.end()};
-  tlog("SDP Response: %s", response_body.c_str());
+  tlog("SDP Response: %s", response.body.c_str());
   webrtc::SdpParseError error;
   std::unique_ptr<webrtc::SessionDescriptionInterface> remote_desc =
-      webrtc::CreateSessionDescription(webrtc::SdpType::kAnswer, response_body,
+      webrtc::CreateSessionDescription(webrtc::SdpType::kAnswer, response.body,
                                        &error);
   if (!remote_desc) {
-    tlog("Failed to create remote description");
+    this->Fail("Failed to create remote description: " + error.description);
     return;
   }
   this->pc->SetRemoteDescription(DummySetSessionDescriptionObserver::Create(),
                                  remote_desc.release());
-
-  return;
+  this->answer_applied = true;
+  GlobalStartupTimeline().Mark("answer applied");
+  this->offer_answered.Set();
+  this->ScheduleTrickle();
 }
 
 void WHIPSession::OnFailure(webrtc::RTCError error) {
-  throw std::runtime_error("OnFailure");
-  tlog("OnFailure %s: %s", ToString(error.type()), error.message());
+  tlog_error("OnFailure %s: %s",
+             std::string(ToString(error.type())).c_str(), error.message());
+  this->Fail(error.message());
 }
 
 void WHIPSession::OnFailure(const std::string &error) {
-  throw std::runtime_error("OnFailure");
   tlog("OnFailure %s", error.c_str());
+  this->Fail(error);
 }
@@ -0,0 +1,75 @@
+#include "whip_client.h"
+#include "logging.h"
+#include "metrics.h"
+#include "rtc_base/location.h"
+
+std::string WHIPResponse::header(const std::string &name) const {
+  for (const auto &field : this->headers) {
+    if (field.first == name) {
+      return field.second;
+    }
+  }
+  return std::string();
+}
+
+WHIPClient::WHIPClient(rtc::Thread *callback_thread, WHIPClientConfig config)
+    : callback_thread(callback_thread), config(config) {
+  this->io_thread = rtc::Thread::Create();
+  this->io_thread->SetName("WhipIO", nullptr);
+  this->io_thread->Start();
+}
+
+WHIPClient::~WHIPClient() { this->io_thread->Stop(); }
+
+void WHIPClient::Send(const std::string &method, const std::string &url,
+                      const std::string &body,
+                      const http::HeaderFields &headers, Callback callback) {
+  this->io_thread->PostTask(
+      RTC_FROM_HERE, [this, method, url, body, headers, callback]() {
+        WHIPResponse response = this->Perform(method, url, body, headers);
+        this->callback_thread->PostTask(
+            RTC_FROM_HERE,
+            [callback, response]() { callback(response); });
+      });
+}
+
+WHIPResponse WHIPClient::SendSync(const std::string &method,
+                                  const std::string &url,
+                                  const std::string &body,
+                                  const http::HeaderFields &headers) {
+  return this->io_thread->Invoke<WHIPResponse>(RTC_FROM_HERE, [&]() {
+    return this->Perform(method, url, body, headers);
+  });
+}
+
+WHIPResponse WHIPClient::Perform(const std::string &method,
+                                 const std::string &url,
+                                 const std::string &body,
+                                 const http::HeaderFields &headers) const {
+  WHIPResponse response;
+  auto start = std::chrono::steady_clock::now();
+  try {
+    http::Request request(url);
+    // HTTPRequest enforces a single deadline across connect, send and
+    // receive, so the two budgets are combined into one.
+    const auto result = request.send(
+        method, body, headers,
+        this->config.connect_timeout + this->config.read_timeout);
+    response.status = result.status.code;
+    response.headers = result.headerFields;
+    response.body.assign(result.body.begin(), result.body.end());
+  } catch (const std::exception &e) {
+    response.error = e.what();
+    tlog("%s %s failed: %s", method.c_str(), url.c_str(), e.what());
+  }
+  response.latency = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  PipelineCounters &counters = GlobalMetrics().counters;
+  counters.http_requests.fetch_add(1, std::memory_order_relaxed);
+  counters.http_latency_us.fetch_add(response.latency.count(),
+                                     std::memory_order_relaxed);
+  if (!response.ok()) {
+    counters.http_failures.fetch_add(1, std::memory_order_relaxed);
+  }
+  return response;
+}
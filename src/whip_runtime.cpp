@@ -0,0 +1,78 @@
+#include "whip_runtime.h"
+#ifdef HW_ENCODING_SUPPORT
+#include "encoder/jetson_encoder.h"
+#endif
+#include "api/audio_codecs/builtin_audio_decoder_factory.h"
+#include "api/audio_codecs/builtin_audio_encoder_factory.h"
+#include "api/create_peerconnection_factory.h"
+#include "api/video_codecs/builtin_video_decoder_factory.h"
+#include "api/video_codecs/builtin_video_encoder_factory.h"
+#include "encoder/h264_passthrough_encoder.h"
+#include "encoder/tracing_encoder.h"
+#include "logging.h"
+#include "rtc_base/location.h"
+#include "thread_policy.h"
+
+WHIPRuntime::WHIPRuntime() {}
+
+WHIPRuntime::~WHIPRuntime() {
+  this->pc_factory = nullptr;
+  for (rtc::Thread *thread :
+       {this->signaling.get(), this->worker.get(), this->network.get()}) {
+    if (thread != nullptr) {
+      thread->Stop();
+    }
+  }
+}
+
+void WHIPRuntime::WarmUpEncoder() {
+#ifdef HW_ENCODING_SUPPORT
+  WarmUpJetsonEncoder();
+#endif
+}
+
+std::shared_ptr<WHIPRuntime>
+WHIPRuntime::Create([[maybe_unused]] const HardwareEncoderConfig &encoder) {
+  std::shared_ptr<WHIPRuntime> runtime(new WHIPRuntime());
+  runtime->network = rtc::Thread::CreateWithSocketServer();
+  runtime->network->SetName("Network", nullptr);
+  runtime->worker = rtc::Thread::Create();
+  runtime->worker->SetName("Worker", nullptr);
+  runtime->signaling = rtc::Thread::CreateWithSocketServer();
+  runtime->signaling->SetName("Signaling", nullptr);
+  if (!runtime->network->Start() || !runtime->worker->Start() ||
+      !runtime->signaling->Start()) {
+    tlog_error("Failed to start WebRTC threads");
+    return nullptr;
+  }
+  runtime->network->Invoke<void>(
+      RTC_FROM_HERE, [] { apply_thread_policy(ThreadRole::kNetwork); });
+  runtime->worker->Invoke<void>(
+      RTC_FROM_HERE, [] { apply_thread_policy(ThreadRole::kWorker); });
+  runtime->signaling->Invoke<void>(
+      RTC_FROM_HERE, [] { apply_thread_policy(ThreadRole::kSignaling); });
+
+#ifdef HW_ENCODING_SUPPORT
+  std::unique_ptr<webrtc::VideoEncoderFactory> encoder_factory =
+      CreateJetsonEncoderFactory(encoder);
+#else
+  std::unique_ptr<webrtc::VideoEncoderFactory> encoder_factory =
+      webrtc::CreateBuiltinVideoEncoderFactory();
+#endif
+  // Cameras with H.264 output skip the encoder; tracing stays outermost so
+  // it sees whichever path a frame takes, whatever the codec.
+  encoder_factory.reset(
+      new H264PassthroughEncoderFactory(std::move(encoder_factory)));
+  encoder_factory.reset(
+      new TracingVideoEncoderFactory(std::move(encoder_factory)));
+  runtime->pc_factory = webrtc::CreatePeerConnectionFactory(
+      runtime->network.get(), runtime->worker.get(), runtime->signaling.get(),
+      nullptr, webrtc::CreateBuiltinAudioEncoderFactory(),
+      webrtc::CreateBuiltinAudioDecoderFactory(), std::move(encoder_factory),
+      webrtc::CreateBuiltinVideoDecoderFactory(), nullptr, nullptr);
+  if (!runtime->pc_factory) {
+    tlog_error("Failed to create PeerConnectionFactory");
+    return nullptr;
+  }
+  return runtime;
+}
@@ -0,0 +1,206 @@
+// Drives DmaBufInputQueue against a fake encoder input plane and checks
+// slot states and how long frame buffers stay referenced: until the
+// encoder returns their slot, a failed Submit(), or ReleaseAll(). Exits
+// non-zero on the first mismatch.
+//
+//   dmabuf_input_check
+#include "check.h"
+#include "encoder/dmabuf_input.h"
+#include "rtc_base/ref_counted_object.h"
+#include <cstdio>
+#include <deque>
+
+static int live_buffers = 0;
+
+// Stands in for a camera buffer; only its lifetime matters here.
+class FakeBuffer : public webrtc::VideoFrameBuffer {
+public:
+  FakeBuffer() { live_buffers++; }
+  ~FakeBuffer() override { live_buffers--; }
+
+  Type type() const override { return Type::kNative; }
+  int width() const override { return 16; }
+  int height() const override { return 16; }
+  rtc::scoped_refptr<webrtc::I420BufferInterface> ToI420() override {
+    return nullptr;
+  }
+};
+
+static rtc::scoped_refptr<webrtc::VideoFrameBuffer> new_buffer() {
+  return new rtc::RefCountedObject<FakeBuffer>();
+}
+
+// Returns queued slots in order, like an encoder that reads one frame at a
+// time. Dequeue() fails when nothing is queued instead of blocking.
+class FakePlane : public DmaBufPlane {
+public:
+  int Queue(uint32_t slot, const DmaBufFrame &) override {
+    if (fail_queue) {
+      return -1;
+    }
+    queued.push_back(slot);
+    return 0;
+  }
+  int Dequeue(uint32_t *slot) override {
+    dequeue_calls++;
+    if (queued.empty()) {
+      return -1;
+    }
+    *slot = queued.front();
+    queued.pop_front();
+    return 0;
+  }
+  // STREAMOFF returns every buffer without a dequeue.
+  void StreamOff() { queued.clear(); }
+
+  std::deque<uint32_t> queued;
+  bool fail_queue = false;
+  int dequeue_calls = 0;
+};
+
+static DmaBufFrame empty_frame() {
+  DmaBufFrame frame = {};
+  frame.num_planes = 1;
+  frame.fd[0] = -1;
+  return frame;
+}
+
+static void check_slot_lifecycle() {
+  FakePlane plane;
+  DmaBufInputQueue input(&plane, 4, 4);
+
+  int slot = input.AcquireSlot();
+  CHECK(slot == 0);
+  CHECK(input.queued() == 0);
+  CHECK(input.Submit(slot, empty_frame(), new_buffer()));
+  CHECK(input.queued() == 1);
+  CHECK(plane.queued.size() == 1 && plane.queued.front() == 0);
+  // The queue holds the only reference.
+  CHECK(live_buffers == 1);
+
+  // A queued slot is not handed out again until the encoder returns it.
+  CHECK(input.AcquireSlot() == 1);
+  input.Cancel(1);
+
+  // A slot can only be submitted once it was acquired.
+  CHECK(!input.Submit(2, empty_frame(), new_buffer()));
+  CHECK(!input.Submit(0, empty_frame(), new_buffer()));
+  CHECK(input.queued() == 1);
+  CHECK(live_buffers == 1);
+
+  input.ReleaseAll();
+  CHECK(live_buffers == 0);
+}
+
+static void check_backpressure() {
+  FakePlane plane;
+  DmaBufInputQueue input(&plane, 4, 2);
+
+  CHECK(input.Submit(input.AcquireSlot(), empty_frame(), new_buffer()));
+  CHECK(input.Submit(input.AcquireSlot(), empty_frame(), new_buffer()));
+  CHECK(input.queued() == 2);
+  CHECK(plane.dequeue_calls == 0);
+  CHECK(live_buffers == 2);
+
+  // With max_queued slots queued, the oldest is reclaimed first and its
+  // frame released, although two slots are still free.
+  int slot = input.AcquireSlot();
+  CHECK(plane.dequeue_calls == 1);
+  CHECK(slot == 0);
+  CHECK(input.queued() == 1);
+  CHECK(live_buffers == 1);
+  CHECK(input.Submit(slot, empty_frame(), new_buffer()));
+  CHECK(input.queued() == 2);
+
+  // A plane that cannot return a slot fails the acquire.
+  plane.queued.clear();
+  CHECK(input.AcquireSlot() == -1);
+  CHECK(input.queued() == 2);
+  CHECK(live_buffers == 2);
+
+  // As does one returning a slot that was not queued.
+  plane.queued.push_back(3);
+  CHECK(input.AcquireSlot() == -1);
+  CHECK(input.queued() == 2);
+
+  input.ReleaseAll();
+  CHECK(live_buffers == 0);
+}
+
+static void check_cancel() {
+  FakePlane plane;
+  DmaBufInputQueue input(&plane, 2, 2);
+
+  int slot = input.AcquireSlot();
+  CHECK(slot == 0);
+  input.Cancel(slot);
+  CHECK(input.AcquireSlot() == 0);
+  CHECK(input.AcquireSlot() == 1);
+  input.Cancel(0);
+  input.Cancel(1);
+  CHECK(input.queued() == 0);
+
+  // Cancelling a queued slot leaves it queued.
+  slot = input.AcquireSlot();
+  CHECK(input.Submit(slot, empty_frame(), new_buffer()));
+  input.Cancel(slot);
+  CHECK(input.queued() == 1);
+  CHECK(live_buffers == 1);
+  CHECK(input.AcquireSlot() == 1);
+
+  input.ReleaseAll();
+  CHECK(live_buffers == 0);
+}
+
+static void check_submit_failure() {
+  FakePlane plane;
+  DmaBufInputQueue input(&plane, 2, 2);
+
+  plane.fail_queue = true;
+  int slot = input.AcquireSlot();
+  CHECK(!input.Submit(slot, empty_frame(), new_buffer()));
+  // The frame is released at once and the slot is free again.
+  CHECK(live_buffers == 0);
+  CHECK(input.queued() == 0);
+  CHECK(input.AcquireSlot() == slot);
+
+  plane.fail_queue = false;
+  CHECK(input.Submit(slot, empty_frame(), new_buffer()));
+  CHECK(input.queued() == 1);
+  CHECK(live_buffers == 1);
+
+  input.ReleaseAll();
+  CHECK(live_buffers == 0);
+}
+
+static void check_release_all() {
+  FakePlane plane;
+  DmaBufInputQueue input(&plane, 3, 3);
+
+  for (int i = 0; i < 3; i++) {
+    CHECK(input.Submit(input.AcquireSlot(), empty_frame(), new_buffer()));
+  }
+  CHECK(input.queued() == 3);
+  CHECK(live_buffers == 3);
+
+  plane.StreamOff();
+  input.ReleaseAll();
+  CHECK(input.queued() == 0);
+  CHECK(live_buffers == 0);
+
+  // Every slot is free again without waiting for the encoder.
+  CHECK(input.AcquireSlot() == 0);
+  CHECK(input.AcquireSlot() == 1);
+  CHECK(input.AcquireSlot() == 2);
+  CHECK(plane.dequeue_calls == 0);
+}
+
+int main() {
+  check_slot_lifecycle();
+  check_backpressure();
+  check_cancel();
+  check_submit_failure();
+  check_release_all();
+  printf("dmabuf_input_check: ok\n");
+  return 0;
+}
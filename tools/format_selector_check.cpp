@@ -0,0 +1,109 @@
+// Checks select_capture_format() on made-up camera format lists: the tier
+// order, the formats it skips, and how native encoder input changes the
+// choice. Exits non-zero on the first mismatch.
+//
+//   format_selector_check
+#include "check.h"
+#include "format_selector.h"
+#include <cstdio>
+#include <vector>
+
+static V4LFrameSize discrete(uint32_t width, uint32_t height,
+                             std::vector<uint32_t> rates) {
+  V4LFrameSize size = {width, width, 0, height, height, 0, {}};
+  for (uint32_t rate : rates) {
+    size.intervals.push_back({1, rate});
+  }
+  return size;
+}
+
+static void check_format(const std::optional<CaptureFormat> &format,
+                         uint32_t pixelformat, uint32_t width, uint32_t height,
+                         uint32_t fps) {
+  CHECK(format.has_value());
+  CHECK(format->pixelformat == pixelformat);
+  CHECK(format->width == width);
+  CHECK(format->height == height);
+  CHECK(format->fps == fps);
+}
+
+static void check_native_input() {
+  FormatSelectorOptions converted;
+  FormatSelectorOptions native;
+  native.native_yuv_input = true;
+
+  // Native NV12 and packed 4:2:2 cost only their transfer.
+  CHECK(capture_pixel_cost(V4L2_PIX_FMT_NV12, native) == 1.5);
+  CHECK(capture_pixel_cost(V4L2_PIX_FMT_YUYV, native) == 2.0);
+  CHECK(capture_pixel_cost(V4L2_PIX_FMT_UYVY, native) == 2.0);
+  CHECK(capture_pixel_cost(V4L2_PIX_FMT_YUV420, native) ==
+        capture_pixel_cost(V4L2_PIX_FMT_YUV420, converted));
+  CHECK(capture_pixel_cost(V4L2_PIX_FMT_NV12, converted) == 4.5);
+  CHECK(capture_pixel_cost(V4L2_PIX_FMT_YUYV, converted) == 5.5);
+  // Decoded MJPEG still needs a pass into the encoder's layout.
+  CHECK(capture_pixel_cost(V4L2_PIX_FMT_MJPEG, native) >
+        capture_pixel_cost(V4L2_PIX_FMT_MJPEG, converted));
+
+  // MJPEG at the target beats converting and scaling 1080p NV12, but not
+  // handing 1080p NV12 to the encoder as it is.
+  std::vector<V4LFormat> formats = {
+      {V4L2_PIX_FMT_MJPEG, V4L2_FMT_FLAG_COMPRESSED, "MJPG",
+       {discrete(1280, 720, {30}), discrete(1920, 1080, {30})}},
+      {V4L2_PIX_FMT_NV12, 0, "NV12", {discrete(1920, 1080, {30})}},
+  };
+  check_format(select_capture_format(formats, 1280, 720, 30, converted),
+               V4L2_PIX_FMT_MJPEG, 1280, 720, 30);
+  check_format(select_capture_format(formats, 1280, 720, 30, native),
+               V4L2_PIX_FMT_NV12, 1920, 1080, 30);
+}
+
+static void check_tiers() {
+  FormatSelectorOptions options;
+  // Cheap YUYV only reaches 720p at 10 fps; MJPEG gets both.
+  std::vector<V4LFormat> formats = {
+      {V4L2_PIX_FMT_YUYV, 0, "YUYV",
+       {discrete(640, 480, {30}), discrete(1280, 720, {10})}},
+      {V4L2_PIX_FMT_MJPEG, V4L2_FMT_FLAG_COMPRESSED, "MJPG",
+       {discrete(640, 480, {30}), discrete(1280, 720, {30, 60})}},
+  };
+  check_format(select_capture_format(formats, 1280, 720, 30, options),
+               V4L2_PIX_FMT_MJPEG, 1280, 720, 30);
+  // Where both make it, the cheaper format wins.
+  check_format(select_capture_format(formats, 640, 480, 30, options),
+               V4L2_PIX_FMT_YUYV, 640, 480, 30);
+  check_format(select_capture_format(formats, 1280, 720, 10, options),
+               V4L2_PIX_FMT_YUYV, 1280, 720, 10);
+  // Nothing is large enough: the largest size at the rate.
+  check_format(select_capture_format(formats, 1920, 1080, 30, options),
+               V4L2_PIX_FMT_MJPEG, 1280, 720, 30);
+}
+
+static void check_skipped_formats() {
+  FormatSelectorOptions options;
+  std::vector<V4LFormat> formats = {
+      {V4L2_PIX_FMT_H264, V4L2_FMT_FLAG_COMPRESSED, "H264",
+       {discrete(1280, 720, {30})}},
+      {V4L2_PIX_FMT_YUV420, V4L2_FMT_FLAG_EMULATED, "YU12",
+       {discrete(1280, 720, {30})}},
+      {V4L2_PIX_FMT_MJPEG, V4L2_FMT_FLAG_COMPRESSED, "MJPG",
+       {discrete(1280, 720, {30})}},
+  };
+  // H.264 only when asked for; libv4l's emulated formats never.
+  check_format(select_capture_format(formats, 1280, 720, 30, options),
+               V4L2_PIX_FMT_MJPEG, 1280, 720, 30);
+  options.allow_h264 = true;
+  check_format(select_capture_format(formats, 1280, 720, 30, options),
+               V4L2_PIX_FMT_H264, 1280, 720, 30);
+
+  formats.pop_back();
+  options.allow_h264 = false;
+  CHECK(!select_capture_format(formats, 1280, 720, 30, options).has_value());
+}
+
+int main() {
+  check_native_input();
+  check_tiers();
+  check_skipped_formats();
+  printf("format_selector_check: ok\n");
+  return 0;
+}
@@ -0,0 +1,294 @@
+// Runs frames through the stages of the frame path for longer than their
+// HOT_PATH_WARMUP_FRAMES warm-up and exits non-zero if any of them
+// allocated afterwards. Allocations are counted by replacing operator new
+// in this binary only.
+//
+//   hot_path_check [-n frames] [-d device]
+//
+// MJPEG decoding is always checked, on frames encoded here. With -d, frames
+// captured from the camera in its current format are wrapped in
+// V4LFrameBuffer and go where wadi would send them: H.264 to the
+// passthrough encoder, MJPEG to the decoder and raw formats through crop
+// and scale into a pooled buffer. Set the format with v4l2-ctl first.
+#include "api/video/video_frame.h"
+#include "common_video/include/i420_buffer_pool.h"
+#include "encoder/h264_passthrough_encoder.h"
+#include "hot_path.h"
+#include "mjpeg_decoder.h"
+#include "rtc_base/event.h"
+#include "rtc_base/ref_counted_object.h"
+#include "rtc_base/time_utils.h"
+#include "v4l.h"
+#include "v4l_frame_buffer.h"
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "third_party/libjpeg_turbo/jpeglib.h"
+
+#define CHECK_WIDTH 1280
+#define CHECK_HEIGHT 720
+// Time a camera gets to deliver each frame before the check gives up.
+#define CHECK_FRAME_TIMEOUT_MS 200
+
+static std::atomic<uint64_t> allocations{0};
+
+static void count_allocation() {
+  if (in_hot_path()) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void *operator new(size_t size) {
+  count_allocation();
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  count_allocation();
+  return malloc(size == 0 ? 1 : size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept {
+  return operator new(size, tag);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+// Counts what the passthrough encoder sends without keeping it.
+class CountingSink : public webrtc::EncodedImageCallback {
+public:
+  Result OnEncodedImage(
+      const webrtc::EncodedImage &,
+      const webrtc::CodecSpecificInfo *,
+      const webrtc::RTPFragmentationHeader *) override {
+    encoded++;
+    return Result(Result::OK);
+  }
+  void OnDroppedFrame(DropReason) override { dropped++; }
+
+  int encoded = 0;
+  int dropped = 0;
+};
+
+// libjpeg in libwebrtc is built without jpeg_mem_dest().
+struct VectorDestination {
+  jpeg_destination_mgr pub;
+  std::vector<uint8_t> *out;
+  uint8_t chunk[64 * 1024];
+};
+
+static void dest_init(j_compress_ptr cinfo) {
+  VectorDestination *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+  dest->pub.next_output_byte = dest->chunk;
+  dest->pub.free_in_buffer = sizeof(dest->chunk);
+}
+
+static boolean dest_empty(j_compress_ptr cinfo) {
+  VectorDestination *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+  dest->out->insert(dest->out->end(), dest->chunk,
+                    dest->chunk + sizeof(dest->chunk));
+  dest_init(cinfo);
+  return TRUE;
+}
+
+static void dest_term(j_compress_ptr cinfo) {
+  VectorDestination *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+  size_t used = sizeof(dest->chunk) - dest->pub.free_in_buffer;
+  dest->out->insert(dest->out->end(), dest->chunk, dest->chunk + used);
+}
+
+// A 4:2:2 gradient, the chroma layout most UVC cameras send.
+static std::vector<uint8_t> encode_test_frame() {
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr error;
+  VectorDestination dest;
+  std::vector<uint8_t> out;
+  cinfo.err = jpeg_std_error(&error);
+  jpeg_create_compress(&cinfo);
+  dest.pub.init_destination = dest_init;
+  dest.pub.empty_output_buffer = dest_empty;
+  dest.pub.term_destination = dest_term;
+  dest.out = &out;
+  cinfo.dest = &dest.pub;
+  cinfo.image_width = CHECK_WIDTH;
+  cinfo.image_height = CHECK_HEIGHT;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_YCbCr;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, 85, TRUE);
+  cinfo.comp_info[0].h_samp_factor = 2;
+  cinfo.comp_info[0].v_samp_factor = 1;
+  jpeg_start_compress(&cinfo, TRUE);
+  std::vector<uint8_t> row(CHECK_WIDTH * 3);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    int y = cinfo.next_scanline;
+    for (int x = 0; x < CHECK_WIDTH; x++) {
+      row[x * 3] = (x + y) & 0xff;
+      row[x * 3 + 1] = 128 + static_cast<int>(64 * std::sin(x / 37.0));
+      row[x * 3 + 2] = 128 + static_cast<int>(64 * std::cos(y / 23.0));
+    }
+    JSAMPROW rows[] = {row.data()};
+    jpeg_write_scanlines(&cinfo, rows, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  return out;
+}
+
+// One decoder thread, so that it alone sees every frame and warms up.
+static bool check_mjpeg(int frames) {
+  std::vector<uint8_t> jpeg = encode_test_frame();
+  std::atomic<int> delivered{0};
+  std::atomic<int> failed{0};
+  MjpegDecoder decoder(
+      1, [&delivered](const webrtc::VideoFrame &) { delivered++; },
+      [&failed]() { failed++; });
+  decoder.Preallocate(CHECK_WIDTH, CHECK_HEIGHT);
+  for (int i = 0; i < frames; i++) {
+    while (!decoder.Decode({jpeg.data(), jpeg.size(), i, nullptr})) {
+      std::this_thread::yield();
+    }
+  }
+  decoder.Flush();
+  printf("MJPEG: %d frames decoded, %d failed\n", delivered.load(),
+         failed.load());
+  return failed == 0 && delivered == frames;
+}
+
+static bool check_camera(const std::string &path, int frames) {
+  std::shared_ptr<V4LDevice> device;
+  try {
+    device = std::make_shared<V4LDevice>(path);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s: %s\n", path.c_str(), e.what());
+    return false;
+  }
+  uint32_t fourcc = device->fmt.fmt.pix.pixelformat;
+  int width = device->fmt.fmt.pix.width;
+  int height = device->fmt.fmt.pix.height;
+  printf("Capturing %d frames of %s %dx%d from %s\n", frames,
+         fourcc_to_string(fourcc).c_str(), width, height, path.c_str());
+
+  std::unique_ptr<MjpegDecoder> decoder;
+  std::atomic<int> decoded{0};
+  if (fourcc == V4L2_PIX_FMT_MJPEG || fourcc == V4L2_PIX_FMT_JPEG) {
+    decoder.reset(new MjpegDecoder(
+        1, [&decoded](const webrtc::VideoFrame &) { decoded++; }, []() {}));
+    decoder->Preallocate(width, height);
+  }
+  H264PassthroughEncoder encoder(
+      nullptr, webrtc::H264PacketizationMode::NonInterleaved);
+  CountingSink sink;
+  webrtc::VideoCodec codec;
+  codec.codecType = webrtc::kVideoCodecH264;
+  codec.width = width;
+  codec.height = height;
+  codec.maxFramerate = 30;
+  encoder.InitEncode(&codec, 1, 1200);
+  encoder.RegisterEncodeCompleteCallback(&sink);
+  std::vector<webrtc::VideoFrameType> frame_types = {
+      webrtc::VideoFrameType::kVideoFrameDelta};
+  webrtc::I420BufferPool pool(false, 4);
+  warm_buffer_pool(&pool, width / 2, height / 2);
+  rtc::scoped_refptr<webrtc::I420Buffer> scratch;
+  int captured = 0;
+  int scaled = 0;
+  rtc::Event done;
+
+  // The steps Start() and OnCapturedBuffer() take in wadi.
+  V4LFrameBuffer::ReserveBlocks(V4L_DEFAULT_NUM_BUFFERS);
+  bool started = device->start_streaming(
+      V4L_DEFAULT_NUM_BUFFERS, [&](const v4l2_buffer &buf) {
+        HotPathScope hot_path;
+        rtc::scoped_refptr<V4LFrameBuffer> buffer(
+            new rtc::RefCountedObject<V4LFrameBuffer>(device, buf));
+        if (captured == frames) {
+          return;
+        }
+        int64_t timestamp_us = rtc::TimeMicros();
+        if (buffer->is_compressed()) {
+          encoder.Encode(webrtc::VideoFrame::Builder()
+                             .set_video_frame_buffer(buffer)
+                             .set_timestamp_us(timestamp_us)
+                             .build(),
+                         &frame_types);
+        } else if (decoder) {
+          decoder->Decode(
+              {buffer->data(), buffer->size(), timestamp_us, buffer});
+        } else {
+          rtc::scoped_refptr<webrtc::I420Buffer> out =
+              pool.CreateBuffer(width / 2, height / 2);
+          if (out && buffer->CropAndScaleTo(0, 0, width, height, out.get(),
+                                            &scratch)) {
+            scaled++;
+          }
+        }
+        if (++captured == frames) {
+          done.Set();
+        }
+      });
+  if (!started) {
+    fprintf(stderr, "Failed to start streaming from %s\n", path.c_str());
+    return false;
+  }
+  bool complete = done.Wait(frames * CHECK_FRAME_TIMEOUT_MS);
+  device->stop_streaming();
+  V4LFrameBuffer::ReleaseBlocks(V4L_DEFAULT_NUM_BUFFERS);
+  if (decoder) {
+    decoder->Flush();
+  }
+  encoder.Release();
+  printf("Camera: %d frames captured, %d passed through, %d decoded, "
+         "%d scaled\n",
+         captured, sink.encoded, decoded.load(), scaled);
+  if (!complete) {
+    fprintf(stderr, "Camera delivered %d of %d frames\n", captured, frames);
+  }
+  return complete;
+}
+
+int main(int argc, char **argv) {
+  int frames = 2 * HOT_PATH_WARMUP_FRAMES;
+  std::string device;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-n") == 0) {
+      frames = std::stoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-d") == 0) {
+      device = argv[i + 1];
+    } else {
+      fprintf(stderr, "Usage: %s [-n frames] [-d device]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (frames <= HOT_PATH_WARMUP_FRAMES) {
+    fprintf(stderr, "Need more than the %d warm-up frames\n",
+            HOT_PATH_WARMUP_FRAMES);
+    return EXIT_FAILURE;
+  }
+
+  bool ok = check_mjpeg(frames);
+  if (!device.empty()) {
+    ok = check_camera(device, frames) && ok;
+  }
+  uint64_t count = allocations.load();
+  printf("%llu allocations after warm-up\n",
+         static_cast<unsigned long long>(count));
+  return ok && count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
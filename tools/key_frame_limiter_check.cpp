@@ -0,0 +1,68 @@
+// Feeds KeyFrameLimiter frames with and without keyframe requests and
+// checks which ones it forces, and its forced and coalesced counters.
+// Exits non-zero on the first mismatch.
+//
+//   key_frame_limiter_check
+#include "check.h"
+#include "encoder/key_frame_limiter.h"
+#include "metrics.h"
+#include <cstdio>
+
+#define MS 1000
+#define SECOND (1000 * MS)
+
+static void check_first_request() {
+  KeyFrameLimiter limiter(1000);
+  int64_t now_us = 10 * SECOND;
+
+  CHECK(!limiter.ShouldForce(false, now_us));
+  // Nothing was forced yet, so the first request goes out at once.
+  CHECK(limiter.ShouldForce(true, now_us + 33 * MS));
+  CHECK(!limiter.ShouldForce(false, now_us + 66 * MS));
+
+  // As does one arriving after the interval.
+  CHECK(limiter.ShouldForce(true, now_us + 1033 * MS));
+}
+
+static void check_coalescing() {
+  KeyFrameLimiter limiter(1000);
+  PipelineCounters &counters = GlobalMetrics().counters;
+  uint64_t forced = counters.keyframes_forced.load();
+  uint64_t coalesced = counters.keyframe_requests_coalesced.load();
+  int64_t now_us = 10 * SECOND;
+
+  CHECK(limiter.ShouldForce(true, now_us));
+  // A burst within min_interval_ms waits and becomes one keyframe.
+  CHECK(!limiter.ShouldForce(true, now_us + 100 * MS));
+  CHECK(!limiter.ShouldForce(true, now_us + 200 * MS));
+  CHECK(!limiter.ShouldForce(true, now_us + 300 * MS));
+  CHECK(counters.keyframe_requests_coalesced.load() == coalesced + 2);
+  CHECK(counters.keyframes_forced.load() == forced + 1);
+
+  CHECK(limiter.ShouldForce(false, now_us + 1000 * MS));
+  CHECK(counters.keyframes_forced.load() == forced + 2);
+  CHECK(!limiter.ShouldForce(false, now_us + 1033 * MS));
+}
+
+static void check_deferred_request() {
+  KeyFrameLimiter limiter(500);
+  int64_t now_us = 10 * SECOND;
+
+  CHECK(limiter.ShouldForce(true, now_us));
+  CHECK(!limiter.ShouldForce(true, now_us + 100 * MS));
+  // The deferred request fires on the first frame past the interval, with
+  // no new request on it.
+  CHECK(!limiter.ShouldForce(false, now_us + 499 * MS));
+  CHECK(limiter.ShouldForce(false, now_us + 533 * MS));
+  // And the interval starts again from then.
+  CHECK(!limiter.ShouldForce(true, now_us + 900 * MS));
+  CHECK(limiter.ShouldForce(false, now_us + 1033 * MS));
+}
+
+int main() {
+  check_first_request();
+  check_coalescing();
+  check_deferred_request();
+  printf("key_frame_limiter_check: ok\n");
+  return 0;
+}
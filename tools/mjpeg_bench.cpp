@@ -0,0 +1,156 @@
+// Measures MJPEG decode throughput per resolution, for a single
+// JpegDecompressor and for the MjpegDecoder worker pool.
+//
+//   mjpeg_bench [-n frames] [-t threads]
+#include "mjpeg_decoder.h"
+#include "rtc_base/ref_counted_object.h"
+#include "rtc_base/time_utils.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "third_party/libjpeg_turbo/jpeglib.h"
+
+struct Resolution {
+  int width;
+  int height;
+};
+
+static const Resolution resolutions[] = {
+    {640, 480}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+
+struct VectorDestination {
+  jpeg_destination_mgr pub;
+  std::vector<uint8_t> *out;
+  uint8_t chunk[64 * 1024];
+};
+
+static void dest_init(j_compress_ptr cinfo) {
+  VectorDestination *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+  dest->pub.next_output_byte = dest->chunk;
+  dest->pub.free_in_buffer = sizeof(dest->chunk);
+}
+
+static boolean dest_empty(j_compress_ptr cinfo) {
+  VectorDestination *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+  dest->out->insert(dest->out->end(), dest->chunk,
+                    dest->chunk + sizeof(dest->chunk));
+  dest_init(cinfo);
+  return TRUE;
+}
+
+static void dest_term(j_compress_ptr cinfo) {
+  VectorDestination *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+  size_t used = sizeof(dest->chunk) - dest->pub.free_in_buffer;
+  dest->out->insert(dest->out->end(), dest->chunk, dest->chunk + used);
+}
+
+// Encodes a moving gradient the way UVC cameras do: baseline YCbCr with
+// 4:2:2 (h_samp 2) or 4:2:0 (h_samp and v_samp 2) chroma.
+static std::vector<uint8_t> encode_test_frame(Resolution res, int v_samp) {
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr error;
+  VectorDestination dest;
+  std::vector<uint8_t> out;
+  cinfo.err = jpeg_std_error(&error);
+  jpeg_create_compress(&cinfo);
+  dest.pub.init_destination = dest_init;
+  dest.pub.empty_output_buffer = dest_empty;
+  dest.pub.term_destination = dest_term;
+  dest.out = &out;
+  cinfo.dest = &dest.pub;
+  cinfo.image_width = res.width;
+  cinfo.image_height = res.height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_YCbCr;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, 85, TRUE);
+  cinfo.comp_info[0].h_samp_factor = 2;
+  cinfo.comp_info[0].v_samp_factor = v_samp;
+  jpeg_start_compress(&cinfo, TRUE);
+  std::vector<uint8_t> row(res.width * 3);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    int y = cinfo.next_scanline;
+    for (int x = 0; x < res.width; x++) {
+      row[x * 3] = (x + y) & 0xff;
+      row[x * 3 + 1] = 128 + static_cast<int>(64 * std::sin(x / 37.0));
+      row[x * 3 + 2] = 128 + static_cast<int>(64 * std::cos(y / 23.0));
+    }
+    JSAMPROW rows[] = {row.data()};
+    jpeg_write_scanlines(&cinfo, rows, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  return out;
+}
+
+static double bench_single(const std::vector<uint8_t> &jpeg, Resolution res,
+                           int frames) {
+  JpegDecompressor decompressor;
+  rtc::scoped_refptr<webrtc::I420Buffer> out =
+      webrtc::I420Buffer::Create(res.width, res.height);
+  int64_t start_us = rtc::TimeMicros();
+  for (int i = 0; i < frames; i++) {
+    if (!decompressor.ReadHeader(jpeg.data(), jpeg.size()) ||
+        !decompressor.DecodeTo(out.get())) {
+      fprintf(stderr, "Decode failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return frames * 1e6 / (rtc::TimeMicros() - start_us);
+}
+
+static double bench_pool(const std::vector<uint8_t> &jpeg, int frames,
+                         size_t threads) {
+  int delivered = 0;
+  MjpegDecoder decoder(
+      threads, [&delivered](const webrtc::VideoFrame &) { delivered++; },
+      []() {
+        fprintf(stderr, "Decode failed\n");
+        exit(EXIT_FAILURE);
+      });
+  int64_t start_us = rtc::TimeMicros();
+  for (int i = 0; i < frames; i++) {
+    // A full pool drops the frame; a camera would too, the bench retries.
+    while (!decoder.Decode({jpeg.data(), jpeg.size(), i, nullptr})) {
+      std::this_thread::yield();
+    }
+  }
+  decoder.Flush();
+  return delivered * 1e6 / (rtc::TimeMicros() - start_us);
+}
+
+int main(int argc, char **argv) {
+  int frames = 200;
+  size_t threads = MjpegDecoder::DefaultThreadCount();
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-n") == 0) {
+      frames = std::stoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-t") == 0) {
+      threads = std::stoul(argv[i + 1]);
+    } else {
+      fprintf(stderr, "Usage: %s [-n frames] [-t threads]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  printf("%-10s %-6s %9s %12s %12s\n", "resolution", "chroma", "jpeg KiB",
+         "1 thread", "pool");
+  for (Resolution res : resolutions) {
+    for (int v_samp : {1, 2}) {
+      std::vector<uint8_t> jpeg = encode_test_frame(res, v_samp);
+      double single = bench_single(jpeg, res, frames);
+      double pool = bench_pool(jpeg, frames, threads);
+      std::string size =
+          std::to_string(res.width) + "x" + std::to_string(res.height);
+      printf("%-10s %-6s %9zu %8.1f fps %8.1f fps (%zu threads)\n",
+             size.c_str(), v_samp == 1 ? "4:2:2" : "4:2:0",
+             jpeg.size() / 1024, single, pool, threads);
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,163 @@
+// Checks H264ScanNalUnits() on canned Annex-B streams, and the vectorized
+// start code search against a byte-by-byte one on generated streams. Exits
+// non-zero on the first mismatch.
+//
+//   nal_scanner_check
+#include "check.h"
+#include "encoder/h264_nal_scanner.h"
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+// Stream sizes tried for every start code position, so that each one lands
+// before, across and after the 16-byte vector loads.
+#define CHECK_MAX_STREAM 80
+
+static size_t scan(const std::vector<uint8_t> &stream,
+                   std::vector<H264NalUnit> *units) {
+  units->resize(H264_MAX_NAL_UNITS);
+  size_t count = H264ScanNalUnits(stream.data(), stream.size(), units->data(),
+                                  units->size());
+  units->resize(std::min(count, units->size()));
+  return count;
+}
+
+static void check_unit(const H264NalUnit &unit, size_t start_offset,
+                       size_t payload_offset, size_t payload_size,
+                       uint8_t type) {
+  CHECK(unit.start_offset == start_offset);
+  CHECK(unit.payload_offset == payload_offset);
+  CHECK(unit.payload_size == payload_size);
+  CHECK(unit.type == type);
+}
+
+static void check_start_code_lengths() {
+  std::vector<uint8_t> stream = {
+      0, 0, 0, 1, 0x67, 0xAA, 0xBB,       // SPS after a 4-byte start code
+      0, 0, 1, 0x68, 0xCC,                // PPS after a 3-byte one
+      0, 0, 0, 1, 0x65, 0xDD, 0xEE, 0xFF, // IDR slice
+  };
+  std::vector<H264NalUnit> units;
+  CHECK(scan(stream, &units) == 3);
+  check_unit(units[0], 0, 4, 3, kH264NalSps);
+  check_unit(units[1], 7, 10, 2, kH264NalPps);
+  check_unit(units[2], 12, 16, 4, kH264NalIdr);
+
+  // Leading garbage is skipped, and a stream without a start code is empty.
+  stream = {0xFF, 0x00, 0x01, 0, 0, 1, 0x41, 0x9A};
+  CHECK(scan(stream, &units) == 1);
+  check_unit(units[0], 3, 6, 2, kH264NalSlice);
+  stream = {0, 0, 2, 0, 1, 0, 0};
+  CHECK(scan(stream, &units) == 0);
+}
+
+static void check_trailing_zeros() {
+  // trailing_zero_8bits do not belong to the NAL unit before them, and a
+  // start code's leading zero_byte is not told apart from them.
+  std::vector<uint8_t> stream = {
+      0, 0, 1, 0x41, 0xAA, 0, 0, 0, 0, 1, 0x41, 0xBB, 0, 0, 0,
+  };
+  std::vector<H264NalUnit> units;
+  CHECK(scan(stream, &units) == 2);
+  check_unit(units[0], 0, 3, 2, kH264NalSlice);
+  check_unit(units[1], 6, 10, 2, kH264NalSlice);
+
+  // Zeros inside the payload stay; a start code with only zeros after it
+  // is no NAL unit.
+  stream = {0, 0, 1, 0x06, 0, 0, 3, 0, 0x80, 0, 0, 1, 0, 0, 0, 0};
+  CHECK(scan(stream, &units) == 1);
+  check_unit(units[0], 0, 3, 6, kH264NalSei);
+}
+
+static void check_overflow() {
+  std::vector<uint8_t> stream;
+  const size_t total = H264_MAX_NAL_UNITS + 10;
+  for (size_t i = 0; i < total; i++) {
+    stream.insert(stream.end(), {0, 0, 0, 1, 0x41, 0x9A, 0x22});
+  }
+  // Units past the caller's array are counted but not written.
+  H264NalUnit units[H264_MAX_NAL_UNITS + 1];
+  units[H264_MAX_NAL_UNITS].start_offset = 12345;
+  CHECK(H264ScanNalUnits(stream.data(), stream.size(), units,
+                         H264_MAX_NAL_UNITS) == total);
+  CHECK(units[H264_MAX_NAL_UNITS].start_offset == 12345);
+  check_unit(units[H264_MAX_NAL_UNITS - 1], (H264_MAX_NAL_UNITS - 1) * 7,
+             (H264_MAX_NAL_UNITS - 1) * 7 + 4, 3, kH264NalSlice);
+}
+
+static const uint8_t *find_start_code_bytewise(const uint8_t *begin,
+                                               const uint8_t *end) {
+  for (const uint8_t *p = begin; end - p >= 3; p++) {
+    if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+      return p;
+    }
+  }
+  return end;
+}
+
+static void check_vector_boundaries() {
+  // A 3- or 4-byte start code at every offset of streams of every length,
+  // in filler that does and does not contain zeros.
+  static const uint8_t fillers[] = {0xAA, 0x00, 0x01};
+  for (uint8_t filler : fillers) {
+    for (size_t size = 3; size <= CHECK_MAX_STREAM; size++) {
+      for (size_t zeros = 2; zeros <= 3; zeros++) {
+        for (size_t offset = 0; offset + zeros + 1 <= size; offset++) {
+          std::vector<uint8_t> stream(size, filler);
+          for (size_t i = 0; i < zeros; i++) {
+            stream[offset + i] = 0;
+          }
+          stream[offset + zeros] = 1;
+          const uint8_t *begin = stream.data();
+          const uint8_t *end = begin + size;
+          CHECK(H264FindStartCode(begin, end) ==
+                find_start_code_bytewise(begin, end));
+        }
+      }
+    }
+  }
+
+  // The second of two NAL units with its start code split across the first
+  // 16-byte load.
+  for (size_t offset = 8; offset <= 18; offset++) {
+    std::vector<uint8_t> stream(40, 0xAA);
+    stream[0] = 0;
+    stream[1] = 0;
+    stream[2] = 1;
+    stream[3] = 0x41;
+    stream[offset] = 0;
+    stream[offset + 1] = 0;
+    stream[offset + 2] = 1;
+    stream[offset + 3] = 0x65;
+    std::vector<H264NalUnit> units;
+    CHECK(scan(stream, &units) == 2);
+    check_unit(units[0], 0, 3, offset - 3, kH264NalSlice);
+    check_unit(units[1], offset, offset + 3, 37 - offset, kH264NalIdr);
+  }
+
+  // Generated streams with plenty of zero runs and start codes.
+  uint32_t state = 1;
+  for (int round = 0; round < 20000; round++) {
+    size_t size = round % CHECK_MAX_STREAM;
+    std::vector<uint8_t> stream(size);
+    for (uint8_t &byte : stream) {
+      state = state * 1103515245 + 12345;
+      uint32_t r = (state >> 16) % 8;
+      byte = r < 4 ? 0 : r == 4 ? 1 : static_cast<uint8_t>(state >> 8);
+    }
+    const uint8_t *begin = stream.data();
+    const uint8_t *end = begin + size;
+    for (const uint8_t *p = begin; p <= end; p++) {
+      CHECK(H264FindStartCode(p, end) == find_start_code_bytewise(p, end));
+    }
+  }
+}
+
+int main() {
+  check_start_code_lengths();
+  check_trailing_zeros();
+  check_overflow();
+  check_vector_boundaries();
+  printf("nal_scanner_check: ok\n");
+  return 0;
+}
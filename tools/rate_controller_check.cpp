@@ -0,0 +1,167 @@
+// Drives RateController against a fake encoder and checks the policy it
+// applies: the increase hold-off, the loss factor, the minimum change and
+// the rate change latency counters. Exits non-zero on the first mismatch.
+//
+//   rate_controller_check
+#include "check.h"
+#include "encoder/rate_controller.h"
+#include "metrics.h"
+#include <cstdio>
+
+#define MS 1000
+#define SECOND (1000 * MS)
+
+class FakeEncoder : public RateControlTarget {
+public:
+  int SetBitrate(uint32_t bitrate_bps) override {
+    bitrate_calls++;
+    bitrate = bitrate_bps;
+    return 0;
+  }
+  int SetFrameRate(uint32_t fps) override {
+    framerate_calls++;
+    framerate = fps;
+    return 0;
+  }
+
+  uint32_t bitrate = 0;
+  uint32_t framerate = 0;
+  int bitrate_calls = 0;
+  int framerate_calls = 0;
+};
+
+static RateControllerConfig default_config() {
+  RateControllerConfig config;
+  config.min_bitrate_bps = 100 * 1000;
+  config.min_change = 0.05;
+  config.min_increase_interval_ms = 500;
+  return config;
+}
+
+static void check_increase_hold_off() {
+  FakeEncoder encoder;
+  RateController controller(&encoder, default_config(), 1000000, 30);
+  int64_t now_us = 10 * SECOND;
+
+  controller.SetTarget(2000000, 30, now_us);
+  CHECK(encoder.bitrate == 2000000);
+  CHECK(controller.applied_bitrate_bps() == 2000000);
+
+  // Held for min_increase_interval_ms after the last change.
+  controller.SetTarget(3000000, 30, now_us + 200 * MS);
+  CHECK(controller.applied_bitrate_bps() == 2000000);
+  controller.SetTarget(3000000, 30, now_us + 500 * MS);
+  CHECK(controller.applied_bitrate_bps() == 3000000);
+  now_us += 500 * MS;
+
+  // Or for twice the RTT when that is longer.
+  controller.OnRtt(400);
+  controller.SetTarget(4000000, 30, now_us + 500 * MS);
+  CHECK(controller.applied_bitrate_bps() == 3000000);
+  controller.SetTarget(4000000, 30, now_us + 799 * MS);
+  CHECK(controller.applied_bitrate_bps() == 3000000);
+  controller.SetTarget(4000000, 30, now_us + 800 * MS);
+  CHECK(controller.applied_bitrate_bps() == 4000000);
+  now_us += 800 * MS;
+
+  // Decreases are never held.
+  controller.SetTarget(1000000, 30, now_us + 1 * MS);
+  CHECK(controller.applied_bitrate_bps() == 1000000);
+  CHECK(encoder.bitrate == 1000000);
+  CHECK(encoder.bitrate_calls == 4);
+
+  controller.SetTarget(1000000, 15, now_us + 2 * MS);
+  CHECK(controller.applied_fps() == 15);
+  CHECK(encoder.framerate == 15);
+  CHECK(encoder.framerate_calls == 1);
+}
+
+static void check_loss_factor() {
+  FakeEncoder encoder;
+  RateController controller(&encoder, default_config(), 1000000, 30);
+  int64_t now_us = 10 * SECOND;
+
+  controller.OnPacketLoss(0.01f, now_us);
+  CHECK(controller.loss_factor() == 1.0);
+  CHECK(encoder.bitrate_calls == 0);
+
+  // 2.5 times the loss above 2% comes off the target.
+  controller.OnPacketLoss(0.1f, now_us);
+  CHECK(controller.loss_factor() > 0.799 && controller.loss_factor() < 0.801);
+  CHECK(controller.applied_bitrate_bps() == 800000);
+
+  // But never more than half of it.
+  controller.OnPacketLoss(0.5f, now_us);
+  CHECK(controller.loss_factor() == 0.5);
+  CHECK(controller.applied_bitrate_bps() == 500000);
+  controller.OnPacketLoss(1.0f, now_us);
+  CHECK(controller.loss_factor() == 0.5);
+  CHECK(controller.applied_bitrate_bps() == 500000);
+
+  // Recovering is an increase and waits for the hold-off.
+  controller.OnPacketLoss(0, now_us + 100 * MS);
+  CHECK(controller.applied_bitrate_bps() == 500000);
+  controller.OnPacketLoss(0, now_us + 500 * MS);
+  CHECK(controller.applied_bitrate_bps() == 1000000);
+}
+
+static void check_min_change() {
+  FakeEncoder encoder;
+  RateController controller(&encoder, default_config(), 1000000, 30);
+  int64_t now_us = 10 * SECOND;
+
+  // Under 5% of the applied rate either way is not worth an ioctl.
+  controller.SetTarget(1040000, 30, now_us);
+  controller.SetTarget(960000, 30, now_us);
+  CHECK(encoder.bitrate_calls == 0);
+  CHECK(controller.applied_bitrate_bps() == 1000000);
+
+  controller.SetTarget(1050000, 30, now_us);
+  CHECK(encoder.bitrate_calls == 1);
+  CHECK(controller.applied_bitrate_bps() == 1050000);
+
+  // The minimum bitrate applies before the comparison.
+  RateController floored(&encoder, default_config(), 100000, 30);
+  floored.SetTarget(50000, 30, now_us);
+  CHECK(floored.applied_bitrate_bps() == 100000);
+  CHECK(encoder.bitrate_calls == 1);
+}
+
+static void check_change_latency() {
+  FakeEncoder encoder;
+  RateController controller(&encoder, default_config(), 1000000, 30);
+  PipelineCounters &counters = GlobalMetrics().counters;
+  uint64_t changes = counters.rate_changes.load();
+  uint64_t latency_us = counters.rate_change_latency_us.load();
+  int64_t change_us = 10 * SECOND;
+
+  controller.SetTarget(2000000, 30, change_us);
+  CHECK(encoder.bitrate_calls == 1);
+
+  // A frame whose encode started before the change does not count.
+  controller.OnFrameEncoded(change_us - 5 * MS, change_us + 10 * MS);
+  CHECK(counters.rate_changes.load() == changes);
+
+  controller.OnFrameEncoded(change_us + 1 * MS, change_us + 40 * MS);
+  CHECK(counters.rate_changes.load() == changes + 1);
+  CHECK(counters.rate_change_latency_us.load() == latency_us + 40 * MS);
+
+  // Only the first frame after a change closes it.
+  controller.OnFrameEncoded(change_us + 2 * MS, change_us + 70 * MS);
+  CHECK(counters.rate_changes.load() == changes + 1);
+  CHECK(counters.rate_change_latency_us.load() == latency_us + 40 * MS);
+
+  // A skipped change leaves nothing to measure.
+  controller.SetTarget(2010000, 30, change_us + SECOND);
+  controller.OnFrameEncoded(change_us + SECOND, change_us + SECOND);
+  CHECK(counters.rate_changes.load() == changes + 1);
+}
+
+int main() {
+  check_increase_hold_off();
+  check_loss_factor();
+  check_min_change();
+  check_change_latency();
+  printf("rate_controller_check: ok\n");
+  return 0;
+}
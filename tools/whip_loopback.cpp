@@ -0,0 +1,514 @@
+// Receive-only WHIP endpoint for end-to-end benchmarks on one machine. It
+// answers wadi's offer, receives and decodes every track, and reports the
+// frame rate and the latency from capture to decoded frame.
+//
+//   whip_loopback [-p port] [-i interval_s] [-t duration_s] [-pid wadi_pid]
+//   wadi -d synthetic:moving -stun none http://127.0.0.1:8890/whip
+//
+// Latency comes from the capture time wadi stamps on each frame, which the
+// receiver recovers from RTCP sender reports as the frame's NTP time. Both
+// ends read the same clock here, so no synchronization is needed. With -pid
+// the CPU time of the wadi process is reported as well, per stream.
+#include "api/audio_codecs/builtin_audio_decoder_factory.h"
+#include "api/audio_codecs/builtin_audio_encoder_factory.h"
+#include "api/create_peerconnection_factory.h"
+#include "api/peer_connection_interface.h"
+#include "api/video_codecs/builtin_video_decoder_factory.h"
+#include "api/video_codecs/builtin_video_encoder_factory.h"
+#include "http_server.h"
+#include "logging.h"
+#include "rtc_base/event.h"
+#include "rtc_base/ref_counted_object.h"
+#include "rtc_base/ssl_adapter.h"
+#include "rtc_base/thread.h"
+#include "run_loop.h"
+#include "system_wrappers/include/clock.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define LOOPBACK_GATHERING_TIMEOUT_MS 5000
+#define LOOPBACK_RESOURCE_PREFIX "/whip/"
+
+// Lets the HTTP thread block on an asynchronous PeerConnection call.
+struct DescriptionWaiter {
+  bool Wait() {
+    return done.Wait(LOOPBACK_GATHERING_TIMEOUT_MS) && error.empty();
+  }
+
+  rtc::Event done;
+  std::string error;
+};
+
+class CreateDescriptionWaiter
+    : public webrtc::CreateSessionDescriptionObserver,
+      public DescriptionWaiter {
+public:
+  void OnSuccess(webrtc::SessionDescriptionInterface *desc) override {
+    description.reset(desc);
+    done.Set();
+  }
+  void OnFailure(webrtc::RTCError error) override {
+    this->error = error.message();
+    done.Set();
+  }
+
+  std::unique_ptr<webrtc::SessionDescriptionInterface> description;
+};
+
+class SetDescriptionWaiter : public webrtc::SetSessionDescriptionObserver,
+                             public DescriptionWaiter {
+public:
+  void OnSuccess() override { done.Set(); }
+  void OnFailure(webrtc::RTCError error) override {
+    this->error = error.message();
+    done.Set();
+  }
+};
+
+struct LatencySummary {
+  size_t frames = 0;
+  size_t timed = 0;
+  int p50 = 0;
+  int p99 = 0;
+  int max = 0;
+};
+
+// Percentiles of |latencies|, reordered in the process.
+static LatencySummary summarize(std::vector<int> &latencies, size_t frames) {
+  LatencySummary summary;
+  summary.frames = frames;
+  summary.timed = latencies.size();
+  if (latencies.empty()) {
+    return summary;
+  }
+  auto percentile = [&latencies](size_t permille) {
+    size_t index = (latencies.size() - 1) * permille / 1000;
+    std::nth_element(latencies.begin(), latencies.begin() + index,
+                     latencies.end());
+    return latencies[index];
+  };
+  summary.p50 = percentile(500);
+  summary.p99 = percentile(990);
+  summary.max = *std::max_element(latencies.begin(), latencies.end());
+  return summary;
+}
+
+// One WHIP resource: a receive-only PeerConnection whose video tracks feed
+// the latency counters.
+class LoopbackSession : public webrtc::PeerConnectionObserver,
+                        public rtc::VideoSinkInterface<webrtc::VideoFrame>,
+                        public rtc::RefCountInterface {
+public:
+  explicit LoopbackSession(std::string id) : id(std::move(id)) {}
+
+  bool Connect(webrtc::PeerConnectionFactoryInterface *factory) {
+    webrtc::PeerConnectionInterface::RTCConfiguration config;
+    config.sdp_semantics = webrtc::SdpSemantics::kUnifiedPlan;
+    webrtc::PeerConnectionDependencies dependencies(this);
+    pc = factory->CreatePeerConnection(config, std::move(dependencies));
+    return pc != nullptr;
+  }
+
+  // Applies the offer and returns the answer with every local candidate,
+  // or an empty string.
+  std::string Answer(const std::string &offer) {
+    webrtc::SdpParseError parse_error;
+    std::unique_ptr<webrtc::SessionDescriptionInterface> remote =
+        webrtc::CreateSessionDescription(webrtc::SdpType::kOffer, offer,
+                                         &parse_error);
+    if (!remote) {
+      tlog_error("Bad offer: %s", parse_error.description.c_str());
+      return "";
+    }
+    remote_ufrag = find_attribute(offer, "a=ice-ufrag:");
+    rtc::scoped_refptr<SetDescriptionWaiter> set_remote(
+        new rtc::RefCountedObject<SetDescriptionWaiter>());
+    pc->SetRemoteDescription(set_remote, remote.release());
+    if (!set_remote->Wait()) {
+      tlog_error("SetRemoteDescription: %s", set_remote->error.c_str());
+      return "";
+    }
+    rtc::scoped_refptr<CreateDescriptionWaiter> create(
+        new rtc::RefCountedObject<CreateDescriptionWaiter>());
+    pc->CreateAnswer(create,
+                     webrtc::PeerConnectionInterface::RTCOfferAnswerOptions());
+    if (!create->Wait()) {
+      tlog_error("CreateAnswer: %s", create->error.c_str());
+      return "";
+    }
+    rtc::scoped_refptr<SetDescriptionWaiter> set_local(
+        new rtc::RefCountedObject<SetDescriptionWaiter>());
+    pc->SetLocalDescription(set_local, create->description.release());
+    if (!set_local->Wait()) {
+      tlog_error("SetLocalDescription: %s", set_local->error.c_str());
+      return "";
+    }
+    // The answer is not trickled; wait for host candidates, which on
+    // loopback takes a few milliseconds.
+    if (!gathered.Wait(LOOPBACK_GATHERING_TIMEOUT_MS)) {
+      tlog_warn("ICE gathering did not complete, answering anyway");
+    }
+    std::string answer;
+    pc->local_description()->ToString(&answer);
+    return answer;
+  }
+
+  // Adds the candidates of an RFC 8840 fragment. Returns false for ICE
+  // restarts, which this endpoint does not support.
+  bool Trickle(const std::string &fragment) {
+    std::istringstream lines(fragment);
+    std::string line;
+    std::string mid = "0";
+    while (std::getline(lines, line)) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (line.rfind("a=ice-ufrag:", 0) == 0 &&
+          line.substr(strlen("a=ice-ufrag:")) != remote_ufrag) {
+        return false;
+      } else if (line.rfind("a=mid:", 0) == 0) {
+        mid = line.substr(strlen("a=mid:"));
+      } else if (line.rfind("a=candidate:", 0) == 0) {
+        webrtc::SdpParseError error;
+        std::unique_ptr<webrtc::IceCandidateInterface> candidate(
+            webrtc::CreateIceCandidate(mid, 0, line.substr(2), &error));
+        if (!candidate || !pc->AddIceCandidate(candidate.get())) {
+          tlog_warn("Ignoring candidate %s", line.c_str());
+        }
+      }
+    }
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(tracks_mutex);
+    for (auto &track : tracks) {
+      track->RemoveSink(this);
+    }
+    tracks.clear();
+    if (pc) {
+      pc->Close();
+    }
+  }
+
+  // Frames and latencies since the last call.
+  LatencySummary TakeInterval(std::vector<int> *all_latencies) {
+    std::vector<int> latencies;
+    size_t frames;
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      latencies.swap(interval_latencies);
+      frames = interval_frames;
+      interval_frames = 0;
+    }
+    all_latencies->insert(all_latencies->end(), latencies.begin(),
+                          latencies.end());
+    return summarize(latencies, frames);
+  }
+
+  std::string size() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return std::to_string(width) + "x" + std::to_string(height);
+  }
+
+  const std::string id;
+
+  // Decoded frames, on the decoder thread.
+  void OnFrame(const webrtc::VideoFrame &frame) override {
+    // Zero until the first sender report maps RTP time to capture time.
+    int64_t capture_ms = frame.ntp_time_ms();
+    int64_t now_ms = clock->CurrentNtpInMilliseconds();
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    interval_frames++;
+    width = frame.width();
+    height = frame.height();
+    if (capture_ms > 0) {
+      interval_latencies.push_back(static_cast<int>(now_ms - capture_ms));
+    }
+  }
+
+  void OnTrack(rtc::scoped_refptr<webrtc::RtpTransceiverInterface>
+                   transceiver) override {
+    rtc::scoped_refptr<webrtc::MediaStreamTrackInterface> track =
+        transceiver->receiver()->track();
+    if (track->kind() != webrtc::MediaStreamTrackInterface::kVideoKind) {
+      return;
+    }
+    rtc::scoped_refptr<webrtc::VideoTrackInterface> video(
+        static_cast<webrtc::VideoTrackInterface *>(track.get()));
+    video->AddOrUpdateSink(this, rtc::VideoSinkWants());
+    std::lock_guard<std::mutex> lock(tracks_mutex);
+    tracks.push_back(video);
+    tlog("%s: receiving track %s", id.c_str(), track->id().c_str());
+  }
+
+  void OnIceGatheringChange(
+      webrtc::PeerConnectionInterface::IceGatheringState state) override {
+    if (state == webrtc::PeerConnectionInterface::kIceGatheringComplete) {
+      gathered.Set();
+    }
+  }
+
+  void OnIceConnectionChange(
+      webrtc::PeerConnectionInterface::IceConnectionState state) override {
+    tlog("%s: ICE connection state %d", id.c_str(), state);
+  }
+
+  void OnSignalingChange(
+      webrtc::PeerConnectionInterface::SignalingState) override {}
+  void OnDataChannel(
+      rtc::scoped_refptr<webrtc::DataChannelInterface>) override {}
+  void OnRenegotiationNeeded() override {}
+  void OnIceCandidate(const webrtc::IceCandidateInterface *) override {}
+
+private:
+  static std::string find_attribute(const std::string &sdp,
+                                    const std::string &prefix) {
+    size_t start = sdp.find(prefix);
+    if (start == std::string::npos) {
+      return "";
+    }
+    start += prefix.size();
+    return sdp.substr(start, sdp.find_first_of("\r\n", start) - start);
+  }
+
+  rtc::scoped_refptr<webrtc::PeerConnectionInterface> pc;
+  rtc::Event gathered;
+  std::string remote_ufrag;
+  webrtc::Clock *clock = webrtc::Clock::GetRealTimeClock();
+  std::mutex tracks_mutex;
+  std::vector<rtc::scoped_refptr<webrtc::VideoTrackInterface>> tracks;
+  std::mutex stats_mutex;
+  std::vector<int> interval_latencies;
+  size_t interval_frames = 0;
+  int width = 0;
+  int height = 0;
+};
+
+// User plus system CPU seconds of |pid|, or of this process when 0.
+static double cpu_seconds(pid_t pid) {
+  if (pid == 0) {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+  }
+  std::string path = "/proc/" + std::to_string(pid) + "/stat";
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == nullptr) {
+    return -1;
+  }
+  char buffer[1024];
+  size_t size = fread(buffer, 1, sizeof(buffer) - 1, file);
+  fclose(file);
+  buffer[size] = '\0';
+  // Fields 14 and 15, counted after the parenthesized command name.
+  const char *fields = strrchr(buffer, ')');
+  unsigned long utime = 0;
+  unsigned long stime = 0;
+  if (fields == nullptr ||
+      sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+             &utime, &stime) != 2) {
+    return -1;
+  }
+  return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+int main(int argc, char **argv) {
+  RunLoop loop;
+  rtc::InitializeSSL();
+  uint16_t port = 8890;
+  int interval_s = 5;
+  int duration_s = 0;
+  pid_t sender_pid = 0;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-p") == 0) {
+      port = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-i") == 0) {
+      interval_s = std::max(1, atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "-t") == 0) {
+      duration_s = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-pid") == 0) {
+      sender_pid = atoi(argv[i + 1]);
+    } else {
+      fprintf(stderr,
+              "Usage: %s [-p port] [-i interval_s] [-t duration_s] "
+              "[-pid wadi_pid]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::unique_ptr<rtc::Thread> network = rtc::Thread::CreateWithSocketServer();
+  std::unique_ptr<rtc::Thread> worker = rtc::Thread::Create();
+  std::unique_ptr<rtc::Thread> signaling =
+      rtc::Thread::CreateWithSocketServer();
+  network->Start();
+  worker->Start();
+  signaling->Start();
+  rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> factory =
+      webrtc::CreatePeerConnectionFactory(
+          network.get(), worker.get(), signaling.get(), nullptr,
+          webrtc::CreateBuiltinAudioEncoderFactory(),
+          webrtc::CreateBuiltinAudioDecoderFactory(),
+          webrtc::CreateBuiltinVideoEncoderFactory(),
+          webrtc::CreateBuiltinVideoDecoderFactory(), nullptr, nullptr);
+  if (!factory) {
+    tlog_error("Failed to create PeerConnectionFactory");
+    return EXIT_FAILURE;
+  }
+  // Loopback interfaces are ignored by default.
+  webrtc::PeerConnectionFactoryInterface::Options options;
+  options.network_ignore_mask = 0;
+  factory->SetOptions(options);
+
+  std::mutex sessions_mutex;
+  std::map<std::string, rtc::scoped_refptr<LoopbackSession>> sessions;
+  int next_id = 0;
+  HttpServer server(
+      "127.0.0.1", port,
+      [&](const HttpServerRequest &request, HttpServerResponse &response) {
+        if (request.method == "POST") {
+          std::string id = std::to_string(next_id++);
+          rtc::scoped_refptr<LoopbackSession> session(
+              new rtc::RefCountedObject<LoopbackSession>(id));
+          std::string answer;
+          if (session->Connect(factory.get())) {
+            answer = session->Answer(request.body);
+          }
+          if (answer.empty()) {
+            session->Close();
+            response.status = 400;
+            return;
+          }
+          response.status = 201;
+          response.content_type = "application/sdp";
+          response.headers["Location"] = LOOPBACK_RESOURCE_PREFIX + id;
+          response.body = answer;
+          std::lock_guard<std::mutex> lock(sessions_mutex);
+          sessions[id] = session;
+          tlog("Session %s created", id.c_str());
+          return;
+        }
+        if (request.path.rfind(LOOPBACK_RESOURCE_PREFIX, 0) != 0) {
+          response.status = 404;
+          return;
+        }
+        std::string id =
+            request.path.substr(strlen(LOOPBACK_RESOURCE_PREFIX));
+        rtc::scoped_refptr<LoopbackSession> session;
+        {
+          std::lock_guard<std::mutex> lock(sessions_mutex);
+          auto found = sessions.find(id);
+          if (found == sessions.end()) {
+            response.status = 404;
+            return;
+          }
+          session = found->second;
+          if (request.method == "DELETE") {
+            sessions.erase(found);
+          }
+        }
+        if (request.method == "DELETE") {
+          session->Close();
+          tlog("Session %s deleted", id.c_str());
+          response.status = 200;
+        } else if (request.method == "PATCH") {
+          response.status = session->Trickle(request.body) ? 204 : 405;
+        } else {
+          response.status = 405;
+        }
+      });
+  if (!server.Start()) {
+    return EXIT_FAILURE;
+  }
+  tlog("WHIP endpoint at http://127.0.0.1:%u/whip", server.port());
+
+  // Reports every interval on its own thread; the main thread waits for a
+  // signal or the end of the run.
+  std::mutex report_mutex;
+  std::condition_variable report_wake;
+  bool stopping = false;
+  std::vector<int> all_latencies;
+  size_t all_frames = 0;
+  std::thread reporter([&]() {
+    double last_own = cpu_seconds(0);
+    double last_sender = sender_pid != 0 ? cpu_seconds(sender_pid) : 0;
+    int elapsed_s = 0;
+    std::unique_lock<std::mutex> lock(report_mutex);
+    while (!report_wake.wait_for(lock, std::chrono::seconds(interval_s),
+                                 [&]() { return stopping; })) {
+      elapsed_s += interval_s;
+      std::vector<rtc::scoped_refptr<LoopbackSession>> current;
+      {
+        std::lock_guard<std::mutex> sessions_lock(sessions_mutex);
+        for (auto &session : sessions) {
+          current.push_back(session.second);
+        }
+      }
+      for (auto &session : current) {
+        LatencySummary summary = session->TakeInterval(&all_latencies);
+        all_frames += summary.frames;
+        printf("[%4ds] session %s %s %6.1f fps  latency p50 %3d ms  p99 %3d "
+               "ms  max %3d ms\n",
+               elapsed_s, session->id.c_str(), session->size().c_str(),
+               static_cast<double>(summary.frames) / interval_s, summary.p50,
+               summary.p99, summary.max);
+      }
+      double own = cpu_seconds(0);
+      printf("[%4ds] receiver CPU %5.1f%%", elapsed_s,
+             100 * (own - last_own) / interval_s);
+      last_own = own;
+      if (sender_pid != 0) {
+        double sender = cpu_seconds(sender_pid);
+        size_t streams = std::max<size_t>(1, current.size());
+        printf("  sender CPU %5.1f%% (%5.1f%% per stream)",
+               100 * (sender - last_sender) / interval_s,
+               100 * (sender - last_sender) / interval_s / streams);
+        last_sender = sender;
+      }
+      printf("\n");
+      fflush(stdout);
+      if (duration_s > 0 && elapsed_s >= duration_s) {
+        loop.Quit(EXIT_SUCCESS);
+      }
+    }
+  });
+
+  int status = loop.Run();
+  {
+    std::lock_guard<std::mutex> lock(report_mutex);
+    stopping = true;
+  }
+  report_wake.notify_all();
+  reporter.join();
+  server.Stop();
+
+  LatencySummary total = summarize(all_latencies, all_frames);
+  printf("total: %zu frames, %zu timed, latency p50 %d ms p99 %d ms max %d "
+         "ms\n",
+         total.frames, total.timed, total.p50, total.p99, total.max);
+
+  for (auto &session : sessions) {
+    session.second->Close();
+  }
+  sessions.clear();
+  factory = nullptr;
+  signaling->Stop();
+  worker->Stop();
+  network->Stop();
+  rtc::CleanupSSL();
+  log_flush();
+  return status;
+}